@@ -21,9 +21,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// SSE2 is used by the occlusion rasterizer when the compiler has it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAS_SSE2
+#endif
 
 #define PI 3.1415926535
 
+// Threads, a thread handle on Windows and pthreads everywhere else
+#ifdef _WIN32
+typedef HANDLE Thread;
+#else
+typedef pthread_t Thread;
+#endif
+
+typedef struct
+{
+	void (*function)(void*);
+	void* data;
+} ThreadStart;
+
+// A lock and a condition to wait on, from the same place as the threads
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condition;
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+#endif
+
+// A file mapped into memory
+typedef struct
+{
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+	void* data;
+	size_t size;
+} MappedFile;
+
+// An int shared between threads without a lock, only used through the atomic functions
+#ifdef _WIN32
+typedef volatile LONG AtomicInt;
+#else
+typedef volatile int AtomicInt;
+#endif
+
 typedef struct
 {
 	GLfloat position[3];
@@ -36,6 +96,13 @@ typedef struct
 
 typedef GLubyte ColorTexture[3];
 
+// Axis aligned bounding box
+typedef struct
+{
+	GLfloat minimum[3];
+	GLfloat maximum[3];
+} Bounds;
+
 typedef struct
 {
 	GLint v[3];
@@ -57,19 +124,806 @@ typedef struct
 	int faceCount;
 } Group;
 
+/*
+* One node of a bounding volume hierarchy. The left child always comes right
+* after its parent and right holds the index of the other child, or -1 for a
+* leaf. Every node covers the count primitives starting at first in the
+* sorted primitive list, so a whole subtree can be taken at once.
+*/
+typedef struct
+{
+	Bounds bounds;
+	GLint right;
+	GLint first;
+	GLint count;
+} BvhNode;
+
+typedef struct
+{
+	BvhNode* nodes;
+	GLint* primitives;
+	GLint nodeCount;
+	GLint primitiveCount;
+} Bvh;
+
+/*
+* A block of memory that things get carved out of one after another and freed
+* all at once. An object works out exactly how much its obj data needs first,
+* so all of that ends up in one allocation. The levels of detail, edge lists,
+* quantized meshes and triangle BVH come later at sizes nobody knows up front,
+* so they get malloc'd while they're built and then packed into a new arena
+* with the obj data once the object is loaded.
+*/
+#define ARENA_ALIGNMENT 16
+typedef struct
+{
+	unsigned char* data;
+	size_t size;
+	size_t used;
+} Arena;
+
+#define MAX_LOD_LEVELS 4
+
+// A simplified version of a mesh. Each triangle has one flat normal, and the
+// wireframe lines get the average of them at each vertex
+typedef struct
+{
+	Vertex3* vertices;
+	Vertex3* normals;
+	GLint* indices;
+	GLint vertexCount;
+	GLint triangleCount;
+	GLuint* edges;
+	Vertex3* edgeNormals;
+	GLint edgeCount;
+} LodMesh;
+
+// A vertex packed into 12 bytes. The position is quantized to the bounding box
+// of its mesh and the normal is stored as signed bytes. The fourth components
+// are only there to keep everything 4 byte aligned
+typedef struct
+{
+	GLshort position[4];
+	GLbyte normal[4];
+} QuantizedVertex;
+
+/*
+* A mesh level in the quantized format. A vertex is at center + position * scale,
+* which gets done by the modelview matrix when drawing. The indices are 16 bit
+* when there are few enough vertices, otherwise 32 bit, and so are the edges
+* of the wireframe. A flat mesh is drawn with flat shading.
+*/
+typedef struct
+{
+	QuantizedVertex* vertices;
+	void* indices;
+	void* edges;
+	GLenum indexType;
+	GLint vertexCount;
+	GLint indexCount;
+	GLint edgeCount;
+	GLfloat center[3];
+	GLfloat scale[3];
+	GLboolean isFlat;
+} QuantizedMesh;
+
+// How many bytes an asset uses, by what they are for
+typedef struct
+{
+	size_t meshBytes;
+	size_t lodBytes;
+	size_t quantizedBytes;
+	size_t collisionBytes;
+} AssetMemory;
+
 typedef struct
 {
+	char name[64];
+
+	// Once the object is loaded everything below lives in the arena, and only
+	// pieces built since the last packing are malloc'd on their own
 	ObjValues values;
-	Group groups[100];
+	Group* groups;
+	Arena arena;
+
+	// Level 0 is the full mesh, lods[i] holds level i + 1
+	LodMesh lods[MAX_LOD_LEVELS - 1];
+	GLint lodCount;
+
+	// Every level in the quantized format, which is what gets drawn once the
+	// object has been quantized
+	QuantizedMesh quantized[MAX_LOD_LEVELS];
+	GLboolean isQuantized;
+
+	// Bounding box and sphere in object space, used for culling and picking a
+	// level of detail
+	Bounds bounds;
+	GLfloat boundingCenter[3];
+	GLfloat boundingRadius;
+
+	// Every face as three vertex indexes, with a hierarchy over them for
+	// collision tests against the actual triangles
+	GLint* triangles;
+	GLint triangleCount;
+	Bvh triangleBvh;
+	Bounds* triangleBounds;
+
+	// The edges of the full mesh for the wireframe, with a normal for each
+	// vertex since the obj normals belong to the faces
+	GLuint* edges;
+	Vertex3* edgeNormals;
+	GLint edgeCount;
 } Object;
 
 typedef struct
 {
 	GLfloat position[3];
 	GLfloat velocity[3];
-	GLfloat color[3];
+	GLint species;
 } Boid;
 
+/*
+* One kind of fish. Every boid of a species shares these parameters, and a
+* predator is chased by nothing and flees from nothing.
+*/
+typedef struct
+{
+	char* name;
+	GLint count;
+	GLint material;
+	GLfloat size;
+	GLfloat speed;
+	GLfloat maxSpeed;
+	GLfloat sightDistance;
+	GLfloat separationDistance;
+	GLfloat wallAvoidanceFactor;
+	GLfloat avoidanceFactor;
+	GLfloat alignmentFactor;
+	GLfloat cohesionFactor;
+	GLboolean isPredator;
+	GLfloat fleeDistance;
+	GLfloat fleeFactor;
+	GLfloat chaseFactor;
+} Species;
+
+#define MAX_SPECIES 8
+
+/*
+* A boid's neighbour list, the boids that could matter to it next to where it
+* was when the list was built. The first sameCount candidates are the nearest
+* of its own species, and every other one of its species is at least
+* sameRadius away. After them come otherCount predators to flee from, or prey
+* for a predator, with the rest at least otherRadius away. Each group is in
+* boid order. sameDrift and otherDrift are how much closer anything left out
+* of each group could have got since then, going by how the boids strayed from
+* their schools.
+*/
+#define NEIGHBOUR_SAME_CANDIDATES 24
+#define NEIGHBOUR_OTHER_CANDIDATES 16
+#define NEIGHBOUR_CANDIDATES (NEIGHBOUR_SAME_CANDIDATES + NEIGHBOUR_OTHER_CANDIDATES)
+typedef struct
+{
+	GLint sameCount;
+	GLint otherCount;
+	GLint tick;
+	GLfloat sameRadius;
+	GLfloat otherRadius;
+	GLfloat sameDrift;
+	GLfloat otherDrift;
+	GLfloat origin[3];
+	GLint candidates[NEIGHBOUR_CANDIDATES];
+} NeighbourList;
+
+/*
+* All of the fish in one tank. The boids are sorted by species, so species s
+* is the range speciesFirst[s] up to speciesFirst[s + 1]. Each tick the
+* previous flock is bucketed into a uniform grid of cells as big as the
+* furthest any species can see, so a neighbour search only has to look at the
+* 27 cells around a boid.
+*/
+typedef struct
+{
+	Species species[MAX_SPECIES];
+	GLint speciesCount;
+	GLint speciesFirst[MAX_SPECIES + 1];
+
+	Boid* current;
+	Boid* previous;
+	GLint count;
+	GLfloat radius;
+	GLfloat height;
+
+	// The grid. cellStart[c] is where cell c starts in sorted
+	GLfloat cellSize;
+	GLfloat gridOrigin[3];
+	GLint gridSize[3];
+	GLint* cellStart;
+	GLint* boidCells;
+	Boid* sorted;
+	GLint* sortedIndexes;
+
+	// How many boids the neighbour search looked at in the last update
+	GLint neighbourChecks;
+
+	// The neighbour lists, one per boid. A boid only goes back to the grid once
+	// it or the boids around it could have moved far enough for its list to be
+	// missing someone, so the grid is only built on ticks that need it.
+	// neighbourRebuilds is how many lists got rebuilt in the last update
+	GLboolean isUsingNeighbourLists;
+	GLboolean isGridBuilt;
+	GLint tick;
+	GLfloat fastestSpeed;
+	GLboolean hasPredators;
+	NeighbourList* neighbourLists;
+	GLint neighbourRebuilds;
+
+	// How each species moved last tick, for the lists. speciesStep is its average
+	// step, and largestDeviation the two furthest any of its boids strayed from
+	// that, the first one by largestBoid
+	GLfloat speciesStep[MAX_SPECIES][3];
+	GLfloat largestDeviation[MAX_SPECIES][2];
+	GLint largestBoid[MAX_SPECIES];
+
+	// A flock off on its own, like in a sweep, has no coral or submarine to avoid
+	GLboolean isInEmptyTank;
+} Flock;
+
+#define MAX_SWEEP_PARAMETERS 16
+#define MAX_SWEEP_VALUES 32
+
+/*
+* One line of a sweep grid file, a flock setting and the values to try for
+* it. Settings of the schooling species have the offset of their field in
+* Species, and the ones for the whole run use the SWEEP_ values below.
+*/
+typedef struct
+{
+	char name[32];
+	GLint offset;
+	GLboolean isInteger;
+	GLfloat values[MAX_SWEEP_VALUES];
+	GLint valueCount;
+} SweepParameter;
+
+#define SWEEP_TICKS -1
+#define SWEEP_RADIUS -2
+#define SWEEP_SEED -3
+
+// What one configuration of a sweep measured
+typedef struct
+{
+	GLint boidCount;
+	GLint tickCount;
+	double updateTime;
+	GLfloat polarization;
+	GLfloat nearestDistance;
+	GLfloat isolated;
+} SweepResult;
+
+/*
+* A whole sweep, shared by its workers. Each worker takes the next
+* configuration under the mutex and runs it in a flock of its own, so the only
+* thing they write to together is next.
+*/
+typedef struct
+{
+	SweepParameter parameters[MAX_SWEEP_PARAMETERS];
+	GLint parameterCount;
+	GLint configurationCount;
+	GLint next;
+	Mutex mutex;
+	SweepResult* results;
+} Sweep;
+
+/*
+* The start of a snapshot file. The payload after it holds the coral
+* positions, then the previous and current flocks as they are in memory.
+*/
+typedef struct
+{
+	GLint magic;
+	GLint version;
+	GLint flags;
+	GLint tick;
+	GLfloat submarine[3];
+	GLfloat waveTimeValue;
+	GLint speciesCount;
+	GLint speciesFirst[MAX_SPECIES + 1];
+	GLint coralCount;
+	GLint rawSize;
+	GLint payloadSize;
+} SnapshotHeader;
+
+// Every kind of input the simulation reacts to, and the end of a journal
+enum
+{
+	INPUT_KEY_DOWN,
+	INPUT_KEY_UP,
+	INPUT_SPECIAL_DOWN,
+	INPUT_SPECIAL_UP,
+	INPUT_MOUSE_MOVE,
+	INPUT_END
+};
+
+// One input event, with the tick it comes before and the seconds since recording started
+typedef struct
+{
+	GLint tick;
+	GLint type;
+	GLint key;
+	GLint x;
+	GLint y;
+	GLfloat time;
+} InputEvent;
+
+// The start of a journal file. The input events follow it until the end
+typedef struct
+{
+	GLint magic;
+	GLint version;
+	GLfloat tickRate;
+	GLfloat cameraAngles[2];
+	GLint mouse[2];
+} JournalHeader;
+
+#define CLIPMAP_CELLS 32
+#define CLIPMAP_VERTICES (CLIPMAP_CELLS + 1)
+#define CLIPMAP_EDGES (CLIPMAP_CELLS * CLIPMAP_CELLS * 3 + CLIPMAP_CELLS * 4)
+#define MAX_CLIPMAP_LEVELS 12
+
+/*
+* One level of the ocean clipmap. The vertices are a square grid of cells
+* starting at origin, counted in cells of this level, and are kept in the same
+* fixed size arrays, only rebuilt when the level moves. Whatever gets rebuilt
+* is copied into the level's buffer objects right after.
+*/
+typedef struct
+{
+	GLfloat spacing;
+	GLint origin[2];
+	GLboolean isBuilt;
+	GLfloat vertices[CLIPMAP_VERTICES * CLIPMAP_VERTICES * 3];
+	GLfloat normals[CLIPMAP_VERTICES * CLIPMAP_VERTICES * 3];
+	GLushort indices[CLIPMAP_CELLS * CLIPMAP_CELLS * 6];
+	GLint indexCount;
+	GLushort edges[CLIPMAP_EDGES * 2];
+	GLint edgeCount;
+	GLuint arrayBuffer;
+	GLuint elementBuffer;
+} ClipmapLevel;
+
+// Everything a frame needs from one tick of the simulation
+typedef struct
+{
+	GLint tick;
+	GLfloat submarine[3];
+	GLfloat waveTimeValue;
+	GLfloat cameraAngles[2];
+	Boid* boids;
+	GLint boidCount;
+	GLint boidCapacity;
+} RenderState;
+
+/*
+* Input going to the simulation thread. Only the window thread pushes and only
+* the simulation thread pops, so head and tail are all that need sharing.
+*/
+#define INPUT_QUEUE_SIZE 256
+typedef struct
+{
+	InputEvent events[INPUT_QUEUE_SIZE];
+	AtomicInt head;
+	AtomicInt tail;
+} InputQueue;
+
+// One tick of telemetry. Times are in milliseconds
+typedef struct
+{
+	GLint tick;
+	GLfloat tickTime;
+	GLfloat frameTime;
+	GLfloat centroid[3];
+	GLfloat dispersion;
+	GLfloat meanSpeed;
+	GLint neighbourChecks;
+	GLint neighbourRebuilds;
+	GLint triangles;
+} TelemetrySample;
+
+/*
+* The start of the telemetry file, followed by capacity samples. The simulation
+* writes at tail and a reader takes from head, so it is a ring with one writer
+* and one reader, the same as the input queue but shared between processes.
+*/
+typedef struct
+{
+	GLuint magic;
+	GLint version;
+	GLint sampleSize;
+	GLint capacity;
+	AtomicInt head;
+	AtomicInt tail;
+	AtomicInt dropped;
+} TelemetryHeader;
+
+typedef struct
+{
+	GLfloat ambient[4];
+	GLfloat diffuse[4];
+	GLfloat specular[4];
+	GLfloat emission[4];
+	GLfloat shininess;
+} Material;
+
+// Indexes into the material table. Unlit things use MATERIAL_NONE
+enum
+{
+	MATERIAL_NONE,
+	MATERIAL_SUBMARINE,
+	MATERIAL_CORAL,
+	MATERIAL_WAVE,
+	MATERIAL_BOID,
+	MATERIAL_BOID_ORANGE,
+	MATERIAL_PREDATOR,
+	MATERIAL_COUNT
+};
+
+// Something to draw once the render queue is flushed, along with the state it needs
+typedef struct
+{
+	GLuint key;
+	GLint order;
+	GLboolean isLit;
+	GLint material;
+	GLuint texture;
+	GLfloat modelview[16];
+	void (*draw)(void* data, GLint param);
+	void* data;
+	GLint param;
+} RenderItem;
+
+// Geometry that never changes, built once into vertex arrays. The texture
+// coordinates are optional, and the edges are there once the mesh is done.
+// The arrays get copied into buffer objects the first time it's drawn
+typedef struct
+{
+	GLfloat* vertices;
+	GLfloat* normals;
+	GLfloat* texCoords;
+	GLuint* indices;
+	GLuint* edges;
+	GLint vertexCount;
+	GLint indexCount;
+	GLint edgeCount;
+	GLuint arrayBuffer;
+	GLuint elementBuffer;
+	GLboolean isUploaded;
+} StaticMesh;
+
+/*
+* The start of a terrain file. The heights follow it as shorts, one tile after
+* the other so a tile is all in one place in the file. Each tile is
+* tileSamples along a side and shares its edge samples with the tiles next to it.
+*/
+typedef struct
+{
+	GLint magic;
+	GLint version;
+	GLint tileSamples;
+	GLint tiles[2];
+	GLfloat spacing;
+	GLfloat heightScale;
+	GLfloat origin[2];
+} TerrainHeader;
+
+enum TerrainTileStates
+{
+	TERRAIN_TILE_EMPTY,
+	TERRAIN_TILE_LOADING,
+	TERRAIN_TILE_MESHED,
+	TERRAIN_TILE_RESIDENT
+};
+
+// How many cells across the coarse grid of a terrain tile's occluder is
+#define TERRAIN_OCCLUDER_CELLS 8
+
+/*
+* A slot that one terrain tile can be loaded into. A worker thread owns the
+* mesh while it is loading, and the main thread owns it once it's meshed, so
+* the state is the only thing both of them touch.
+*/
+typedef struct
+{
+	GLint tile[2];
+	AtomicInt state;
+	GLint lastUsed;
+	GLint drawnFrame;
+	StaticMesh mesh;
+	Bounds bounds;
+	// A coarse grid of the tile kept under the real heights, for the occlusion buffer
+	GLfloat occluder[(TERRAIN_OCCLUDER_CELLS + 1) * (TERRAIN_OCCLUDER_CELLS + 1)][3];
+} TerrainTile;
+
+// GL values from after 1.1 that the Windows headers don't have
+#ifndef GL_VERTEX_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#define GL_VERTEX_SHADER 0x8B31
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#define GL_INFO_LOG_LENGTH 0x8B84
+#endif
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#define GL_STATIC_DRAW 0x88E4
+#define GL_DYNAMIC_DRAW 0x88E8
+#endif
+
+// Turns a byte offset into a buffer object into the pointer the gl*Pointer calls take
+#define BUFFER_OFFSET(offset) ((const GLvoid*)(size_t)(offset))
+
+/*
+* The GL 1.5 and later functions, which have to be looked up when the program
+* runs since opengl32 on Windows only has GL 1.1. Anything the driver doesn't
+* have stays NULL. The names to look them up by are in glFunctionNames in the
+* same order.
+*/
+typedef struct
+{
+	GLuint (APIENTRY* createShader)(GLenum type);
+	void (APIENTRY* shaderSource)(GLuint shader, GLsizei count, const char** strings, const GLint* lengths);
+	void (APIENTRY* compileShader)(GLuint shader);
+	void (APIENTRY* getShaderiv)(GLuint shader, GLenum name, GLint* value);
+	void (APIENTRY* getShaderInfoLog)(GLuint shader, GLsizei size, GLsizei* length, char* log);
+	void (APIENTRY* deleteShader)(GLuint shader);
+	GLuint (APIENTRY* createProgram)(void);
+	void (APIENTRY* attachShader)(GLuint program, GLuint shader);
+	void (APIENTRY* bindAttribLocation)(GLuint program, GLuint index, const char* name);
+	void (APIENTRY* linkProgram)(GLuint program);
+	void (APIENTRY* getProgramiv)(GLuint program, GLenum name, GLint* value);
+	void (APIENTRY* getProgramInfoLog)(GLuint program, GLsizei size, GLsizei* length, char* log);
+	void (APIENTRY* deleteProgram)(GLuint program);
+	void (APIENTRY* useProgram)(GLuint program);
+	GLint (APIENTRY* getUniformLocation)(GLuint program, const char* name);
+	void (APIENTRY* uniform1f)(GLint location, GLfloat value);
+	void (APIENTRY* uniform1i)(GLint location, GLint value);
+	void (APIENTRY* uniform2f)(GLint location, GLfloat x, GLfloat y);
+	void (APIENTRY* activeTexture)(GLenum unit);
+	void (APIENTRY* vertexAttribPointer)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer);
+	void (APIENTRY* enableVertexAttribArray)(GLuint index);
+	void (APIENTRY* disableVertexAttribArray)(GLuint index);
+	void (APIENTRY* vertexAttribDivisor)(GLuint index, GLuint divisor);
+	void (APIENTRY* drawElementsInstanced)(GLenum mode, GLsizei count, GLenum type, const void* indices, GLsizei instances);
+	void (APIENTRY* programParameteri)(GLuint program, GLenum name, GLint value);
+	void (APIENTRY* getProgramBinary)(GLuint program, GLsizei size, GLsizei* length, GLenum* format, void* binary);
+	void (APIENTRY* programBinary)(GLuint program, GLenum format, const void* binary, GLsizei length);
+	void (APIENTRY* genBuffers)(GLsizei count, GLuint* buffers);
+	void (APIENTRY* deleteBuffers)(GLsizei count, const GLuint* buffers);
+	void (APIENTRY* bindBuffer)(GLenum target, GLuint buffer);
+	void (APIENTRY* bufferData)(GLenum target, ptrdiff_t size, const void* data, GLenum usage);
+	void (APIENTRY* bufferSubData)(GLenum target, ptrdiff_t offset, ptrdiff_t size, const void* data);
+} GlFunctions;
+
+/*
+* What the vertex shader needs to draw one fish. The size goes in the last
+* spot of the position and how far through its stroke the fish is goes in the
+* last spot of the velocity, so it's two attributes.
+*/
+typedef struct
+{
+	GLfloat position[4];
+	GLfloat velocity[4];
+} FishInstance;
+
+// A run of fish instances of one species and mesh, drawn with one call
+typedef struct
+{
+	Species* species;
+	StaticMesh* mesh;
+	GLint first;
+	GLint count;
+} FishBatch;
+
+// A corner of a far away fish, drawn as a flat fish shape facing the camera
+typedef struct
+{
+	GLfloat position[3];
+	GLfloat texCoord[2];
+	GLubyte color[4];
+} FishImpostorVertex;
+
+/*
+* The features a scene shader permutation is built with, each one a #define in
+* front of the shader source. Every combination gets its own program, so a draw
+* never pays for anything it doesn't use.
+*/
+#define SHADER_LIT 1
+#define SHADER_TEXTURED 2
+#define SHADER_FOG 4
+#define SHADER_INSTANCED 8
+#define SHADER_PERMUTATIONS 16
+
+// A permutation of the scene shader and where its uniforms are
+typedef struct
+{
+	GLuint program;
+	GLint fogDensityLocation;
+	GLint tileScaleLocation;
+	GLint sliceScaleLocation;
+	GLint indexRowsLocation;
+	GLint isCullingLocation;
+	GLint lightCountLocation;
+	GLint squigglesLocation;
+	GLint squiggleDepthLocation;
+} SceneProgram;
+
+// GL values for getting linked programs back out, from GL 4.1 or ARB_get_program_binary
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+// GL values for the float textures the clustered lighting reads
+#ifndef GL_RGBA32F
+#define GL_TEXTURE0 0x84C0
+#define GL_CLAMP_TO_EDGE 0x812F
+#define GL_CURRENT_PROGRAM 0x8B8D
+#define GL_RGBA32F 0x8814
+#endif
+#ifndef GL_LUMINANCE32F_ARB
+#define GL_LUMINANCE32F_ARB 0x8818
+#define GL_LUMINANCE_ALPHA32F_ARB 0x8819
+#endif
+
+/*
+* A point light, or a spotlight when spotCosine is over -1. The position and
+* direction are in eye space once the frame's lights are gathered, and the
+* light fades out to nothing at its radius.
+*/
+typedef struct
+{
+	GLfloat position[3];
+	GLfloat radius;
+	GLfloat color[3];
+	GLfloat spotCosine;
+	GLfloat direction[3];
+	GLfloat padding;
+} ClusterLight;
+
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 9
+#define CLUSTER_TILES (CLUSTER_TILES_X * CLUSTER_TILES_Y)
+#define CLUSTER_SLICES 24
+#define MAX_CLUSTER_LIGHTS 1024
+#define CLUSTER_INDEX_WIDTH 1024
+
+/*
+* One depth slice of the light clusters. Every tile of the screen is a
+* cluster in each slice, and the light indexes are kept cluster after cluster
+* with counts saying how many each one has. The candidates are the lights that
+* reach into the slice at all, with the tiles they cover in rects.
+*/
+typedef struct
+{
+	GLint counts[CLUSTER_TILES];
+	GLint* indexes;
+	GLint indexCount;
+	GLint indexCapacity;
+	GLint candidates[MAX_CLUSTER_LIGHTS];
+	GLint rects[MAX_CLUSTER_LIGHTS][4];
+	GLint candidateCount;
+} ClusterSlice;
+
+/*
+* The occlusion buffer is a small depth buffer drawn on the CPU. It is split
+* into tiles so each tile can be drawn on its own thread, and into blocks that
+* each keep the farthest depth in them for a quick first test.
+*/
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+#define OCCLUSION_TILE_WIDTH 64
+#define OCCLUSION_TILE_HEIGHT 32
+#define OCCLUSION_TILES_X (OCCLUSION_WIDTH / OCCLUSION_TILE_WIDTH)
+#define OCCLUSION_TILES (OCCLUSION_TILES_X * (OCCLUSION_HEIGHT / OCCLUSION_TILE_HEIGHT))
+#define OCCLUSION_BLOCK 8
+#define OCCLUSION_BLOCKS_X (OCCLUSION_WIDTH / OCCLUSION_BLOCK)
+#define OCCLUSION_BLOCKS_Y (OCCLUSION_HEIGHT / OCCLUSION_BLOCK)
+
+// An occluder triangle in occlusion buffer pixels. Each edge is a x + b y + c,
+// which is positive inside, and the depth is a plane over the screen the same way
+typedef struct
+{
+	GLfloat edges[3][3];
+	GLfloat depth[3];
+	GLint minimum[2];
+	GLint maximum[2];
+} OcclusionTriangle;
+
+// A coral that's big enough on screen to be an occluder
+typedef struct
+{
+	GLfloat area;
+	GLint index;
+} OccluderCandidate;
+
+// The occluder triangles that touch a tile
+typedef struct
+{
+	GLint* triangles;
+	GLint triangleCount;
+	GLint triangleCapacity;
+} OcclusionTile;
+
+// The kinds of things in the scene hierarchy
+enum
+{
+	SCENE_CORAL,
+	SCENE_FLOOR,
+	SCENE_WALL
+};
+
+typedef struct
+{
+	GLint type;
+	GLint index;
+} ScenePrimitive;
+
+// One placed copy of a coral mesh, turned by its heading in radians about z
+typedef struct
+{
+	GLint mesh;
+	GLfloat position[3];
+	GLfloat heading;
+	GLfloat scale;
+	GLint lodLevel;
+} CoralInstance;
+
+/*
+* The background grid of the reef sampler. The cells are small enough that
+* only one coral centre can be in each, so a cell holds its centre, or 1e30
+* when it's empty. The grid is split into square regions at least three
+* spacings across that threads fill.
+*/
+typedef struct
+{
+	GLfloat spacing;
+	GLfloat radius;
+	GLfloat cellSize;
+	GLint gridSize;
+	GLint regionCount;
+	GLfloat regionSize;
+	GLfloat (*cells)[2];
+} ReefGrid;
+
+// One region of the reef for a thread to fill, with its own random numbers
+typedef struct
+{
+	ReefGrid* grid;
+	GLint region[2];
+	unsigned int random;
+} ReefRegionJob;
+
+// The regions one thread fills in one phase
+typedef struct
+{
+	ReefRegionJob* regions;
+	GLint first;
+	GLint last;
+} ReefPhaseJob;
+
+// Counters for the last frame the render queue drew
+typedef struct
+{
+	GLint items;
+	GLint lightingChanges;
+	GLint materialChanges;
+	GLint textureChanges;
+	GLint programChanges;
+	GLint triangles;
+	GLint lines;
+} RenderStats;
+
 // Beginning camera position
 GLfloat cameraPosition[] = { 0.0f, -200.0f, 0.0f };
 GLfloat cameraLookAt[] = { 0.0f, 0.0f, 0.0f };
@@ -79,11 +933,20 @@ GLfloat windowWidth = 800;
 GLfloat windowHeight = 600;
 GLint windowPositionX = 100;
 GLint windowPositionY = 100;
+GLint viewportHeight = 600;
+GLfloat fieldOfView = 45.0f;
 
 // State variables
 GLboolean isFullscreen = GL_FALSE;
 GLboolean isDrawingWireFrame = GL_FALSE;
+
+// The wireframe is drawn as lines along the edges of each mesh, found once when
+// the mesh is built, instead of with glPolygonMode drawing every triangle's
+// outline. isDrawingEdges is on while the render queue draws a wireframe frame
+GLboolean isUsingEdgeLists = GL_TRUE;
+GLboolean isDrawingEdges = GL_FALSE;
 GLboolean isDrawingFog = GL_TRUE;
+GLfloat fogDensity = 0.0025f;
 
 // Submarine varaibles
 Object submarine;
@@ -92,9 +955,170 @@ GLfloat submarineX = 0.0f;
 GLfloat submarineY = -150.0f;
 GLfloat submarineZ = 150.0f;
 
+// Which way the submarine faces along the floor and how far its nose is from
+// its centre, for the headlights
+GLfloat submarineForward[2] = { 0.0f, 1.0f };
+GLfloat submarineNoseDistance = 30.0f;
+
 // Coral Variables
 Object coral[14];
-Vertex3 coralPositions[14];
+
+// How many coral to place using the 14 meshes, and whether to draw the meshes
+// in the quantized format
+GLint coralInstanceTarget = 14;
+GLboolean isQuantizingMeshes = GL_FALSE;
+CoralInstance* coralInstances = NULL;
+GLint coralInstanceCount = 0;
+GLfloat coralScale = 200.0f;
+
+// Reef Variables. The coral centres are kept coralSpacing apart, or a spacing
+// that fits them all when it's 0, and coral closer than reefFullSizeSpacing
+// are shrunk to match. The same seed always gives the same reef
+GLfloat coralSpacing = 0;
+GLfloat reefFullSizeSpacing = 150.0f;
+GLint reefSeed = 1;
+
+// Scene hierarchy variables. The hierarchy holds every coral instance, the
+// floor and one panel per wall segment, and gets refit when something moves
+Bvh sceneBvh;
+Bounds* sceneBounds = NULL;
+ScenePrimitive* scenePrimitives = NULL;
+GLint scenePrimitiveCount = 0;
+GLint* visiblePrimitives = NULL;
+GLboolean isSceneBvhDirty = GL_FALSE;
+GLfloat projectionMatrix[16];
+
+// Held by the window thread while it reads the coral for a frame and by a
+// snapshot restore while it moves them, so the hierarchy never gets refit in
+// the middle of a frame
+Mutex sceneMutex;
+
+// Level of detail variables. An object drops to level i + 1 once its projected
+// radius is smaller than lodScreenRadius[i] pixels; the hysteresis keeps it
+// from popping back and forth right on the threshold
+GLfloat lodTriangleRatios[MAX_LOD_LEVELS - 1] = { 0.5f, 0.25f, 0.1f };
+GLfloat lodScreenRadius[MAX_LOD_LEVELS - 1] = { 150.0f, 60.0f, 25.0f };
+GLfloat lodHysteresis = 0.15f;
+GLint submarineLodLevel = 0;
+
+// Collision variables. The submarine is approximated by a row of spheres along
+// its length, worked out from its mesh when it is loaded
+#define SUBMARINE_COLLISION_SPHERES 3
+GLfloat submarineCollisionOffsets[SUBMARINE_COLLISION_SPHERES][3];
+GLfloat submarineCollisionRadius = 10.0f;
+GLint collisionIterations = 4;
+GLint* collisionCandidates = NULL;
+GLint collisionCandidateCapacity = 0;
+GLint* collisionTriangles = NULL;
+GLint collisionTriangleCapacity = 0;
+double collisionTime = 0.0;
+
+// Obstacle field variables. Signed distances to the coral are baked into a grid
+// when the scene loads so a fish only needs one lookup to know how close it is.
+// Anything further than the band away just reads as the band
+GLfloat* obstacleField = NULL;
+GLint obstacleFieldSize[3] = { 0, 0, 0 };
+GLfloat obstacleFieldOrigin[3];
+GLfloat obstacleFieldSpacing = 8.0f;
+GLfloat obstacleFieldBand = 64.0f;
+GLint obstacleFieldThreads = 0; // 0 uses one thread per processor
+
+// Snapshot variables. A checkpoint is a snapshot written every so many ticks
+// by its own thread
+#define SNAPSHOT_MAGIC 0x504E5353
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_COMPRESSED 1
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 12
+GLint simulationTick = 0;
+GLboolean isSnapshotCompressed = GL_TRUE;
+char* snapshotPath = "sub.snap";
+char* checkpointPath = "checkpoint.snap";
+GLint checkpointInterval = 0;
+GLint checkpointsSkipped = 0;
+Thread checkpointThread;
+GLboolean isCheckpointThreadRunning = GL_FALSE;
+Mutex checkpointMutex;
+Condition checkpointCondition;
+GLboolean isCheckpointPending = GL_FALSE;
+SnapshotHeader checkpointHeader;
+unsigned char* checkpointPayload = NULL;
+GLint checkpointPayloadCapacity = 0;
+
+// Journal variables. The simulation runs tickRate fixed ticks a second, and a
+// journal records the input that came before each tick
+#define JOURNAL_MAGIC 0x4C4E4A53
+#define JOURNAL_VERSION 1
+GLfloat tickRate = 60.0f;
+GLint maxTicksPerIdle = 5;
+double tickAccumulator = 0;
+double lastIdleTime = 0;
+FILE* journalFile = NULL;
+char* journalPath = NULL;
+double journalStartTime = 0;
+GLint journalFirstTick = 0;
+InputEvent* replayEvents = NULL;
+GLint replayEventCount = 0;
+GLint replayEventCapacity = 0;
+GLint replayNextEvent = 0;
+GLint replayFirstTick = 0;
+GLint replayEndTick = 0;
+GLboolean isReplaying = GL_FALSE;
+GLboolean isHeadless = GL_FALSE;
+FILE* timingsFile = NULL;
+double lastTickTime = 0;
+
+// Simulation thread variables. The simulation publishes a RenderState after
+// every tick through a triple buffer: it writes one state, the window thread
+// reads another, and the third is the latest finished one waiting to be
+// picked up. renderStateLatest holds that third index, with RENDER_STATE_FRESH
+// set if it hasn't been picked up yet
+#define RENDER_STATE_FRESH 4
+RenderState renderStates[3];
+AtomicInt renderStateLatest = 1;
+GLint renderStateWriting = 0;
+GLint renderStateReading = 2;
+RenderState* frameState = &renderStates[2];
+InputQueue inputQueue;
+Thread simulationThread;
+AtomicInt isSimulationRunning = 0;
+GLboolean isSimulationThreadRunning = GL_FALSE;
+GLboolean isSimulationThreaded = GL_TRUE;
+double lastFrameTime = 0;
+
+// How long the last frame took in microseconds and how many triangles it drew.
+// The window thread writes these for the telemetry on the simulation thread,
+// so they're atomics instead of being read out of renderStats
+AtomicInt lastFrameMicroseconds = 0;
+AtomicInt lastFrameTriangles = 0;
+
+// Frame pacing variables. Frames are only drawn when there is a new tick or
+// something asked for a redraw, and no faster than targetFps (0 for no cap).
+// With vsync on, the frame starts a little early so it doesn't miss the
+// vertical blank it was aiming for
+GLint targetFps = 60;
+GLboolean isVsyncWanted = GL_TRUE;
+GLboolean isVsyncOn = GL_FALSE;
+double vsyncMargin = 0.002;
+double maxIdleSleep = 0.002;
+GLboolean isRedisplayPending = GL_TRUE;
+double lastFrameStart = 0;
+
+// Counted since the last time they were printed, to see how busy the app is
+double pacingStartTime = 0;
+double pacingStartCpu = 0;
+double idleSleepTime = 0;
+GLint framesDrawn = 0;
+
+// Telemetry variables. Samples that come while the ring is full are dropped
+// and counted rather than waited on
+#define TELEMETRY_MAGIC 0x4D4C4554
+#define TELEMETRY_VERSION 2
+#define TELEMETRY_CAPACITY 1024
+MappedFile telemetryFile;
+TelemetryHeader* telemetry = NULL;
+TelemetrySample* telemetrySamples = NULL;
 
 // Keyboard Varibales
 GLboolean keyStates[256] = { GL_FALSE };
@@ -111,10 +1135,18 @@ GLfloat sensitivity = 0.5f;
 // Scene Variables
 GLint bottomDiscRadius = 500;
 GLint bottomDiscSegments = 48;
+GLint bottomDiscRings = 1;
 GLint wallHeight = 500;
+GLint wallStacks = 48;
+GLint originMarkerSegments = 30;
+
+// The floor, wall and origin marker are tessellated once into these, and again
+// only when the tessellation above is changed
+StaticMesh floorMesh;
+StaticMesh wallMesh;
+StaticMesh originMarkerMesh;
 
 // Wave Variables
-GLfloat subdivisionSize = 25.0f;
 GLfloat waveHeightOffset = 450.0f;
 GLfloat wavePhase = 50.0f;
 GLfloat waveTimeValue = 0.0f;
@@ -122,139 +1154,673 @@ GLfloat waveAmplitude = 40.0f;
 GLfloat waveVelocity = 0.025f;
 GLfloat waveLength = 450.0f;
 
-// Fish Variables
-GLfloat fishPathRadius = 350.0f;
-GLfloat numberOfFishSquiggles = 20.0f;
-GLfloat fishSquiggleDepth = 20.0f;
+// Ocean Variables. The ocean is oceanSize across, drawn as clipmap levels
+// whose cells start out clipmapSpacing across and double every level
+GLfloat oceanSize = 1200.0f;
+GLfloat clipmapSpacing = 3.125f;
+ClipmapLevel clipmapLevels[MAX_CLIPMAP_LEVELS];
+GLint clipmapLevelCount = 0;
+GLint clipmapRebuilds = 0;
+
+// Terrain Variables. The terrain is a heightmap file of tiles much bigger than
+// memory, mapped in, with at most terrainBudget tiles meshed around the submarine
+#define TERRAIN_MAGIC 0x52524554
+#define TERRAIN_VERSION 1
+#define MAX_TERRAIN_WORKERS 4
+char* terrainPath = NULL;
+MappedFile terrainFile;
+TerrainHeader* terrainHeader = NULL;
+const GLshort* terrainSamples = NULL;
+TerrainTile* terrainTiles = NULL;
+GLint terrainBudget = 96;
+GLfloat terrainViewDistance = 2000.0f;
+GLint terrainUploadsPerFrame = 4;
+GLint terrainFrame = 0;
+
+// The slots waiting for a worker, and the workers meshing them
+GLint* terrainQueue = NULL;
+GLint terrainQueueStart = 0;
+GLint terrainQueueCount = 0;
+Mutex terrainMutex;
+Condition terrainCondition;
+Thread terrainWorkers[MAX_TERRAIN_WORKERS];
+GLint terrainWorkerCount = 0;
+GLboolean isTerrainStopping = GL_FALSE;
+
+// Terrain counters printed with 'i'
+GLint terrainUploads = 0;
+GLint terrainLoads = 0;
+GLint terrainEvictions = 0;
+GLint terrainMeshCount = 0;
+GLint terrainUploadCount = 0;
+double terrainMeshTime = 0;
+double terrainUploadTime = 0;
+double terrainWorstUploadTime = 0;
+
+// Fish Variables. The fish bend their tails from side to side once every
+// fishStrokeLength units they swim, with numberOfFishSquiggles waves along the
+// body and the tail swinging out fishSquiggleDepth of a body length
+GLfloat fishStrokeLength = 20.0f;
+GLfloat numberOfFishSquiggles = 0.75f;
+GLfloat fishSquiggleDepth = 0.15f;
+#define FISH_SEGMENTS 12
+#define FISH_SIDES 8
+#define FISH_POSITION_ATTRIBUTE 6
+#define FISH_VELOCITY_ATTRIBUTE 7
+StaticMesh fishMesh;
+
+// Fish LOD Variables. A fish at least fishNearPixels long on screen gets the
+// whole mesh, one at least fishImpostorPixels long gets the simple mesh, and
+// anything smaller or mostly fogged out is a flat impostor facing the camera,
+// all of them in one draw. Fish past where the fog hides them are skipped
+#define FISH_SIMPLE_SEGMENTS 4
+#define FISH_SIMPLE_SIDES 4
+#define FISH_LOD_NEAR 0
+#define FISH_LOD_SIMPLE 1
+#define FISH_LOD_IMPOSTOR 2
+#define FISH_LOD_HIDDEN 3
+#define FISH_LOD_OFF_SCREEN 4
+#define FISH_LOD_COUNT 5
+StaticMesh fishSimpleMesh;
+GLboolean isFishLod = GL_TRUE;
+GLfloat fishNearPixels = 60.0f;
+GLfloat fishImpostorPixels = 16.0f;
+GLuint fishImpostorTexture = 0;
+GLubyte* fishLods = NULL;
+GLint fishLodCapacity = 0;
+GLint fishLodCounts[FISH_LOD_COUNT];
+FishImpostorVertex* fishImpostorVertices = NULL;
+GLint fishImpostorCapacity = 0;
+GLint fishImpostorCount = 0;
+GLuint* fishImpostorEdges = NULL;
+GLint fishImpostorEdgeCapacity = 0;
+GLint fishImpostorEdgeQuads = 0;
+GLboolean isDrawingRigidFish = GL_FALSE;
+FishInstance* fishInstances = NULL;
+GLint fishInstanceCapacity = 0;
+GLfloat* fishPhases = NULL;
+GLint fishPhaseCount = 0;
+GLint fishPhaseCapacity = 0;
+GLint fishPhaseTick = 0;
+FishBatch fishBatches[MAX_SPECIES * 2];
+
+// GL functions past 1.1, looked up once there is a window
+GlFunctions gl;
+
+// Shader Variables. When the driver has shaders everything in the render queue
+// is drawn with the scene shader permutation for its state, so none of the
+// fixed function lighting or fog has to be emulated. The linked programs are
+// saved to shaderCachePath so the next launch can skip compiling them
+SceneProgram scenePrograms[SHADER_PERMUTATIONS];
+GLboolean hasScenePrograms = GL_FALSE;
+GLboolean isCachingShaders = GL_TRUE;
+char* shaderCachePath = "shaders.cache";
+GLint shaderProgramCount = 0;
+GLint shaderCachedCount = 0;
+double shaderBuildTime = 0;
+
+// Lighting Variables. With clustered lighting the lit things are shaded per
+// pixel by the sun and up to clusterLightLimit small lights, which are binned
+// into the clusters of the view every frame so each pixel only loops over the
+// lights near it. The clusters run between the near and far planes
+GLboolean isClusteredLighting = GL_TRUE;
+GLint clusterLightLimit = 256;
+GLint clusterThreads = 0;
+#define CLUSTER_NEAR 1.0f
+#define CLUSTER_FAR 2000.0f
+ClusterLight clusterLights[MAX_CLUSTER_LIGHTS];
+GLint clusterLightCount = 0;
+ClusterSlice clusterSlices[CLUSTER_SLICES];
+GLfloat clusterRanges[CLUSTER_SLICES * CLUSTER_TILES * 2];
+GLfloat* clusterIndexData = NULL;
+GLint clusterIndexCapacity = 0;
+GLint clusterIndexRows = 0;
+GLint clusterIndexCount = 0;
+GLint clusterMostLights = 0;
+double clusterBinTime = 0;
+GLuint clusterRangeTexture = 0;
+GLuint clusterIndexTexture = 0;
+GLuint clusterLightTexture = 0;
+GLboolean isCullingClusterLights = GL_TRUE;
+GLint benchmarkLightCount = 0;
+ClusterLight* benchmarkLights = NULL;
+
+// The binning workers, woken for each frame by bumping clusterFrame
+Thread clusterWorkers[CLUSTER_SLICES];
+GLint clusterWorkerCount = -1;
+GLboolean isClusterStopping = GL_FALSE;
+Mutex clusterMutex;
+Condition clusterStartCondition;
+Condition clusterDoneCondition;
+GLint clusterFrame = 0;
+GLint clusterWorkersDone = 0;
+
+// Occlusion Variables. The occluderLimit biggest coral that cover at least
+// occluderMinimumSize pixels of the occlusion buffer both ways are drawn into it
+// at their coarsest level of detail, then every coral's box is tested against
+// it before being queued. The
+// buffer holds window depths from 0 at the near plane to 1 at the far plane
+GLboolean isOcclusionCulling = GL_TRUE;
+GLint occlusionThreads = 0;
+GLfloat occluderMinimumSize = 12.0f;
+GLint occluderLimit = 16;
+OccluderCandidate* occluderCandidates = NULL;
+GLint occluderCandidateCapacity = 0;
+GLfloat occlusionDepth[OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+GLfloat occlusionBlockDepth[OCCLUSION_BLOCKS_X * OCCLUSION_BLOCKS_Y];
+OcclusionTriangle* occlusionTriangles = NULL;
+GLint occlusionTriangleCount = 0;
+GLint occlusionTriangleCapacity = 0;
+OcclusionTile occlusionTiles[OCCLUSION_TILES];
+GLfloat* occlusionVertices = NULL;
+GLint occlusionVertexCapacity = 0;
+GLint occluderCount = 0;
+GLint occlusionTestCount = 0;
+GLint occludedCount = 0;
+double occlusionDrawTime = 0;
+
+// The occlusion workers, woken for each frame by bumping occlusionFrame
+Thread occlusionWorkers[OCCLUSION_TILES];
+GLint occlusionWorkerCount = -1;
+GLboolean isOcclusionStopping = GL_FALSE;
+Mutex occlusionMutex;
+Condition occlusionStartCondition;
+Condition occlusionDoneCondition;
+GLint occlusionFrame = 0;
+GLint occlusionWorkersDone = 0;
 
-#define FLOCK_SIZE 15
 #define NUMBER_NEIGHBOURS 6
-Boid currentFlock[FLOCK_SIZE];
-Boid previousFlock[FLOCK_SIZE];
-GLfloat flockSpeed = 0.4;
-GLfloat maxSpeed = 0.4;
 GLint distanceThreshold = 25;
-GLfloat boidDistance = 20;
-GLfloat boidSize = 10;
 
-// boid factors
-GLfloat wallAvoidanceFactor = 0.05;
-GLfloat boidAvoidanceFactor = 0.07;
-GLfloat boidAlignmentFactor = 0.0003;
-GLfloat boidCohesionFactor = 0.0003;
+// How much further than they need to the neighbour lists look, so they last
+// a few ticks before a boid has to search the grid again. They're off unless
+// asked for, since they only beat searching the grid by a little
+GLboolean isUsingNeighbourLists = GL_FALSE;
+GLfloat neighbourSkin = 8.0f;
+
+// The fish in the scene. Each species has its own boid factors
+Species speciesTable[] =
+{
+	// name, count, material, size, speed, max speed, sight, separation distance,
+	// wall, separation, alignment and cohesion factors, predator, flee distance,
+	// flee factor, chase factor
+	{ "Blue school", 15, MATERIAL_BOID, 10, 0.4f, 0.4f, 250, 20, 0.05f, 0.07f, 0.0003f, 0.0003f, GL_FALSE, 150, 0.02f, 0 },
+	{ "Orange school", 20, MATERIAL_BOID_ORANGE, 6, 0.5f, 0.5f, 150, 14, 0.05f, 0.07f, 0.0006f, 0.0004f, GL_FALSE, 150, 0.03f, 0 },
+	{ "Predator", 2, MATERIAL_PREDATOR, 18, 0.35f, 0.45f, 250, 60, 0.05f, 0.07f, 0.0002f, 0.0001f, GL_TRUE, 0, 0, 0.004f }
+};
+Flock flock;
+
+GLfloat obstacleAvoidanceFactor = 0.05;
+GLfloat obstacleThreshold = 30.0f;
 
 // Textures
 GLuint sandTexture;
 
-GLfloat getDistance(GLfloat a[3], GLfloat b[3])
+// Materials. The sea floor used to leave a 0.2 emission set after it was
+// drawn, so every lit material keeps that same emission
+Material materials[MATERIAL_COUNT] =
 {
-	return sqrtf((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]));
+	{ { 0 }, { 0 }, { 0 }, { 0 }, 0.0f },
+	// Submarine, yellow and slightly shiny
+	{ { 0.5f, 0.5f, 0.0f, 1.0f }, { 1.0f, 1.0f, 0.0f, 1.0f }, { 0.5f, 0.5f, 0.5f, 1.0f }, { 0.2f, 0.2f, 0.2f, 1.0f }, 50.0f },
+	// Coral, green
+	{ { 0.05f, 0.7f, 0.1f, 1.0f }, { 0.0f, 1.0f, 0.1f, 1.0f }, { 0.5f, 0.5f, 0.5f, 1.0f }, { 0.2f, 0.2f, 0.2f, 1.0f }, 50.0f },
+	// Wave, water blue
+	{ { 0.02f, 0.25f, 0.5f, 1.0f }, { 0.0f, 0.03f, 0.5f, 1.0f }, { 0.5f, 0.5f, 0.5f, 1.0f }, { 0.2f, 0.2f, 0.2f, 1.0f }, 25.0f },
+	// Boids, blue
+	{ { 0.1f, 0.1f, 0.5f, 1.0f }, { 0.0f, 0.0f, 1.0f, 1.0f }, { 0.5f, 0.5f, 0.5f, 1.0f }, { 0.2f, 0.2f, 0.2f, 1.0f }, 50.0f },
+	// Boids, orange
+	{ { 0.5f, 0.25f, 0.0f, 1.0f }, { 1.0f, 0.5f, 0.0f, 1.0f }, { 0.5f, 0.5f, 0.5f, 1.0f }, { 0.2f, 0.2f, 0.2f, 1.0f }, 50.0f },
+	// Predators, grey
+	{ { 0.3f, 0.3f, 0.35f, 1.0f }, { 0.5f, 0.5f, 0.55f, 1.0f }, { 0.8f, 0.8f, 0.8f, 1.0f }, { 0.2f, 0.2f, 0.2f, 1.0f }, 80.0f }
+};
+
+// Render queue variables
+RenderItem* renderQueue = NULL;
+GLint renderQueueCount = 0;
+GLint renderQueueCapacity = 0;
+GLfloat viewMatrix[16];
+RenderStats renderStats;
+
+// Returns a time in seconds from a high resolution clock, for timing things
+double getTimeSeconds()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+#endif
 }
 
-/*
-* This method generates a random float between any two random number inclusively.
-*/
-GLfloat generateRandomFloat(GLfloat minValue, GLfloat maxValue)
+// Asks for another frame. Requests are gathered up until the next frame is due
+void requestRedisplay()
 {
-	GLfloat random = rand() / (float)RAND_MAX;
-	return (GLfloat)(minValue + random * (maxValue - minValue));
+	if (!isHeadless)
+	{
+		isRedisplayPending = GL_TRUE;
+	}
 }
 
-/*
-* A helper function to return the normal of three vectors. It calculates the cross
-* product of the two vectors, and returns the normal
-*/
-Vertex3 calculateNormal(Vertex3 v1, Vertex3 v2, Vertex3 v3) 
+// Returns how much CPU time the whole process has used, over all threads
+double getProcessCpuSeconds()
 {
-	GLfloat edge1[3] = { v2.position[0] - v1.position[0], v2.position[1] - v1.position[1], v2.position[2] - v1.position[2] };
-	GLfloat edge2[3] = { v3.position[0] - v1.position[0], v3.position[1] - v1.position[1], v3.position[2] - v1.position[2] };
-
-	GLfloat x = edge1[1] * edge2[2] - edge1[2] * edge2[1];
-	GLfloat y = edge1[2] * edge2[0] - edge1[0] * edge2[2];
-	GLfloat z = edge1[0] * edge2[1] - edge1[1] * edge2[0];
-
-	Vertex3 normal = { x, y, z };
-	return normal;
+#ifdef _WIN32
+	FILETIME creation, exitTime, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user);
+	ULARGE_INTEGER kernelTime = { kernel.dwLowDateTime, kernel.dwHighDateTime };
+	ULARGE_INTEGER userTime = { user.dwLowDateTime, user.dwHighDateTime };
+	return (kernelTime.QuadPart + userTime.QuadPart) / 10000000.0;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+#endif
 }
 
-/*
-* Helper function that normalizes a vector.
-*/
-void normalizeVector(Vertex3* vector)
+// Runs the function given to startThread on the new thread
+#ifdef _WIN32
+DWORD WINAPI runThread(LPVOID argument)
+#else
+void* runThread(void* argument)
+#endif
 {
-	GLfloat length = sqrtf(vector->position[0] * vector->position[0] +
-		vector->position[1] * vector->position[1] + vector->position[2] * vector->position[2]);
-
-	vector->position[0] /= length;
-	vector->position[1] /= length;
-	vector->position[2] /= length;
+	ThreadStart start = *(ThreadStart*)argument;
+	free(argument);
+	start.function(start.data);
+	return 0;
 }
 
-void normalizeVectorArray(GLfloat* vector)
+// Starts function(data) on a new thread
+void startThread(Thread* thread, void (*function)(void*), void* data)
 {
-	GLfloat length = sqrtf(vector[0] * vector[0] + vector[1] * vector[1] +
-		vector[2] * vector[2]);
-
-	if (length != 0)
+	ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+	if (!start)
 	{
-		vector[0] /= length;
-		vector[1] /= length;
-		vector[2] /= length;
+		printf("Error allocating memory for a thread\n");
+		exit(1);
+	}
+	start->function = function;
+	start->data = data;
+
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, runThread, start, 0, NULL);
+	if (!*thread)
+#else
+	if (pthread_create(thread, NULL, runThread, start) != 0)
+#endif
+	{
+		printf("Error starting a thread\n");
+		exit(1);
 	}
-	
 }
 
-// Helper function to set the material of a surface
-void setMaterial(GLfloat ambient[], GLfloat diffuse[], GLfloat specular[], GLfloat shininess)
+// Waits for a thread to finish
+void joinThread(Thread thread)
 {
-	glMaterialfv(GL_FRONT, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT, GL_SPECULAR, specular);
-	glMaterialf(GL_FRONT, GL_SHININESS, shininess);
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
 }
 
-// Helper method to initialize the values and allocate memory for Object structs
-void allocateObject(Object** object)
+// Returns how many processors can run threads at once
+GLint getProcessorCount()
 {
-	*object = (Object*)malloc(sizeof(Object));
-	if (!*object)
-	{
-		printf("Error allocating memory for Object\n");
-		exit(1);
-	}
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	GLint count = (GLint)info.dwNumberOfProcessors;
+#else
+	GLint count = (GLint)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return count > 0 ? count : 1;
+}
 
-	(*object)->values.vertexCount = 0;
-	(*object)->values.normalCount = 0;
-	(*object)->values.groupcount = 0;
+void initMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
 
-	for (GLint i = 0; i < 10; i++)
-	{
-		(*object)->groups[i].faceCount = 0;
-		(*object)->groups[i].faces = NULL;
-	}
+void lockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
 }
 
-// Method that reads through a file, counting the pieces of a certain object, 
-// whether it's coral or the submarine pieces. It increases trh groupCount 
-// for each object
-void countElements(FILE* file, Object* object)
+void unlockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void initCondition(Condition* condition)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(condition);
+#else
+	pthread_cond_init(condition, NULL);
+#endif
+}
+
+// Unlocks the mutex while waiting, and has it locked again when it returns
+void waitCondition(Condition* condition, Mutex* mutex)
+{
+#ifdef _WIN32
+	SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+	pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void signalCondition(Condition* condition)
+{
+#ifdef _WIN32
+	WakeConditionVariable(condition);
+#else
+	pthread_cond_signal(condition);
+#endif
+}
+
+// Wakes every thread waiting on the condition, not just one
+void broadcastCondition(Condition* condition)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(condition);
+#else
+	pthread_cond_broadcast(condition);
+#endif
+}
+
+GLint atomicLoad(AtomicInt* value)
+{
+#ifdef _WIN32
+	return (GLint)InterlockedCompareExchange(value, 0, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void atomicStore(AtomicInt* value, GLint newValue)
+{
+#ifdef _WIN32
+	InterlockedExchange(value, newValue);
+#else
+	__atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+#endif
+}
+
+// Sets the value and returns what it was before, in one step
+GLint atomicExchange(AtomicInt* value, GLint newValue)
+{
+#ifdef _WIN32
+	return (GLint)InterlockedExchange(value, newValue);
+#else
+	return __atomic_exchange_n(value, newValue, __ATOMIC_ACQ_REL);
+#endif
+}
+
+void sleepSeconds(double seconds)
+{
+#ifdef _WIN32
+	Sleep((DWORD)(seconds * 1000.0));
+#else
+	struct timespec duration;
+	duration.tv_sec = (time_t)seconds;
+	duration.tv_nsec = (long)((seconds - duration.tv_sec) * 1000000000.0);
+	nanosleep(&duration, NULL);
+#endif
+}
+
+/*
+* Sleeps until the given time. Sleeps can run over, so it sleeps until just
+* before and then yields until the time comes.
+*/
+void sleepUntil(double deadline)
+{
+	double now = getTimeSeconds();
+	while (now < deadline)
+	{
+		double remaining = deadline - now;
+		sleepSeconds(remaining > 0.002 ? remaining - 0.001 : 0);
+		now = getTimeSeconds();
+	}
+}
+
+// Adds an input event to the queue. Returns GL_FALSE if the queue is full
+GLboolean pushInputEvent(InputEvent* event)
+{
+	GLint tail = atomicLoad(&inputQueue.tail);
+	GLint next = (tail + 1) % INPUT_QUEUE_SIZE;
+	if (next == atomicLoad(&inputQueue.head))
+	{
+		return GL_FALSE;
+	}
+
+	inputQueue.events[tail] = *event;
+	atomicStore(&inputQueue.tail, next);
+	return GL_TRUE;
+}
+
+// Takes the oldest input event off the queue. Returns GL_FALSE if it is empty
+GLboolean popInputEvent(InputEvent* event)
+{
+	GLint head = atomicLoad(&inputQueue.head);
+	if (head == atomicLoad(&inputQueue.tail))
+	{
+		return GL_FALSE;
+	}
+
+	*event = inputQueue.events[head];
+	atomicStore(&inputQueue.head, (head + 1) % INPUT_QUEUE_SIZE);
+	return GL_TRUE;
+}
+
+GLfloat getDistance(GLfloat a[3], GLfloat b[3])
+{
+	return sqrtf((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]));
+}
+
+/*
+* This method generates a random float between any two random number inclusively.
+*/
+GLfloat generateRandomFloat(GLfloat minValue, GLfloat maxValue)
+{
+	GLfloat random = rand() / (float)RAND_MAX;
+	return (GLfloat)(minValue + random * (maxValue - minValue));
+}
+
+/*
+* A helper function to return the normal of three vectors. It calculates the cross
+* product of the two vectors, and returns the normal
+*/
+Vertex3 calculateNormal(Vertex3 v1, Vertex3 v2, Vertex3 v3) 
+{
+	GLfloat edge1[3] = { v2.position[0] - v1.position[0], v2.position[1] - v1.position[1], v2.position[2] - v1.position[2] };
+	GLfloat edge2[3] = { v3.position[0] - v1.position[0], v3.position[1] - v1.position[1], v3.position[2] - v1.position[2] };
+
+	GLfloat x = edge1[1] * edge2[2] - edge1[2] * edge2[1];
+	GLfloat y = edge1[2] * edge2[0] - edge1[0] * edge2[2];
+	GLfloat z = edge1[0] * edge2[1] - edge1[1] * edge2[0];
+
+	Vertex3 normal = { x, y, z };
+	return normal;
+}
+
+/*
+* Helper function that normalizes a vector.
+*/
+void normalizeVector(Vertex3* vector)
+{
+	GLfloat length = sqrtf(vector->position[0] * vector->position[0] +
+		vector->position[1] * vector->position[1] + vector->position[2] * vector->position[2]);
+
+	vector->position[0] /= length;
+	vector->position[1] /= length;
+	vector->position[2] /= length;
+}
+
+void normalizeVectorArray(GLfloat* vector)
+{
+	GLfloat length = sqrtf(vector[0] * vector[0] + vector[1] * vector[1] +
+		vector[2] * vector[2]);
+
+	if (length != 0)
+	{
+		vector[0] /= length;
+		vector[1] /= length;
+		vector[2] /= length;
+	}
+	
+}
+
+// Helper function to set the material of a surface
+void setMaterial(GLfloat ambient[], GLfloat diffuse[], GLfloat specular[], GLfloat shininess)
+{
+	glMaterialfv(GL_FRONT, GL_AMBIENT, ambient);
+	glMaterialfv(GL_FRONT, GL_DIFFUSE, diffuse);
+	glMaterialfv(GL_FRONT, GL_SPECULAR, specular);
+	glMaterialf(GL_FRONT, GL_SHININESS, shininess);
+}
+
+// Helper function to apply one of the materials from the material table
+void applyMaterial(Material* material)
+{
+	setMaterial(material->ambient, material->diffuse, material->specular, material->shininess);
+	glMaterialfv(GL_FRONT, GL_EMISSION, material->emission);
+}
+
+// Helper that makes sure a growing array has room for at least count items
+void reserveArray(void** array, GLint* capacity, GLint count, size_t itemSize)
+{
+	if (count <= *capacity)
+	{
+		return;
+	}
+
+	GLint newCapacity = *capacity > 0 ? *capacity : 64;
+	while (newCapacity < count)
+	{
+		newCapacity *= 2;
+	}
+
+	void* grown = realloc(*array, itemSize * newCapacity);
+	if (!grown)
+	{
+		printf("Error growing an array to %d items\n", newCapacity);
+		exit(1);
+	}
+
+	*array = grown;
+	*capacity = newCapacity;
+}
+
+// Rounds a size up so everything carved out of an arena stays aligned
+size_t getArenaSize(size_t size)
+{
+	return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+void initArena(Arena* arena, size_t size)
+{
+	arena->data = (unsigned char*)malloc(size > 0 ? size : 1);
+	if (!arena->data)
+	{
+		printf("Error allocating memory for an arena\n");
+		exit(1);
+	}
+	arena->size = size;
+	arena->used = 0;
+}
+
+// Takes the next piece of an arena. The sizes are worked out beforehand, so
+// running out means they were worked out wrong
+void* arenaAllocate(Arena* arena, size_t size)
+{
+	size = getArenaSize(size);
+	if (arena->used + size > arena->size)
+	{
+		printf("Error, an arena ran out of space\n");
+		exit(1);
+	}
+
+	void* pointer = arena->data + arena->used;
+	arena->used += size;
+	return pointer;
+}
+
+void freeArena(Arena* arena)
+{
+	free(arena->data);
+	arena->data = NULL;
+	arena->size = 0;
+	arena->used = 0;
+}
+
+// Whether a pointer is inside an arena, so it goes when the arena does
+GLboolean isInArena(Arena* arena, void* pointer)
+{
+	return (unsigned char*)pointer >= arena->data && (unsigned char*)pointer < arena->data + arena->size;
+}
+
+// Frees one piece of an object, unless it was packed into the object's arena
+void freeObjectPiece(Object* object, void* pointer)
+{
+	if (!isInArena(&object->arena, pointer))
+	{
+		free(pointer);
+	}
+}
+
+// Helper method to initialize the values of Object structs
+void initObject(Object* object, char* name)
+{
+	memset(object, 0, sizeof(Object));
+	snprintf(object->name, sizeof(object->name), "%s", name);
+}
+
+/*
+* Method that reads through a file, counting the pieces of a certain object,
+* whether it's coral or the submarine pieces. It increases the groupcount for
+* each object and keeps how many faces each group has in faceCounts, which
+* grows as needed so there is no limit on the groups. Faces before the first
+* group go in a group of their own.
+*/
+void countElements(FILE* file, Object* object, GLint** faceCounts, GLint* faceCountCapacity)
 {
 	char line[128];
 	int currentGroup = -1;
 
 	while (fgets(line, sizeof(line), file) != NULL)
 	{
-		// If the line starts with g, then we have a sub piece
-		if (line[0] == 'g')
+		// If the line starts with g, or we find a face with no group yet, then we have a sub piece
+		if (line[0] == 'g' || (line[0] == 'f' && currentGroup < 0))
 		{
 			currentGroup++;
+			reserveArray((void**)faceCounts, faceCountCapacity, currentGroup + 1, sizeof(GLint));
+			(*faceCounts)[currentGroup] = 0;
 
-			object->groups[currentGroup].faceCount = 0;
-			
 			object->values.groupcount++;
 		}
+
 		// If we are on a vertex line
-		else if (line[0] == 'v' && line[1] != 'n')
+		if (line[0] == 'v' && line[1] != 'n')
 		{
 			object->values.vertexCount++;
 		}
@@ -266,7 +1832,7 @@ void countElements(FILE* file, Object* object)
 		// If we are on a face line
 		else if (line[0] == 'f')
 		{
-			object->groups[currentGroup].faceCount++;
+			(*faceCounts)[currentGroup]++;
 		}
 	}
 
@@ -274,33 +1840,52 @@ void countElements(FILE* file, Object* object)
 	rewind(file);
 }
 
-// Function to allocate memory for all of the groups of a specific object to be
-// rendered.
-void allocateMemory(Object* object)
+/*
+* Puts the groups, vertices, normals, faces and triangle list of an object in
+* one arena sized exactly for them. The faces of all the groups sit one after
+* another.
+*/
+void layoutObjectArena(Object* object, GLint* faceCounts, GLint triangleCount)
 {
-	object->values.vertices = (Vertex3*)malloc(sizeof(Vertex3) * (object->values.vertexCount));
-	if (!object->values.vertices)
+	GLint groupCount = object->values.groupcount;
+	GLint faceCount = 0;
+	for (GLint i = 0; i < groupCount; i++)
 	{
-		printf("Error allocating memory for the vertices\n");
-		exit(1);
+		faceCount += faceCounts[i];
 	}
 
-	object->values.normals = (Vertex3*)malloc(sizeof(Vertex3) * (object->values.normalCount));
-	if (!object->values.normals)
+	initArena(&object->arena, getArenaSize(sizeof(Group) * groupCount) +
+		getArenaSize(sizeof(Vertex3) * object->values.vertexCount) +
+		getArenaSize(sizeof(Vertex3) * object->values.normalCount) +
+		getArenaSize(sizeof(Face) * faceCount) + getArenaSize(sizeof(GLint) * 3 * triangleCount));
+
+	object->groups = (Group*)arenaAllocate(&object->arena, sizeof(Group) * groupCount);
+	object->values.vertices = (Vertex3*)arenaAllocate(&object->arena, sizeof(Vertex3) * object->values.vertexCount);
+	object->values.normals = (Vertex3*)arenaAllocate(&object->arena, sizeof(Vertex3) * object->values.normalCount);
+
+	Face* faces = (Face*)arenaAllocate(&object->arena, sizeof(Face) * faceCount);
+	for (GLint i = 0; i < groupCount; i++)
 	{
-		printf("Error allocating memory for the normals\n");
-		exit(1);
+		object->groups[i].faces = faces;
+		object->groups[i].faceCount = faceCounts[i];
+		faces += object->groups[i].faceCount;
 	}
-	for (int i = 0; i < object->values.groupcount; i++)
+
+	object->triangles = (GLint*)arenaAllocate(&object->arena, sizeof(GLint) * 3 * triangleCount);
+	object->triangleCount = triangleCount;
+}
+
+// Function to allocate memory for all of the groups of a specific object to be
+// rendered, all in the one arena
+void allocateMemory(Object* object, GLint* faceCounts)
+{
+	GLint triangleCount = 0;
+	for (GLint i = 0; i < object->values.groupcount; i++)
 	{
-		
-		object->groups[i].faces = (Face*)malloc(sizeof(Face) * (object->groups[i].faceCount));
-		if (!object->groups[i].faces)
-		{
-			printf("Error allocating memory for the faces at index: %d\n", i);
-			exit(1);
-		}
+		triangleCount += faceCounts[i];
 	}
+
+	layoutObjectArena(object, faceCounts, triangleCount);
 }
 
 /*
@@ -317,12 +1902,13 @@ void setValues(FILE* file, Object* object)
 
 	while (fgets(line, sizeof(line), file) != NULL)
 	{
-		if (line[0] == 'g')
+		if (line[0] == 'g' || (line[0] == 'f' && currentGroup < 0))
 		{
 			currentGroup++;
 			faceCounter = 0;
 		}
-		else if (line[0] == 'v' && line[1] != 'n')
+
+		if (line[0] == 'v' && line[1] != 'n')
 		{
 			if (sscanf_s(line, "v %f %f %f",
 				&object->values.vertices[vertexCounter].position[0],
@@ -372,1108 +1958,11685 @@ void setValues(FILE* file, Object* object)
 	}
 }
 
-// Helper method to count, allocate, and set the values for the object to be
-// rendered.
-void allocateAndPopulateHelper(FILE* file, Object* object)
+/*
+* Works out the bounding box of an object's vertices, and the bounding sphere
+* centred on that box.
+*/
+void calculateObjectBounds(Object* object)
 {
-	countElements(file, object);
-	allocateMemory(object);
-	setValues(file, object);
+	for (GLint i = 0; i < 3; i++)
+	{
+		object->bounds.minimum[i] = 0;
+		object->bounds.maximum[i] = 0;
+	}
+
+	for (GLint v = 0; v < object->values.vertexCount; v++)
+	{
+		for (GLint i = 0; i < 3; i++)
+		{
+			GLfloat value = object->values.vertices[v].position[i];
+			if (v == 0 || value < object->bounds.minimum[i]) object->bounds.minimum[i] = value;
+			if (v == 0 || value > object->bounds.maximum[i]) object->bounds.maximum[i] = value;
+		}
+	}
+
+	object->boundingRadius = 0;
+	for (GLint i = 0; i < 3; i++)
+	{
+		object->boundingCenter[i] = (object->bounds.minimum[i] + object->bounds.maximum[i]) / 2;
+	}
+	for (GLint v = 0; v < object->values.vertexCount; v++)
+	{
+		GLfloat distance = getDistance(object->boundingCenter, object->values.vertices[v].position);
+		if (distance > object->boundingRadius)
+		{
+			object->boundingRadius = distance;
+		}
+	}
 }
 
-/*
-* This method is used to render an object based on their values that were previously
-* initialized, and their groups where memory was previously allocated. This method 
-* sets an objects normal and vertex for each triangle that gets drawn
-*/
-void renderObject(Object* object)
+// Gathers the faces of every group into one list of vertex indexes
+void gatherObjectTriangles(Object* object)
 {
-	glBegin(GL_TRIANGLES);
+	GLint written = 0;
 	for (GLint i = 0; i < object->values.groupcount; i++)
 	{
 		for (GLint j = 0; j < object->groups[i].faceCount; j++)
 		{
-			Face* currentFace = &object->groups[i].faces[j];
-
 			for (GLint k = 0; k < 3; k++)
 			{
-				GLint vertexIndex = currentFace->v[k];
-				GLint normalIndex = currentFace->vn[k];
-
-				Vertex3* vertex = &object->values.vertices[vertexIndex];
-				Vertex3* normal = &object->values.normals[normalIndex];
-
-				glNormal3f(normal->position[0], normal->position[1], normal->position[2]);
-				glVertex3f(vertex->position[0], vertex->position[1], vertex->position[2]);
+				object->triangles[written * 3 + k] = object->groups[i].faces[j].v[k];
 			}
+			written++;
 		}
 	}
-	
+}
 
-	glEnd();
+// Sorts edges packed with the smaller vertex in the high 32 bits
+int compareEdges(const void* a, const void* b)
+{
+	unsigned long long edgeA = *(const unsigned long long*)a;
+	unsigned long long edgeB = *(const unsigned long long*)b;
+	return edgeA < edgeB ? -1 : edgeA > edgeB ? 1 : 0;
 }
 
 /*
-* Method to read PPM files to set a TextureID to it. It reads PPM files of most widths
-* and heights, allocating memory dynamically. It reads through the PPM file and
-* creates a mipmap to render the texture on top of. Handles errors if the file
-* cannot be properly read or manipulated. Returns an unsigned integer representing
-* the ID of the created texture.
+* Finds every edge of a triangle list once, for drawing the wireframe as lines.
+* Two triangles next to each other share an edge, so each edge gets packed
+* with its smaller vertex first, they get sorted and the repeats are dropped.
+* Returns the edges as pairs of vertex indexes.
 */
-GLuint readPPM(char * filename)
+GLuint* buildEdgeList(GLint* triangles, GLint triangleCount, GLint* edgeCount)
 {
-	FILE* file = fopen(filename, "rb");
-	if (!file)
+	GLint cornerCount = triangleCount * 3;
+	unsigned long long* keys = (unsigned long long*)malloc(sizeof(unsigned long long) * (cornerCount > 0 ? cornerCount : 1));
+	GLuint* edges = (GLuint*)malloc(sizeof(GLuint) * 2 * (cornerCount > 0 ? cornerCount : 1));
+	if (!keys || !edges)
 	{
-		printf("Could not open file %s\n", filename);
-		return 1;
+		printf("Error allocating memory for an edge list\n");
+		exit(1);
 	}
 
-	char line[256];
-	char header[3];
-	GLint width, height, maxColor;
-
-	if (!fgets(line, sizeof(line), file))
+	for (GLint t = 0; t < triangleCount; t++)
 	{
-		printf("Error with reading the header\n");
-		fclose(file);
-		return 1;
+		for (GLint k = 0; k < 3; k++)
+		{
+			GLuint a = (GLuint)triangles[t * 3 + k];
+			GLuint b = (GLuint)triangles[t * 3 + (k + 1) % 3];
+			keys[t * 3 + k] = a < b ? ((unsigned long long)a << 32) | b : ((unsigned long long)b << 32) | a;
+		}
 	}
+	qsort(keys, cornerCount, sizeof(unsigned long long), compareEdges);
 
-	sscanf_s(line, "%s2", header, (unsigned)_countof(header));
-	if (header[0] != 'P' || header[1] != '6')
+	GLint count = 0;
+	for (GLint i = 0; i < cornerCount; i++)
 	{
-		printf("Error with file, make sure it's a valid format\n");
-		fclose(file);
-		return 1;
+		GLuint a = (GLuint)(keys[i] >> 32);
+		GLuint b = (GLuint)(keys[i] & 0xFFFFFFFFu);
+		if ((i > 0 && keys[i] == keys[i - 1]) || a == b)
+		{
+			continue;
+		}
+		edges[count * 2] = a;
+		edges[count * 2 + 1] = b;
+		count++;
 	}
 
-	if (!fgets(line, sizeof(line), file))
-	{
-		printf("Error reading sizes\n");
-		fclose(file);
-		return 1;
-	}
-	sscanf_s(line, "%d %d", &width, &height);
-
-	if (!fgets(line, sizeof(line), file))
-	{
-		printf("Error reading max color\n");
-		fclose(file);
-		return 1;
-	}
-	sscanf_s(line, "%d", &maxColor);
-
-	GLubyte *textureData = (GLubyte *)malloc(width * height * 3);
-	if (!textureData) 
-	{
-		printf("Error allocating memory for textureData\n");
-		fclose(file);
-		return 1;
-	}
-
-	fread(textureData, 3, width * height, file);
-	fclose(file);
-
-	GLuint textureID = 1;
-	glGenTextures(1, &textureID);
-
-	glBindTexture(GL_TEXTURE_2D, textureID);
-
-	gluBuild2DMipmaps(GL_TEXTURE_2D, 3, width, height, GL_RGB, GL_UNSIGNED_BYTE, textureData);
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	
-	free(textureData);
-
-	return textureID;
-}
-
-// Method used to draw the submarine
-void drawSubmarine()
-{
-	glEnable(GL_LIGHTING);
-	glPushMatrix();
-
-	// Move to the look at position
-	glTranslatef(submarineX, submarineY, submarineZ);
-
-	// Rotate the submarine so that it is rotated to the right axis
-	glRotatef(90.0f, 1, 0, 0);
-	glRotatef(-90.0f, 0, 1, 0);
-
-	// Increase the size by 0.1x
-	glScalef(0.2f, 0.2f, 0.2f);
-
-	// Submarine lighting variables so that the submarine is yellow, and slightly shiny
-	GLfloat ambient[] = { 0.5f, 0.5f, 0.0f, 1.0f };
-	GLfloat diffuse[] = { 1.0f, 1.0f, 0.0f, 1.0f };
-	GLfloat specular[] = { 0.5f, 0.5f, 0.5f, 1.0f };
-	GLfloat shininess = 50.0f;
-
-	setMaterial(ambient, diffuse, specular, shininess);
-
-	// Call the draw helper
-	renderObject(&submarine);
-	
-	glPopMatrix();
-	glDisable(GL_LIGHTING);
+	free(keys);
+	*edgeCount = count;
+	return (GLuint*)realloc(edges, sizeof(GLuint) * 2 * (count > 0 ? count : 1));
 }
 
-void drawCoral()
+// Makes room for a normal per vertex, all zero so they can be added up
+Vertex3* allocateEdgeNormals(GLint vertexCount)
 {
-	glEnable(GL_LIGHTING);
-
-	GLfloat ambient[] = { 0.05f, 0.7f, 0.1f, 1.0f };
-	GLfloat diffuse[] = { 0.0f, 1.0f, 0.1f, 1.0f };
-	GLfloat specular[] = { 0.5f, 0.5f, 0.5f, 1.0f };
-	GLfloat shininess = 50.0f;
-	
-	for (GLint i = 0; i < 14; i++)
+	Vertex3* normals = (Vertex3*)calloc(vertexCount > 0 ? vertexCount : 1, sizeof(Vertex3));
+	if (!normals)
 	{
-		glPushMatrix();
-		
-		// Move each coral to their random position
-		glTranslatef(coralPositions[i].position[0], coralPositions[i].position[1], 0);
-
-		// Scale each coral to 100 times its size
-		glScalef(200.0f, 200.0f, 200.0f);
-
-		// Rotate the coral so it lies on the proper axis
-		glRotatef(90.0f, 1, 0, 0);
-		glRotatef(-90.0f, 0, 1, 0);
-
-		// Set the material to the green color
-		setMaterial(ambient, diffuse, specular, shininess);
-
-		// Render each coral
-		renderObject(&coral[i]);
-
-		glPopMatrix();
+		printf("Error allocating memory for the edge normals\n");
+		exit(1);
 	}
-
-	glDisable(GL_LIGHTING);
+	return normals;
 }
 
 /*
-* Method used to draw the unit vectors coming out of the origin. It uses for 
-* loops to set the vector values, and draws an X, Y, and Z vector, with their
-* respective colors being red, green, and blue. It also draws a little white
-* sphere at the origin.
+* Builds the wireframe edges of an object's full mesh and levels of detail, once
+* they are loaded. A line has no face, so each vertex gets the average of the
+* normals it is drawn with in the triangles instead.
 */
-void drawUnitVectors()
+void buildObjectEdges(Object* object)
 {
-	GLint lineLegnth = 25;
-
-	Vertex3 vertices[3];
-	Color colors[3];
-	// Initialize the vertices and colors to 0
-	for (GLint i = 0; i < 3; i++) 
+	object->edges = buildEdgeList(object->triangles, object->triangleCount, &object->edgeCount);
+	object->edgeNormals = allocateEdgeNormals(object->values.vertexCount);
+	for (GLint i = 0; i < object->values.groupcount; i++)
 	{
-		for (GLint j = 0; j < 3; j++)
+		for (GLint j = 0; j < object->groups[i].faceCount; j++)
 		{
-			vertices[i].position[j] = 0;
-			colors[i].rgb[j] = 0.0;
+			Face* face = &object->groups[i].faces[j];
+			for (GLint k = 0; k < 3; k++)
+			{
+				for (GLint a = 0; a < 3; a++)
+				{
+					object->edgeNormals[face->v[k]].position[a] += object->values.normals[face->vn[k]].position[a];
+				}
+			}
 		}
 	}
-
-	// Loop that sets each line and color
-	for (GLint i = 0; i < 3; i++)
+	for (GLint v = 0; v < object->values.vertexCount; v++)
 	{
-		vertices[i].position[i] = lineLegnth;
-		colors[i].rgb[i] = 1.0;
+		if (object->edgeNormals[v].position[0] || object->edgeNormals[v].position[1] || object->edgeNormals[v].position[2])
+		{
+			normalizeVector(&object->edgeNormals[v]);
+		}
 	}
 
-	glDisable(GL_LIGHTING);
-
-	glBegin(GL_LINES);
-	glLineWidth(5);
-	for (GLint i = 0; i < 3; i++)
+	for (GLint level = 0; level < object->lodCount; level++)
 	{
-		glColor3f(colors[i].rgb[0], colors[i].rgb[1], colors[i].rgb[2]);
-		glVertex3f(0, 0, 0);
-		glVertex3f(vertices[i].position[0], vertices[i].position[1], vertices[i].position[2]);
+		LodMesh* mesh = &object->lods[level];
+		mesh->edges = buildEdgeList(mesh->indices, mesh->triangleCount, &mesh->edgeCount);
+		mesh->edgeNormals = allocateEdgeNormals(mesh->vertexCount);
+		for (GLint t = 0; t < mesh->triangleCount; t++)
+		{
+			for (GLint k = 0; k < 3; k++)
+			{
+				for (GLint a = 0; a < 3; a++)
+				{
+					mesh->edgeNormals[mesh->indices[t * 3 + k]].position[a] += mesh->normals[t].position[a];
+				}
+			}
+		}
+		for (GLint v = 0; v < mesh->vertexCount; v++)
+		{
+			if (mesh->edgeNormals[v].position[0] || mesh->edgeNormals[v].position[1] || mesh->edgeNormals[v].position[2])
+			{
+				normalizeVector(&mesh->edgeNormals[v]);
+			}
+		}
 	}
-	glEnd();
+}
 
-	GLUquadric* quad = gluNewQuadric();
+// Draws edges between float vertices as lines, one call for the whole mesh
+void drawEdges(Vertex3* vertices, Vertex3* normals, GLuint* edges, GLint edgeCount)
+{
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(Vertex3), vertices);
+	glNormalPointer(GL_FLOAT, sizeof(Vertex3), normals);
 
-	glPushMatrix();
-	glTranslatef(0, 0, 0);
-	glColor3f(1.0, 1.0, 1.0);
-	gluSphere(quad, 1, 30, 30);
-	glPopMatrix();
+	glDrawElements(GL_LINES, edgeCount * 2, GL_UNSIGNED_INT, edges);
+	renderStats.lines += edgeCount;
 
-	gluDeleteQuadric(quad);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
 
-	glEnable(GL_LIGHTING);
+// Helper method to count, allocate, and set the values for the object to be
+// rendered.
+void allocateAndPopulateHelper(FILE* file, Object* object)
+{
+	GLint* faceCounts = NULL;
+	GLint faceCountCapacity = 0;
+
+	countElements(file, object, &faceCounts, &faceCountCapacity);
+	allocateMemory(object, faceCounts);
+	setValues(file, object);
+	calculateObjectBounds(object);
+	gatherObjectTriangles(object);
+
+	free(faceCounts);
 }
 
 /*
-* Method that's used to draw the bottom of the map, or the sandy sea floor.
-* It does so by using gluDisk, and fills the circle with the spongebob sand 
-* ppm texture.
+* This method is used to render an object based on their values that were previously
+* initialized, and their groups where memory was previously allocated. This method 
+* sets an objects normal and vertex for each triangle that gets drawn
 */
-void drawBottomDisc()
+void renderObject(Object* object)
 {
-	GLfloat emission[] = {0.2f, 0.2f, 0.2f, 1.0f};
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, sandTexture);
-
-	glColor3f(1.0f, 1.0f, 1.0f);
+	glBegin(GL_TRIANGLES);
+	for (GLint i = 0; i < object->values.groupcount; i++)
+	{
+		for (GLint j = 0; j < object->groups[i].faceCount; j++)
+		{
+			Face* currentFace = &object->groups[i].faces[j];
 
-	GLUquadric* quadric = gluNewQuadric();
-	gluQuadricTexture(quadric, GL_TRUE);
+			for (GLint k = 0; k < 3; k++)
+			{
+				GLint vertexIndex = currentFace->v[k];
+				GLint normalIndex = currentFace->vn[k];
 
-	gluDisk(quadric, 0.0, bottomDiscRadius + 1, bottomDiscSegments, 1);
+				Vertex3* vertex = &object->values.vertices[vertexIndex];
+				Vertex3* normal = &object->values.normals[normalIndex];
 
-	gluDeleteQuadric(quadric);
+				glNormal3f(normal->position[0], normal->position[1], normal->position[2]);
+				glVertex3f(vertex->position[0], vertex->position[1], vertex->position[2]);
+			}
+		}
+	}
+	
 
-	glDisable(GL_TEXTURE_2D);
+	glEnd();
 }
 
 /*
-* Method to draw the walls of the scene using the same texture as the floor.
-* It uses gluQuadrics to draw a gluCylinder.
+* The structs below are only used while building the levels of detail. The
+* simplifier collapses edges using the quadric error metric (Garland and
+* Heckbert). Every vertex keeps the sum of the planes of the triangles around
+* it as a symmetric 4x4 matrix, stored as its 10 unique values, and collapsing
+* an edge moves the kept vertex to the spot with the least squared distance to
+* all of those planes.
 */
-void drawCylinderWall()
+typedef struct
 {
-	GLfloat emission[] = { 0.2f, 0.2f, 0.2f, 1.0f };
-	glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, emission);
-
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, sandTexture);
-
-	glColor3f(1.0f, 1.0f, 1.0f);
-
-	GLUquadric* quadric = gluNewQuadric();
-	gluQuadricTexture(quadric, GL_TRUE);
+	GLdouble q[10];
+} Quadric;
 
-	gluCylinder(quadric, bottomDiscRadius, bottomDiscRadius, wallHeight, bottomDiscSegments, bottomDiscSegments);
+typedef struct
+{
+	GLdouble position[3];
+	Quadric quadric;
+	GLint refStart;
+	GLint refCount;
+	GLboolean isBorder;
+} SimplifyVertex;
 
-	gluDeleteQuadric(quadric);
+typedef struct
+{
+	GLint v[3];
+	GLdouble error[4];
+	GLdouble normal[3];
+	GLboolean isDeleted;
+	GLboolean isDirty;
+} SimplifyTriangle;
 
-	glDisable(GL_TEXTURE_2D);
-}
+// A reference from a vertex to one corner of a triangle that uses it
+typedef struct
+{
+	GLint triangle;
+	GLint corner;
+} SimplifyRef;
 
-/*
-* Function that's used to draw fog, which simulates the look of being under
-* water. It draws a blue fog and draws it exponentially. The fog is toggled on
-* and off with the 'b' key.
-*/
-void drawFog()
+typedef struct
 {
-	if (isDrawingFog)
-	{
-		glEnable(GL_FOG);
-	}
-	else
+	SimplifyVertex* vertices;
+	SimplifyTriangle* triangles;
+	SimplifyRef* refs;
+	GLint vertexCount;
+	GLint triangleCount;
+	GLint refCount;
+	GLint refCapacity;
+} SimplifyMesh;
+
+void addQuadric(Quadric* result, Quadric* a, Quadric* b)
+{
+	for (GLint i = 0; i < 10; i++)
 	{
-		glDisable(GL_FOG);
+		result->q[i] = a->q[i] + b->q[i];
 	}
-	GLfloat fogColor[] = { 0.01f, 0.2f, 0.4f, 1.0f };
+}
 
-	glFogfv(GL_FOG_COLOR, fogColor);
-	glFogf(GL_FOG_MODE, GL_EXP);
-	glFogf(GL_FOG_DENSITY, 0.0025f);
+// Determinant of a 3x3 matrix whose entries are picked out of the quadric
+GLdouble quadricDeterminant(Quadric* m, GLint a11, GLint a12, GLint a13, GLint a21, GLint a22, GLint a23,
+	GLint a31, GLint a32, GLint a33)
+{
+	return m->q[a11] * m->q[a22] * m->q[a33] + m->q[a13] * m->q[a21] * m->q[a32] +
+		m->q[a12] * m->q[a23] * m->q[a31] - m->q[a13] * m->q[a22] * m->q[a31] -
+		m->q[a11] * m->q[a23] * m->q[a32] - m->q[a12] * m->q[a21] * m->q[a33];
+}
+
+// The squared distance of a point to all of the planes summed into a quadric
+GLdouble quadricVertexError(Quadric* m, GLdouble x, GLdouble y, GLdouble z)
+{
+	return m->q[0] * x * x + 2 * m->q[1] * x * y + 2 * m->q[2] * x * z + 2 * m->q[3] * x +
+		m->q[4] * y * y + 2 * m->q[5] * y * z + 2 * m->q[6] * y + m->q[7] * z * z +
+		2 * m->q[8] * z + m->q[9];
 }
 
 /*
-* Function that's used to draw a wave. It starts from -600, -600 and goes all the
-* way to 600, 600, with a fixed height; the variance coming from the heights 
-* calculated in the function. It draws the waves diagonally, has lighting set to 
-* it so it resembles water, and uses GL_TRIANGLES to draw the surface. It sets the
-* normals of the triangles to properly reflect lights hitting the surface.
+* Finds the cost of collapsing the edge between two vertices, and the position
+* the merged vertex should end up at. If the summed quadric can't be inverted,
+* or the edge is on a border, the best of the two ends and the midpoint is used.
 */
-void drawWave()
+GLdouble calculateCollapseError(SimplifyMesh* mesh, GLint id0, GLint id1, GLdouble result[3])
 {
-	glEnable(GL_LIGHTING);
+	SimplifyVertex* v0 = &mesh->vertices[id0];
+	SimplifyVertex* v1 = &mesh->vertices[id1];
 
-	// Used to draw more or less waves based on the wavelength
-	GLfloat frequency = 2.0f * PI / waveLength;
+	Quadric q;
+	addQuadric(&q, &v0->quadric, &v1->quadric);
 
-	// Set the lighting properties of the wave
-	GLfloat ambient[] = { 0.02f, 0.25f, 0.5f, 1.0f };
-	GLfloat diffuse[] = { 0.0f, 0.03f, 0.5f, 1.0f };
-	GLfloat specular[] = { 0.5f, 0.5f, 0.5f, 1.0f };
-	GLfloat shininess = 25.0f;
+	GLdouble det = quadricDeterminant(&q, 0, 1, 2, 1, 4, 5, 2, 5, 7);
+	if (det != 0 && !(v0->isBorder && v1->isBorder))
+	{
+		result[0] = -1 / det * quadricDeterminant(&q, 1, 2, 3, 4, 5, 6, 5, 7, 8);
+		result[1] = 1 / det * quadricDeterminant(&q, 0, 2, 3, 1, 5, 6, 2, 7, 8);
+		result[2] = -1 / det * quadricDeterminant(&q, 0, 1, 3, 1, 4, 6, 2, 5, 8);
+		return quadricVertexError(&q, result[0], result[1], result[2]);
+	}
 
-	setMaterial(ambient, diffuse, specular, shininess);
+	GLdouble midpoint[3];
+	for (GLint i = 0; i < 3; i++)
+	{
+		midpoint[i] = (v0->position[i] + v1->position[i]) / 2;
+	}
 
-	// Loop from -600 to 600
-	for (GLfloat x = -600; x < 600; x += subdivisionSize)
+	GLdouble* candidates[3] = { v0->position, v1->position, midpoint };
+	GLdouble bestError = 0;
+	for (GLint i = 0; i < 3; i++)
 	{
-		for (GLfloat y = -600; y < 600; y += subdivisionSize)
+		GLdouble error = quadricVertexError(&q, candidates[i][0], candidates[i][1], candidates[i][2]);
+		if (i == 0 || error < bestError)
 		{
-			// The calculation of the x points is based on the following pseudocode:
-			//heightAtVertex = sin(valueBasedOnPosition + phase + timeValue) * waveAmplitude
-
-			// Multiply the frequency by the x + z (+ subDivisionSize) to properly set the wavelength
-			GLfloat z1 = (sinf((x + y) * frequency + wavePhase + waveTimeValue) * waveAmplitude) + waveHeightOffset;
-			GLfloat z2 = (sinf((x + subdivisionSize + y) * frequency + wavePhase + waveTimeValue) * waveAmplitude) + waveHeightOffset;
-			GLfloat z3 = (sinf((x + subdivisionSize + y + subdivisionSize) * frequency + wavePhase + waveTimeValue) * waveAmplitude) + waveHeightOffset;
-			GLfloat z4 = (sinf((x + y + subdivisionSize) * frequency + wavePhase + waveTimeValue) * waveAmplitude) + waveHeightOffset;
-
-			// Set the vertices to the x, y, and z values with their respective offsets
-			Vertex3 v1 = { x, y, z1 };
-			Vertex3 v2 = { x + subdivisionSize, y, z2 };
-			Vertex3 v3 = { x + subdivisionSize, y + subdivisionSize, z3 };
-			Vertex3 v4 = { x, y + subdivisionSize, z4 };
-
-			// Find the normals between the two triangles we are drawing
-			Vertex3 normal1 = calculateNormal(v1, v2, v3);
-			normalizeVector(&normal1);
-
-			Vertex3 normal2 = calculateNormal(v1, v3, v4);
-			normalizeVector(&normal2);
-
-			// Draw the two triangles, setting the normal each triangle
-			glBegin(GL_TRIANGLES);
-			glNormal3f(normal1.position[0], normal1.position[1], normal1.position[2]);
-			glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
-			glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
-			glVertex3f(v3.position[0], v3.position[1], v3.position[2]);
-			
-			glNormal3f(normal2.position[0], normal2.position[1], normal2.position[2]);
-			glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
-			glVertex3f(v3.position[0], v3.position[1], v3.position[2]);
-			glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
-			glEnd();
+			bestError = error;
+			result[0] = candidates[i][0];
+			result[1] = candidates[i][1];
+			result[2] = candidates[i][2];
 		}
 	}
-	glDisable(GL_LIGHTING);
+
+	return bestError;
 }
 
-/**
-* This method copies the current flock to the previous flock
-*/
-void copyCurrentFlockToPrevious()
+void calculateTriangleErrors(SimplifyMesh* mesh, SimplifyTriangle* triangle)
 {
-	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	GLdouble position[3];
+	for (GLint j = 0; j < 3; j++)
 	{
-		previousFlock[i].position[0] = currentFlock[i].position[0];
-		previousFlock[i].position[1] = currentFlock[i].position[1];
-		previousFlock[i].position[2] = currentFlock[i].position[2];
-		previousFlock[i].velocity[0] = currentFlock[i].velocity[0];
-		previousFlock[i].velocity[1] = currentFlock[i].velocity[1];
-		previousFlock[i].velocity[2] = currentFlock[i].velocity[2];
-		previousFlock[i].color[0] = currentFlock[i].color[0];
-		previousFlock[i].color[1] = currentFlock[i].color[1];
-		previousFlock[i].color[2] = currentFlock[i].color[2];
+		triangle->error[j] = calculateCollapseError(mesh, triangle->v[j], triangle->v[(j + 1) % 3], position);
 	}
+
+	triangle->error[3] = fmin(triangle->error[0], fmin(triangle->error[1], triangle->error[2]));
 }
 
-/*
-* This method initializes the fish at random positions and velocities
-*/
-void initializeBoids()
+void normalizeDoubleArray(GLdouble* vector)
 {
-	
-	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	GLdouble length = sqrt(vector[0] * vector[0] + vector[1] * vector[1] + vector[2] * vector[2]);
+	if (length != 0)
 	{
-		// Generate a random angle and radius
-		GLfloat angle = generateRandomFloat(0, 2 * PI);
-		GLfloat r = generateRandomFloat(0, bottomDiscRadius - 100);
-
-		// Set the initial position of the fish 
-		currentFlock[i].position[0] = r * cos(angle);
-		currentFlock[i].position[1] = r * sin(angle);
-		currentFlock[i].position[2] = generateRandomFloat(0, wallHeight - 100);
-
-		// Set the intial velocity
-		GLfloat speedAngle = generateRandomFloat(0, 2 * PI);
-		currentFlock[i].velocity[0] = flockSpeed * cos(speedAngle);
-		currentFlock[i].velocity[1] = flockSpeed * sin(speedAngle);
-		currentFlock[i].velocity[2] = generateRandomFloat(0, flockSpeed);
-
-		// Set boid color to blue
-		currentFlock[i].color[0] = 0.0;
-		currentFlock[i].color[1] = 0.0;
-		currentFlock[i].color[2] = 1.0;
+		vector[0] /= length;
+		vector[1] /= length;
+		vector[2] /= length;
 	}
-	// Copy this to the previous flock so when we do our very first calculation we aren't calculating 
-	// from null values
-	copyCurrentFlockToPrevious();
 }
 
-// This struct is used to find the boids neighbours and nothing else
-typedef struct boidNeighbours
+/*
+* Checks if moving vertex id0 to position p would flip (or squash flat) any of
+* the triangles around it. Triangles that also use id1 will disappear with the
+* collapse, so they are marked in isRemoved instead of checked.
+*/
+GLboolean isCollapseFlipped(SimplifyMesh* mesh, GLdouble p[3], GLint id0, GLint id1, GLboolean* isRemoved)
 {
-	GLfloat distance;
-	GLint index;
-} boidNeighbours;
+	SimplifyVertex* vertex = &mesh->vertices[id0];
 
-// The three methods below are standard implementations of quicksort except we pass structs rather
-// than some integer/float directly
-void swap(boidNeighbours* a, boidNeighbours* b)
-{
-	boidNeighbours temp = *a;
-	*a = *b;
-	*b = temp;
-}
+	for (GLint k = 0; k < vertex->refCount; k++)
+	{
+		SimplifyRef* ref = &mesh->refs[vertex->refStart + k];
+		SimplifyTriangle* triangle = &mesh->triangles[ref->triangle];
+		if (triangle->isDeleted)
+		{
+			continue;
+		}
 
-GLint partition(boidNeighbours arr[], GLint low, GLint high)
-{
-	GLfloat pivot = arr[high].distance;
+		GLint other1 = triangle->v[(ref->corner + 1) % 3];
+		GLint other2 = triangle->v[(ref->corner + 2) % 3];
 
-	GLint i = low - 1;
+		if (other1 == id1 || other2 == id1)
+		{
+			isRemoved[k] = GL_TRUE;
+			continue;
+		}
 
-	for (GLint j = low; j <= high; j++)
-	{
-		if (arr[j].distance < pivot)
+		GLdouble d1[3], d2[3], normal[3];
+		for (GLint i = 0; i < 3; i++)
 		{
-			i++;
-			swap(&arr[i], &arr[j]);
+			d1[i] = mesh->vertices[other1].position[i] - p[i];
+			d2[i] = mesh->vertices[other2].position[i] - p[i];
 		}
-	}
+		normalizeDoubleArray(d1);
+		normalizeDoubleArray(d2);
 
-	swap(&arr[i + 1], &arr[high]);
-	return i + 1;
-}
+		if (fabs(d1[0] * d2[0] + d1[1] * d2[1] + d1[2] * d2[2]) > 0.999)
+		{
+			return GL_TRUE;
+		}
 
-void quicksort(boidNeighbours arr[], GLint low, GLint high)
-{
-	if (low < high)
-	{
-		GLint pi = partition(arr, low, high);
-		quicksort(arr, low, pi - 1);
-		quicksort(arr, pi + 1, high);
+		normal[0] = d1[1] * d2[2] - d1[2] * d2[1];
+		normal[1] = d1[2] * d2[0] - d1[0] * d2[2];
+		normal[2] = d1[0] * d2[1] - d1[1] * d2[0];
+		normalizeDoubleArray(normal);
+
+		isRemoved[k] = GL_FALSE;
+		if (normal[0] * triangle->normal[0] + normal[1] * triangle->normal[1] + normal[2] * triangle->normal[2] < 0.2)
+		{
+			return GL_TRUE;
+		}
 	}
+
+	return GL_FALSE;
 }
 
-/**
-* Using quicksort, this function will find any boids NUMBER_NEIGHBOURS (6) neighbours. This
-* function accepts 3 parameters, the current Boid, the index of the boid, and the list of
-* the boid's nearest neighbours. It first fills the struct array of boidNeighbours, then sorts
-* them, copying over the indexes to the array we passed into the function.
+/*
+* Points every triangle around vertexId at the kept vertex id0 after a collapse,
+* removing the ones that became degenerate. The references of the surviving
+* triangles are appended to the end of the reference list.
 */
-void findNearestNeighboursIndex(Boid boid, GLint index, GLint* nearestNeighboursIndexes)
+void updateCollapsedTriangles(SimplifyMesh* mesh, GLint id0, GLint vertexId, GLboolean* isRemoved, GLint* deletedTriangles)
 {
-	boidNeighbours neighbours[FLOCK_SIZE];
+	GLint refStart = mesh->vertices[vertexId].refStart;
+	GLint refCount = mesh->vertices[vertexId].refCount;
 
-	// Copy over every boid to the list, if the index equals the current boid, the distance is 
-	// set to some arbitrarily large value (the window width in our case), so the boid will not
-	// be the first index in the sorted list (it would be index 0 because the distance would be
-	// 0
-	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	for (GLint k = 0; k < refCount; k++)
 	{
-		if (i != index)
+		SimplifyRef ref = mesh->refs[refStart + k];
+		SimplifyTriangle* triangle = &mesh->triangles[ref.triangle];
+		if (triangle->isDeleted)
 		{
-			neighbours[i].distance = getDistance(boid.position, currentFlock[i].position);
-			neighbours[i].index = i;
+			continue;
 		}
-		else
+
+		if (isRemoved[k])
 		{
-			neighbours[i].distance = windowHeight;
-			neighbours[i].index = i;
+			triangle->isDeleted = GL_TRUE;
+			(*deletedTriangles)++;
+			continue;
 		}
-	}
 
-	quicksort(neighbours, 0, FLOCK_SIZE - 1);
+		triangle->v[ref.corner] = id0;
+		triangle->isDirty = GL_TRUE;
+		calculateTriangleErrors(mesh, triangle);
 
-	// Copy the first x indexes to the list we passed into the function
-	for (GLint i = 0; i < NUMBER_NEIGHBOURS; i++)
-	{
-		nearestNeighboursIndexes[i] = neighbours[i].index;
+		reserveArray((void**)&mesh->refs, &mesh->refCapacity, mesh->refCount + 1, sizeof(SimplifyRef));
+		mesh->refs[mesh->refCount++] = ref;
 	}
 }
 
 /*
-* Method that steers the boids away from the wall It steers them away based
-* on how far from the origin they are, or if they are close to hittin the 
-* floor or ceiling.
+* Removes deleted triangles and rebuilds the vertex to triangle references. On
+* the first pass it also finds the border vertices and sets up the quadrics and
+* the collapse errors of every edge.
 */
-void avoidCylinderWalls(GLint index)
+void updateSimplifyMesh(SimplifyMesh* mesh, GLint iteration)
 {
-	GLfloat x = previousFlock[index].position[0];
-	GLfloat y = previousFlock[index].position[1];
-	GLfloat z = previousFlock[index].position[2];
-
-	GLfloat vx = previousFlock[index].velocity[0];
-	GLfloat vy = previousFlock[index].velocity[1];
-	GLfloat vz = previousFlock[index].velocity[2];
-
-	// Distance to the center of the cylinder
-	GLfloat distanceToOrigin = sqrt(x * x + y * y);
-
-	// If we are outside of the range of the cylinder
-	if (distanceToOrigin > bottomDiscRadius - distanceThreshold)
+	if (iteration > 0)
 	{
-		// So we aren't dividing by zero
-		if (distanceToOrigin != 0)
+		GLint kept = 0;
+		for (GLint i = 0; i < mesh->triangleCount; i++)
 		{
-			vx -= (x / (distanceToOrigin * (bottomDiscRadius - distanceToOrigin))) * wallAvoidanceFactor;
-			vy -= (y / (distanceToOrigin * (bottomDiscRadius - distanceToOrigin))) * wallAvoidanceFactor;
+			if (!mesh->triangles[i].isDeleted)
+			{
+				mesh->triangles[kept++] = mesh->triangles[i];
+			}
 		}
+		mesh->triangleCount = kept;
 	}
 
-	// Top wall hit
-	if (z > wallHeight - distanceThreshold)
+	// Count the triangles around each vertex, then fill in the references
+	for (GLint i = 0; i < mesh->vertexCount; i++)
 	{
-		vz += ((1.0f / (z - wallHeight)) * wallAvoidanceFactor);
+		mesh->vertices[i].refStart = 0;
+		mesh->vertices[i].refCount = 0;
 	}
-	// Bottom wall hit
-	else if (z < distanceThreshold)
+	for (GLint i = 0; i < mesh->triangleCount; i++)
 	{
-		vz += ((1.0f / z) * wallAvoidanceFactor);
+		for (GLint j = 0; j < 3; j++)
+		{
+			mesh->vertices[mesh->triangles[i].v[j]].refCount++;
+		}
 	}
 
-	// Make sure the speed doesn't get too high
-	GLfloat speed = sqrt(vx * vx + vy * vy + vz * vz);
-	if (speed > maxSpeed) 
+	GLint refStart = 0;
+	for (GLint i = 0; i < mesh->vertexCount; i++)
 	{
-		vx = (vx / speed) * maxSpeed;
-		vy = (vy / speed) * maxSpeed;
-		vz = (vz / speed) * maxSpeed;
+		mesh->vertices[i].refStart = refStart;
+		refStart += mesh->vertices[i].refCount;
+		mesh->vertices[i].refCount = 0;
 	}
 
-	currentFlock[index].velocity[0] = vx;
-	currentFlock[index].velocity[1] = vy;
-	currentFlock[index].velocity[2] = vz;
-}
+	reserveArray((void**)&mesh->refs, &mesh->refCapacity, mesh->triangleCount * 3, sizeof(SimplifyRef));
+	mesh->refCount = mesh->triangleCount * 3;
+	for (GLint i = 0; i < mesh->triangleCount; i++)
+	{
+		for (GLint j = 0; j < 3; j++)
+		{
+			SimplifyVertex* vertex = &mesh->vertices[mesh->triangles[i].v[j]];
+			mesh->refs[vertex->refStart + vertex->refCount].triangle = i;
+			mesh->refs[vertex->refStart + vertex->refCount].corner = j;
+			vertex->refCount++;
+		}
+	}
 
-// Applies a boid factor to a certain array value (like alignment for example)
-void applyFactor(GLfloat * array, GLfloat factor)
-{
-	array[0] *= factor;
-	array[1] *= factor;
-	array[2] *= factor;
-}
+	if (iteration != 0)
+	{
+		return;
+	}
 
-/*
-* Almost identical to the method used in Assignment 1, this method does the same
-* thing as A1 except in the 3rd dimension.
-*/
-void handleBoidRules(GLint i, GLint* nearestNeighbours)
-{
-	GLfloat alignment[3] = { 0, 0, 0 };
-	GLfloat cohesion[3] = { 0, 0, 0 };
-	GLfloat separation[3] = { 0, 0, 0 };
+	// An edge that only one triangle uses is on a border. Count how many times
+	// each neighbouring vertex shows up around every vertex to find them
+	GLint* neighbourIds = NULL;
+	GLint* neighbourCounts = NULL;
+	GLint idCapacity = 0, countCapacity = 0;
 
-	// Iterate through each nearest neighbour of a given boid
-	for (GLint j = 0; j < NUMBER_NEIGHBOURS; j++)
+	for (GLint i = 0; i < mesh->vertexCount; i++)
 	{
-		GLint neighbour = nearestNeighbours[j];
+		mesh->vertices[i].isBorder = GL_FALSE;
+	}
 
-		alignment[0] += previousFlock[neighbour].velocity[0];
-		alignment[1] += previousFlock[neighbour].velocity[1];
-		alignment[2] += previousFlock[neighbour].velocity[2];
+	for (GLint i = 0; i < mesh->vertexCount; i++)
+	{
+		SimplifyVertex* vertex = &mesh->vertices[i];
+		GLint neighbourCount = 0;
 
-		alignment[0] += previousFlock[neighbour].position[0];
-		alignment[1] += previousFlock[neighbour].position[1];
-		alignment[2] += previousFlock[neighbour].position[2];
-		
-		// Find the distance of the curretn boid compared to the current neighbour
-		GLfloat distance = getDistance(currentFlock[i].position, currentFlock[neighbour].position);
-		if (distance < boidDistance)
+		for (GLint k = 0; k < vertex->refCount; k++)
 		{
-			// Get the vectors of the distance away from the current boid
-			GLfloat directionAway[3] =
+			SimplifyTriangle* triangle = &mesh->triangles[mesh->refs[vertex->refStart + k].triangle];
+			for (GLint j = 0; j < 3; j++)
 			{
-				previousFlock[i].position[0] - previousFlock[neighbour].position[0],
-				previousFlock[i].position[1] - previousFlock[neighbour].position[1],
-				previousFlock[i].position[2] - previousFlock[neighbour].position[2]
-			};
+				GLint id = triangle->v[j];
+				GLint n = 0;
+				while (n < neighbourCount && neighbourIds[n] != id)
+				{
+					n++;
+				}
 
-			normalizeVectorArray(directionAway);
-			
-			// Math for the boid separation
-			if (distance != 0)
-			{
-				directionAway[0] *= (1.0f / distance) * boidAvoidanceFactor;
-				directionAway[1] *= (1.0f / distance) * boidAvoidanceFactor;
-				directionAway[2] *= (1.0f / distance) * boidAvoidanceFactor;
+				if (n == neighbourCount)
+				{
+					reserveArray((void**)&neighbourIds, &idCapacity, neighbourCount + 1, sizeof(GLint));
+					reserveArray((void**)&neighbourCounts, &countCapacity, neighbourCount + 1, sizeof(GLint));
+					neighbourIds[n] = id;
+					neighbourCounts[n] = 0;
+					neighbourCount++;
+				}
+				neighbourCounts[n]++;
 			}
+		}
 
-			separation[0] += directionAway[0];
-			separation[1] += directionAway[1];
-			separation[2] += directionAway[2];
+		for (GLint n = 0; n < neighbourCount; n++)
+		{
+			if (neighbourCounts[n] == 1)
+			{
+				mesh->vertices[neighbourIds[n]].isBorder = GL_TRUE;
+			}
 		}
 	}
 
-	// Take the average of the boid and its neighbours
-	alignment[0] /= NUMBER_NEIGHBOURS;
-	alignment[1] /= NUMBER_NEIGHBOURS;
-	alignment[2] /= NUMBER_NEIGHBOURS;
-
-	// Remove the current boids alignment
-	alignment[0] -= previousFlock[i].velocity[0];
-	alignment[1] -= previousFlock[i].velocity[1];
-	alignment[2] -= previousFlock[i].velocity[2];
-
-	normalizeVectorArray(alignment);
-	applyFactor(alignment, boidAlignmentFactor);
-
-	// Take the average cohesion
-	cohesion[0] /= NUMBER_NEIGHBOURS;
-	cohesion[1] /= NUMBER_NEIGHBOURS;
-	cohesion[2] /= NUMBER_NEIGHBOURS;
+	free(neighbourIds);
+	free(neighbourCounts);
 
-	normalizeVectorArray(cohesion);
-	applyFactor(cohesion, boidCohesionFactor);
-
-	// Add the three values to the velocity
-	currentFlock[i].velocity[0] += alignment[0];
-	currentFlock[i].velocity[1] += alignment[1];
-	currentFlock[i].velocity[2] += alignment[2];
-
-	currentFlock[i].velocity[0] += cohesion[0];
-	currentFlock[i].velocity[1] += cohesion[1];
-	currentFlock[i].velocity[2] += cohesion[2];
+	// Sum the plane of each triangle into the quadrics of its three corners
+	for (GLint i = 0; i < mesh->vertexCount; i++)
+	{
+		memset(&mesh->vertices[i].quadric, 0, sizeof(Quadric));
+	}
 
-	currentFlock[i].velocity[0] += separation[0];
-	currentFlock[i].velocity[1] += separation[1];
-	currentFlock[i].velocity[2] += separation[2];
+	for (GLint i = 0; i < mesh->triangleCount; i++)
+	{
+		SimplifyTriangle* triangle = &mesh->triangles[i];
+		GLdouble* p0 = mesh->vertices[triangle->v[0]].position;
+		GLdouble* p1 = mesh->vertices[triangle->v[1]].position;
+		GLdouble* p2 = mesh->vertices[triangle->v[2]].position;
+
+		GLdouble e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+		GLdouble e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+		GLdouble* n = triangle->normal;
+		n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+		n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+		n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+		normalizeDoubleArray(n);
+
+		GLdouble d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+		Quadric plane = { { n[0] * n[0], n[0] * n[1], n[0] * n[2], n[0] * d,
+			n[1] * n[1], n[1] * n[2], n[1] * d, n[2] * n[2], n[2] * d, d * d } };
 
-	// Calculate the current speed anf make sure it's not too fast
-	GLfloat currentSpeed = sqrt(currentFlock[i].velocity[0] * currentFlock[i].velocity[0] +
-		currentFlock[i].velocity[1] * currentFlock[i].velocity[1] + currentFlock[i].velocity[2] * currentFlock[i].velocity[2]);
+		for (GLint j = 0; j < 3; j++)
+		{
+			Quadric* q = &mesh->vertices[triangle->v[j]].quadric;
+			addQuadric(q, q, &plane);
+		}
+	}
 
-	if (currentSpeed > flockSpeed)
+	for (GLint i = 0; i < mesh->triangleCount; i++)
 	{
-		currentFlock[i].velocity[0] = (currentFlock[i].velocity[0] / flockSpeed) * flockSpeed;
-		currentFlock[i].velocity[1] = (currentFlock[i].velocity[1] / flockSpeed) * flockSpeed;
-		currentFlock[i].velocity[2] = (currentFlock[i].velocity[2] / flockSpeed) * flockSpeed;
+		calculateTriangleErrors(mesh, &mesh->triangles[i]);
 	}
 }
 
-// A simplified version of the same method used in the first assignment
-void updateBoids()
+/*
+* Simplifies an indexed triangle mesh down to about targetTriangles triangles
+* and writes the result into a LodMesh with flat normals. The mesh is scaled
+* into a unit box first so the error threshold doesn't depend on the size of
+* the model. Each pass collapses every edge under a threshold that grows until
+* enough triangles are gone.
+*/
+void simplifyMesh(Vertex3* vertices, GLint vertexCount, GLint* indices, GLint triangleCount,
+	GLint targetTriangles, LodMesh* result)
 {
-	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	SimplifyMesh mesh = { 0 };
+	mesh.vertexCount = vertexCount;
+	mesh.triangleCount = triangleCount;
+	mesh.vertices = (SimplifyVertex*)malloc(sizeof(SimplifyVertex) * vertexCount);
+	mesh.triangles = (SimplifyTriangle*)malloc(sizeof(SimplifyTriangle) * triangleCount);
+	if (!mesh.vertices || !mesh.triangles)
 	{
-		GLint nearestNeighbours[NUMBER_NEIGHBOURS];
-		findNearestNeighboursIndex(currentFlock[i], i, nearestNeighbours);
+		printf("Error allocating memory for the simplifier\n");
+		exit(1);
+	}
 
-		avoidCylinderWalls(i);
-		handleBoidRules(i, nearestNeighbours);
+	GLdouble minimum[3], maximum[3];
+	for (GLint i = 0; i < 3; i++)
+	{
+		minimum[i] = vertices[0].position[i];
+		maximum[i] = vertices[0].position[i];
+	}
+	for (GLint v = 1; v < vertexCount; v++)
+	{
+		for (GLint i = 0; i < 3; i++)
+		{
+			minimum[i] = fmin(minimum[i], vertices[v].position[i]);
+			maximum[i] = fmax(maximum[i], vertices[v].position[i]);
+		}
+	}
 
-		currentFlock[i].position[0] += currentFlock[i].velocity[0];
-		currentFlock[i].position[1] += currentFlock[i].velocity[1];
-		currentFlock[i].position[2] += currentFlock[i].velocity[2];
+	GLdouble extent = fmax(maximum[0] - minimum[0], fmax(maximum[1] - minimum[1], maximum[2] - minimum[2]));
+	if (extent <= 0)
+	{
+		extent = 1;
 	}
-}
 
-/*
-* This method draws the boids and sets the normals for each boid. It points the 
-* boids in the direction they are moving and sets their material to blue.
-*/
-void drawBoids(Boid boid)
-{
-	glEnable(GL_LIGHTING);
+	for (GLint v = 0; v < vertexCount; v++)
+	{
+		for (GLint i = 0; i < 3; i++)
+		{
+			mesh.vertices[v].position[i] = (vertices[v].position[i] - minimum[i]) / extent;
+		}
+	}
 
-	// Normalize the velocity vectors for the angle calculations
-	GLfloat magnitude = sqrt(boid.velocity[0] * boid.velocity[0] + 
-		boid.velocity[1] * boid.velocity[1] +
-		boid.velocity[2] * boid.velocity[2]);
+	for (GLint t = 0; t < triangleCount; t++)
+	{
+		mesh.triangles[t].v[0] = indices[t * 3];
+		mesh.triangles[t].v[1] = indices[t * 3 + 1];
+		mesh.triangles[t].v[2] = indices[t * 3 + 2];
+		mesh.triangles[t].isDeleted = GL_FALSE;
+		mesh.triangles[t].isDirty = GL_FALSE;
+	}
 
-	GLfloat velocity[3] = 
+	GLboolean* isRemoved0 = NULL;
+	GLboolean* isRemoved1 = NULL;
+	GLint removed0Capacity = 0, removed1Capacity = 0;
+	GLint deletedTriangles = 0;
+
+	for (GLint iteration = 0; iteration < 100; iteration++)
 	{
-		boid.velocity[0] / magnitude,
-		boid.velocity[1] / magnitude,
-		boid.velocity[2] / magnitude 
-	};
+		if (triangleCount - deletedTriangles <= targetTriangles)
+		{
+			break;
+		}
 
-	// For rotation
-	GLfloat angleZ = atan2f(velocity[0], velocity[2]);
-	GLfloat pitch = -asinf(velocity[1]);
+		if (iteration % 5 == 0)
+		{
+			updateSimplifyMesh(&mesh, iteration);
+		}
 
-	glPushMatrix();
+		for (GLint i = 0; i < mesh.triangleCount; i++)
+		{
+			mesh.triangles[i].isDirty = GL_FALSE;
+		}
 
-	glTranslatef(boid.position[0], boid.position[1], boid.position[2]);
+		// Edges cheaper than this get collapsed in this pass
+		GLdouble threshold = 0.000000001 * pow(iteration + 3.0, 7.0);
 
-	glRotatef(angleZ * (180.0f / PI), 0.0f, 1.0f, 0.0f); 
-	glRotatef(pitch * (180.0f / PI), 1.0f, 0.0f, 0.0f);
+		for (GLint i = 0; i < mesh.triangleCount; i++)
+		{
+			SimplifyTriangle* triangle = &mesh.triangles[i];
+			if (triangle->error[3] > threshold || triangle->isDeleted || triangle->isDirty)
+			{
+				continue;
+			}
 
-	GLfloat ambient[] = { 0.1f, 0.1f, 0.5f, 1.0f };
-	GLfloat diffuse[] = { 0.0f, 0.0f, 1.0f, 1.0f };
-	GLfloat specular[] = { 0.5f, 0.5f, 0.5f, 1.0f };
-	GLfloat shininess = 50.0f;
+			for (GLint j = 0; j < 3; j++)
+			{
+				if (triangle->error[j] >= threshold)
+				{
+					continue;
+				}
 
-	setMaterial(ambient, diffuse, specular, shininess);
+				GLint id0 = triangle->v[j];
+				GLint id1 = triangle->v[(j + 1) % 3];
+				SimplifyVertex* v0 = &mesh.vertices[id0];
+				SimplifyVertex* v1 = &mesh.vertices[id1];
 
-	// The 5 vertices that make up the boid
-	Vertex3 v1 = { 0.0f, 0.0f, boidSize * 1.75f };
-	Vertex3 v2 = { -boidSize, boidSize, -boidSize };
-	Vertex3 v3 = { boidSize, boidSize, -boidSize };
-	Vertex3 v4 = { boidSize, -boidSize, -boidSize };
-	Vertex3 v5 = { -boidSize, -boidSize, -boidSize };
+				// Keep the outline of open meshes
+				if (v0->isBorder != v1->isBorder)
+				{
+					continue;
+				}
 
-	glBegin(GL_TRIANGLES);
+				GLdouble p[3];
+				calculateCollapseError(&mesh, id0, id1, p);
 
-	// First triangle
-	Vertex3 normal;
-	normal = calculateNormal(v1, v2, v3);
-	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
-	glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
-	glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
-	glVertex3f(v3.position[0], v3.position[1], v3.position[2]);
+				reserveArray((void**)&isRemoved0, &removed0Capacity, v0->refCount, sizeof(GLboolean));
+				reserveArray((void**)&isRemoved1, &removed1Capacity, v1->refCount, sizeof(GLboolean));
 
-	// Second triangle
-	normal = calculateNormal(v1, v3, v4);
-	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
-	glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
-	glVertex3f(v3.position[0], v3.position[1], v3.position[2]);
-	glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
+				if (isCollapseFlipped(&mesh, p, id0, id1, isRemoved0) || isCollapseFlipped(&mesh, p, id1, id0, isRemoved1))
+				{
+					continue;
+				}
 
-	// Third triangle
-	normal = calculateNormal(v1, v4, v5);
-	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
-	glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
-	glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
-	glVertex3f(v5.position[0], v5.position[1], v5.position[2]);
+				v0->position[0] = p[0];
+				v0->position[1] = p[1];
+				v0->position[2] = p[2];
+				addQuadric(&v0->quadric, &v0->quadric, &v1->quadric);
 
-	// Fourth triangle
-	normal = calculateNormal(v1, v5, v2);
-	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
-	glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
-	glVertex3f(v5.position[0], v5.position[1], v5.position[2]);
-	glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
+				GLint refStart = mesh.refCount;
+				updateCollapsedTriangles(&mesh, id0, id0, isRemoved0, &deletedTriangles);
+				updateCollapsedTriangles(&mesh, id0, id1, isRemoved1, &deletedTriangles);
 
-	// First base triangle
-	normal = calculateNormal(v2, v3, v4);
-	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
-	glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
-	glVertex3f(v3.position[0], v3.position[1], v3.position[2]);
-	glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
+				// The references may have moved if the list grew
+				v0 = &mesh.vertices[id0];
+				GLint refCount = mesh.refCount - refStart;
+				if (refCount <= v0->refCount)
+				{
+					if (refCount > 0)
+					{
+						memmove(&mesh.refs[v0->refStart], &mesh.refs[refStart], sizeof(SimplifyRef) * refCount);
+					}
+				}
+				else
+				{
+					v0->refStart = refStart;
+				}
+				v0->refCount = refCount;
+				break;
+			}
 
-	// Second base triangle
-	normal = calculateNormal(v4, v5, v2);
-	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
-	glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
-	glVertex3f(v5.position[0], v5.position[1], v5.position[2]);
-	glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
+			if (triangleCount - deletedTriangles <= targetTriangles)
+			{
+				break;
+			}
+		}
+	}
 
-	glEnd();
+	// Copy the surviving triangles and the vertices they use into the result
+	GLint* remap = (GLint*)malloc(sizeof(GLint) * vertexCount);
+	if (!remap)
+	{
+		printf("Error allocating memory for the simplifier\n");
+		exit(1);
+	}
+	for (GLint v = 0; v < vertexCount; v++)
+	{
+		remap[v] = -1;
+	}
 
-	glPopMatrix();
+	result->triangleCount = 0;
+	result->vertexCount = 0;
+	for (GLint t = 0; t < mesh.triangleCount; t++)
+	{
+		if (mesh.triangles[t].isDeleted)
+		{
+			continue;
+		}
 
-	glDisable(GL_LIGHTING);
-}
+		result->triangleCount++;
+		for (GLint j = 0; j < 3; j++)
+		{
+			if (remap[mesh.triangles[t].v[j]] < 0)
+			{
+				remap[mesh.triangles[t].v[j]] = result->vertexCount++;
+			}
+		}
+	}
 
-/*
-* Method that is used to handle the mouse movement across the screen to rotate 
-* the camera. It uses global prevX and prevY variables so that it can keep 
-* track of the mouse position. It sets the horizontal mouse angle (the azimuth)
-* based on the sensitivity and the difference, and also sets the vertical based 
-* on the same properties. It keeps the vertical within bounds, and makes sure
-* the horizontal doesn't get some large (or negatively large) number.
-*/
-void moveMouse(GLint x, GLint y)
-{
-	GLint xDiff = x - prevX;
-	GLint yDiff = y - prevY;
+	result->vertices = (Vertex3*)malloc(sizeof(Vertex3) * (result->vertexCount > 0 ? result->vertexCount : 1));
+	result->normals = (Vertex3*)malloc(sizeof(Vertex3) * (result->triangleCount > 0 ? result->triangleCount : 1));
+	result->indices = (GLint*)malloc(sizeof(GLint) * 3 * (result->triangleCount > 0 ? result->triangleCount : 1));
+	if (!result->vertices || !result->normals || !result->indices)
+	{
+		printf("Error allocating memory for a level of detail\n");
+		exit(1);
+	}
 
-	horizontalMouseAngle += xDiff * sensitivity;
-	verticalMouseAngle += yDiff * sensitivity;
+	for (GLint v = 0; v < vertexCount; v++)
+	{
+		if (remap[v] >= 0)
+		{
+			for (GLint i = 0; i < 3; i++)
+			{
+				result->vertices[remap[v]].position[i] = (GLfloat)(mesh.vertices[v].position[i] * extent + minimum[i]);
+			}
+		}
+	}
 
-	// Reset angles to avoid ridiculoualy large (or negatively large) horizontal values
-	if (horizontalMouseAngle > 360.0f) horizontalMouseAngle -= 360.0f;
-	else if (horizontalMouseAngle < 0.0f) horizontalMouseAngle += 360.0f;
+	GLint written = 0;
+	for (GLint t = 0; t < mesh.triangleCount; t++)
+	{
+		if (mesh.triangles[t].isDeleted)
+		{
+			continue;
+		}
 
-	// Make sure that the vertical does not go above or below the top or the bottonm of the submarine
-	if (verticalMouseAngle > 89.0f) verticalMouseAngle = 89.0f;
-	else if (verticalMouseAngle < -89.0f) verticalMouseAngle = -89.0f;
+		for (GLint j = 0; j < 3; j++)
+		{
+			result->indices[written * 3 + j] = remap[mesh.triangles[t].v[j]];
+		}
 
-	prevX = x;
-	prevY = y;
+		result->normals[written] = calculateNormal(result->vertices[result->indices[written * 3]],
+			result->vertices[result->indices[written * 3 + 1]], result->vertices[result->indices[written * 3 + 2]]);
+		normalizeVectorArray(result->normals[written].position);
+		written++;
+	}
+
+	free(remap);
+	free(isRemoved0);
+	free(isRemoved1);
+	free(mesh.vertices);
+	free(mesh.triangles);
+	free(mesh.refs);
+}
+
+#define LOD_CACHE_VERSION 2
 
-	glutPostRedisplay();
+// Adds some bytes to an FNV-1a hash
+uint32_t hashBytes(uint32_t hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
 }
 
 /*
-* This method calculates where the camera should be based on a sphere on where
-* the submarine lies, sets the new camera based on this, and makes sure the 
-* camera is looking at the position of the submarine. It first calculates the
-* horizontal and vertical radians of the mouse angles, and then it calculates
-* the new postion of the camera based on this web resource:
-* https://mathinsight.org/spherical_coordinates, retrieved from relationship
-* (1)l except I added the submarine position to properly offset the camera
+* Hashes everything in an open file and counts its bytes, then rewinds it.
+* The size alone missed edits that kept the obj the same length.
 */
-void moveCamera()
+uint32_t hashFile(FILE* file, int64_t* size)
 {
-	GLfloat radianHorizontal = horizontalMouseAngle * (PI / 180.0f);
-	GLfloat radianVertical = verticalMouseAngle * (PI / 180.0f);
-
-	GLfloat newCamX = submarineX + cameraDistance * cosf(radianHorizontal) * cosf(radianVertical);
-	GLfloat newCamY = submarineY + cameraDistance * sinf(radianHorizontal) * cosf(radianVertical);
-	GLfloat newCamZ = submarineZ + cameraDistance * sinf(radianVertical);
+	unsigned char buffer[16384];
+	uint32_t hash = 2166136261u;
+	size_t read;
 
-	//printf("Camera: ( %.2f, %.2f, %.2f ); Submarine: ( %.2f, %.2f, %.2f )\n", newCamX, newCamY, newCamZ, submarineX, submarineY, submarineZ);
-
-	gluLookAt(newCamX, newCamY, newCamZ, submarineX, submarineY, submarineZ, 0, 0, 1);
+	*size = 0;
+	rewind(file);
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		hash = hashBytes(hash, buffer, read);
+		*size += read;
+	}
+	rewind(file);
+	return hash;
 }
 
-// Function to handle standard key down presses. We handle the state varaibles
-// in this function
-void handleKeyboardDown(unsigned char key, GLint x, GLint y)
+/*
+* Reads the levels of detail that were saved next to an obj file. The cache is
+* only used if it was built from an obj file with the same size and contents
+* hash and the same triangle ratios, otherwise it returns false and the levels
+* get rebuilt. The header uses fixed width types so a cache written by a 64 bit
+* build still reads on Windows, where long is 32 bits.
+*/
+GLboolean loadLodCache(Object* object, char* cachePath, int64_t sourceSize, uint32_t sourceHash)
 {
-	keyStates[key] = GL_TRUE;
-
-	// Toggle the state variables
-	if (key == 'f' || key == 'F')
+	FILE* file = fopen(cachePath, "rb");
+	if (!file)
 	{
-		isFullscreen = !isFullscreen;
-		if (isFullscreen)
+		return GL_FALSE;
+	}
+
+	char magic[4];
+	uint32_t version, cachedHash;
+	int64_t cachedSize;
+	GLint levelCount;
+	GLfloat ratios[MAX_LOD_LEVELS - 1];
+
+	if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "SLOD", 4) != 0 ||
+		fread(&version, sizeof(uint32_t), 1, file) != 1 || version != LOD_CACHE_VERSION ||
+		fread(&cachedSize, sizeof(int64_t), 1, file) != 1 || cachedSize != sourceSize ||
+		fread(&cachedHash, sizeof(uint32_t), 1, file) != 1 || cachedHash != sourceHash ||
+		fread(ratios, sizeof(ratios), 1, file) != 1 || memcmp(ratios, lodTriangleRatios, sizeof(ratios)) != 0 ||
+		fread(&levelCount, sizeof(GLint), 1, file) != 1 || levelCount < 0 || levelCount > MAX_LOD_LEVELS - 1)
+	{
+		fclose(file);
+		return GL_FALSE;
+	}
+
+	for (GLint level = 0; level < levelCount; level++)
+	{
+		LodMesh* mesh = &object->lods[level];
+
+		if (fread(&mesh->vertexCount, sizeof(GLint), 1, file) != 1 ||
+			fread(&mesh->triangleCount, sizeof(GLint), 1, file) != 1 ||
+			mesh->vertexCount < 0 || mesh->triangleCount < 0)
 		{
-			glutFullScreen();
+			object->lodCount = level;
+			fclose(file);
+			return GL_FALSE;
 		}
-		else
+
+		mesh->vertices = (Vertex3*)malloc(sizeof(Vertex3) * (mesh->vertexCount > 0 ? mesh->vertexCount : 1));
+		mesh->normals = (Vertex3*)malloc(sizeof(Vertex3) * (mesh->triangleCount > 0 ? mesh->triangleCount : 1));
+		mesh->indices = (GLint*)malloc(sizeof(GLint) * 3 * (mesh->triangleCount > 0 ? mesh->triangleCount : 1));
+		if (!mesh->vertices || !mesh->normals || !mesh->indices)
 		{
-			glutReshapeWindow(windowWidth, windowHeight);
-			glutPositionWindow(windowPositionX, windowPositionY);
+			printf("Error allocating memory for a level of detail\n");
+			exit(1);
+		}
+
+		object->lodCount = level + 1;
+
+		if (fread(mesh->vertices, sizeof(Vertex3), mesh->vertexCount, file) != (size_t)mesh->vertexCount ||
+			fread(mesh->normals, sizeof(Vertex3), mesh->triangleCount, file) != (size_t)mesh->triangleCount ||
+			fread(mesh->indices, sizeof(GLint) * 3, mesh->triangleCount, file) != (size_t)mesh->triangleCount)
+		{
+			fclose(file);
+			return GL_FALSE;
 		}
 	}
-	if (key == 'u' || key == 'U')
-	{
-		isDrawingWireFrame = !isDrawingWireFrame;
-		glutPostRedisplay();
-	}
-	if (key == 'b' || key == 'B')
+
+	fclose(file);
+	return GL_TRUE;
+}
+
+// Writes the levels of detail of an object so the next launch can skip the simplifier
+void saveLodCache(Object* object, char* cachePath, int64_t sourceSize, uint32_t sourceHash)
+{
+	FILE* file = fopen(cachePath, "wb");
+	if (!file)
 	{
-		isDrawingFog = !isDrawingFog;
-		glutPostRedisplay();
+		printf("Could not write the level of detail cache %s\n", cachePath);
+		return;
 	}
 
-	if (key == 'q' || key == 'Q')
+	uint32_t version = LOD_CACHE_VERSION;
+	fwrite("SLOD", 1, 4, file);
+	fwrite(&version, sizeof(uint32_t), 1, file);
+	fwrite(&sourceSize, sizeof(int64_t), 1, file);
+	fwrite(&sourceHash, sizeof(uint32_t), 1, file);
+	fwrite(lodTriangleRatios, sizeof(lodTriangleRatios), 1, file);
+	fwrite(&object->lodCount, sizeof(GLint), 1, file);
+
+	for (GLint level = 0; level < object->lodCount; level++)
 	{
-		exit(1);
+		LodMesh* mesh = &object->lods[level];
+		fwrite(&mesh->vertexCount, sizeof(GLint), 1, file);
+		fwrite(&mesh->triangleCount, sizeof(GLint), 1, file);
+		fwrite(mesh->vertices, sizeof(Vertex3), mesh->vertexCount, file);
+		fwrite(mesh->normals, sizeof(Vertex3), mesh->triangleCount, file);
+		fwrite(mesh->indices, sizeof(GLint) * 3, mesh->triangleCount, file);
 	}
-}
 
-// Function to handle the release of standard keys
-void handleKeyboardUp(unsigned char key, GLint x, GLint y)
-{
-	keyStates[key] = GL_FALSE;
+	fclose(file);
 }
 
-// Function to handle special key down presses
-void handleSpecialKeyboardDown(unsigned char key, GLint x, GLint y)
+void freeLodMeshes(Object* object)
 {
-	specialKeyStates[key] = GL_TRUE;
+	for (GLint level = 0; level < object->lodCount; level++)
+	{
+		freeObjectPiece(object, object->lods[level].vertices);
+		freeObjectPiece(object, object->lods[level].normals);
+		freeObjectPiece(object, object->lods[level].indices);
+		freeObjectPiece(object, object->lods[level].edges);
+		freeObjectPiece(object, object->lods[level].edgeNormals);
+	}
+	object->lodCount = 0;
 }
 
-// Function to handle the release of special keys
-void handleSpecialKeyboardUp(unsigned char key, GLint x, GLint y)
+/*
+* Builds the levels of detail for an object that was just read from an obj file.
+* It either loads the levels from "<path>.lod" or simplifies the mesh and saves
+* them there. Each level is simplified from the one before it.
+*/
+void buildObjectLods(Object* object, FILE* file, char* path)
 {
-	specialKeyStates[key] = GL_FALSE;
-}
+	object->lodCount = 0;
 
-// Function that's used to move the submarine if any of the keys are pressed
-void handleMovement()
-{
-	// Handle lateral movement
-	if (keyStates['w'] || keyStates['W'])
-	{
-		submarineY += submarineSpeed;
-	}
-	if (keyStates['a'] || keyStates['A'])
-	{
-		submarineX -= submarineSpeed;
-	}
-	if (keyStates['s'] || keyStates['S'])
+	int64_t sourceSize;
+	uint32_t sourceHash = hashFile(file, &sourceSize);
+
+	char cachePath[256];
+	snprintf(cachePath, sizeof(cachePath), "%s.lod", path);
+
+	if (loadLodCache(object, cachePath, sourceSize, sourceHash))
 	{
-		submarineY -= submarineSpeed;
+		return;
 	}
-	if (keyStates['d'] || keyStates['D'])
+	freeLodMeshes(object);
+
+	GLint triangleCount = object->triangleCount;
+	if (triangleCount == 0)
 	{
-		submarineX += submarineSpeed;
+		return;
 	}
 
-	// Handle vertical movement
-	if (specialKeyStates[GLUT_KEY_UP])
+	Vertex3* levelVertices = object->values.vertices;
+	GLint levelVertexCount = object->values.vertexCount;
+	GLint* levelIndices = object->triangles;
+	GLint levelTriangles = triangleCount;
+
+	for (GLint level = 0; level < MAX_LOD_LEVELS - 1; level++)
 	{
-		submarineZ += submarineSpeed;
+		GLint target = (GLint)(triangleCount * lodTriangleRatios[level]);
+		if (target < 4 || target >= levelTriangles)
+		{
+			break;
+		}
+
+		LodMesh* mesh = &object->lods[level];
+		simplifyMesh(levelVertices, levelVertexCount, levelIndices, levelTriangles, target, mesh);
+		object->lodCount++;
+
+		printf("Level of detail %d for %s: %d triangles\n", level + 1, path, mesh->triangleCount);
+
+		levelVertices = mesh->vertices;
+		levelVertexCount = mesh->vertexCount;
+		levelIndices = mesh->indices;
+		levelTriangles = mesh->triangleCount;
 	}
-	if (specialKeyStates[GLUT_KEY_DOWN])
+
+	saveLodCache(object, cachePath, sourceSize, sourceHash);
+}
+
+// Draws one simplified level of an object with a flat normal per triangle
+void renderLodMesh(LodMesh* mesh)
+{
+	glBegin(GL_TRIANGLES);
+	for (GLint t = 0; t < mesh->triangleCount; t++)
 	{
-		submarineZ -= submarineSpeed;
+		glNormal3fv(mesh->normals[t].position);
+		for (GLint k = 0; k < 3; k++)
+		{
+			glVertex3fv(mesh->vertices[mesh->indices[t * 3 + k]].position);
+		}
 	}
+	glEnd();
 }
 
-// Idle function to handle idle changes
-void idleScene(void)
+// A quantized vertex along with the corner it came from, for finding duplicates
+typedef struct
 {
-	handleMovement();
-
-	updateBoids();
-	copyCurrentFlockToPrevious();
-
-	waveTimeValue += waveVelocity;
-	if (waveTimeValue > 100000) waveTimeValue = 0;
+	QuantizedVertex vertex;
+	GLint corner;
+} QuantizedCorner;
 
-	glutPostRedisplay();
+GLint compareQuantizedCorners(const void* a, const void* b)
+{
+	return memcmp(&((QuantizedCorner*)a)->vertex, &((QuantizedCorner*)b)->vertex, sizeof(QuantizedVertex));
 }
 
-// Display function that sets what the camera is looking at, draws the vectors,
-// the scene, etc.
-void display(void)
+/*
+* Builds a quantized mesh from a list of triangle corners, three per triangle.
+* Positions are mapped onto the bounding box of the corners as 16 bit ints.
+* Since the box gets stretched back out by a scale in the modelview matrix, GL
+* divides the normals by that scale, so each normal is multiplied by it first
+* and GL_NORMALIZE fixes the length.
+*
+* A smooth mesh merges corners that quantize to the same vertex. A flat mesh
+* would need a vertex per corner that way, so instead it is drawn with flat
+* shading, where only the last vertex of a triangle gives the normal. Each
+* position gets one vertex, the triangles are turned so their last corner is a
+* vertex that has their normal or no normal yet, and a new vertex is only
+* added when none of the three corners is free.
+*/
+void buildQuantizedMesh(QuantizedMesh* mesh, Vertex3* positions, Vertex3* normals, GLint cornerCount, GLboolean isFlat)
 {
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	glLoadIdentity();
-
-	glPolygonMode(GL_FRONT_AND_BACK, isDrawingWireFrame ? GL_LINE : GL_FILL);
+	GLfloat minimum[3] = { 1e30f, 1e30f, 1e30f };
+	GLfloat maximum[3] = { -1e30f, -1e30f, -1e30f };
+	for (GLint i = 0; i < cornerCount; i++)
+	{
+		for (GLint a = 0; a < 3; a++)
+		{
+			if (positions[i].position[a] < minimum[a]) minimum[a] = positions[i].position[a];
+			if (positions[i].position[a] > maximum[a]) maximum[a] = positions[i].position[a];
+		}
+	}
 
-	moveCamera();
+	GLfloat halfSize[3];
+	for (GLint a = 0; a < 3; a++)
+	{
+		mesh->center[a] = cornerCount > 0 ? (minimum[a] + maximum[a]) * 0.5f : 0;
+		halfSize[a] = cornerCount > 0 ? (maximum[a] - minimum[a]) * 0.5f : 0;
+		if (halfSize[a] < 0.000001f) halfSize[a] = 0.000001f;
+		mesh->scale[a] = halfSize[a] / 32767.0f;
+	}
 
-	// Make sure the light comes from the top
-	GLfloat lightPosition[] = { 0.0f, 0.0f, 1.0f, 0.0f };
-	glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+	QuantizedCorner* corners = (QuantizedCorner*)malloc(sizeof(QuantizedCorner) * (cornerCount > 0 ? cornerCount : 1));
+	QuantizedVertex* quantized = (QuantizedVertex*)malloc(sizeof(QuantizedVertex) * (cornerCount > 0 ? cornerCount : 1));
+	GLint* vertexIds = (GLint*)malloc(sizeof(GLint) * (cornerCount > 0 ? cornerCount : 1));
+	if (!corners || !quantized || !vertexIds)
+	{
+		printf("Error allocating memory for quantizing a mesh\n");
+		exit(1);
+	}
 
-	drawFog();
+	for (GLint i = 0; i < cornerCount; i++)
+	{
+		QuantizedVertex* vertex = &quantized[i];
+		memset(vertex, 0, sizeof(QuantizedVertex));
 
-	drawSubmarine();
+		GLfloat normal[3];
+		GLfloat length = 0;
+		for (GLint a = 0; a < 3; a++)
+		{
+			GLfloat value = (positions[i].position[a] - mesh->center[a]) / mesh->scale[a];
+			value = value > 32767.0f ? 32767.0f : value < -32767.0f ? -32767.0f : value;
+			vertex->position[a] = (GLshort)lroundf(value);
 
-	drawBottomDisc();
-	drawCylinderWall();
+			normal[a] = normals[i].position[a] * halfSize[a];
+			length += normal[a] * normal[a];
+		}
 
-	drawCoral();
+		length = length > 0 ? sqrtf(length) : 1;
+		for (GLint a = 0; a < 3; a++)
+		{
+			vertex->normal[a] = (GLbyte)lroundf(normal[a] / length * 127.0f);
+		}
 
-	drawWave();
+		// A flat mesh only merges by position, the normals get sorted out below
+		corners[i].vertex = *vertex;
+		if (isFlat)
+		{
+			memset(corners[i].vertex.normal, 0, sizeof(vertex->normal));
+		}
+		corners[i].corner = i;
+	}
 
-	for (GLint i = 0; i < FLOCK_SIZE; i++)
+	// Give every corner the id of the first one like it
+	qsort(corners, cornerCount, sizeof(QuantizedCorner), compareQuantizedCorners);
+	GLint uniqueCount = 0;
+	for (GLint i = 0; i < cornerCount; i++)
 	{
-		drawBoids(currentFlock[i]);
+		if (i > 0 && compareQuantizedCorners(&corners[i - 1], &corners[i]) != 0)
+		{
+			uniqueCount++;
+		}
+		vertexIds[corners[i].corner] = uniqueCount;
 	}
+	uniqueCount = cornerCount > 0 ? uniqueCount + 1 : 0;
 
-	drawUnitVectors();
+	// The edges come from the corners merged by position, before a flat mesh
+	// splits them up again by normal, so no edge is drawn twice
+	GLuint* edges = buildEdgeList(vertexIds, cornerCount / 3, &mesh->edgeCount);
 
-	glutSwapBuffers();
-}
+	// A flat mesh can need a vertex more for every triangle, at most
+	GLint capacity = isFlat ? uniqueCount + cornerCount / 3 : uniqueCount;
+	mesh->vertices = (QuantizedVertex*)malloc(sizeof(QuantizedVertex) * (capacity > 0 ? capacity : 1));
+	GLboolean* isClaimed = (GLboolean*)calloc(uniqueCount > 0 ? uniqueCount : 1, sizeof(GLboolean));
+	if (!mesh->vertices || !isClaimed)
+	{
+		printf("Error allocating memory for a quantized mesh\n");
+		exit(1);
+	}
+	for (GLint i = 0; i < cornerCount; i++)
+	{
+		mesh->vertices[vertexIds[corners[i].corner]] = corners[i].vertex;
+	}
 
-/*
-* Function that handles window reshaping by calling gluPerspective when the 
-* window is resized.
-*/
-void windowReshape(GLint width, GLint height)
-{
-	glViewport(0, 0, width, height);
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(45.0f, (float)width / (float)height, 1.0f, 2000.0f);
-	glMatrixMode(GL_MODELVIEW);
-}
+	mesh->vertexCount = uniqueCount;
+	mesh->indexCount = cornerCount;
+	if (isFlat)
+	{
+		for (GLint t = 0; t < cornerCount / 3; t++)
+		{
+			GLint* ids = &vertexIds[t * 3];
+			GLbyte* normal = quantized[t * 3].normal;
 
-void initializeGL(void)
-{
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_LIGHTING);
-	glEnable(GL_LIGHT0);
-	glEnable(GL_NORMALIZE);
-	glClearColor(0, 0, 0, 1.0);
+			GLint last = -1;
+			for (GLint k = 0; k < 3 && last < 0; k++)
+			{
+				QuantizedVertex* vertex = &mesh->vertices[ids[k]];
+				if (!isClaimed[ids[k]] || memcmp(vertex->normal, normal, sizeof(vertex->normal)) == 0)
+				{
+					memcpy(vertex->normal, normal, sizeof(vertex->normal));
+					isClaimed[ids[k]] = GL_TRUE;
+					last = k;
+				}
+			}
+			if (last < 0)
+			{
+				mesh->vertices[mesh->vertexCount] = quantized[t * 3 + 2];
+				ids[2] = mesh->vertexCount++;
+				last = 2;
+			}
 
-	// Global ambient light
-	GLfloat globalAmbient[] = { 0.25f, 0.25f, 0.25f, 1.0f };
-	glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
+			// Turning the triangle keeps its winding
+			GLint turned[3] = { ids[(last + 1) % 3], ids[(last + 2) % 3], ids[last] };
+			memcpy(ids, turned, sizeof(turned));
+		}
+	}
+	free(isClaimed);
+	mesh->vertices = (QuantizedVertex*)realloc(mesh->vertices, sizeof(QuantizedVertex) * (mesh->vertexCount > 0 ? mesh->vertexCount : 1));
+
+	mesh->isFlat = isFlat;
+	mesh->indexType = mesh->vertexCount <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+	size_t indexSize = mesh->indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+	mesh->indices = malloc(indexSize * (cornerCount > 0 ? cornerCount : 1));
+	if (!mesh->indices)
+	{
+		printf("Error allocating memory for a quantized mesh\n");
+		exit(1);
+	}
 
-	// Set up the sunlight
-	GLfloat lightPosition[] = { 0.0f, 0.0f, 1.0f, 0.0f };
-	GLfloat lightDiffuse[] = { 1.0f, 1.0f, 0.8f, 1.0f };  
-	GLfloat lightSpecular[] = { 1.0f, 1.0f, 0.8f, 1.0f }; 
+	for (GLint i = 0; i < cornerCount; i++)
+	{
+		if (mesh->indexType == GL_UNSIGNED_SHORT)
+		{
+			((GLushort*)mesh->indices)[i] = (GLushort)vertexIds[i];
+		}
+		else
+		{
+			((GLuint*)mesh->indices)[i] = (GLuint)vertexIds[i];
+		}
+	}
 
-	glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
-	glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
-	glLightfv(GL_LIGHT0, GL_SPECULAR, lightSpecular);
+	if (mesh->indexType == GL_UNSIGNED_SHORT)
+	{
+		mesh->edges = malloc(sizeof(GLushort) * 2 * (mesh->edgeCount > 0 ? mesh->edgeCount : 1));
+		if (!mesh->edges)
+		{
+			printf("Error allocating memory for a quantized mesh\n");
+			exit(1);
+		}
+		for (GLint i = 0; i < mesh->edgeCount * 2; i++)
+		{
+			((GLushort*)mesh->edges)[i] = (GLushort)edges[i];
+		}
+		free(edges);
+	}
+	else
+	{
+		mesh->edges = edges;
+	}
 
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(45, (float)windowWidth / (float)windowHeight, 1.0f, 2000.0f);
-	glMatrixMode(GL_MODELVIEW);
+	free(corners);
+	free(quantized);
+	free(vertexIds);
 }
 
-// Helper method to clean up the main method and leave the initialization of 
-// the submarine in its own method
-void initSub()
+// Adds a piece to the size of an arena being worked out, or once the arena is
+// there moves the piece into it. Pieces that weren't in the old arena were
+// malloc'd on their own, so they get freed
+void packArenaPiece(Arena* arena, Arena* oldArena, size_t* size, void** pointer, size_t pieceSize)
 {
-	allocateObject(&submarine);
-
-	FILE* file = fopen("sub_norm_flat.obj", "r");
-	if (!file)
+	if (!*pointer)
 	{
-		printf("No file found\n");
-		return 1;
+		return;
 	}
 
-	allocateAndPopulateHelper(file, &submarine);
-	fclose(file);
+	if (!arena)
+	{
+		*size += getArenaSize(pieceSize);
+		return;
+	}
 
-	printf("Success allocating for submarine\n");
+	void* moved = arenaAllocate(arena, pieceSize);
+	memcpy(moved, *pointer, pieceSize);
+	if (!isInArena(oldArena, *pointer))
+	{
+		free(*pointer);
+	}
+	*pointer = moved;
 }
 
-void initCoral()
+// Goes over every piece an object has, either adding up their sizes or moving them into arena
+void packObjectPieces(Object* object, Arena* arena, Arena* oldArena, size_t* size)
 {
-	char* coralFilePaths[14] = { "coral/coral_1.obj", "coral/coral_2.obj", "coral/coral_3.obj" ,
-	"coral/coral_4.obj", "coral/coral_5.obj", "coral/coral_6.obj", "coral/coral_7.obj", 
-	"coral/coral_8.obj", "coral/coral_9.obj", "coral/coral_10.obj", "coral/coral_11.obj", 
-	"coral/coral_12.obj", "coral/coral_13.obj", "coral/coral_14.obj" };
-	for (GLint i = 0; i < 14; i++)
+	packArenaPiece(arena, oldArena, size, (void**)&object->groups, sizeof(Group) * object->values.groupcount);
+	for (GLint i = 0; i < object->values.groupcount; i++)
 	{
-		allocateObject(&coral[i]);
-
-		FILE* file = fopen(coralFilePaths[i], "r");
-		if (!file)
-		{
-			printf("No coral file found for index: %d\n", i);
-			return 1;
-		}
-
-		allocateAndPopulateHelper(file, &coral[i]);
-		fclose(file);
-		
-		printf("Success allocating for coral at %d\n", i);
+		packArenaPiece(arena, oldArena, size, (void**)&object->groups[i].faces, sizeof(Face) * object->groups[i].faceCount);
+	}
+	packArenaPiece(arena, oldArena, size, (void**)&object->values.vertices, sizeof(Vertex3) * object->values.vertexCount);
+	packArenaPiece(arena, oldArena, size, (void**)&object->values.normals, sizeof(Vertex3) * object->values.normalCount);
+	packArenaPiece(arena, oldArena, size, (void**)&object->triangles, sizeof(GLint) * 3 * object->triangleCount);
+	packArenaPiece(arena, oldArena, size, (void**)&object->edges, sizeof(GLuint) * 2 * object->edgeCount);
+	packArenaPiece(arena, oldArena, size, (void**)&object->edgeNormals, sizeof(Vertex3) * object->values.vertexCount);
 
-		// Set the coral positions to some random position
-		GLint x = (int)generateRandomFloat(-400, 400);
-		GLint y = (int)generateRandomFloat(-400, 400);
+	for (GLint level = 0; level < object->lodCount; level++)
+	{
+		LodMesh* mesh = &object->lods[level];
+		packArenaPiece(arena, oldArena, size, (void**)&mesh->vertices, sizeof(Vertex3) * mesh->vertexCount);
+		packArenaPiece(arena, oldArena, size, (void**)&mesh->normals, sizeof(Vertex3) * mesh->triangleCount);
+		packArenaPiece(arena, oldArena, size, (void**)&mesh->indices, sizeof(GLint) * 3 * mesh->triangleCount);
+		packArenaPiece(arena, oldArena, size, (void**)&mesh->edges, sizeof(GLuint) * 2 * mesh->edgeCount);
+		packArenaPiece(arena, oldArena, size, (void**)&mesh->edgeNormals, sizeof(Vertex3) * mesh->vertexCount);
+	}
 
-		coralPositions[i].position[0] = x;
-		coralPositions[i].position[1] = y;
-		coralPositions[i].position[2] = 0;
+	for (GLint level = 0; level <= object->lodCount && object->isQuantized; level++)
+	{
+		QuantizedMesh* mesh = &object->quantized[level];
+		size_t indexSize = mesh->indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+		packArenaPiece(arena, oldArena, size, (void**)&mesh->vertices, sizeof(QuantizedVertex) * mesh->vertexCount);
+		packArenaPiece(arena, oldArena, size, &mesh->indices, indexSize * mesh->indexCount);
+		packArenaPiece(arena, oldArena, size, &mesh->edges, indexSize * 2 * mesh->edgeCount);
 	}
+
+	packArenaPiece(arena, oldArena, size, (void**)&object->triangleBounds, sizeof(Bounds) * object->triangleCount);
+	packArenaPiece(arena, oldArena, size, (void**)&object->triangleBvh.nodes, sizeof(BvhNode) * object->triangleBvh.nodeCount);
+	packArenaPiece(arena, oldArena, size, (void**)&object->triangleBvh.primitives, sizeof(GLint) * object->triangleBvh.primitiveCount);
 }
 
-// Method to initialize data and textures
-void init()
+/*
+* Moves everything an object has into one new arena sized exactly for it, the
+* obj data along with the edges, levels of detail, quantized meshes and
+* triangle hierarchy. It's done once the object is loaded and again after
+* quantizing, so each object ends up as a single block.
+*/
+void packObjectArena(Object* object)
 {
-	initSub();
-	initCoral();
-	initializeBoids();
+	Arena oldArena = object->arena;
+	size_t size = 0;
+	packObjectPieces(object, NULL, &oldArena, &size);
 
-	sandTexture = readPPM("spongebob-sand.ppm");
-	printf("Initialized sand texture with ID: %u\n", sandTexture);
+	initArena(&object->arena, size);
+	packObjectPieces(object, &object->arena, &oldArena, NULL);
+	freeArena(&oldArena);
 }
 
-// Method to free the memory of all of the objects we allocated memory for
-void freeObjects()
+/*
+* Builds the quantized format for every level of an object. The floats of the
+* simplified levels and the faces and normals of the full mesh are only used
+* for drawing, so they are freed afterwards, the full mesh by moving what is
+* left to a smaller arena. The vertices and triangles of the
+* full mesh stay since collision and the obstacle field use them.
+*/
+void quantizeObjectMeshes(Object* object)
 {
-	free(submarine.groups->faceCount);
-	free(submarine.groups->faces);
-	free(submarine.values.vertices);
-	free(submarine.values.normals);
-}
+	if (object->isQuantized)
+	{
+		return;
+	}
 
-void printDump()
-{
-	printf("\n\n");
-	printf("Scene Controls\n");
-	printf("-----------------\n");
-	printf("Up Arrow   : Raise Submarine\n");
-	printf("Down Arrow : Lower Submarine\n");
-	printf("w,a,s,d    : Lateral Movement of Submarine\n");
+	GLint cornerCount = object->triangleCount * 3;
+	for (GLint level = 1; level <= object->lodCount; level++)
+	{
+		if (object->lods[level - 1].triangleCount * 3 > cornerCount)
+		{
+			cornerCount = object->lods[level - 1].triangleCount * 3;
+		}
+	}
+
+	Vertex3* positions = (Vertex3*)malloc(sizeof(Vertex3) * (cornerCount > 0 ? cornerCount : 1));
+	Vertex3* normals = (Vertex3*)malloc(sizeof(Vertex3) * (cornerCount > 0 ? cornerCount : 1));
+	if (!positions || !normals)
+	{
+		printf("Error allocating memory for quantizing a mesh\n");
+		exit(1);
+	}
+
+	// The full mesh, with the normals from the obj file. It is flat if every
+	// face uses one normal
+	GLint corner = 0;
+	GLboolean isFlat = GL_TRUE;
+	for (GLint i = 0; i < object->values.groupcount; i++)
+	{
+		for (GLint j = 0; j < object->groups[i].faceCount; j++)
+		{
+			Face* face = &object->groups[i].faces[j];
+			for (GLint k = 0; k < 3; k++, corner++)
+			{
+				positions[corner] = object->values.vertices[face->v[k]];
+				normals[corner] = object->values.normals[face->vn[k]];
+				if (memcmp(&normals[corner], &normals[corner - k], sizeof(Vertex3)) != 0)
+				{
+					isFlat = GL_FALSE;
+				}
+			}
+		}
+	}
+	buildQuantizedMesh(&object->quantized[0], positions, normals, corner, isFlat);
+
+	// The faces and normals are left out when the arena is packed again below
+	object->groups = NULL;
+	object->values.groupcount = 0;
+	object->values.normals = NULL;
+	object->values.normalCount = 0;
+	freeObjectPiece(object, object->edges);
+	freeObjectPiece(object, object->edgeNormals);
+	object->edges = NULL;
+	object->edgeNormals = NULL;
+
+	// The simplified levels, with one flat normal per triangle
+	for (GLint level = 1; level <= object->lodCount; level++)
+	{
+		LodMesh* mesh = &object->lods[level - 1];
+		for (GLint t = 0; t < mesh->triangleCount; t++)
+		{
+			for (GLint k = 0; k < 3; k++)
+			{
+				positions[t * 3 + k] = mesh->vertices[mesh->indices[t * 3 + k]];
+				normals[t * 3 + k] = mesh->normals[t];
+			}
+		}
+		buildQuantizedMesh(&object->quantized[level], positions, normals, mesh->triangleCount * 3, GL_TRUE);
+
+		freeObjectPiece(object, mesh->vertices);
+		freeObjectPiece(object, mesh->normals);
+		freeObjectPiece(object, mesh->indices);
+		freeObjectPiece(object, mesh->edges);
+		freeObjectPiece(object, mesh->edgeNormals);
+		mesh->vertices = NULL;
+		mesh->normals = NULL;
+		mesh->indices = NULL;
+		mesh->edges = NULL;
+		mesh->edgeNormals = NULL;
+	}
+
+	free(positions);
+	free(normals);
+	object->isQuantized = GL_TRUE;
+	packObjectArena(object);
+}
+
+void freeQuantizedMeshes(Object* object)
+{
+	if (!object->isQuantized)
+	{
+		return;
+	}
+
+	for (GLint level = 0; level <= object->lodCount; level++)
+	{
+		freeObjectPiece(object, object->quantized[level].vertices);
+		freeObjectPiece(object, object->quantized[level].indices);
+		freeObjectPiece(object, object->quantized[level].edges);
+	}
+	object->isQuantized = GL_FALSE;
+}
+
+// Draws a quantized mesh, or its edges, scaling it back out to its bounding box first
+void renderQuantizedMesh(QuantizedMesh* mesh)
+{
+	glTranslatef(mesh->center[0], mesh->center[1], mesh->center[2]);
+	glScalef(mesh->scale[0], mesh->scale[1], mesh->scale[2]);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glVertexPointer(3, GL_SHORT, sizeof(QuantizedVertex), mesh->vertices[0].position);
+	glNormalPointer(GL_BYTE, sizeof(QuantizedVertex), mesh->vertices[0].normal);
+
+	if (isDrawingEdges)
+	{
+		glDrawElements(GL_LINES, mesh->edgeCount * 2, mesh->indexType, mesh->edges);
+		renderStats.lines += mesh->edgeCount;
+	}
+	else
+	{
+		if (mesh->isFlat)
+		{
+			glShadeModel(GL_FLAT);
+		}
+		glDrawElements(GL_TRIANGLES, mesh->indexCount, mesh->indexType, mesh->indices);
+		glShadeModel(GL_SMOOTH);
+		renderStats.triangles += mesh->indexCount / 3;
+	}
+
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+/*
+* Adds up the memory an object has, split by what it is for. The mesh is
+* everything read from the obj file, and collision is the triangle
+* hierarchy. An object is drawn from its mesh and levels of detail, or from
+* the quantized format once it has that.
+*/
+void getObjectMemory(Object* object, AssetMemory* memory)
+{
+	memory->meshBytes += sizeof(Group) * object->values.groupcount + sizeof(GLint) * 3 * object->triangleCount +
+		sizeof(Vertex3) * (object->values.vertexCount + object->values.normalCount);
+	for (GLint i = 0; i < object->values.groupcount; i++)
+	{
+		memory->meshBytes += sizeof(Face) * object->groups[i].faceCount;
+	}
+	if (object->edges)
+	{
+		memory->meshBytes += sizeof(GLuint) * 2 * object->edgeCount + sizeof(Vertex3) * object->values.vertexCount;
+	}
+
+	for (GLint level = 0; level < object->lodCount; level++)
+	{
+		LodMesh* mesh = &object->lods[level];
+		if (mesh->vertices)
+		{
+			memory->lodBytes += sizeof(Vertex3) * (mesh->vertexCount + mesh->triangleCount) +
+				sizeof(GLint) * 3 * mesh->triangleCount;
+		}
+		if (mesh->edges)
+		{
+			memory->lodBytes += sizeof(GLuint) * 2 * mesh->edgeCount + sizeof(Vertex3) * mesh->vertexCount;
+		}
+	}
+
+	for (GLint level = 0; level <= object->lodCount && object->isQuantized; level++)
+	{
+		QuantizedMesh* mesh = &object->quantized[level];
+		memory->quantizedBytes += sizeof(QuantizedVertex) * mesh->vertexCount +
+			(mesh->indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint)) * (mesh->indexCount + mesh->edgeCount * 2);
+	}
+
+	if (object->triangleBounds)
+	{
+		memory->collisionBytes += sizeof(Bounds) * object->triangleCount +
+			sizeof(GLint) * object->triangleBvh.primitiveCount + sizeof(BvhNode) * 2 * object->triangleBvh.primitiveCount;
+	}
+}
+
+size_t getAssetMemoryTotal(AssetMemory* memory)
+{
+	return memory->meshBytes + memory->lodBytes + memory->quantizedBytes + memory->collisionBytes;
+}
+
+// Renders an object at a level of detail, where level 0 is the full obj mesh
+void renderObjectLod(Object* object, GLint level)
+{
+	if (level > object->lodCount)
+	{
+		level = object->lodCount;
+	}
+
+	if (object->isQuantized)
+	{
+		renderQuantizedMesh(&object->quantized[level > 0 ? level : 0]);
+	}
+	else if (level <= 0 && isDrawingEdges)
+	{
+		drawEdges(object->values.vertices, object->edgeNormals, object->edges, object->edgeCount);
+	}
+	else if (level <= 0)
+	{
+		renderObject(object);
+		renderStats.triangles += object->triangleCount;
+	}
+	else if (isDrawingEdges)
+	{
+		LodMesh* mesh = &object->lods[level - 1];
+		drawEdges(mesh->vertices, mesh->edgeNormals, mesh->edges, mesh->edgeCount);
+	}
+	else
+	{
+		renderLodMesh(&object->lods[level - 1]);
+		renderStats.triangles += object->lods[level - 1].triangleCount;
+	}
+}
+
+// Prints how much mesh data the submarine and coral have in memory
+void printMeshMemory()
+{
+	AssetMemory memory = { 0 };
+	getObjectMemory(&submarine, &memory);
+	for (GLint i = 0; i < 14; i++)
+	{
+		getObjectMemory(&coral[i], &memory);
+	}
+
+	printf("Mesh memory: %.1f KB resident, drawing from %.1f KB %s, for %d coral instances\n",
+		getAssetMemoryTotal(&memory) / 1024.0,
+		(submarine.isQuantized ? memory.quantizedBytes : memory.meshBytes + memory.lodBytes) / 1024.0,
+		submarine.isQuantized ? "quantized" : "of floats", coralInstanceCount);
+}
+
+// Prints the memory of every asset on its own
+void printAssetMemory()
+{
+	for (GLint i = -1; i < 14; i++)
+	{
+		Object* object = i < 0 ? &submarine : &coral[i];
+		AssetMemory memory = { 0 };
+		getObjectMemory(object, &memory);
+		printf("%-20s %7.1f KB: mesh %.1f, levels of detail %.1f, quantized %.1f, collision %.1f\n", object->name,
+			getAssetMemoryTotal(&memory) / 1024.0, memory.meshBytes / 1024.0, memory.lodBytes / 1024.0,
+			memory.quantizedBytes / 1024.0, memory.collisionBytes / 1024.0);
+	}
+	printMeshMemory();
+}
+
+/*
+* Helper that places a point from an obj file in the world the same way that
+* drawSubmarine and drawCoral do. Rotating 90 degrees about x and then -90
+* degrees about y turns (x, y, z) into (-z, -x, y), which then gets scaled,
+* turned by the heading in radians about z and moved to the translation.
+*/
+void placeModelPoint(GLfloat point[3], GLfloat scale, GLfloat heading, GLfloat translation[3], GLfloat result[3])
+{
+	GLfloat x = -point[2] * scale;
+	GLfloat y = -point[0] * scale;
+	GLfloat c = cosf(heading);
+	GLfloat s = sinf(heading);
+
+	result[0] = translation[0] + x * c - y * s;
+	result[1] = translation[1] + x * s + y * c;
+	result[2] = translation[2] + point[1] * scale;
+}
+
+/*
+* Picks the level of detail of an object from how many pixels its bounding
+* sphere covers on the screen. The current level only changes once the radius
+* is past a threshold by the hysteresis amount, so an object sitting right on
+* a threshold doesn't flicker between two levels.
+*/
+GLint selectLodLevel(Object* object, GLint currentLevel, GLfloat scale, GLfloat heading, GLfloat translation[3])
+{
+	GLfloat center[3];
+	placeModelPoint(object->boundingCenter, scale, heading, translation, center);
+
+	GLfloat radius = object->boundingRadius * scale;
+	GLfloat distance = getDistance(center, cameraPosition);
+	if (distance <= radius)
+	{
+		return 0;
+	}
+
+	GLfloat pixelsPerUnit = viewportHeight / (2.0f * tanf(fieldOfView * (PI / 180.0f) / 2.0f));
+	GLfloat screenRadius = radius / distance * pixelsPerUnit;
+
+	GLint level = currentLevel;
+	if (level > object->lodCount)
+	{
+		level = object->lodCount;
+	}
+
+	while (level < object->lodCount && screenRadius < lodScreenRadius[level] * (1.0f - lodHysteresis))
+	{
+		level++;
+	}
+	while (level > 0 && screenRadius > lodScreenRadius[level - 1] * (1.0f + lodHysteresis))
+	{
+		level--;
+	}
+
+	return level;
+}
+
+/*
+* The matrix helpers below work on column major 4x4 matrices, the same layout
+* OpenGL uses. Translate, rotate and scale multiply on the right just like
+* glTranslatef, glRotatef and glScalef do.
+*/
+void matrixIdentity(GLfloat m[16])
+{
+	for (GLint i = 0; i < 16; i++)
+	{
+		m[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+	}
+}
+
+void matrixMultiply(GLfloat a[16], GLfloat b[16], GLfloat result[16])
+{
+	GLfloat product[16];
+	for (GLint column = 0; column < 4; column++)
+	{
+		for (GLint row = 0; row < 4; row++)
+		{
+			product[column * 4 + row] = a[row] * b[column * 4] + a[4 + row] * b[column * 4 + 1] +
+				a[8 + row] * b[column * 4 + 2] + a[12 + row] * b[column * 4 + 3];
+		}
+	}
+	memcpy(result, product, sizeof(product));
+}
+
+void matrixTranslate(GLfloat m[16], GLfloat x, GLfloat y, GLfloat z)
+{
+	for (GLint row = 0; row < 4; row++)
+	{
+		m[12 + row] += m[row] * x + m[4 + row] * y + m[8 + row] * z;
+	}
+}
+
+void matrixScale(GLfloat m[16], GLfloat x, GLfloat y, GLfloat z)
+{
+	for (GLint row = 0; row < 4; row++)
+	{
+		m[row] *= x;
+		m[4 + row] *= y;
+		m[8 + row] *= z;
+	}
+}
+
+void matrixRotate(GLfloat m[16], GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+{
+	GLfloat axis[3] = { x, y, z };
+	normalizeVectorArray(axis);
+	x = axis[0];
+	y = axis[1];
+	z = axis[2];
+
+	GLfloat c = cosf(angle * (PI / 180.0f));
+	GLfloat s = sinf(angle * (PI / 180.0f));
+	GLfloat t = 1.0f - c;
+
+	GLfloat rotation[16] =
+	{
+		x * x * t + c, y * x * t + z * s, x * z * t - y * s, 0,
+		x * y * t - z * s, y * y * t + c, y * z * t + x * s, 0,
+		x * z * t + y * s, y * z * t - x * s, z * z * t + c, 0,
+		0, 0, 0, 1
+	};
+
+	matrixMultiply(m, rotation, m);
+}
+
+/*
+* Adds something to the render queue instead of drawing it right away. The
+* draw function gets called from flushRenderQueue with the model matrix loaded
+* (relative to the camera), once the lighting, material and texture it asked
+* for are set. The sort key puts lighting first, then texture and then
+* material, so the most expensive changes happen the least often.
+*/
+void submitRenderItem(GLboolean isLit, GLint material, GLuint texture, GLfloat model[16],
+	void (*draw)(void* data, GLint param), void* data, GLint param)
+{
+	reserveArray((void**)&renderQueue, &renderQueueCapacity, renderQueueCount + 1, sizeof(RenderItem));
+
+	RenderItem* item = &renderQueue[renderQueueCount];
+	item->isLit = isLit;
+	item->material = isLit ? material : MATERIAL_NONE;
+	item->texture = texture;
+	item->key = ((GLuint)(isLit != GL_FALSE) << 30) |
+		((texture & 0x3FFF) << 16) | (item->material & 0xFFFF);
+	item->order = renderQueueCount;
+	item->draw = draw;
+	item->data = data;
+	item->param = param;
+
+	matrixMultiply(viewMatrix, model, item->modelview);
+
+	renderQueueCount++;
+}
+
+// Sorts by the state key, keeping the order things were submitted in otherwise
+int compareRenderItems(const void* a, const void* b)
+{
+	const RenderItem* itemA = (const RenderItem*)a;
+	const RenderItem* itemB = (const RenderItem*)b;
+
+	if (itemA->key != itemB->key)
+	{
+		return itemA->key < itemB->key ? -1 : 1;
+	}
+	return itemA->order - itemB->order;
+}
+
+/*
+* Sorts everything submitted this frame and draws it, only touching the GL state
+* when it differs from the item before. The number of changes gets counted in
+* renderStats. The state starts out unknown every frame so the first item
+* always sets all of it. In wireframe every draw function draws the edges of
+* its mesh as lines, unless the polygon mode is asked for to compare against.
+*/
+void flushRenderQueue()
+{
+	qsort(renderQueue, renderQueueCount, sizeof(RenderItem), compareRenderItems);
+
+	memset(&renderStats, 0, sizeof(RenderStats));
+	renderStats.items = renderQueueCount;
+
+	GLint currentLighting = -1;
+	GLint currentMaterial = -1;
+	GLint currentTexture = -1;
+	GLint currentProgram = -1;
+
+	isDrawingEdges = isDrawingWireFrame && isUsingEdgeLists;
+	if (isDrawingWireFrame && !isUsingEdgeLists)
+	{
+		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	}
+
+	for (GLint i = 0; i < renderQueueCount; i++)
+	{
+		RenderItem* item = &renderQueue[i];
+
+		// Everything gets the scene shader permutation for its state when there
+		// are shaders, and the items are sorted so this rarely changes
+		GLint features = (item->isLit ? SHADER_LIT : 0) | (item->texture ? SHADER_TEXTURED : 0) | (isDrawingFog ? SHADER_FOG : 0);
+		GLint program = hasScenePrograms ? (GLint)scenePrograms[features].program : 0;
+		if (program != currentProgram)
+		{
+			gl.useProgram(program);
+			currentProgram = program;
+			renderStats.programChanges++;
+		}
+
+		if (item->isLit != currentLighting)
+		{
+			if (item->isLit)
+			{
+				glEnable(GL_LIGHTING);
+			}
+			else
+			{
+				glDisable(GL_LIGHTING);
+			}
+			currentLighting = item->isLit;
+			renderStats.lightingChanges++;
+		}
+
+		if ((GLint)item->texture != currentTexture)
+		{
+			if (item->texture)
+			{
+				glEnable(GL_TEXTURE_2D);
+				glBindTexture(GL_TEXTURE_2D, item->texture);
+			}
+			else
+			{
+				glDisable(GL_TEXTURE_2D);
+			}
+			currentTexture = item->texture;
+			renderStats.textureChanges++;
+		}
+
+		// Unlit items don't care about the material, so leave it alone
+		if (item->material != MATERIAL_NONE && item->material != currentMaterial)
+		{
+			applyMaterial(&materials[item->material]);
+			currentMaterial = item->material;
+			renderStats.materialChanges++;
+		}
+
+		glLoadMatrixf(item->modelview);
+		item->draw(item->data, item->param);
+	}
+
+	if (currentProgram > 0)
+	{
+		gl.useProgram(0);
+	}
+	if (isDrawingWireFrame && !isUsingEdgeLists)
+	{
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	}
+	isDrawingEdges = GL_FALSE;
+	glLoadMatrixf(viewMatrix);
+	renderQueueCount = 0;
+}
+
+// Prints the render queue counters from the last frame, and the collision time
+// from the last tick
+void printRenderStats()
+{
+	printf("Render queue: %d items, %d triangles, %d lines, %d lighting, %d material, %d texture and %d shader changes\n",
+		renderStats.items, renderStats.triangles, renderStats.lines, renderStats.lightingChanges, renderStats.materialChanges,
+		renderStats.textureChanges, renderStats.programChanges);
+	printf("Submarine collision: %.1f us last tick\n", collisionTime * 1000000.0);
+	printf("Ocean: %d clipmap levels over %.0f units, %d rebuilt last frame\n", clipmapLevelCount, oceanSize, clipmapRebuilds);
+	printf("Frame of tick %d: %.2f ms, last tick %.2f ms%s\n", frameState->tick, lastFrameTime * 1000.0,
+		lastTickTime * 1000.0, isSimulationThreadRunning ? " on the simulation thread" : "");
+
+	// How busy the app has been since the last time this was printed
+	double now = getTimeSeconds();
+	double wallTime = now - pacingStartTime;
+	if (wallTime > 0)
+	{
+		printf("Over %.1f s: %.1f fps (cap %d, vsync %s), %.0f%% of a core used, %.0f%% of the time asleep in idle\n",
+			wallTime, framesDrawn / wallTime, targetFps, isVsyncOn ? "on" : "off",
+			(getProcessCpuSeconds() - pacingStartCpu) / wallTime * 100.0, idleSleepTime / wallTime * 100.0);
+	}
+	pacingStartTime = now;
+	pacingStartCpu = getProcessCpuSeconds();
+	idleSleepTime = 0;
+	framesDrawn = 0;
+}
+
+// Render queue callback that draws an Object at the level of detail in param
+void renderObjectItem(void* data, GLint level)
+{
+	renderObjectLod((Object*)data, level);
+}
+
+/*
+* Copies some arrays one after another into a buffer object, making the buffer
+* the first time. Arrays that are NULL are skipped without leaving a gap. It
+* does nothing when the driver has no buffer objects, and the draws then keep
+* reading the arrays from memory like before.
+*/
+void fillBuffer(GLuint* buffer, GLenum target, GLenum usage, const void** arrays, const size_t* sizes, GLint count)
+{
+	if (!gl.genBuffers)
+	{
+		return;
+	}
+	if (!*buffer)
+	{
+		gl.genBuffers(1, buffer);
+	}
+
+	size_t total = 0;
+	for (GLint i = 0; i < count; i++)
+	{
+		total += arrays[i] ? sizes[i] : 0;
+	}
+
+	gl.bindBuffer(target, *buffer);
+	gl.bufferData(target, (ptrdiff_t)total, NULL, usage);
+	size_t offset = 0;
+	for (GLint i = 0; i < count; i++)
+	{
+		if (arrays[i])
+		{
+			gl.bufferSubData(target, (ptrdiff_t)offset, (ptrdiff_t)sizes[i], arrays[i]);
+			offset += sizes[i];
+		}
+	}
+	gl.bindBuffer(target, 0);
+}
+
+void deleteBuffer(GLuint* buffer)
+{
+	if (*buffer && gl.deleteBuffers)
+	{
+		gl.deleteBuffers(1, buffer);
+	}
+	*buffer = 0;
+}
+
+// Helper to allocate the arrays of a static mesh
+void allocateStaticMesh(StaticMesh* mesh, GLint vertexCount, GLint indexCount, GLboolean hasTexCoords)
+{
+	mesh->vertexCount = vertexCount;
+	mesh->indexCount = indexCount;
+	mesh->vertices = (GLfloat*)malloc(sizeof(GLfloat) * 3 * vertexCount);
+	mesh->normals = (GLfloat*)malloc(sizeof(GLfloat) * 3 * vertexCount);
+	mesh->texCoords = hasTexCoords ? (GLfloat*)malloc(sizeof(GLfloat) * 2 * vertexCount) : NULL;
+	mesh->indices = (GLuint*)malloc(sizeof(GLuint) * indexCount);
+	mesh->edges = NULL;
+	mesh->edgeCount = 0;
+	mesh->arrayBuffer = 0;
+	mesh->elementBuffer = 0;
+	mesh->isUploaded = GL_FALSE;
+
+	if (!mesh->vertices || !mesh->normals || !mesh->indices || (hasTexCoords && !mesh->texCoords))
+	{
+		printf("Error allocating memory for a static mesh\n");
+		exit(1);
+	}
+}
+
+void freeStaticMesh(StaticMesh* mesh)
+{
+	free(mesh->vertices);
+	free(mesh->normals);
+	free(mesh->texCoords);
+	free(mesh->indices);
+	free(mesh->edges);
+	deleteBuffer(&mesh->arrayBuffer);
+	deleteBuffer(&mesh->elementBuffer);
+	memset(mesh, 0, sizeof(StaticMesh));
+}
+
+// Finds the edges of a static mesh once its triangles are filled in
+void buildStaticMeshEdges(StaticMesh* mesh)
+{
+	free(mesh->edges);
+	mesh->edges = buildEdgeList((GLint*)mesh->indices, mesh->indexCount / 3, &mesh->edgeCount);
+}
+
+// Helper that adds the two triangles of a grid cell, where the grid rows are columns + 1 wide
+void addGridQuad(StaticMesh* mesh, GLint* written, GLint row, GLint column, GLint columns)
+{
+	GLuint a = row * (columns + 1) + column;
+	GLuint b = a + 1;
+	GLuint c = a + columns + 1;
+	GLuint d = c + 1;
+
+	mesh->indices[(*written)++] = a;
+	mesh->indices[(*written)++] = b;
+	mesh->indices[(*written)++] = d;
+
+	mesh->indices[(*written)++] = a;
+	mesh->indices[(*written)++] = d;
+	mesh->indices[(*written)++] = c;
+}
+
+/*
+* Builds a flat disc facing up, the same shape gluDisk makes. Ring 0 is the
+* centre, so its first triangle in each slice is skipped. The texture is
+* stretched over the whole disc like gluQuadricTexture does.
+*/
+void buildDiscMesh(StaticMesh* mesh, GLfloat radius, GLint slices, GLint rings)
+{
+	allocateStaticMesh(mesh, (rings + 1) * (slices + 1), (rings * 2 - 1) * slices * 3, GL_TRUE);
+
+	for (GLint r = 0; r <= rings; r++)
+	{
+		GLfloat ringRadius = radius * r / rings;
+		for (GLint i = 0; i <= slices; i++)
+		{
+			GLfloat angle = 2.0f * PI * i / slices;
+			GLint v = r * (slices + 1) + i;
+
+			mesh->vertices[v * 3] = ringRadius * sinf(angle);
+			mesh->vertices[v * 3 + 1] = ringRadius * cosf(angle);
+			mesh->vertices[v * 3 + 2] = 0;
+
+			mesh->normals[v * 3] = 0;
+			mesh->normals[v * 3 + 1] = 0;
+			mesh->normals[v * 3 + 2] = 1;
+
+			mesh->texCoords[v * 2] = (mesh->vertices[v * 3] / radius + 1.0f) / 2.0f;
+			mesh->texCoords[v * 2 + 1] = (mesh->vertices[v * 3 + 1] / radius + 1.0f) / 2.0f;
+		}
+	}
+
+	GLint written = 0;
+	for (GLint r = 0; r < rings; r++)
+	{
+		for (GLint i = 0; i < slices; i++)
+		{
+			GLuint inner = r * (slices + 1) + i;
+			GLuint outer = inner + slices + 1;
+
+			mesh->indices[written++] = inner;
+			mesh->indices[written++] = outer + 1;
+			mesh->indices[written++] = outer;
+
+			if (r > 0)
+			{
+				mesh->indices[written++] = inner;
+				mesh->indices[written++] = inner + 1;
+				mesh->indices[written++] = outer + 1;
+			}
+		}
+	}
+}
+
+/*
+* Builds the side of a cylinder standing on the xy plane, the same shape
+* gluCylinder makes, with its texture coordinates wrapping around once.
+*/
+void buildCylinderMesh(StaticMesh* mesh, GLfloat radius, GLfloat height, GLint slices, GLint stacks)
+{
+	allocateStaticMesh(mesh, (stacks + 1) * (slices + 1), stacks * slices * 6, GL_TRUE);
+
+	for (GLint j = 0; j <= stacks; j++)
+	{
+		for (GLint i = 0; i <= slices; i++)
+		{
+			GLfloat angle = 2.0f * PI * i / slices;
+			GLint v = j * (slices + 1) + i;
+
+			mesh->normals[v * 3] = sinf(angle);
+			mesh->normals[v * 3 + 1] = cosf(angle);
+			mesh->normals[v * 3 + 2] = 0;
+
+			mesh->vertices[v * 3] = radius * mesh->normals[v * 3];
+			mesh->vertices[v * 3 + 1] = radius * mesh->normals[v * 3 + 1];
+			mesh->vertices[v * 3 + 2] = height * j / stacks;
+
+			mesh->texCoords[v * 2] = 1.0f - (GLfloat)i / slices;
+			mesh->texCoords[v * 2 + 1] = (GLfloat)j / stacks;
+		}
+	}
+
+	GLint written = 0;
+	for (GLint j = 0; j < stacks; j++)
+	{
+		for (GLint i = 0; i < slices; i++)
+		{
+			addGridQuad(mesh, &written, j, i, slices);
+		}
+	}
+}
+
+// Builds a sphere around the origin, the same shape gluSphere makes
+void buildSphereMesh(StaticMesh* mesh, GLfloat radius, GLint slices, GLint stacks)
+{
+	allocateStaticMesh(mesh, (stacks + 1) * (slices + 1), stacks * slices * 6, GL_FALSE);
+
+	for (GLint j = 0; j <= stacks; j++)
+	{
+		GLfloat polar = PI * j / stacks;
+		for (GLint i = 0; i <= slices; i++)
+		{
+			GLfloat angle = 2.0f * PI * i / slices;
+			GLint v = j * (slices + 1) + i;
+
+			mesh->normals[v * 3] = sinf(polar) * sinf(angle);
+			mesh->normals[v * 3 + 1] = sinf(polar) * cosf(angle);
+			mesh->normals[v * 3 + 2] = cosf(polar);
+
+			mesh->vertices[v * 3] = radius * mesh->normals[v * 3];
+			mesh->vertices[v * 3 + 1] = radius * mesh->normals[v * 3 + 1];
+			mesh->vertices[v * 3 + 2] = radius * mesh->normals[v * 3 + 2];
+		}
+	}
+
+	GLint written = 0;
+	for (GLint j = 0; j < stacks; j++)
+	{
+		for (GLint i = 0; i < slices; i++)
+		{
+			addGridQuad(mesh, &written, j, i, slices);
+		}
+	}
+}
+
+// Tessellates the floor, wall and origin marker, throwing away any old geometry
+void buildStaticGeometry()
+{
+	freeStaticMesh(&floorMesh);
+	freeStaticMesh(&wallMesh);
+	freeStaticMesh(&originMarkerMesh);
+
+	buildDiscMesh(&floorMesh, bottomDiscRadius + 1, bottomDiscSegments, bottomDiscRings);
+	buildCylinderMesh(&wallMesh, bottomDiscRadius, wallHeight, bottomDiscSegments, wallStacks);
+	buildSphereMesh(&originMarkerMesh, 1, originMarkerSegments, originMarkerSegments);
+	buildStaticMeshEdges(&floorMesh);
+	buildStaticMeshEdges(&wallMesh);
+	buildStaticMeshEdges(&originMarkerMesh);
+
+	printf("Static geometry: floor %d, wall %d and origin marker %d triangles\n",
+		floorMesh.indexCount / 3, wallMesh.indexCount / 3, originMarkerMesh.indexCount / 3);
+}
+
+/*
+* Multiplies the tessellation of the floor and wall by a factor and rebuilds
+* them, for when the camera gets close enough to see the facets.
+*/
+void scaleStaticTessellation(GLfloat factor)
+{
+	bottomDiscSegments = (GLint)(bottomDiscSegments * factor);
+	bottomDiscRings = (GLint)(bottomDiscRings * factor);
+	wallStacks = (GLint)(wallStacks * factor);
+
+	if (bottomDiscSegments < 8) bottomDiscSegments = 8;
+	if (bottomDiscSegments > 1024) bottomDiscSegments = 1024;
+	if (bottomDiscRings < 1) bottomDiscRings = 1;
+	if (bottomDiscRings > 256) bottomDiscRings = 256;
+	if (wallStacks < 1) wallStacks = 1;
+	if (wallStacks > 1024) wallStacks = 1024;
+
+	buildStaticGeometry();
+}
+
+/*
+* Copies a static mesh into buffer objects. The positions, normals and texture
+* coordinates go one after another in one buffer, and the triangles and then
+* the edges in another. The triangles never change once a mesh is built, so
+* uploading again only refills the vertices, which is what the terrain tiles
+* do each time a slot gets a new tile.
+*/
+void uploadStaticMesh(StaticMesh* mesh)
+{
+	size_t arraySize = sizeof(GLfloat) * 3 * mesh->vertexCount;
+	const void* arrays[3] = { mesh->vertices, mesh->normals, mesh->texCoords };
+	size_t arraySizes[3] = { arraySize, arraySize, sizeof(GLfloat) * 2 * mesh->vertexCount };
+	fillBuffer(&mesh->arrayBuffer, GL_ARRAY_BUFFER, GL_STATIC_DRAW, arrays, arraySizes, 3);
+
+	if (!mesh->elementBuffer)
+	{
+		const void* elements[2] = { mesh->indices, mesh->edges };
+		size_t elementSizes[2] = { sizeof(GLuint) * mesh->indexCount, sizeof(GLuint) * 2 * mesh->edgeCount };
+		fillBuffer(&mesh->elementBuffer, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW, elements, elementSizes, 2);
+	}
+	mesh->isUploaded = GL_TRUE;
+}
+
+/*
+* Points the vertex arrays at a static mesh and returns where its triangles,
+* or its edges, start. With buffer objects those are offsets into them,
+* otherwise they point straight at the arrays in memory.
+*/
+const GLvoid* bindStaticMesh(StaticMesh* mesh, GLboolean isEdges)
+{
+	if (!mesh->isUploaded)
+	{
+		uploadStaticMesh(mesh);
+	}
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	if (mesh->texCoords)
+	{
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	}
+
+	if (!mesh->arrayBuffer)
+	{
+		glVertexPointer(3, GL_FLOAT, 0, mesh->vertices);
+		glNormalPointer(GL_FLOAT, 0, mesh->normals);
+		glTexCoordPointer(2, GL_FLOAT, 0, mesh->texCoords);
+		return isEdges ? (const GLvoid*)mesh->edges : (const GLvoid*)mesh->indices;
+	}
+
+	size_t arraySize = sizeof(GLfloat) * 3 * mesh->vertexCount;
+	gl.bindBuffer(GL_ARRAY_BUFFER, mesh->arrayBuffer);
+	gl.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->elementBuffer);
+	glVertexPointer(3, GL_FLOAT, 0, BUFFER_OFFSET(0));
+	glNormalPointer(GL_FLOAT, 0, BUFFER_OFFSET(arraySize));
+	glTexCoordPointer(2, GL_FLOAT, 0, BUFFER_OFFSET(arraySize * 2));
+	return isEdges ? BUFFER_OFFSET(sizeof(GLuint) * mesh->indexCount) : BUFFER_OFFSET(0);
+}
+
+// Turns the arrays bindStaticMesh turned on back off, and unbinds the buffers
+void unbindStaticMesh()
+{
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	if (gl.bindBuffer)
+	{
+		gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+		gl.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+}
+
+// Draws a static mesh from its buffer objects, or only its edges as lines
+void drawStaticMesh(StaticMesh* mesh, GLboolean isEdges)
+{
+	const GLvoid* elements = bindStaticMesh(mesh, isEdges);
+
+	if (isEdges)
+	{
+		glDrawElements(GL_LINES, mesh->edgeCount * 2, GL_UNSIGNED_INT, elements);
+		renderStats.lines += mesh->edgeCount;
+	}
+	else
+	{
+		glDrawElements(GL_TRIANGLES, mesh->indexCount, GL_UNSIGNED_INT, elements);
+		renderStats.triangles += mesh->indexCount / 3;
+	}
+
+	unbindStaticMesh();
+}
+
+/*
+* Bounding box helpers. An empty box has its minimum above its maximum so that
+* growing it by anything gives that thing's box.
+*/
+void boundsEmpty(Bounds* bounds)
+{
+	for (GLint i = 0; i < 3; i++)
+	{
+		bounds->minimum[i] = 1e30f;
+		bounds->maximum[i] = -1e30f;
+	}
+}
+
+void boundsGrowPoint(Bounds* bounds, GLfloat point[3])
+{
+	for (GLint i = 0; i < 3; i++)
+	{
+		if (point[i] < bounds->minimum[i]) bounds->minimum[i] = point[i];
+		if (point[i] > bounds->maximum[i]) bounds->maximum[i] = point[i];
+	}
+}
+
+void boundsGrow(Bounds* bounds, Bounds* other)
+{
+	boundsGrowPoint(bounds, other->minimum);
+	boundsGrowPoint(bounds, other->maximum);
+}
+
+GLfloat boundsSurfaceArea(Bounds* bounds)
+{
+	GLfloat x = bounds->maximum[0] - bounds->minimum[0];
+	GLfloat y = bounds->maximum[1] - bounds->minimum[1];
+	GLfloat z = bounds->maximum[2] - bounds->minimum[2];
+	if (x < 0 || y < 0 || z < 0)
+	{
+		return 0;
+	}
+	return 2.0f * (x * y + y * z + z * x);
+}
+
+/*
+* Slab test of a ray against a box. The ray direction is passed in already
+* inverted. Returns the distance along the ray where it enters the box (0 if it
+* starts inside), or -1 if it misses or only hits past maxDistance.
+*/
+GLfloat rayBoundsDistance(Bounds* bounds, GLfloat origin[3], GLfloat inverseDirection[3], GLfloat maxDistance)
+{
+	GLfloat near = 0.0f;
+	GLfloat far = maxDistance;
+
+	for (GLint i = 0; i < 3; i++)
+	{
+		GLfloat t1 = (bounds->minimum[i] - origin[i]) * inverseDirection[i];
+		GLfloat t2 = (bounds->maximum[i] - origin[i]) * inverseDirection[i];
+		if (t1 > t2)
+		{
+			GLfloat temp = t1;
+			t1 = t2;
+			t2 = temp;
+		}
+
+		if (t1 > near) near = t1;
+		if (t2 < far) far = t2;
+		if (near > far)
+		{
+			return -1.0f;
+		}
+	}
+
+	return near;
+}
+
+// The squared distance from a point to the closest point of a box, 0 if inside
+GLfloat pointBoundsDistanceSquared(Bounds* bounds, GLfloat point[3])
+{
+	GLfloat distance = 0;
+	for (GLint i = 0; i < 3; i++)
+	{
+		GLfloat d = 0;
+		if (point[i] < bounds->minimum[i]) d = bounds->minimum[i] - point[i];
+		else if (point[i] > bounds->maximum[i]) d = point[i] - bounds->maximum[i];
+		distance += d * d;
+	}
+	return distance;
+}
+
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 12
+#define BVH_MAX_SAH_DEPTH 32
+
+/*
+* Builds the node for the primitives first to first + count, splitting them
+* with a binned surface area heuristic along the longest axis of their centres
+* and recursing into the two halves.
+*/
+GLint buildBvhNode(Bvh* bvh, Bounds* boxes, GLint first, GLint count, GLint depth)
+{
+	GLint nodeIndex = bvh->nodeCount++;
+	BvhNode* node = &bvh->nodes[nodeIndex];
+	node->first = first;
+	node->count = count;
+	node->right = -1;
+
+	Bounds centres;
+	boundsEmpty(&node->bounds);
+	boundsEmpty(&centres);
+	for (GLint i = first; i < first + count; i++)
+	{
+		Bounds* box = &boxes[bvh->primitives[i]];
+		GLfloat centre[3] = { (box->minimum[0] + box->maximum[0]) / 2, (box->minimum[1] + box->maximum[1]) / 2,
+			(box->minimum[2] + box->maximum[2]) / 2 };
+		boundsGrow(&node->bounds, box);
+		boundsGrowPoint(&centres, centre);
+	}
+
+	if (count <= BVH_LEAF_SIZE)
+	{
+		return nodeIndex;
+	}
+
+	GLint axis = 0;
+	for (GLint i = 1; i < 3; i++)
+	{
+		if (centres.maximum[i] - centres.minimum[i] > centres.maximum[axis] - centres.minimum[axis])
+		{
+			axis = i;
+		}
+	}
+
+	GLfloat axisMinimum = centres.minimum[axis];
+	GLfloat axisExtent = centres.maximum[axis] - axisMinimum;
+	GLint split = first + count / 2;
+
+	// Past the depth limit just cut the range in half, so lopsided splits can't
+	// make the tree deeper than the query stacks
+	if (axisExtent > 0 && depth < BVH_MAX_SAH_DEPTH)
+	{
+		// Drop every primitive into a bin by its centre
+		GLint binCounts[BVH_BINS] = { 0 };
+		Bounds binBounds[BVH_BINS];
+		for (GLint b = 0; b < BVH_BINS; b++)
+		{
+			boundsEmpty(&binBounds[b]);
+		}
+
+		for (GLint i = first; i < first + count; i++)
+		{
+			Bounds* box = &boxes[bvh->primitives[i]];
+			GLfloat centre = (box->minimum[axis] + box->maximum[axis]) / 2;
+			GLint bin = (GLint)((centre - axisMinimum) / axisExtent * BVH_BINS);
+			if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+			binCounts[bin]++;
+			boundsGrow(&binBounds[bin], box);
+		}
+
+		// Sweep from the right to get the cost of everything past each plane
+		GLfloat rightCosts[BVH_BINS];
+		Bounds sweep;
+		boundsEmpty(&sweep);
+		GLint sweepCount = 0;
+		for (GLint b = BVH_BINS - 1; b > 0; b--)
+		{
+			boundsGrow(&sweep, &binBounds[b]);
+			sweepCount += binCounts[b];
+			rightCosts[b] = boundsSurfaceArea(&sweep) * sweepCount;
+		}
+
+		// Then from the left, keeping the cheapest plane
+		GLint bestPlane = -1;
+		GLfloat bestCost = 0;
+		boundsEmpty(&sweep);
+		sweepCount = 0;
+		for (GLint b = 0; b < BVH_BINS - 1; b++)
+		{
+			boundsGrow(&sweep, &binBounds[b]);
+			sweepCount += binCounts[b];
+			if (sweepCount == 0 || sweepCount == count)
+			{
+				continue;
+			}
+
+			GLfloat cost = boundsSurfaceArea(&sweep) * sweepCount + rightCosts[b + 1];
+			if (bestPlane < 0 || cost < bestCost)
+			{
+				bestPlane = b + 1;
+				bestCost = cost;
+			}
+		}
+
+		if (bestPlane > 0)
+		{
+			// Partition the primitives so the ones left of the plane come first
+			GLint left = first;
+			for (GLint i = first; i < first + count; i++)
+			{
+				Bounds* box = &boxes[bvh->primitives[i]];
+				GLfloat centre = (box->minimum[axis] + box->maximum[axis]) / 2;
+				GLint bin = (GLint)((centre - axisMinimum) / axisExtent * BVH_BINS);
+				if (bin >= BVH_BINS) bin = BVH_BINS - 1;
+				if (bin < bestPlane)
+				{
+					GLint temp = bvh->primitives[left];
+					bvh->primitives[left] = bvh->primitives[i];
+					bvh->primitives[i] = temp;
+					left++;
+				}
+			}
+			split = left;
+		}
+	}
+
+	buildBvhNode(bvh, boxes, first, split - first, depth + 1);
+	GLint right = buildBvhNode(bvh, boxes, split, first + count - split, depth + 1);
+	bvh->nodes[nodeIndex].right = right;
+
+	return nodeIndex;
+}
+
+// Builds a bounding volume hierarchy over an array of boxes
+void buildBvh(Bvh* bvh, Bounds* boxes, GLint count)
+{
+	free(bvh->nodes);
+	free(bvh->primitives);
+
+	bvh->primitiveCount = count;
+	bvh->nodeCount = 0;
+	bvh->primitives = (GLint*)malloc(sizeof(GLint) * (count > 0 ? count : 1));
+	bvh->nodes = (BvhNode*)malloc(sizeof(BvhNode) * (count > 0 ? 2 * count : 1));
+	if (!bvh->primitives || !bvh->nodes)
+	{
+		printf("Error allocating memory for a bounding volume hierarchy\n");
+		exit(1);
+	}
+
+	for (GLint i = 0; i < count; i++)
+	{
+		bvh->primitives[i] = i;
+	}
+
+	if (count > 0)
+	{
+		buildBvhNode(bvh, boxes, 0, count, 0);
+	}
+}
+
+void freeBvh(Bvh* bvh)
+{
+	free(bvh->nodes);
+	free(bvh->primitives);
+	memset(bvh, 0, sizeof(Bvh));
+}
+
+/*
+* Updates the node boxes after some of the primitive boxes moved, without
+* changing the tree. Children always come after their parents, so walking the
+* nodes backwards sees both children before the parent.
+*/
+void refitBvh(Bvh* bvh, Bounds* boxes)
+{
+	for (GLint n = bvh->nodeCount - 1; n >= 0; n--)
+	{
+		BvhNode* node = &bvh->nodes[n];
+		boundsEmpty(&node->bounds);
+
+		if (node->right < 0)
+		{
+			for (GLint i = node->first; i < node->first + node->count; i++)
+			{
+				boundsGrow(&node->bounds, &boxes[bvh->primitives[i]]);
+			}
+		}
+		else
+		{
+			boundsGrow(&node->bounds, &bvh->nodes[n + 1].bounds);
+			boundsGrow(&node->bounds, &bvh->nodes[node->right].bounds);
+		}
+	}
+}
+
+#define BVH_STACK_SIZE 64
+
+/*
+* Finds every primitive whose box is at least partly inside a frustum given as
+* six planes (a, b, c, d) facing inwards. Once a node is completely inside, its
+* whole primitive range is taken without testing any further. Returns how many
+* primitive indexes were written into results.
+*/
+GLint queryBvhFrustum(Bvh* bvh, Bounds* boxes, GLfloat planes[6][4], GLint* results)
+{
+	GLint found = 0;
+	GLint stack[BVH_STACK_SIZE];
+	GLint stackSize = 0;
+
+	if (bvh->nodeCount > 0)
+	{
+		stack[stackSize++] = 0;
+	}
+
+	while (stackSize > 0)
+	{
+		BvhNode* node = &bvh->nodes[stack[--stackSize]];
+		GLboolean isInside = GL_TRUE;
+		GLboolean isOutside = GL_FALSE;
+
+		for (GLint p = 0; p < 6 && !isOutside; p++)
+		{
+			GLfloat* plane = planes[p];
+			GLfloat farthest = plane[3], nearest = plane[3];
+			for (GLint i = 0; i < 3; i++)
+			{
+				farthest += plane[i] * (plane[i] > 0 ? node->bounds.maximum[i] : node->bounds.minimum[i]);
+				nearest += plane[i] * (plane[i] > 0 ? node->bounds.minimum[i] : node->bounds.maximum[i]);
+			}
+
+			if (farthest < 0) isOutside = GL_TRUE;
+			if (nearest < 0) isInside = GL_FALSE;
+		}
+
+		if (isOutside)
+		{
+			continue;
+		}
+
+		if (isInside || node->right < 0)
+		{
+			// Leaves that are only partly inside test each primitive box
+			for (GLint i = node->first; i < node->first + node->count; i++)
+			{
+				GLint primitive = bvh->primitives[i];
+				GLboolean isVisible = GL_TRUE;
+
+				for (GLint p = 0; p < 6 && !isInside && isVisible; p++)
+				{
+					GLfloat* plane = planes[p];
+					GLfloat farthest = plane[3];
+					for (GLint k = 0; k < 3; k++)
+					{
+						farthest += plane[k] * (plane[k] > 0 ? boxes[primitive].maximum[k] : boxes[primitive].minimum[k]);
+					}
+					isVisible = farthest >= 0;
+				}
+
+				if (isVisible)
+				{
+					results[found++] = primitive;
+				}
+			}
+			continue;
+		}
+
+		stack[stackSize++] = node->right;
+		stack[stackSize++] = (GLint)(node - bvh->nodes) + 1;
+	}
+
+	return found;
+}
+
+/*
+* Finds every primitive whose box comes within radius of a point. Returns how
+* many primitive indexes were written into results, never more than maxResults.
+*/
+GLint queryBvhSphere(Bvh* bvh, Bounds* boxes, GLfloat centre[3], GLfloat radius, GLint* results, GLint maxResults)
+{
+	GLint found = 0;
+	GLint stack[BVH_STACK_SIZE];
+	GLint stackSize = 0;
+	GLfloat radiusSquared = radius * radius;
+
+	if (bvh->nodeCount > 0)
+	{
+		stack[stackSize++] = 0;
+	}
+
+	while (stackSize > 0 && found < maxResults)
+	{
+		BvhNode* node = &bvh->nodes[stack[--stackSize]];
+		if (pointBoundsDistanceSquared(&node->bounds, centre) > radiusSquared)
+		{
+			continue;
+		}
+
+		if (node->right < 0)
+		{
+			for (GLint i = node->first; i < node->first + node->count && found < maxResults; i++)
+			{
+				GLint primitive = bvh->primitives[i];
+				if (pointBoundsDistanceSquared(&boxes[primitive], centre) <= radiusSquared)
+				{
+					results[found++] = primitive;
+				}
+			}
+			continue;
+		}
+
+		stack[stackSize++] = node->right;
+		stack[stackSize++] = (GLint)(node - bvh->nodes) + 1;
+	}
+
+	return found;
+}
+
+/*
+* Finds the closest primitive a ray hits within maxDistance. The direction has
+* to be normalized. If intersect is given it is called for each primitive whose
+* box the ray enters and returns the real hit distance (or -1 for a miss),
+* otherwise the distance to the box is used. The nearer child is always visited
+* first so farther nodes can be skipped once something closer has been hit.
+* Returns the primitive index, or -1 if nothing was hit.
+*/
+GLint queryBvhRay(Bvh* bvh, Bounds* boxes, GLfloat origin[3], GLfloat direction[3], GLfloat maxDistance,
+	GLfloat (*intersect)(void* data, GLint primitive, GLfloat origin[3], GLfloat direction[3], GLfloat maxDistance),
+	void* data, GLfloat* hitDistance)
+{
+	GLfloat inverseDirection[3];
+	for (GLint i = 0; i < 3; i++)
+	{
+		inverseDirection[i] = direction[i] != 0 ? 1.0f / direction[i] : 1e30f;
+	}
+
+	GLint hit = -1;
+	GLfloat closest = maxDistance;
+	GLint stack[BVH_STACK_SIZE];
+	GLint stackSize = 0;
+
+	if (bvh->nodeCount > 0 && rayBoundsDistance(&bvh->nodes[0].bounds, origin, inverseDirection, closest) >= 0)
+	{
+		stack[stackSize++] = 0;
+	}
+
+	while (stackSize > 0)
+	{
+		GLint nodeIndex = stack[--stackSize];
+		BvhNode* node = &bvh->nodes[nodeIndex];
+
+		// Something closer may have been hit since this node was pushed
+		if (rayBoundsDistance(&node->bounds, origin, inverseDirection, closest) < 0)
+		{
+			continue;
+		}
+
+		if (node->right < 0)
+		{
+			for (GLint i = node->first; i < node->first + node->count; i++)
+			{
+				GLint primitive = bvh->primitives[i];
+				GLfloat distance = rayBoundsDistance(&boxes[primitive], origin, inverseDirection, closest);
+				if (distance >= 0 && intersect)
+				{
+					distance = intersect(data, primitive, origin, direction, closest);
+				}
+
+				if (distance >= 0 && distance <= closest)
+				{
+					closest = distance;
+					hit = primitive;
+				}
+			}
+			continue;
+		}
+
+		GLint left = nodeIndex + 1;
+		GLfloat leftDistance = rayBoundsDistance(&bvh->nodes[left].bounds, origin, inverseDirection, closest);
+		GLfloat rightDistance = rayBoundsDistance(&bvh->nodes[node->right].bounds, origin, inverseDirection, closest);
+
+		// Push the farther child first so the nearer one gets popped first
+		if (leftDistance >= 0 && rightDistance >= 0)
+		{
+			GLboolean isLeftNearer = leftDistance <= rightDistance;
+			stack[stackSize++] = isLeftNearer ? node->right : left;
+			stack[stackSize++] = isLeftNearer ? left : node->right;
+		}
+		else if (leftDistance >= 0)
+		{
+			stack[stackSize++] = left;
+		}
+		else if (rightDistance >= 0)
+		{
+			stack[stackSize++] = node->right;
+		}
+	}
+
+	if (hitDistance)
+	{
+		*hitDistance = closest;
+	}
+	return hit;
+}
+
+/*
+* Finds the closest primitive to a point within maxDistance. measure is called
+* for each primitive whose box is close enough and returns the real distance to
+* it. Like the ray query the nearer child is visited first, and nodes further
+* than the closest primitive so far are skipped. Returns the primitive index,
+* or -1 if nothing was within maxDistance.
+*/
+GLint queryBvhClosest(Bvh* bvh, Bounds* boxes, GLfloat point[3], GLfloat maxDistance,
+	GLfloat (*measure)(void* data, GLint primitive, GLfloat point[3], GLfloat maxDistance),
+	void* data, GLfloat* closestDistance)
+{
+	GLint closestPrimitive = -1;
+	GLfloat closest = maxDistance;
+	GLint stack[BVH_STACK_SIZE];
+	GLint stackSize = 0;
+
+	if (bvh->nodeCount > 0)
+	{
+		stack[stackSize++] = 0;
+	}
+
+	while (stackSize > 0)
+	{
+		GLint nodeIndex = stack[--stackSize];
+		BvhNode* node = &bvh->nodes[nodeIndex];
+
+		if (pointBoundsDistanceSquared(&node->bounds, point) > closest * closest)
+		{
+			continue;
+		}
+
+		if (node->right < 0)
+		{
+			for (GLint i = node->first; i < node->first + node->count; i++)
+			{
+				GLint primitive = bvh->primitives[i];
+				if (pointBoundsDistanceSquared(&boxes[primitive], point) > closest * closest)
+				{
+					continue;
+				}
+
+				GLfloat distance = measure(data, primitive, point, closest);
+				if (distance <= closest)
+				{
+					closest = distance;
+					closestPrimitive = primitive;
+				}
+			}
+			continue;
+		}
+
+		GLint left = nodeIndex + 1;
+		GLfloat leftDistance = pointBoundsDistanceSquared(&bvh->nodes[left].bounds, point);
+		GLfloat rightDistance = pointBoundsDistanceSquared(&bvh->nodes[node->right].bounds, point);
+
+		// Push the farther child first so the nearer one gets popped first
+		GLboolean isLeftNearer = leftDistance <= rightDistance;
+		stack[stackSize++] = isLeftNearer ? node->right : left;
+		stack[stackSize++] = isLeftNearer ? left : node->right;
+	}
+
+	if (closestDistance)
+	{
+		*closestDistance = closest;
+	}
+
+	return closestPrimitive;
+}
+
+/*
+* Pulls the six planes of the view frustum out of a projection times view
+* matrix (Gribb and Hartmann). Each plane is normalized and faces inwards.
+*/
+void extractFrustumPlanes(GLfloat projection[16], GLfloat view[16], GLfloat planes[6][4])
+{
+	GLfloat m[16];
+	matrixMultiply(projection, view, m);
+
+	for (GLint i = 0; i < 3; i++)
+	{
+		for (GLint j = 0; j < 4; j++)
+		{
+			planes[i * 2][j] = m[j * 4 + 3] + m[j * 4 + i];
+			planes[i * 2 + 1][j] = m[j * 4 + 3] - m[j * 4 + i];
+		}
+	}
+
+	for (GLint p = 0; p < 6; p++)
+	{
+		GLfloat length = sqrtf(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+		for (GLint j = 0; j < 4; j++)
+		{
+			planes[p][j] /= length;
+		}
+	}
+}
+
+// Returns whether a box is at least partly inside a frustum of six planes facing inwards
+GLboolean isBoundsInFrustum(Bounds* bounds, GLfloat planes[6][4])
+{
+	for (GLint p = 0; p < 6; p++)
+	{
+		GLfloat farthest = planes[p][3];
+		for (GLint i = 0; i < 3; i++)
+		{
+			farthest += planes[p][i] * (planes[p][i] > 0 ? bounds->maximum[i] : bounds->minimum[i]);
+		}
+
+		if (farthest < 0)
+		{
+			return GL_FALSE;
+		}
+	}
+
+	return GL_TRUE;
+}
+
+// Returns whether a sphere is at least partly inside a frustum of six planes facing inwards
+GLboolean isSphereInFrustum(GLfloat center[3], GLfloat radius, GLfloat planes[6][4])
+{
+	for (GLint p = 0; p < 6; p++)
+	{
+		if (planes[p][0] * center[0] + planes[p][1] * center[1] + planes[p][2] * center[2] + planes[p][3] < -radius)
+		{
+			return GL_FALSE;
+		}
+	}
+
+	return GL_TRUE;
+}
+
+// Builds a perspective projection matrix the same way gluPerspective does
+void matrixPerspective(GLfloat m[16], GLfloat fovY, GLfloat aspect, GLfloat near, GLfloat far)
+{
+	GLfloat f = 1.0f / tanf(fovY * (PI / 180.0f) / 2.0f);
+	memset(m, 0, sizeof(GLfloat) * 16);
+	m[0] = f / aspect;
+	m[5] = f;
+	m[10] = (far + near) / (near - far);
+	m[11] = -1.0f;
+	m[14] = 2.0f * far * near / (near - far);
+}
+
+// Builds a view matrix the same way gluLookAt does
+void matrixLookAt(GLfloat m[16], GLfloat eye[3], GLfloat centre[3], GLfloat up[3])
+{
+	GLfloat forward[3] = { centre[0] - eye[0], centre[1] - eye[1], centre[2] - eye[2] };
+	normalizeVectorArray(forward);
+
+	GLfloat side[3] = { forward[1] * up[2] - forward[2] * up[1], forward[2] * up[0] - forward[0] * up[2],
+		forward[0] * up[1] - forward[1] * up[0] };
+	normalizeVectorArray(side);
+
+	GLfloat newUp[3] = { side[1] * forward[2] - side[2] * forward[1], side[2] * forward[0] - side[0] * forward[2],
+		side[0] * forward[1] - side[1] * forward[0] };
+
+	matrixIdentity(m);
+	for (GLint i = 0; i < 3; i++)
+	{
+		m[i * 4] = side[i];
+		m[i * 4 + 1] = newUp[i];
+		m[i * 4 + 2] = -forward[i];
+	}
+	matrixTranslate(m, -eye[0], -eye[1], -eye[2]);
+}
+
+/*
+* Works out the world box of a coral instance by placing the eight corners of
+* its mesh's box the same way drawCoral places the mesh.
+*/
+void calculateCoralInstanceBounds(CoralInstance* instance, Bounds* bounds)
+{
+	Bounds* local = &coral[instance->mesh].bounds;
+	boundsEmpty(bounds);
+
+	for (GLint corner = 0; corner < 8; corner++)
+	{
+		GLfloat point[3] =
+		{
+			(corner & 1) ? local->maximum[0] : local->minimum[0],
+			(corner & 2) ? local->maximum[1] : local->minimum[1],
+			(corner & 4) ? local->maximum[2] : local->minimum[2]
+		};
+		GLfloat placed[3];
+		placeModelPoint(point, instance->scale, instance->heading, instance->position, placed);
+		boundsGrowPoint(bounds, placed);
+	}
+}
+
+/*
+* Builds the scene hierarchy from the coral instances, the sea floor and the
+* wall. The floor is one thin box, and the wall is split into a thin box for
+* each of its segments so that it doesn't cover the whole scene.
+*/
+void buildSceneBvh()
+{
+	scenePrimitiveCount = coralInstanceCount + 1 + bottomDiscSegments;
+
+	free(sceneBounds);
+	free(scenePrimitives);
+	free(visiblePrimitives);
+	sceneBounds = (Bounds*)malloc(sizeof(Bounds) * scenePrimitiveCount);
+	scenePrimitives = (ScenePrimitive*)malloc(sizeof(ScenePrimitive) * scenePrimitiveCount);
+	visiblePrimitives = (GLint*)malloc(sizeof(GLint) * scenePrimitiveCount);
+	if (!sceneBounds || !scenePrimitives || !visiblePrimitives)
+	{
+		printf("Error allocating memory for the scene hierarchy\n");
+		exit(1);
+	}
+
+	GLint p = 0;
+	for (GLint i = 0; i < coralInstanceCount; i++, p++)
+	{
+		scenePrimitives[p].type = SCENE_CORAL;
+		scenePrimitives[p].index = i;
+		calculateCoralInstanceBounds(&coralInstances[i], &sceneBounds[p]);
+	}
+
+	scenePrimitives[p].type = SCENE_FLOOR;
+	scenePrimitives[p].index = 0;
+	Bounds floor = { { -(GLfloat)bottomDiscRadius, -(GLfloat)bottomDiscRadius, -1.0f },
+		{ (GLfloat)bottomDiscRadius, (GLfloat)bottomDiscRadius, 0.0f } };
+	sceneBounds[p++] = floor;
+
+	for (GLint i = 0; i < bottomDiscSegments; i++, p++)
+	{
+		GLfloat angle1 = 2.0f * PI * i / bottomDiscSegments;
+		GLfloat angle2 = 2.0f * PI * (i + 1) / bottomDiscSegments;
+		GLfloat bottom[3] = { bottomDiscRadius * sinf(angle1), bottomDiscRadius * cosf(angle1), 0 };
+		GLfloat top[3] = { bottomDiscRadius * sinf(angle2), bottomDiscRadius * cosf(angle2), (GLfloat)wallHeight };
+
+		scenePrimitives[p].type = SCENE_WALL;
+		scenePrimitives[p].index = i;
+		boundsEmpty(&sceneBounds[p]);
+		boundsGrowPoint(&sceneBounds[p], bottom);
+		boundsGrowPoint(&sceneBounds[p], top);
+	}
+
+	double start = getTimeSeconds();
+	buildBvh(&sceneBvh, sceneBounds, scenePrimitiveCount);
+	printf("Built the scene hierarchy over %d primitives in %.2f ms\n", scenePrimitiveCount,
+		(getTimeSeconds() - start) * 1000.0);
+
+	isSceneBvhDirty = GL_FALSE;
+}
+
+/*
+* Moves a coral instance and updates its box. The hierarchy gets refit before
+* it is next queried instead of being rebuilt.
+*/
+void moveCoralInstance(GLint index, GLfloat position[3])
+{
+	coralInstances[index].position[0] = position[0];
+	coralInstances[index].position[1] = position[1];
+	coralInstances[index].position[2] = position[2];
+
+	// Coral instances come first in the scene primitives
+	calculateCoralInstanceBounds(&coralInstances[index], &sceneBounds[index]);
+	isSceneBvhDirty = GL_TRUE;
+}
+
+// Refits the scene hierarchy if anything moved since it was last used
+void updateSceneBvh()
+{
+	if (isSceneBvhDirty)
+	{
+		refitBvh(&sceneBvh, sceneBounds);
+		isSceneBvhDirty = GL_FALSE;
+	}
+}
+
+/*
+* Returns the height of the wave surface at a point. The calculation is based
+* on the following pseudocode:
+* heightAtVertex = sin(valueBasedOnPosition + phase + timeValue) * waveAmplitude
+*/
+GLfloat getWaveHeightAt(GLfloat x, GLfloat y, GLfloat timeValue)
+{
+	// Used to draw more or less waves based on the wavelength
+	GLfloat frequency = 2.0f * PI / waveLength;
+
+	return (sinf((x + y) * frequency + wavePhase + timeValue) * waveAmplitude) + waveHeightOffset;
+}
+
+// The height of the wave surface at a point right now in the simulation
+GLfloat getWaveHeight(GLfloat x, GLfloat y)
+{
+	return getWaveHeightAt(x, y, waveTimeValue);
+}
+
+/*
+* Reads one height sample out of the terrain file, counting samples across the
+* whole terrain. Samples past the edges are clamped onto them.
+*/
+GLfloat getTerrainSample(GLint x, GLint y)
+{
+	GLint cells = terrainHeader->tileSamples - 1;
+	GLint sample[2] = { x, y };
+	GLint tile[2], local[2];
+
+	for (GLint a = 0; a < 2; a++)
+	{
+		if (sample[a] < 0) sample[a] = 0;
+		if (sample[a] > terrainHeader->tiles[a] * cells) sample[a] = terrainHeader->tiles[a] * cells;
+
+		tile[a] = sample[a] / cells;
+		if (tile[a] == terrainHeader->tiles[a]) tile[a]--;
+		local[a] = sample[a] - tile[a] * cells;
+	}
+
+	// Big maps go past 2^31 samples, so the index has to be worked out in size_t
+	size_t index = (((size_t)tile[1] * terrainHeader->tiles[0] + tile[0]) * terrainHeader->tileSamples + local[1])
+		* terrainHeader->tileSamples + local[0];
+	return terrainSamples[index] * terrainHeader->heightScale;
+}
+
+/*
+* Height of the sea floor under a point. Without a terrain the floor is the
+* plane z = 0, otherwise it is read straight from the mapped file so the
+* simulation never has to wait for a tile to be loaded.
+*/
+GLfloat getTerrainHeight(GLfloat x, GLfloat y)
+{
+	if (!terrainHeader)
+	{
+		return 0;
+	}
+
+	GLfloat u = (x - terrainHeader->origin[0]) / terrainHeader->spacing;
+	GLfloat v = (y - terrainHeader->origin[1]) / terrainHeader->spacing;
+	GLint i = (GLint)floorf(u);
+	GLint j = (GLint)floorf(v);
+	u -= i;
+	v -= j;
+
+	GLfloat bottom = getTerrainSample(i, j) * (1 - u) + getTerrainSample(i + 1, j) * u;
+	GLfloat top = getTerrainSample(i, j + 1) * (1 - u) + getTerrainSample(i + 1, j + 1) * u;
+	return bottom * (1 - v) + top * v;
+}
+
+// Builds the triangle hierarchy of an object so collision can test its triangles
+void buildObjectTriangleBvh(Object* object)
+{
+	free(object->triangleBounds);
+	object->triangleBounds = (Bounds*)malloc(sizeof(Bounds) * (object->triangleCount > 0 ? object->triangleCount : 1));
+	if (!object->triangleBounds)
+	{
+		printf("Error allocating memory for the triangle bounds\n");
+		exit(1);
+	}
+
+	for (GLint t = 0; t < object->triangleCount; t++)
+	{
+		boundsEmpty(&object->triangleBounds[t]);
+		for (GLint k = 0; k < 3; k++)
+		{
+			boundsGrowPoint(&object->triangleBounds[t], object->values.vertices[object->triangles[t * 3 + k]].position);
+		}
+	}
+
+	buildBvh(&object->triangleBvh, object->triangleBounds, object->triangleCount);
+}
+
+/*
+* Finds the closest point on a triangle to p, from Real-Time Collision Detection
+* (Ericson). It works out which vertex, edge or face region p projects into.
+*/
+void closestPointOnTriangle(GLfloat p[3], GLfloat a[3], GLfloat b[3], GLfloat c[3], GLfloat result[3])
+{
+	GLfloat ab[3], ac[3], ap[3], bp[3], cp[3];
+	for (GLint i = 0; i < 3; i++)
+	{
+		ab[i] = b[i] - a[i];
+		ac[i] = c[i] - a[i];
+		ap[i] = p[i] - a[i];
+		bp[i] = p[i] - b[i];
+		cp[i] = p[i] - c[i];
+	}
+
+	GLfloat d1 = ab[0] * ap[0] + ab[1] * ap[1] + ab[2] * ap[2];
+	GLfloat d2 = ac[0] * ap[0] + ac[1] * ap[1] + ac[2] * ap[2];
+	if (d1 <= 0 && d2 <= 0)
+	{
+		memcpy(result, a, sizeof(GLfloat) * 3);
+		return;
+	}
+
+	GLfloat d3 = ab[0] * bp[0] + ab[1] * bp[1] + ab[2] * bp[2];
+	GLfloat d4 = ac[0] * bp[0] + ac[1] * bp[1] + ac[2] * bp[2];
+	if (d3 >= 0 && d4 <= d3)
+	{
+		memcpy(result, b, sizeof(GLfloat) * 3);
+		return;
+	}
+
+	GLfloat vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0)
+	{
+		GLfloat v = d1 / (d1 - d3);
+		for (GLint i = 0; i < 3; i++) result[i] = a[i] + v * ab[i];
+		return;
+	}
+
+	GLfloat d5 = ab[0] * cp[0] + ab[1] * cp[1] + ab[2] * cp[2];
+	GLfloat d6 = ac[0] * cp[0] + ac[1] * cp[1] + ac[2] * cp[2];
+	if (d6 >= 0 && d5 <= d6)
+	{
+		memcpy(result, c, sizeof(GLfloat) * 3);
+		return;
+	}
+
+	GLfloat vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0)
+	{
+		GLfloat w = d2 / (d2 - d6);
+		for (GLint i = 0; i < 3; i++) result[i] = a[i] + w * ac[i];
+		return;
+	}
+
+	GLfloat va = d3 * d6 - d5 * d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+	{
+		GLfloat w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		for (GLint i = 0; i < 3; i++) result[i] = b[i] + w * (c[i] - b[i]);
+		return;
+	}
+
+	GLfloat denominator = 1.0f / (va + vb + vc);
+	GLfloat v = vb * denominator;
+	GLfloat w = vc * denominator;
+	for (GLint i = 0; i < 3; i++) result[i] = a[i] + ab[i] * v + ac[i] * w;
+}
+
+/*
+* The opposite of placeModelPoint. It takes a world point back into the space
+* of an obj file placed at translation with the given scale and heading.
+*/
+void unplaceModelPoint(GLfloat point[3], GLfloat scale, GLfloat heading, GLfloat translation[3], GLfloat result[3])
+{
+	GLfloat x = point[0] - translation[0];
+	GLfloat y = point[1] - translation[1];
+	GLfloat c = cosf(heading);
+	GLfloat s = sinf(heading);
+
+	result[0] = -(-x * s + y * c) / scale;
+	result[1] = (point[2] - translation[2]) / scale;
+	result[2] = -(x * c + y * s) / scale;
+}
+
+/*
+* Finds how far a sphere has sunk into the triangles of a mesh placed in the
+* world, and the direction that gets it out the quickest. The sphere is taken
+* into the mesh's own space so the triangles never need to be moved. Returns
+* the depth in world units, or 0 if the sphere isn't touching the mesh.
+*/
+GLfloat findMeshPenetration(Object* mesh, GLfloat scale, GLfloat heading, GLfloat translation[3], GLfloat centre[3],
+	GLfloat radius, GLfloat direction[3])
+{
+	GLfloat local[3];
+	unplaceModelPoint(centre, scale, heading, translation, local);
+	GLfloat localRadius = radius / scale;
+
+	reserveArray((void**)&collisionTriangles, &collisionTriangleCapacity, mesh->triangleCount, sizeof(GLint));
+	GLint found = queryBvhSphere(&mesh->triangleBvh, mesh->triangleBounds, local, localRadius,
+		collisionTriangles, mesh->triangleCount);
+
+	GLfloat deepest = 0;
+	GLfloat localDirection[3] = { 0, 0, 0 };
+
+	for (GLint i = 0; i < found; i++)
+	{
+		GLint* triangle = &mesh->triangles[collisionTriangles[i] * 3];
+		GLfloat* a = mesh->values.vertices[triangle[0]].position;
+		GLfloat* b = mesh->values.vertices[triangle[1]].position;
+		GLfloat* c = mesh->values.vertices[triangle[2]].position;
+
+		GLfloat closest[3];
+		closestPointOnTriangle(local, a, b, c, closest);
+
+		GLfloat away[3] = { local[0] - closest[0], local[1] - closest[1], local[2] - closest[2] };
+		GLfloat distance = sqrtf(away[0] * away[0] + away[1] * away[1] + away[2] * away[2]);
+		if (distance >= localRadius || localRadius - distance <= deepest)
+		{
+			continue;
+		}
+
+		// A centre right on the triangle gets pushed along the face normal
+		if (distance < 0.000001f)
+		{
+			Vertex3 normal = calculateNormal(mesh->values.vertices[triangle[0]], mesh->values.vertices[triangle[1]],
+				mesh->values.vertices[triangle[2]]);
+			memcpy(away, normal.position, sizeof(away));
+			normalizeVectorArray(away);
+		}
+		else
+		{
+			away[0] /= distance;
+			away[1] /= distance;
+			away[2] /= distance;
+		}
+
+		deepest = localRadius - distance;
+		memcpy(localDirection, away, sizeof(localDirection));
+	}
+
+	if (deepest <= 0)
+	{
+		return 0;
+	}
+
+	// Directions only rotate, (x, y, z) in the mesh is (-z, -x, y) in the world before the heading
+	GLfloat c = cosf(heading);
+	GLfloat s = sinf(heading);
+	direction[0] = -localDirection[2] * c + localDirection[0] * s;
+	direction[1] = -localDirection[2] * s - localDirection[0] * c;
+	direction[2] = localDirection[1];
+	return deepest * scale;
+}
+
+/*
+* Works out the collision spheres of the submarine from the box of its mesh as
+* drawSubmarine places it. The spheres are spread along the longest side, and
+* their radius is half of the second longest side.
+*/
+void setupSubmarineCollision()
+{
+	GLfloat origin[3] = { 0, 0, 0 };
+	Bounds placed;
+	boundsEmpty(&placed);
+
+	for (GLint corner = 0; corner < 8; corner++)
+	{
+		GLfloat point[3] =
+		{
+			(corner & 1) ? submarine.bounds.maximum[0] : submarine.bounds.minimum[0],
+			(corner & 2) ? submarine.bounds.maximum[1] : submarine.bounds.minimum[1],
+			(corner & 4) ? submarine.bounds.maximum[2] : submarine.bounds.minimum[2]
+		};
+		GLfloat world[3];
+		placeModelPoint(point, 0.2f, 0, origin, world);
+		boundsGrowPoint(&placed, world);
+	}
+
+	GLfloat extents[3];
+	GLint longest = 0;
+	for (GLint i = 0; i < 3; i++)
+	{
+		extents[i] = placed.maximum[i] - placed.minimum[i];
+		if (extents[i] > extents[longest])
+		{
+			longest = i;
+		}
+	}
+
+	GLfloat secondLongest = 0;
+	for (GLint i = 0; i < 3; i++)
+	{
+		if (i != longest && extents[i] > secondLongest)
+		{
+			secondLongest = extents[i];
+		}
+	}
+
+	// Keep the default spheres if there isn't a submarine mesh
+	if (extents[longest] <= 0)
+	{
+		for (GLint s = 0; s < SUBMARINE_COLLISION_SPHERES; s++)
+		{
+			submarineCollisionOffsets[s][0] = 0;
+			submarineCollisionOffsets[s][1] = 0;
+			submarineCollisionOffsets[s][2] = 0;
+		}
+		return;
+	}
+
+	submarineCollisionRadius = secondLongest / 2;
+	GLfloat start = placed.minimum[longest] + submarineCollisionRadius;
+	GLfloat end = placed.maximum[longest] - submarineCollisionRadius;
+	if (end < start)
+	{
+		start = end = (placed.minimum[longest] + placed.maximum[longest]) / 2;
+	}
+
+	for (GLint s = 0; s < SUBMARINE_COLLISION_SPHERES; s++)
+	{
+		for (GLint i = 0; i < 3; i++)
+		{
+			submarineCollisionOffsets[s][i] = (placed.minimum[i] + placed.maximum[i]) / 2;
+		}
+		submarineCollisionOffsets[s][longest] = start + (end - start) * s / (SUBMARINE_COLLISION_SPHERES - 1);
+	}
+
+	// The headlights sit on the far end of the hull when it lies flat
+	if (longest < 2)
+	{
+		submarineForward[0] = longest == 0 ? 1.0f : 0.0f;
+		submarineForward[1] = longest == 1 ? 1.0f : 0.0f;
+		submarineNoseDistance = placed.maximum[longest];
+	}
+
+	printf("Submarine collision: %d spheres of radius %.2f\n", SUBMARINE_COLLISION_SPHERES, submarineCollisionRadius);
+}
+
+/*
+* Keeps a sphere inside the scene by moving the position it hangs off of. The
+* wall is an analytic cylinder, the floor is the plane z = 0 and the top is
+* the wave surface above the sphere's centre. With a terrain there is no wall,
+* only the edges of the terrain, and the floor is the terrain height.
+*/
+void clampSphereToScene(GLfloat position[3], GLfloat offset[3], GLfloat radius)
+{
+	GLfloat centre[3] = { position[0] + offset[0], position[1] + offset[1], position[2] + offset[2] };
+
+	if (terrainHeader)
+	{
+		for (GLint a = 0; a < 2; a++)
+		{
+			GLfloat size = terrainHeader->tiles[a] * (terrainHeader->tileSamples - 1) * terrainHeader->spacing;
+			if (centre[a] - radius < terrainHeader->origin[a])
+			{
+				position[a] += terrainHeader->origin[a] + radius - centre[a];
+			}
+			if (centre[a] + radius > terrainHeader->origin[a] + size)
+			{
+				position[a] -= centre[a] + radius - terrainHeader->origin[a] - size;
+			}
+		}
+	}
+	else
+	{
+		GLfloat distanceToAxis = sqrtf(centre[0] * centre[0] + centre[1] * centre[1]);
+		if (distanceToAxis + radius > bottomDiscRadius && distanceToAxis > 0)
+		{
+			GLfloat pushBack = distanceToAxis + radius - bottomDiscRadius;
+			position[0] -= centre[0] / distanceToAxis * pushBack;
+			position[1] -= centre[1] / distanceToAxis * pushBack;
+		}
+	}
+
+	GLfloat floorHeight = getTerrainHeight(centre[0], centre[1]);
+	if (centre[2] - radius < floorHeight)
+	{
+		position[2] += radius + floorHeight - centre[2];
+	}
+
+	GLfloat surface = getWaveHeight(centre[0], centre[1]);
+	if (centre[2] + radius > surface)
+	{
+		position[2] -= centre[2] + radius - surface;
+	}
+}
+
+/*
+* Moves the submarine by a step and resolves any collisions. The broad phase
+* asks the scene hierarchy for the coral instances near the submarine, then
+* the narrow phase pushes each collision sphere out of the deepest triangle it
+* overlaps. Pushing straight out of the surface keeps the part of the step that
+* runs along it, so the submarine slides along coral instead of sticking. The
+* scene clamps go last so they always win.
+*/
+void moveSubmarine(GLfloat dx, GLfloat dy, GLfloat dz)
+{
+	double start = getTimeSeconds();
+
+	GLfloat position[3] = { submarineX + dx, submarineY + dy, submarineZ + dz };
+	GLfloat step = sqrtf(dx * dx + dy * dy + dz * dz);
+
+	// One sphere around all of the collision spheres and the step
+	GLfloat reach = submarineCollisionRadius + step;
+	for (GLint s = 0; s < SUBMARINE_COLLISION_SPHERES; s++)
+	{
+		GLfloat length = sqrtf(submarineCollisionOffsets[s][0] * submarineCollisionOffsets[s][0] +
+			submarineCollisionOffsets[s][1] * submarineCollisionOffsets[s][1] +
+			submarineCollisionOffsets[s][2] * submarineCollisionOffsets[s][2]);
+		if (length + submarineCollisionRadius + step > reach)
+		{
+			reach = length + submarineCollisionRadius + step;
+		}
+	}
+
+	updateSceneBvh();
+	reserveArray((void**)&collisionCandidates, &collisionCandidateCapacity, scenePrimitiveCount, sizeof(GLint));
+	GLint candidateCount = queryBvhSphere(&sceneBvh, sceneBounds, position, reach, collisionCandidates, scenePrimitiveCount);
+
+	for (GLint iteration = 0; iteration < collisionIterations; iteration++)
+	{
+		GLboolean isTouching = GL_FALSE;
+
+		for (GLint c = 0; c < candidateCount; c++)
+		{
+			ScenePrimitive* primitive = &scenePrimitives[collisionCandidates[c]];
+			if (primitive->type != SCENE_CORAL)
+			{
+				continue;
+			}
+
+			CoralInstance* instance = &coralInstances[primitive->index];
+			for (GLint s = 0; s < SUBMARINE_COLLISION_SPHERES; s++)
+			{
+				GLfloat centre[3] = { position[0] + submarineCollisionOffsets[s][0],
+					position[1] + submarineCollisionOffsets[s][1], position[2] + submarineCollisionOffsets[s][2] };
+				GLfloat direction[3];
+				GLfloat depth = findMeshPenetration(&coral[instance->mesh], instance->scale, instance->heading,
+					instance->position, centre, submarineCollisionRadius, direction);
+
+				if (depth > 0)
+				{
+					position[0] += direction[0] * depth;
+					position[1] += direction[1] * depth;
+					position[2] += direction[2] * depth;
+					isTouching = GL_TRUE;
+				}
+			}
+		}
+
+		for (GLint s = 0; s < SUBMARINE_COLLISION_SPHERES; s++)
+		{
+			clampSphereToScene(position, submarineCollisionOffsets[s], submarineCollisionRadius);
+		}
+
+		if (!isTouching)
+		{
+			break;
+		}
+	}
+
+	submarineX = position[0];
+	submarineY = position[1];
+	submarineZ = position[2];
+
+	collisionTime = getTimeSeconds() - start;
+}
+
+// What the closest triangle search keeps track of for findMeshDistance
+typedef struct
+{
+	Object* mesh;
+	GLfloat closestDistance;
+	GLfloat closestFacing;
+} MeshDistanceSearch;
+
+/*
+* Measures the distance to one triangle for the closest triangle search. It
+* also remembers how much the closest triangle faces the point, which gives
+* the sign of the distance. Where several triangles share the closest point
+* (an edge or corner) the one facing the point the most decides it.
+*/
+GLfloat measureTriangleDistance(void* data, GLint primitive, GLfloat point[3], GLfloat maxDistance)
+{
+	// The search keeps its own closest distance with a bit of slack for ties,
+	// so the query's cutoff isn't needed here
+	(void)maxDistance;
+
+	MeshDistanceSearch* search = (MeshDistanceSearch*)data;
+	Vertex3* vertices = search->mesh->values.vertices;
+	GLint* triangle = &search->mesh->triangles[primitive * 3];
+
+	GLfloat closest[3];
+	closestPointOnTriangle(point, vertices[triangle[0]].position, vertices[triangle[1]].position,
+		vertices[triangle[2]].position, closest);
+
+	GLfloat away[3] = { point[0] - closest[0], point[1] - closest[1], point[2] - closest[2] };
+	GLfloat distance = sqrtf(away[0] * away[0] + away[1] * away[1] + away[2] * away[2]);
+	if (distance > search->closestDistance + 0.00001f)
+	{
+		return distance;
+	}
+
+	Vertex3 normal = calculateNormal(vertices[triangle[0]], vertices[triangle[1]], vertices[triangle[2]]);
+	normalizeVectorArray(normal.position);
+	GLfloat facing = away[0] * normal.position[0] + away[1] * normal.position[1] + away[2] * normal.position[2];
+	if (distance > 0)
+	{
+		facing /= distance;
+	}
+
+	if (distance < search->closestDistance - 0.00001f || fabsf(facing) > fabsf(search->closestFacing))
+	{
+		search->closestDistance = distance;
+		search->closestFacing = facing;
+	}
+
+	return distance;
+}
+
+/*
+* Finds the signed distance from a point to the triangles of a mesh placed in
+* the world, negative when the point is inside. Only triangles within the band
+* are looked at, so anything further reads as the band.
+*/
+GLfloat findMeshDistance(Object* mesh, GLfloat scale, GLfloat heading, GLfloat translation[3], GLfloat point[3], GLfloat band)
+{
+	GLfloat local[3];
+	unplaceModelPoint(point, scale, heading, translation, local);
+
+	MeshDistanceSearch search = { mesh, band / scale, 0 };
+	queryBvhClosest(&mesh->triangleBvh, mesh->triangleBounds, local, band / scale, measureTriangleDistance, &search, NULL);
+
+	return (search.closestFacing < 0 ? -1.0f : 1.0f) * search.closestDistance * scale;
+}
+
+// The part of the obstacle field one thread bakes, a range of z slices
+typedef struct
+{
+	GLint firstSlice;
+	GLint lastSlice;
+} ObstacleFieldJob;
+
+/*
+* Bakes the z slices of one job. Each point asks the scene hierarchy for the
+* coral near it and keeps the closest signed distance. The scene is only read,
+* and each thread has its own list for the query results.
+*/
+void bakeObstacleFieldSlices(void* data)
+{
+	ObstacleFieldJob* job = (ObstacleFieldJob*)data;
+	GLint* candidates = (GLint*)malloc(sizeof(GLint) * (scenePrimitiveCount > 0 ? scenePrimitiveCount : 1));
+	if (!candidates)
+	{
+		printf("Error allocating memory for the obstacle field\n");
+		exit(1);
+	}
+	for (GLint k = job->firstSlice; k < job->lastSlice; k++)
+	{
+		for (GLint j = 0; j < obstacleFieldSize[1]; j++)
+		{
+			for (GLint i = 0; i < obstacleFieldSize[0]; i++)
+			{
+				GLfloat point[3] =
+				{
+					obstacleFieldOrigin[0] + i * obstacleFieldSpacing,
+					obstacleFieldOrigin[1] + j * obstacleFieldSpacing,
+					obstacleFieldOrigin[2] + k * obstacleFieldSpacing
+				};
+
+				GLfloat distance = obstacleFieldBand;
+				GLint candidateCount = queryBvhSphere(&sceneBvh, sceneBounds, point, obstacleFieldBand,
+					candidates, scenePrimitiveCount);
+
+				for (GLint c = 0; c < candidateCount; c++)
+				{
+					ScenePrimitive* primitive = &scenePrimitives[candidates[c]];
+					if (primitive->type != SCENE_CORAL)
+					{
+						continue;
+					}
+
+					CoralInstance* instance = &coralInstances[primitive->index];
+					GLfloat coralDistance = findMeshDistance(&coral[instance->mesh], instance->scale, instance->heading,
+						instance->position, point, obstacleFieldBand);
+
+					// The reef is every coral together, so the closest one wins
+					if (coralDistance < distance)
+					{
+						distance = coralDistance;
+					}
+				}
+
+				obstacleField[(k * obstacleFieldSize[1] + j) * obstacleFieldSize[0] + i] = distance;
+			}
+		}
+	}
+
+	free(candidates);
+}
+
+/*
+* Bakes the obstacle field over the whole cylinder, splitting the z slices
+* between threads. Coral that moves after this keeps its old spot in the field
+* until it is baked again.
+*/
+void bakeObstacleField()
+{
+	double start = getTimeSeconds();
+
+	obstacleFieldOrigin[0] = -(GLfloat)bottomDiscRadius;
+	obstacleFieldOrigin[1] = -(GLfloat)bottomDiscRadius;
+	obstacleFieldOrigin[2] = 0;
+	obstacleFieldSize[0] = (GLint)(2 * bottomDiscRadius / obstacleFieldSpacing) + 2;
+	obstacleFieldSize[1] = obstacleFieldSize[0];
+	obstacleFieldSize[2] = (GLint)(wallHeight / obstacleFieldSpacing) + 2;
+
+	free(obstacleField);
+	obstacleField = (GLfloat*)malloc(sizeof(GLfloat) * obstacleFieldSize[0] * obstacleFieldSize[1] * obstacleFieldSize[2]);
+	if (!obstacleField)
+	{
+		printf("Error allocating memory for the obstacle field\n");
+		exit(1);
+	}
+
+	updateSceneBvh();
+
+	GLint threadCount = obstacleFieldThreads > 0 ? obstacleFieldThreads : getProcessorCount();
+	if (threadCount > obstacleFieldSize[2])
+	{
+		threadCount = obstacleFieldSize[2];
+	}
+
+	Thread* threads = (Thread*)malloc(sizeof(Thread) * threadCount);
+	ObstacleFieldJob* jobs = (ObstacleFieldJob*)malloc(sizeof(ObstacleFieldJob) * threadCount);
+	if (!threads || !jobs)
+	{
+		printf("Error allocating memory for the obstacle field threads\n");
+		exit(1);
+	}
+
+	// Interleaving would balance better, but coral sits on the floor so even
+	// slabs of slices are close enough and keep each thread's writes together
+	for (GLint t = 0; t < threadCount; t++)
+	{
+		jobs[t].firstSlice = obstacleFieldSize[2] * t / threadCount;
+		jobs[t].lastSlice = obstacleFieldSize[2] * (t + 1) / threadCount;
+	}
+
+	for (GLint t = 1; t < threadCount; t++)
+	{
+		startThread(&threads[t], bakeObstacleFieldSlices, &jobs[t]);
+	}
+	bakeObstacleFieldSlices(&jobs[0]);
+	for (GLint t = 1; t < threadCount; t++)
+	{
+		joinThread(threads[t]);
+	}
+
+	free(threads);
+	free(jobs);
+
+	printf("Baked the %d x %d x %d obstacle field on %d threads in %.2f ms\n", obstacleFieldSize[0],
+		obstacleFieldSize[1], obstacleFieldSize[2], threadCount, (getTimeSeconds() - start) * 1000.0);
+}
+
+/*
+* Samples the obstacle field at a point with trilinear interpolation. The
+* gradient, which points away from the nearest coral, comes from the same
+* eight grid points. Outside the grid the field reads as the band.
+*/
+GLfloat sampleObstacleField(GLfloat point[3], GLfloat gradient[3])
+{
+	gradient[0] = gradient[1] = gradient[2] = 0;
+	if (!obstacleField)
+	{
+		return obstacleFieldBand;
+	}
+
+	GLint cell[3];
+	GLfloat t[3];
+	for (GLint a = 0; a < 3; a++)
+	{
+		GLfloat grid = (point[a] - obstacleFieldOrigin[a]) / obstacleFieldSpacing;
+		if (grid < 0 || grid >= obstacleFieldSize[a] - 1)
+		{
+			return obstacleFieldBand;
+		}
+		cell[a] = (GLint)grid;
+		t[a] = grid - cell[a];
+	}
+
+	GLint strideY = obstacleFieldSize[0];
+	GLint strideZ = obstacleFieldSize[0] * obstacleFieldSize[1];
+	GLfloat* base = &obstacleField[cell[2] * strideZ + cell[1] * strideY + cell[0]];
+
+	GLfloat c000 = base[0], c100 = base[1];
+	GLfloat c010 = base[strideY], c110 = base[strideY + 1];
+	GLfloat c001 = base[strideZ], c101 = base[strideZ + 1];
+	GLfloat c011 = base[strideZ + strideY], c111 = base[strideZ + strideY + 1];
+
+	// Interpolate along x first, then y, then z
+	GLfloat c00 = c000 + (c100 - c000) * t[0];
+	GLfloat c10 = c010 + (c110 - c010) * t[0];
+	GLfloat c01 = c001 + (c101 - c001) * t[0];
+	GLfloat c11 = c011 + (c111 - c011) * t[0];
+	GLfloat c0 = c00 + (c10 - c00) * t[1];
+	GLfloat c1 = c01 + (c11 - c01) * t[1];
+
+	// The derivative of the interpolation along each axis
+	GLfloat dx0 = (c100 - c000) + ((c110 - c010) - (c100 - c000)) * t[1];
+	GLfloat dx1 = (c101 - c001) + ((c111 - c011) - (c101 - c001)) * t[1];
+	gradient[0] = (dx0 + (dx1 - dx0) * t[2]) / obstacleFieldSpacing;
+	gradient[1] = ((c10 - c00) + ((c11 - c01) - (c10 - c00)) * t[2]) / obstacleFieldSpacing;
+	gradient[2] = (c1 - c0) / obstacleFieldSpacing;
+
+	return c0 + (c1 - c0) * t[2];
+}
+
+/*
+* Finds the distance from a point to the submarine, treated as a capsule
+* running through its collision spheres. The direction points from the
+* submarine towards the point.
+*/
+GLfloat findSubmarineDistance(GLfloat point[3], GLfloat direction[3])
+{
+	GLfloat start[3], segment[3];
+	for (GLint a = 0; a < 3; a++)
+	{
+		GLfloat position = a == 0 ? submarineX : a == 1 ? submarineY : submarineZ;
+		start[a] = position + submarineCollisionOffsets[0][a];
+		segment[a] = submarineCollisionOffsets[SUBMARINE_COLLISION_SPHERES - 1][a] - submarineCollisionOffsets[0][a];
+	}
+
+	GLfloat lengthSquared = segment[0] * segment[0] + segment[1] * segment[1] + segment[2] * segment[2];
+	GLfloat along = 0;
+	if (lengthSquared > 0)
+	{
+		along = ((point[0] - start[0]) * segment[0] + (point[1] - start[1]) * segment[1] +
+			(point[2] - start[2]) * segment[2]) / lengthSquared;
+		along = along < 0 ? 0 : along > 1 ? 1 : along;
+	}
+
+	for (GLint a = 0; a < 3; a++)
+	{
+		direction[a] = point[a] - (start[a] + segment[a] * along);
+	}
+	GLfloat distance = sqrtf(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+	if (distance > 0)
+	{
+		direction[0] /= distance;
+		direction[1] /= distance;
+		direction[2] /= distance;
+	}
+
+	return distance - submarineCollisionRadius;
+}
+
+/*
+* Command line benchmark for the bounding volume hierarchy. It scatters a lot of
+* coral sized boxes over a large disc, builds the hierarchy over them, and times
+* frustum, ray and proximity queries from random spots inside the disc.
+*/
+GLint benchmarkBvh(GLint instanceCount)
+{
+	GLint queryCount = 1000;
+	GLfloat discRadius = 50.0f * sqrtf((GLfloat)instanceCount);
+
+	Bounds* boxes = (Bounds*)malloc(sizeof(Bounds) * instanceCount);
+	GLint* results = (GLint*)malloc(sizeof(GLint) * instanceCount);
+	if (!boxes || !results)
+	{
+		printf("Error allocating memory for the benchmark\n");
+		return 1;
+	}
+
+	srand(1);
+	for (GLint i = 0; i < instanceCount; i++)
+	{
+		GLfloat angle = generateRandomFloat(0, 2 * PI);
+		GLfloat r = discRadius * sqrtf(generateRandomFloat(0, 1));
+		GLfloat size = generateRandomFloat(10, 60);
+		GLfloat centre[3] = { r * cosf(angle), r * sinf(angle), size / 2 };
+
+		for (GLint k = 0; k < 3; k++)
+		{
+			boxes[i].minimum[k] = centre[k] - size / 2;
+			boxes[i].maximum[k] = centre[k] + size / 2;
+		}
+	}
+
+	Bvh bvh = { 0 };
+	double start = getTimeSeconds();
+	buildBvh(&bvh, boxes, instanceCount);
+	double buildTime = getTimeSeconds() - start;
+
+	GLfloat projection[16];
+	matrixPerspective(projection, fieldOfView, 4.0f / 3.0f, 1.0f, 2000.0f);
+
+	double frustumTime = 0, rayTime = 0, sphereTime = 0;
+	long frustumFound = 0, raysHit = 0, sphereFound = 0;
+
+	for (GLint q = 0; q < queryCount; q++)
+	{
+		GLfloat angle = generateRandomFloat(0, 2 * PI);
+		GLfloat r = discRadius * sqrtf(generateRandomFloat(0, 1));
+		GLfloat eye[3] = { r * cosf(angle), r * sinf(angle), generateRandomFloat(10, 200) };
+		GLfloat direction[3] = { generateRandomFloat(-1, 1), generateRandomFloat(-1, 1), generateRandomFloat(-0.3f, 0.1f) };
+		normalizeVectorArray(direction);
+		GLfloat centre[3] = { eye[0] + direction[0], eye[1] + direction[1], eye[2] + direction[2] };
+		GLfloat up[3] = { 0, 0, 1 };
+
+		GLfloat view[16], planes[6][4];
+		matrixLookAt(view, eye, centre, up);
+
+		start = getTimeSeconds();
+		extractFrustumPlanes(projection, view, planes);
+		frustumFound += queryBvhFrustum(&bvh, boxes, planes, results);
+		frustumTime += getTimeSeconds() - start;
+
+		start = getTimeSeconds();
+		GLfloat distance;
+		raysHit += queryBvhRay(&bvh, boxes, eye, direction, 2000.0f, NULL, NULL, &distance) >= 0;
+		rayTime += getTimeSeconds() - start;
+
+		start = getTimeSeconds();
+		sphereFound += queryBvhSphere(&bvh, boxes, eye, 100.0f, results, instanceCount);
+		sphereTime += getTimeSeconds() - start;
+	}
+
+	printf("Hierarchy over %d boxes: %d nodes, built in %.2f ms\n", instanceCount, bvh.nodeCount, buildTime * 1000.0);
+	printf("Frustum query: %.1f us on average, %.1f boxes found\n", frustumTime / queryCount * 1000000.0,
+		(double)frustumFound / queryCount);
+	printf("Ray query: %.1f us on average, %.1f%% of rays hit\n", rayTime / queryCount * 1000000.0,
+		100.0 * raysHit / queryCount);
+	printf("Proximity query: %.1f us on average, %.1f boxes found\n", sphereTime / queryCount * 1000000.0,
+		(double)sphereFound / queryCount);
+
+	freeBvh(&bvh);
+	free(boxes);
+	free(results);
+	return 0;
+}
+
+/*
+* Method to read PPM files to set a TextureID to it. It reads PPM files of most widths
+* and heights, allocating memory dynamically. It reads through the PPM file and
+* creates a mipmap to render the texture on top of. Handles errors if the file
+* cannot be properly read or manipulated. Returns an unsigned integer representing
+* the ID of the created texture.
+*/
+GLuint readPPM(char * filename)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+	{
+		printf("Could not open file %s\n", filename);
+		return 1;
+	}
+
+	char line[256];
+	char header[3];
+	GLint width, height, maxColor;
+
+	if (!fgets(line, sizeof(line), file))
+	{
+		printf("Error with reading the header\n");
+		fclose(file);
+		return 1;
+	}
+
+	sscanf_s(line, "%s2", header, (unsigned)_countof(header));
+	if (header[0] != 'P' || header[1] != '6')
+	{
+		printf("Error with file, make sure it's a valid format\n");
+		fclose(file);
+		return 1;
+	}
+
+	if (!fgets(line, sizeof(line), file))
+	{
+		printf("Error reading sizes\n");
+		fclose(file);
+		return 1;
+	}
+	sscanf_s(line, "%d %d", &width, &height);
+
+	if (!fgets(line, sizeof(line), file))
+	{
+		printf("Error reading max color\n");
+		fclose(file);
+		return 1;
+	}
+	sscanf_s(line, "%d", &maxColor);
+
+	GLubyte *textureData = (GLubyte *)malloc(width * height * 3);
+	if (!textureData) 
+	{
+		printf("Error allocating memory for textureData\n");
+		fclose(file);
+		return 1;
+	}
+
+	fread(textureData, 3, width * height, file);
+	fclose(file);
+
+	GLuint textureID = 1;
+	glGenTextures(1, &textureID);
+
+	glBindTexture(GL_TEXTURE_2D, textureID);
+
+	gluBuild2DMipmaps(GL_TEXTURE_2D, 3, width, height, GL_RGB, GL_UNSIGNED_BYTE, textureData);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	
+	free(textureData);
+
+	return textureID;
+}
+
+// Method used to draw the submarine
+void drawSubmarine()
+{
+	GLfloat model[16];
+	matrixIdentity(model);
+
+	// Move to the look at position
+	matrixTranslate(model, frameState->submarine[0], frameState->submarine[1], frameState->submarine[2]);
+
+	// Rotate the submarine so that it is rotated to the right axis
+	matrixRotate(model, 90.0f, 1, 0, 0);
+	matrixRotate(model, -90.0f, 0, 1, 0);
+
+	// Increase the size by 0.1x
+	matrixScale(model, 0.2f, 0.2f, 0.2f);
+
+	// Queue the submarine at the level of detail for how big it is on screen
+	submarineLodLevel = selectLodLevel(&submarine, submarineLodLevel, 0.2f, 0, frameState->submarine);
+	submitRenderItem(GL_TRUE, MATERIAL_SUBMARINE, 0, model, renderObjectItem, &submarine, submarineLodLevel);
+}
+
+// Builds the model matrix a coral instance is drawn with
+void getCoralModelMatrix(CoralInstance* instance, GLfloat model[16])
+{
+	matrixIdentity(model);
+
+	// Move each coral to their random position and turn it to its heading
+	matrixTranslate(model, instance->position[0], instance->position[1], instance->position[2]);
+	matrixRotate(model, instance->heading * (180.0f / PI), 0, 0, 1);
+
+	// Scale each coral to its size
+	matrixScale(model, instance->scale, instance->scale, instance->scale);
+
+	// Rotate the coral so it lies on the proper axis
+	matrixRotate(model, 90.0f, 1, 0, 0);
+	matrixRotate(model, -90.0f, 0, 1, 0);
+}
+
+/*
+* Projects a point onto the occlusion buffer, giving its x and y in pixels and
+* its window depth. Points closer than the near plane, which is 1 away, can't
+* be projected.
+*/
+GLboolean projectOcclusionPoint(GLfloat matrix[16], GLfloat point[3], GLfloat result[3])
+{
+	GLfloat clip[4];
+	for (GLint row = 0; row < 4; row++)
+	{
+		clip[row] = matrix[row] * point[0] + matrix[4 + row] * point[1] + matrix[8 + row] * point[2] + matrix[12 + row];
+	}
+	if (clip[3] < 1.0f)
+	{
+		return GL_FALSE;
+	}
+
+	result[0] = (clip[0] / clip[3] * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+	result[1] = (clip[1] / clip[3] * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+	result[2] = clip[2] / clip[3] * 0.5f + 0.5f;
+	return GL_TRUE;
+}
+
+/*
+* Finds the pixels a box covers on the occlusion buffer and the depth of its
+* nearest corner. A box that reaches past the near plane has no rectangle.
+*/
+GLboolean getOcclusionRectangle(Bounds* bounds, GLfloat matrix[16], GLfloat minimum[2], GLfloat maximum[2], GLfloat* nearest)
+{
+	minimum[0] = minimum[1] = 1e30f;
+	maximum[0] = maximum[1] = -1e30f;
+	*nearest = 1.0f;
+
+	for (GLint corner = 0; corner < 8; corner++)
+	{
+		GLfloat point[3] =
+		{
+			(corner & 1) ? bounds->maximum[0] : bounds->minimum[0],
+			(corner & 2) ? bounds->maximum[1] : bounds->minimum[1],
+			(corner & 4) ? bounds->maximum[2] : bounds->minimum[2]
+		};
+		GLfloat projected[3];
+		if (!projectOcclusionPoint(matrix, point, projected))
+		{
+			return GL_FALSE;
+		}
+
+		for (GLint a = 0; a < 2; a++)
+		{
+			minimum[a] = projected[a] < minimum[a] ? projected[a] : minimum[a];
+			maximum[a] = projected[a] > maximum[a] ? projected[a] : maximum[a];
+		}
+		*nearest = projected[2] < *nearest ? projected[2] : *nearest;
+	}
+	return GL_TRUE;
+}
+
+/*
+* Sets up a projected triangle for the rasterizer and adds it to the tiles it
+* touches. Both windings are kept since nothing says which way the coral faces
+* wind, so clockwise triangles get their edges flipped.
+*/
+void addOcclusionTriangle(GLfloat* a, GLfloat* b, GLfloat* c)
+{
+	GLfloat area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+	if (fabsf(area) < 1e-6f)
+	{
+		return;
+	}
+
+	GLint minimum[2];
+	GLint maximum[2];
+	GLint size[2] = { OCCLUSION_WIDTH, OCCLUSION_HEIGHT };
+	for (GLint i = 0; i < 2; i++)
+	{
+		GLfloat low = a[i] < b[i] ? (a[i] < c[i] ? a[i] : c[i]) : (b[i] < c[i] ? b[i] : c[i]);
+		GLfloat high = a[i] > b[i] ? (a[i] > c[i] ? a[i] : c[i]) : (b[i] > c[i] ? b[i] : c[i]);
+		minimum[i] = low < 0 ? 0 : (GLint)low;
+		maximum[i] = high >= size[i] ? size[i] - 1 : (GLint)floorf(high);
+		if (minimum[i] > maximum[i])
+		{
+			return;
+		}
+	}
+
+	reserveArray((void**)&occlusionTriangles, &occlusionTriangleCapacity, occlusionTriangleCount + 1, sizeof(OcclusionTriangle));
+	OcclusionTriangle* triangle = &occlusionTriangles[occlusionTriangleCount];
+
+	GLfloat sign = area > 0 ? 1.0f : -1.0f;
+	GLfloat* corners[3] = { a, b, c };
+	for (GLint e = 0; e < 3; e++)
+	{
+		GLfloat* p = corners[e];
+		GLfloat* q = corners[(e + 1) % 3];
+		triangle->edges[e][0] = (p[1] - q[1]) * sign;
+		triangle->edges[e][1] = (q[0] - p[0]) * sign;
+		triangle->edges[e][2] = -(triangle->edges[e][0] * p[0] + triangle->edges[e][1] * p[1]);
+	}
+
+	// The depth as a plane over the screen, which is right for window depths
+	triangle->depth[0] = ((b[2] - a[2]) * (c[1] - a[1]) - (c[2] - a[2]) * (b[1] - a[1])) / area;
+	triangle->depth[1] = ((c[2] - a[2]) * (b[0] - a[0]) - (b[2] - a[2]) * (c[0] - a[0])) / area;
+	triangle->depth[2] = a[2] - triangle->depth[0] * a[0] - triangle->depth[1] * a[1];
+
+	for (GLint i = 0; i < 2; i++)
+	{
+		triangle->minimum[i] = minimum[i];
+		triangle->maximum[i] = maximum[i];
+	}
+
+	for (GLint y = minimum[1] / OCCLUSION_TILE_HEIGHT; y <= maximum[1] / OCCLUSION_TILE_HEIGHT; y++)
+	{
+		for (GLint x = minimum[0] / OCCLUSION_TILE_WIDTH; x <= maximum[0] / OCCLUSION_TILE_WIDTH; x++)
+		{
+			OcclusionTile* tile = &occlusionTiles[y * OCCLUSION_TILES_X + x];
+			reserveArray((void**)&tile->triangles, &tile->triangleCapacity, tile->triangleCount + 1, sizeof(GLint));
+			tile->triangles[tile->triangleCount++] = occlusionTriangleCount;
+		}
+	}
+	occlusionTriangleCount++;
+}
+
+/*
+* Projects the full mesh of a coral instance and adds its triangles. The
+* coarser levels are cheaper but they don't stay inside the coral, so they
+* could hide something that's really poking out past it. The full mesh is
+* always kept in floats since collision uses it, even for quantized coral.
+*/
+void addCoralOccluder(CoralInstance* instance, GLfloat matrix[16])
+{
+	Object* mesh = &coral[instance->mesh];
+	Vertex3* vertices = mesh->values.vertices;
+	GLint* indices = mesh->triangles;
+	GLint vertexCount = mesh->values.vertexCount;
+	GLint triangleCount = mesh->triangleCount;
+
+	GLfloat model[16];
+	GLfloat transform[16];
+	getCoralModelMatrix(instance, model);
+	matrixMultiply(matrix, model, transform);
+
+	// x, y, depth and whether the vertex is in front of the near plane
+	reserveArray((void**)&occlusionVertices, &occlusionVertexCapacity, vertexCount * 4, sizeof(GLfloat));
+	for (GLint v = 0; v < vertexCount; v++)
+	{
+		occlusionVertices[v * 4 + 3] = (GLfloat)projectOcclusionPoint(transform, vertices[v].position, &occlusionVertices[v * 4]);
+	}
+
+	for (GLint t = 0; t < triangleCount; t++)
+	{
+		GLfloat* a = &occlusionVertices[indices[t * 3] * 4];
+		GLfloat* b = &occlusionVertices[indices[t * 3 + 1] * 4];
+		GLfloat* c = &occlusionVertices[indices[t * 3 + 2] * 4];
+
+		// Triangles through the near plane are left out, which only hides less
+		if (a[3] > 0 && b[3] > 0 && c[3] > 0)
+		{
+			addOcclusionTriangle(a, b, c);
+		}
+	}
+}
+
+/*
+* Projects the coarse grid of a terrain tile and adds its triangles. Every
+* corner of the grid is as low as the lowest height in the cells around it, so
+* the grid stays under the real ground and never hides anything the ground
+* doesn't.
+*/
+void addTerrainOccluder(TerrainTile* tile, GLfloat matrix[16])
+{
+	GLfloat projected[(TERRAIN_OCCLUDER_CELLS + 1) * (TERRAIN_OCCLUDER_CELLS + 1)][4];
+	for (GLint v = 0; v < (TERRAIN_OCCLUDER_CELLS + 1) * (TERRAIN_OCCLUDER_CELLS + 1); v++)
+	{
+		projected[v][3] = (GLfloat)projectOcclusionPoint(matrix, tile->occluder[v], projected[v]);
+	}
+
+	for (GLint j = 0; j < TERRAIN_OCCLUDER_CELLS; j++)
+	{
+		for (GLint i = 0; i < TERRAIN_OCCLUDER_CELLS; i++)
+		{
+			GLfloat* a = projected[j * (TERRAIN_OCCLUDER_CELLS + 1) + i];
+			GLfloat* b = projected[j * (TERRAIN_OCCLUDER_CELLS + 1) + i + 1];
+			GLfloat* c = projected[(j + 1) * (TERRAIN_OCCLUDER_CELLS + 1) + i + 1];
+			GLfloat* d = projected[(j + 1) * (TERRAIN_OCCLUDER_CELLS + 1) + i];
+			if (a[3] > 0 && b[3] > 0 && c[3] > 0)
+			{
+				addOcclusionTriangle(a, b, c);
+			}
+			if (a[3] > 0 && c[3] > 0 && d[3] > 0)
+			{
+				addOcclusionTriangle(a, c, d);
+			}
+		}
+	}
+}
+
+/*
+* Clears one tile of the occlusion buffer and draws the triangles that touch
+* it, keeping the nearest depth. With SSE2 four pixels of a row are tested and
+* written at once, which is why the tiles are a multiple of four wide. After
+* that each block of the tile keeps its farthest depth.
+*/
+void drawOcclusionTile(GLint tileIndex)
+{
+	OcclusionTile* tile = &occlusionTiles[tileIndex];
+	GLint tileX = (tileIndex % OCCLUSION_TILES_X) * OCCLUSION_TILE_WIDTH;
+	GLint tileY = (tileIndex / OCCLUSION_TILES_X) * OCCLUSION_TILE_HEIGHT;
+
+	for (GLint y = tileY; y < tileY + OCCLUSION_TILE_HEIGHT; y++)
+	{
+		for (GLint x = tileX; x < tileX + OCCLUSION_TILE_WIDTH; x++)
+		{
+			occlusionDepth[y * OCCLUSION_WIDTH + x] = 1.0f;
+		}
+	}
+
+	for (GLint t = 0; t < tile->triangleCount; t++)
+	{
+		OcclusionTriangle* triangle = &occlusionTriangles[tile->triangles[t]];
+		GLint minimumX = triangle->minimum[0] > tileX ? triangle->minimum[0] : tileX;
+		GLint maximumX = triangle->maximum[0] < tileX + OCCLUSION_TILE_WIDTH - 1 ? triangle->maximum[0] : tileX + OCCLUSION_TILE_WIDTH - 1;
+		GLint minimumY = triangle->minimum[1] > tileY ? triangle->minimum[1] : tileY;
+		GLint maximumY = triangle->maximum[1] < tileY + OCCLUSION_TILE_HEIGHT - 1 ? triangle->maximum[1] : tileY + OCCLUSION_TILE_HEIGHT - 1;
+
+		for (GLint y = minimumY; y <= maximumY; y++)
+		{
+			GLfloat* row = &occlusionDepth[y * OCCLUSION_WIDTH];
+			GLfloat centreY = y + 0.5f;
+
+			// Solve the edges for where the triangle crosses this row, so long
+			// thin triangles don't walk their whole box
+			GLfloat left = (GLfloat)minimumX;
+			GLfloat right = (GLfloat)maximumX;
+			for (GLint e = 0; e < 3; e++)
+			{
+				GLfloat a = triangle->edges[e][0];
+				GLfloat rest = triangle->edges[e][1] * centreY + triangle->edges[e][2];
+				if (a > 0)
+				{
+					GLfloat crossing = -rest / a - 0.5f;
+					left = crossing > left ? crossing : left;
+				}
+				else if (a < 0)
+				{
+					GLfloat crossing = -rest / a - 0.5f;
+					right = crossing < right ? crossing : right;
+				}
+				else if (rest < 0)
+				{
+					right = -1.0f;
+				}
+			}
+			if (left > right)
+			{
+				continue;
+			}
+
+			// The edges still get tested for each pixel, the span is only to skip work
+			GLint firstX = (GLint)floorf(left);
+			GLint lastX = (GLint)ceilf(right);
+			firstX = firstX > minimumX ? firstX : minimumX;
+			lastX = lastX < maximumX ? lastX : maximumX;
+#ifdef HAS_SSE2
+			__m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+			__m128 edgeX[3];
+			__m128 edgeRow[3];
+			for (GLint e = 0; e < 3; e++)
+			{
+				edgeX[e] = _mm_set1_ps(triangle->edges[e][0]);
+				edgeRow[e] = _mm_set1_ps(triangle->edges[e][1] * centreY + triangle->edges[e][2]);
+			}
+			__m128 depthX = _mm_set1_ps(triangle->depth[0]);
+			__m128 depthRow = _mm_set1_ps(triangle->depth[1] * centreY + triangle->depth[2]);
+			__m128 zero = _mm_setzero_ps();
+
+			for (GLint x = firstX & ~3; x <= lastX; x += 4)
+			{
+				__m128 centreX = _mm_add_ps(_mm_set1_ps((GLfloat)x), offsets);
+				__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX[0], centreX), edgeRow[0]), zero);
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX[1], centreX), edgeRow[1]), zero));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeX[2], centreX), edgeRow[2]), zero));
+				if (_mm_movemask_ps(inside) == 0)
+				{
+					continue;
+				}
+
+				__m128 depth = _mm_add_ps(_mm_mul_ps(depthX, centreX), depthRow);
+				__m128 old = _mm_loadu_ps(&row[x]);
+				__m128 nearer = _mm_min_ps(old, depth);
+				_mm_storeu_ps(&row[x], _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+			}
+#else
+			for (GLint x = firstX; x <= lastX; x++)
+			{
+				GLfloat centreX = x + 0.5f;
+				GLboolean isInside = GL_TRUE;
+				for (GLint e = 0; e < 3; e++)
+				{
+					if (triangle->edges[e][0] * centreX + triangle->edges[e][1] * centreY + triangle->edges[e][2] < 0)
+					{
+						isInside = GL_FALSE;
+					}
+				}
+
+				GLfloat depth = triangle->depth[0] * centreX + triangle->depth[1] * centreY + triangle->depth[2];
+				if (isInside && depth < row[x])
+				{
+					row[x] = depth;
+				}
+			}
+#endif
+		}
+	}
+
+	for (GLint blockY = tileY / OCCLUSION_BLOCK; blockY < (tileY + OCCLUSION_TILE_HEIGHT) / OCCLUSION_BLOCK; blockY++)
+	{
+		for (GLint blockX = tileX / OCCLUSION_BLOCK; blockX < (tileX + OCCLUSION_TILE_WIDTH) / OCCLUSION_BLOCK; blockX++)
+		{
+			GLfloat farthest = 0.0f;
+			for (GLint y = blockY * OCCLUSION_BLOCK; y < (blockY + 1) * OCCLUSION_BLOCK; y++)
+			{
+				for (GLint x = blockX * OCCLUSION_BLOCK; x < (blockX + 1) * OCCLUSION_BLOCK; x++)
+				{
+					GLfloat depth = occlusionDepth[y * OCCLUSION_WIDTH + x];
+					farthest = depth > farthest ? depth : farthest;
+				}
+			}
+			occlusionBlockDepth[blockY * OCCLUSION_BLOCKS_X + blockX] = farthest;
+		}
+	}
+}
+
+// Draws every tile starting at first, skipping the ones the other threads draw
+void drawOcclusionTiles(GLint first)
+{
+	for (GLint t = first; t < OCCLUSION_TILES; t += occlusionWorkerCount + 1)
+	{
+		drawOcclusionTile(t);
+	}
+}
+
+// Thread function for the occlusion workers, which wait for each frame and draw their tiles
+void runOcclusionWorker(void* data)
+{
+	GLint worker = (GLint)(size_t)data;
+	GLint frame = 0;
+
+	lockMutex(&occlusionMutex);
+	for (;;)
+	{
+		while (occlusionFrame == frame && !isOcclusionStopping)
+		{
+			waitCondition(&occlusionStartCondition, &occlusionMutex);
+		}
+		if (isOcclusionStopping)
+		{
+			break;
+		}
+		frame = occlusionFrame;
+		unlockMutex(&occlusionMutex);
+
+		drawOcclusionTiles(worker + 1);
+
+		lockMutex(&occlusionMutex);
+		occlusionWorkersDone++;
+		signalCondition(&occlusionDoneCondition);
+	}
+	unlockMutex(&occlusionMutex);
+}
+
+// Stops the occlusion workers and lets go of the occluder triangles
+void freeOcclusionBuffer()
+{
+	if (occlusionWorkerCount > 0)
+	{
+		lockMutex(&occlusionMutex);
+		isOcclusionStopping = GL_TRUE;
+		broadcastCondition(&occlusionStartCondition);
+		unlockMutex(&occlusionMutex);
+
+		for (GLint t = 0; t < occlusionWorkerCount; t++)
+		{
+			joinThread(occlusionWorkers[t]);
+		}
+		occlusionWorkerCount = 0;
+	}
+
+	for (GLint t = 0; t < OCCLUSION_TILES; t++)
+	{
+		free(occlusionTiles[t].triangles);
+		occlusionTiles[t].triangles = NULL;
+		occlusionTiles[t].triangleCount = 0;
+		occlusionTiles[t].triangleCapacity = 0;
+	}
+	free(occlusionTriangles);
+	free(occlusionVertices);
+	free(occluderCandidates);
+	occlusionTriangles = NULL;
+	occlusionVertices = NULL;
+	occluderCandidates = NULL;
+	occlusionTriangleCount = 0;
+	occlusionTriangleCapacity = 0;
+	occlusionVertexCapacity = 0;
+	occluderCandidateCapacity = 0;
+}
+
+// Sorts occluder candidates from the most to the least of the screen they cover
+int compareOccluderCandidates(const void* a, const void* b)
+{
+	GLfloat areaA = ((const OccluderCandidate*)a)->area;
+	GLfloat areaB = ((const OccluderCandidate*)b)->area;
+	return areaA < areaB ? 1 : (areaA > areaB ? -1 : 0);
+}
+
+/*
+* Draws the occlusion buffer for this frame from the coral that passed the
+* frustum test. Only coral big enough on the screen is worth drawing, since
+* small coral hides very little. With a terrain the tiles queued this frame go
+* in too, so coral behind a hill gets hidden. The triangles are set up here
+* and the tiles are drawn on the workers and this thread together.
+*/
+void drawOcclusionBuffer(GLint* visible, GLint visibleCount, GLfloat matrix[16])
+{
+	if (occlusionWorkerCount < 0)
+	{
+		occlusionWorkerCount = (occlusionThreads > 0 ? occlusionThreads : getProcessorCount()) - 1;
+		if (occlusionWorkerCount > OCCLUSION_TILES - 1)
+		{
+			occlusionWorkerCount = OCCLUSION_TILES - 1;
+		}
+		initMutex(&occlusionMutex);
+		initCondition(&occlusionStartCondition);
+		initCondition(&occlusionDoneCondition);
+		for (GLint t = 0; t < occlusionWorkerCount; t++)
+		{
+			startThread(&occlusionWorkers[t], runOcclusionWorker, (void*)(size_t)t);
+		}
+		atexit(freeOcclusionBuffer);
+	}
+
+	double start = getTimeSeconds();
+	occlusionTriangleCount = 0;
+	occluderCount = 0;
+	for (GLint t = 0; t < OCCLUSION_TILES; t++)
+	{
+		occlusionTiles[t].triangleCount = 0;
+	}
+
+	GLint candidateCount = 0;
+	for (GLint v = 0; v < visibleCount; v++)
+	{
+		ScenePrimitive* primitive = &scenePrimitives[visible[v]];
+		GLfloat minimum[2];
+		GLfloat maximum[2];
+		GLfloat nearest;
+		if (primitive->type != SCENE_CORAL || !getOcclusionRectangle(&sceneBounds[visible[v]], matrix, minimum, maximum, &nearest))
+		{
+			continue;
+		}
+
+		if (maximum[0] - minimum[0] >= occluderMinimumSize && maximum[1] - minimum[1] >= occluderMinimumSize)
+		{
+			reserveArray((void**)&occluderCandidates, &occluderCandidateCapacity, candidateCount + 1, sizeof(OccluderCandidate));
+			occluderCandidates[candidateCount].area = (maximum[0] - minimum[0]) * (maximum[1] - minimum[1]);
+			occluderCandidates[candidateCount].index = primitive->index;
+			candidateCount++;
+		}
+	}
+
+	// The biggest coral on screen hide the most, and the rest mostly get drawn
+	// over what's already there
+	qsort(occluderCandidates, candidateCount, sizeof(OccluderCandidate), compareOccluderCandidates);
+	for (GLint c = 0; c < candidateCount && occluderCount < occluderLimit; c++)
+	{
+		addCoralOccluder(&coralInstances[occluderCandidates[c].index], matrix);
+		occluderCount++;
+	}
+
+	for (GLint s = 0; terrainHeader && s < terrainBudget; s++)
+	{
+		if (terrainTiles[s].drawnFrame == terrainFrame && atomicLoad(&terrainTiles[s].state) == TERRAIN_TILE_RESIDENT)
+		{
+			addTerrainOccluder(&terrainTiles[s], matrix);
+			occluderCount++;
+		}
+	}
+
+	lockMutex(&occlusionMutex);
+	occlusionFrame++;
+	occlusionWorkersDone = 0;
+	broadcastCondition(&occlusionStartCondition);
+	unlockMutex(&occlusionMutex);
+
+	drawOcclusionTiles(0);
+
+	lockMutex(&occlusionMutex);
+	while (occlusionWorkersDone < occlusionWorkerCount)
+	{
+		waitCondition(&occlusionDoneCondition, &occlusionMutex);
+	}
+	unlockMutex(&occlusionMutex);
+
+	occlusionDrawTime = getTimeSeconds() - start;
+}
+
+/*
+* Tests a box against the occlusion buffer. It's hidden when every pixel it
+* covers already has something nearer than its nearest corner. A block whose
+* farthest depth is nearer than that is hidden all at once, so the pixels only
+* get looked at in the blocks that aren't.
+*/
+GLboolean isOccluded(Bounds* bounds, GLfloat matrix[16])
+{
+	GLfloat minimum[2];
+	GLfloat maximum[2];
+	GLfloat nearest;
+	if (!getOcclusionRectangle(bounds, matrix, minimum, maximum, &nearest))
+	{
+		return GL_FALSE;
+	}
+
+	GLint minimumX = minimum[0] < 0 ? 0 : (GLint)minimum[0];
+	GLint minimumY = minimum[1] < 0 ? 0 : (GLint)minimum[1];
+	GLint maximumX = maximum[0] >= OCCLUSION_WIDTH ? OCCLUSION_WIDTH - 1 : (GLint)floorf(maximum[0]);
+	GLint maximumY = maximum[1] >= OCCLUSION_HEIGHT ? OCCLUSION_HEIGHT - 1 : (GLint)floorf(maximum[1]);
+	if (minimumX > maximumX || minimumY > maximumY)
+	{
+		return GL_FALSE;
+	}
+
+	for (GLint blockY = minimumY / OCCLUSION_BLOCK; blockY <= maximumY / OCCLUSION_BLOCK; blockY++)
+	{
+		for (GLint blockX = minimumX / OCCLUSION_BLOCK; blockX <= maximumX / OCCLUSION_BLOCK; blockX++)
+		{
+			if (occlusionBlockDepth[blockY * OCCLUSION_BLOCKS_X + blockX] < nearest)
+			{
+				continue;
+			}
+
+			GLint lastY = (blockY + 1) * OCCLUSION_BLOCK - 1;
+			GLint lastX = (blockX + 1) * OCCLUSION_BLOCK - 1;
+			for (GLint y = blockY * OCCLUSION_BLOCK > minimumY ? blockY * OCCLUSION_BLOCK : minimumY; y <= (lastY < maximumY ? lastY : maximumY); y++)
+			{
+				for (GLint x = blockX * OCCLUSION_BLOCK > minimumX ? blockX * OCCLUSION_BLOCK : minimumX; x <= (lastX < maximumX ? lastX : maximumX); x++)
+				{
+					if (occlusionDepth[y * OCCLUSION_WIDTH + x] >= nearest)
+					{
+						return GL_FALSE;
+					}
+				}
+			}
+		}
+	}
+	return GL_TRUE;
+}
+
+// Prints how much the occlusion buffer hid last frame
+void printOcclusionStats()
+{
+	if (!isOcclusionCulling)
+	{
+		printf("Occlusion: off\n");
+		return;
+	}
+
+	printf("Occlusion: %d of %d coral hidden behind %d occluders of %d triangles, drawn in %.3f ms on %d threads\n",
+		occludedCount, occlusionTestCount, occluderCount, occlusionTriangleCount, occlusionDrawTime * 1000.0,
+		occlusionWorkerCount + 1);
+}
+
+/*
+* Queues the coral instances that are inside the view frustum. The frustum comes
+* from the camera and projection matrices of this frame, and the scene hierarchy
+* finds the instances inside it. With occlusion culling the big ones are drawn
+* into the occlusion buffer first, and any coral hidden behind them is skipped.
+*/
+void drawCoral()
+{
+	GLfloat planes[6][4];
+	extractFrustumPlanes(projectionMatrix, viewMatrix, planes);
+
+	updateSceneBvh();
+	GLint visibleCount = queryBvhFrustum(&sceneBvh, sceneBounds, planes, visiblePrimitives);
+
+	GLfloat viewProjection[16];
+	matrixMultiply(projectionMatrix, viewMatrix, viewProjection);
+	occlusionTestCount = 0;
+	occludedCount = 0;
+	if (isOcclusionCulling)
+	{
+		drawOcclusionBuffer(visiblePrimitives, visibleCount, viewProjection);
+	}
+
+	for (GLint v = 0; v < visibleCount; v++)
+	{
+		ScenePrimitive* primitive = &scenePrimitives[visiblePrimitives[v]];
+		if (primitive->type != SCENE_CORAL)
+		{
+			continue;
+		}
+
+		if (isOcclusionCulling && occluderCount > 0)
+		{
+			occlusionTestCount++;
+			if (isOccluded(&sceneBounds[visiblePrimitives[v]], viewProjection))
+			{
+				occludedCount++;
+				continue;
+			}
+		}
+
+		CoralInstance* instance = &coralInstances[primitive->index];
+		Object* mesh = &coral[instance->mesh];
+
+		GLfloat model[16];
+		getCoralModelMatrix(instance, model);
+
+		// Queue each coral at the level of detail for how big it is on screen
+		instance->lodLevel = selectLodLevel(mesh, instance->lodLevel, instance->scale, instance->heading, instance->position);
+		submitRenderItem(GL_TRUE, MATERIAL_CORAL, 0, model, renderObjectItem, mesh, instance->lodLevel);
+	}
+}
+
+/*
+* Method used to draw the unit vectors coming out of the origin. It uses for 
+* loops to set the vector values, and draws an X, Y, and Z vector, with their
+* respective colors being red, green, and blue. It also draws a little white
+* sphere at the origin. It gets called by the render queue with lighting off.
+*/
+void drawUnitVectorGeometry(void* data, GLint param)
+{
+	(void)data;
+	(void)param;
+
+	GLint lineLegnth = 25;
+
+	Vertex3 vertices[3];
+	Color colors[3];
+	// Initialize the vertices and colors to 0
+	for (GLint i = 0; i < 3; i++) 
+	{
+		for (GLint j = 0; j < 3; j++)
+		{
+			vertices[i].position[j] = 0;
+			colors[i].rgb[j] = 0.0;
+		}
+	}
+
+	// Loop that sets each line and color
+	for (GLint i = 0; i < 3; i++)
+	{
+		vertices[i].position[i] = lineLegnth;
+		colors[i].rgb[i] = 1.0;
+	}
+
+	glBegin(GL_LINES);
+	glLineWidth(5);
+	for (GLint i = 0; i < 3; i++)
+	{
+		glColor3f(colors[i].rgb[0], colors[i].rgb[1], colors[i].rgb[2]);
+		glVertex3f(0, 0, 0);
+		glVertex3f(vertices[i].position[0], vertices[i].position[1], vertices[i].position[2]);
+	}
+	glEnd();
+
+	glColor3f(1.0, 1.0, 1.0);
+	drawStaticMesh(&originMarkerMesh, isDrawingEdges);
+}
+
+// Queues the unit vectors at the origin
+void drawUnitVectors()
+{
+	GLfloat model[16];
+	matrixIdentity(model);
+	submitRenderItem(GL_FALSE, MATERIAL_NONE, 0, model, drawUnitVectorGeometry, NULL, 0);
+}
+
+/*
+* Method that's used to draw the bottom of the map, or the sandy sea floor.
+* It draws the disc built by buildStaticGeometry, and fills the circle with 
+* the spongebob sand ppm texture, which the render queue binds before calling it.
+*/
+void drawBottomDiscGeometry(void* data, GLint param)
+{
+	(void)data;
+	(void)param;
+
+	glColor3f(1.0f, 1.0f, 1.0f);
+	drawStaticMesh(&floorMesh, isDrawingEdges);
+}
+
+// Queues the sea floor with the sand texture
+void drawBottomDisc()
+{
+	GLfloat model[16];
+	matrixIdentity(model);
+	submitRenderItem(GL_FALSE, MATERIAL_NONE, sandTexture, model, drawBottomDiscGeometry, NULL, 0);
+}
+
+/*
+* Method to draw the walls of the scene using the same texture as the floor.
+* It draws the cylinder built by buildStaticGeometry.
+*/
+void drawCylinderWallGeometry(void* data, GLint param)
+{
+	(void)data;
+	(void)param;
+
+	glColor3f(1.0f, 1.0f, 1.0f);
+	drawStaticMesh(&wallMesh, isDrawingEdges);
+}
+
+// Queues the walls with the sand texture
+void drawCylinderWall()
+{
+	GLfloat model[16];
+	matrixIdentity(model);
+	submitRenderItem(GL_FALSE, MATERIAL_NONE, sandTexture, model, drawCylinderWallGeometry, NULL, 0);
+}
+
+/*
+* Function that's used to draw fog, which simulates the look of being under
+* water. It draws a blue fog and draws it exponentially. The fog is toggled on
+* and off with the 'b' key.
+*/
+void drawFog()
+{
+	if (isDrawingFog)
+	{
+		glEnable(GL_FOG);
+	}
+	else
+	{
+		glDisable(GL_FOG);
+	}
+	GLfloat fogColor[] = { 0.01f, 0.2f, 0.4f, 1.0f };
+
+	glFogfv(GL_FOG_COLOR, fogColor);
+	glFogf(GL_FOG_MODE, GL_EXP);
+	glFogf(GL_FOG_DENSITY, fogDensity);
+}
+
+/*
+* How far the wave pattern has moved along both x and y at a time value. The
+* waves only depend on x + y, so moving both by timeValue / (2 * frequency)
+* is the same as the time passing. The pattern repeats every half wavelength
+* along both, so the shift is wrapped to keep the numbers small.
+*/
+GLfloat getWaveShift(GLfloat timeValue)
+{
+	GLfloat frequency = 2.0f * PI / waveLength;
+
+	return fmodf(timeValue / (2.0f * frequency), waveLength / 2.0f);
+}
+
+// Works out how many clipmap levels it takes to cover the ocean
+void initClipmap()
+{
+	clipmapLevelCount = 0;
+	GLfloat spacing = clipmapSpacing;
+	do
+	{
+		ClipmapLevel* level = &clipmapLevels[clipmapLevelCount++];
+		level->spacing = spacing;
+		level->isBuilt = GL_FALSE;
+		spacing *= 2.0f;
+	} while (clipmapLevelCount < MAX_CLIPMAP_LEVELS && CLIPMAP_CELLS * spacing / 2.0f < oceanSize);
+}
+
+/*
+* Fills in the vertices of a clipmap level from the wave heights at time 0,
+* which never change since the whole surface gets moved by the wave shift
+* instead. Every level but the last one lines its outer edge up with the
+* coarser level around it, where only every other vertex exists, by putting
+* the odd vertices halfway between their neighbours.
+*/
+void buildClipmapLevel(ClipmapLevel* level, GLboolean isStitched)
+{
+	GLfloat frequency = 2.0f * PI / waveLength;
+
+	for (GLint j = 0; j <= CLIPMAP_CELLS; j++)
+	{
+		for (GLint i = 0; i <= CLIPMAP_CELLS; i++)
+		{
+			GLfloat x = (level->origin[0] + i) * level->spacing;
+			GLfloat y = (level->origin[1] + j) * level->spacing;
+			GLfloat* vertex = &level->vertices[(j * CLIPMAP_VERTICES + i) * 3];
+			GLfloat* normal = &level->normals[(j * CLIPMAP_VERTICES + i) * 3];
+
+			// The slope is the same along x and y
+			GLfloat slope = cosf((x + y) * frequency + wavePhase) * waveAmplitude * frequency;
+			Vertex3 surfaceNormal = { { -slope, -slope, 1.0f } };
+			normalizeVector(&surfaceNormal);
+
+			vertex[0] = x;
+			vertex[1] = y;
+			vertex[2] = getWaveHeightAt(x, y, 0);
+			memcpy(normal, surfaceNormal.position, sizeof(GLfloat) * 3);
+		}
+	}
+
+	if (!isStitched)
+	{
+		return;
+	}
+
+	// The origin is always even, so the odd vertices along the edges are the ones in between
+	for (GLint k = 1; k < CLIPMAP_CELLS; k += 2)
+	{
+		GLint edges[4][3] =
+		{
+			{ k, k - 1, k + 1 },
+			{ CLIPMAP_CELLS * CLIPMAP_VERTICES + k, CLIPMAP_CELLS * CLIPMAP_VERTICES + k - 1, CLIPMAP_CELLS * CLIPMAP_VERTICES + k + 1 },
+			{ k * CLIPMAP_VERTICES, (k - 1) * CLIPMAP_VERTICES, (k + 1) * CLIPMAP_VERTICES },
+			{ k * CLIPMAP_VERTICES + CLIPMAP_CELLS, (k - 1) * CLIPMAP_VERTICES + CLIPMAP_CELLS, (k + 1) * CLIPMAP_VERTICES + CLIPMAP_CELLS }
+		};
+
+		for (GLint e = 0; e < 4; e++)
+		{
+			GLfloat* middle = &level->vertices[edges[e][0] * 3];
+			GLfloat* before = &level->vertices[edges[e][1] * 3];
+			GLfloat* after = &level->vertices[edges[e][2] * 3];
+			middle[2] = (before[2] + after[2]) * 0.5f;
+
+			Vertex3 normal;
+			for (GLint a = 0; a < 3; a++)
+			{
+				normal.position[a] = level->normals[edges[e][1] * 3 + a] + level->normals[edges[e][2] * 3 + a];
+			}
+			normalizeVector(&normal);
+			memcpy(&level->normals[edges[e][0] * 3], normal.position, sizeof(GLfloat) * 3);
+		}
+	}
+}
+
+// Whether a cell of a clipmap level is in the hole left for the finer level
+GLboolean isInClipmapHole(GLint hole[4], GLint i, GLint j)
+{
+	return i >= hole[0] && i < hole[2] && j >= hole[1] && j < hole[3];
+}
+
+/*
+* Builds the triangles of a clipmap level, leaving a hole where the finer level
+* inside it goes. The finer level starts on an even vertex of its own, which
+* is always on a vertex of this one, so the hole lines up exactly. The edges
+* for the wireframe come straight from the grid: every cell has its bottom,
+* left and diagonal edge, and the top and right ones when nothing is there to
+* draw them.
+*/
+void buildClipmapIndices(ClipmapLevel* level, ClipmapLevel* inner)
+{
+	GLint hole[4] = { CLIPMAP_CELLS, CLIPMAP_CELLS, -1, -1 };
+	if (inner)
+	{
+		hole[0] = inner->origin[0] / 2 - level->origin[0];
+		hole[1] = inner->origin[1] / 2 - level->origin[1];
+		hole[2] = hole[0] + CLIPMAP_CELLS / 2;
+		hole[3] = hole[1] + CLIPMAP_CELLS / 2;
+	}
+
+	level->indexCount = 0;
+	level->edgeCount = 0;
+	for (GLint j = 0; j < CLIPMAP_CELLS; j++)
+	{
+		for (GLint i = 0; i < CLIPMAP_CELLS; i++)
+		{
+			if (isInClipmapHole(hole, i, j))
+			{
+				continue;
+			}
+
+			GLushort corner = (GLushort)(j * CLIPMAP_VERTICES + i);
+			GLushort* indices = &level->indices[level->indexCount];
+			indices[0] = corner;
+			indices[1] = corner + 1;
+			indices[2] = corner + CLIPMAP_VERTICES + 1;
+			indices[3] = corner;
+			indices[4] = corner + CLIPMAP_VERTICES + 1;
+			indices[5] = corner + CLIPMAP_VERTICES;
+			level->indexCount += 6;
+
+			GLushort* edges = &level->edges[level->edgeCount * 2];
+			edges[0] = corner;
+			edges[1] = corner + 1;
+			edges[2] = corner;
+			edges[3] = corner + CLIPMAP_VERTICES;
+			edges[4] = corner;
+			edges[5] = corner + CLIPMAP_VERTICES + 1;
+			level->edgeCount += 3;
+
+			if (j == CLIPMAP_CELLS - 1 || isInClipmapHole(hole, i, j + 1))
+			{
+				level->edges[level->edgeCount * 2] = corner + CLIPMAP_VERTICES;
+				level->edges[level->edgeCount * 2 + 1] = corner + CLIPMAP_VERTICES + 1;
+				level->edgeCount++;
+			}
+			if (i == CLIPMAP_CELLS - 1 || isInClipmapHole(hole, i + 1, j))
+			{
+				level->edges[level->edgeCount * 2] = corner + 1;
+				level->edges[level->edgeCount * 2 + 1] = corner + CLIPMAP_VERTICES + 1;
+				level->edgeCount++;
+			}
+		}
+	}
+}
+
+/*
+* Copies the vertices of a clipmap level, or its triangles and edges, into its
+* buffer objects. The whole fixed size arrays go in so the edges always start
+* at the same place.
+*/
+void uploadClipmapLevel(ClipmapLevel* level, GLboolean isElements)
+{
+	if (isElements)
+	{
+		const void* elements[2] = { level->indices, level->edges };
+		size_t elementSizes[2] = { sizeof(level->indices), sizeof(level->edges) };
+		fillBuffer(&level->elementBuffer, GL_ELEMENT_ARRAY_BUFFER, GL_DYNAMIC_DRAW, elements, elementSizes, 2);
+	}
+	else
+	{
+		const void* arrays[2] = { level->vertices, level->normals };
+		size_t arraySizes[2] = { sizeof(level->vertices), sizeof(level->normals) };
+		fillBuffer(&level->arrayBuffer, GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW, arrays, arraySizes, 2);
+	}
+}
+
+/*
+* Moves the clipmap levels to stay centred on the camera. Each level snaps to
+* every other one of its vertices, so a level only gets rebuilt when the camera
+* has moved two of its cells, and the coarse levels far away hardly ever do.
+* The triangles get rebuilt when the level or the one inside it moved.
+*/
+void updateClipmap(GLfloat cameraX, GLfloat cameraY, GLfloat shift)
+{
+	GLfloat center[2] = { cameraX + shift, cameraY + shift };
+	GLboolean wasMoved[MAX_CLIPMAP_LEVELS];
+
+	clipmapRebuilds = 0;
+	for (GLint l = 0; l < clipmapLevelCount; l++)
+	{
+		ClipmapLevel* level = &clipmapLevels[l];
+		GLint origin[2];
+		for (GLint a = 0; a < 2; a++)
+		{
+			origin[a] = (GLint)floorf(center[a] / (2.0f * level->spacing)) * 2 - CLIPMAP_CELLS / 2;
+		}
+
+		wasMoved[l] = !level->isBuilt || origin[0] != level->origin[0] || origin[1] != level->origin[1];
+		if (wasMoved[l])
+		{
+			level->origin[0] = origin[0];
+			level->origin[1] = origin[1];
+			buildClipmapLevel(level, l < clipmapLevelCount - 1);
+			uploadClipmapLevel(level, GL_FALSE);
+			level->isBuilt = GL_TRUE;
+			clipmapRebuilds++;
+		}
+	}
+
+	for (GLint l = 0; l < clipmapLevelCount; l++)
+	{
+		if (wasMoved[l] || (l > 0 && wasMoved[l - 1]))
+		{
+			buildClipmapIndices(&clipmapLevels[l], l > 0 ? &clipmapLevels[l - 1] : NULL);
+			uploadClipmapLevel(&clipmapLevels[l], GL_TRUE);
+		}
+	}
+}
+
+/*
+* Function that's used to draw the wave surface. The surface is a clipmap, a
+* grid around the camera with fine cells close up and rings of cells twice as
+* big going outwards, so about the same number of triangles get drawn however
+* big the ocean is. It is lit by the render queue with the water material so
+* it resembles water.
+*/
+void drawWaveGeometry(void* data, GLint param)
+{
+	(void)data;
+	(void)param;
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+
+	for (GLint l = 0; l < clipmapLevelCount; l++)
+	{
+		ClipmapLevel* level = &clipmapLevels[l];
+		const GLvoid* vertices = level->vertices;
+		const GLvoid* normals = level->normals;
+		const GLvoid* indices = level->indices;
+		const GLvoid* edges = level->edges;
+		if (level->arrayBuffer && level->elementBuffer)
+		{
+			gl.bindBuffer(GL_ARRAY_BUFFER, level->arrayBuffer);
+			gl.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, level->elementBuffer);
+			vertices = BUFFER_OFFSET(0);
+			normals = BUFFER_OFFSET(sizeof(level->vertices));
+			indices = BUFFER_OFFSET(0);
+			edges = BUFFER_OFFSET(sizeof(level->indices));
+		}
+
+		glVertexPointer(3, GL_FLOAT, 0, vertices);
+		glNormalPointer(GL_FLOAT, 0, normals);
+		if (isDrawingEdges)
+		{
+			glDrawElements(GL_LINES, level->edgeCount * 2, GL_UNSIGNED_SHORT, edges);
+			renderStats.lines += level->edgeCount;
+		}
+		else
+		{
+			glDrawElements(GL_TRIANGLES, level->indexCount, GL_UNSIGNED_SHORT, indices);
+			renderStats.triangles += level->indexCount / 3;
+		}
+	}
+
+	unbindStaticMesh();
+}
+
+// Queues the wave surface with the water material, moved along by the waves
+void drawWave()
+{
+	GLfloat shift = getWaveShift(frameState->waveTimeValue);
+	updateClipmap(cameraPosition[0], cameraPosition[1], shift);
+
+	GLfloat model[16];
+	matrixIdentity(model);
+	matrixTranslate(model, -shift, -shift, 0);
+	submitRenderItem(GL_TRUE, MATERIAL_WAVE, 0, model, drawWaveGeometry, NULL, 0);
+}
+
+// Throws away every neighbour list, for when the boids were moved some other way than a tick
+void resetNeighbourLists(Flock* flock)
+{
+	if (!flock->neighbourLists)
+	{
+		return;
+	}
+
+	for (GLint i = 0; i < flock->count; i++)
+	{
+		flock->neighbourLists[i].sameCount = -1;
+	}
+	flock->isGridBuilt = GL_FALSE;
+}
+
+/*
+* Sets up a flock with the given species. The boids are stored sorted by
+* species so each species can be updated as one batch, and they start at
+* random positions and velocities inside the flock's cylinder.
+*/
+void initializeFlock(Flock* flock, Species* speciesTable, GLint speciesCount, GLfloat radius, GLfloat height)
+{
+	memset(flock, 0, sizeof(Flock));
+	flock->speciesCount = speciesCount < MAX_SPECIES ? speciesCount : MAX_SPECIES;
+	flock->radius = radius;
+	flock->height = height;
+
+	// The grid cells have to be as big as the furthest any fish can see
+	flock->cellSize = 1.0f;
+	for (GLint s = 0; s < flock->speciesCount; s++)
+	{
+		flock->species[s] = speciesTable[s];
+		flock->speciesFirst[s] = flock->count;
+		flock->count += flock->species[s].count;
+
+		if (flock->species[s].sightDistance > flock->cellSize)
+		{
+			flock->cellSize = flock->species[s].sightDistance;
+		}
+		if (flock->species[s].fleeDistance > flock->cellSize)
+		{
+			flock->cellSize = flock->species[s].fleeDistance;
+		}
+	}
+	flock->speciesFirst[flock->speciesCount] = flock->count;
+
+	// The lists look the skin further, and the 27 cells around a boid have to cover that too
+	flock->isUsingNeighbourLists = isUsingNeighbourLists;
+	if (flock->isUsingNeighbourLists)
+	{
+		flock->cellSize += neighbourSkin;
+		flock->neighbourLists = (NeighbourList*)malloc(sizeof(NeighbourList) * (flock->count > 0 ? flock->count : 1));
+		if (!flock->neighbourLists)
+		{
+			printf("Error allocating memory for the neighbour lists\n");
+			exit(1);
+		}
+	}
+
+	flock->current = (Boid*)malloc(sizeof(Boid) * (flock->count > 0 ? flock->count : 1));
+	flock->previous = (Boid*)malloc(sizeof(Boid) * (flock->count > 0 ? flock->count : 1));
+	flock->sorted = (Boid*)malloc(sizeof(Boid) * (flock->count > 0 ? flock->count : 1));
+	flock->sortedIndexes = (GLint*)malloc(sizeof(GLint) * (flock->count > 0 ? flock->count : 1));
+
+	// One extra layer of cells around the cylinder catches fish that stray out
+	flock->gridOrigin[0] = -radius - flock->cellSize;
+	flock->gridOrigin[1] = -radius - flock->cellSize;
+	flock->gridOrigin[2] = -flock->cellSize;
+	flock->gridSize[0] = (GLint)ceilf(2 * radius / flock->cellSize) + 2;
+	flock->gridSize[1] = flock->gridSize[0];
+	flock->gridSize[2] = (GLint)ceilf(height / flock->cellSize) + 2;
+	GLint cellCount = flock->gridSize[0] * flock->gridSize[1] * flock->gridSize[2];
+	flock->cellStart = (GLint*)malloc(sizeof(GLint) * (cellCount + 1));
+	flock->boidCells = (GLint*)malloc(sizeof(GLint) * (flock->count > 0 ? flock->count : 1));
+
+	if (!flock->current || !flock->previous || !flock->sorted || !flock->sortedIndexes || !flock->cellStart || !flock->boidCells)
+	{
+		printf("Error allocating memory for the flock\n");
+		exit(1);
+	}
+
+	for (GLint s = 0; s < flock->speciesCount; s++)
+	{
+		Species* species = &flock->species[s];
+		for (GLint i = flock->speciesFirst[s]; i < flock->speciesFirst[s + 1]; i++)
+		{
+			// Generate a random angle and radius
+			GLfloat angle = generateRandomFloat(0, 2 * PI);
+			GLfloat r = generateRandomFloat(0, radius - 100);
+
+			// Set the initial position of the fish
+			flock->current[i].position[0] = r * cosf(angle);
+			flock->current[i].position[1] = r * sinf(angle);
+			flock->current[i].position[2] = generateRandomFloat(0, height - 100);
+
+			// Set the intial velocity
+			GLfloat speedAngle = generateRandomFloat(0, 2 * PI);
+			flock->current[i].velocity[0] = species->speed * cosf(speedAngle);
+			flock->current[i].velocity[1] = species->speed * sinf(speedAngle);
+			flock->current[i].velocity[2] = generateRandomFloat(0, species->speed);
+
+			flock->current[i].species = s;
+		}
+	}
+
+	// Copy this to the previous flock so when we do our very first calculation we aren't calculating
+	// from null values
+	memcpy(flock->previous, flock->current, sizeof(Boid) * flock->count);
+	resetNeighbourLists(flock);
+}
+
+void freeFlock(Flock* flock)
+{
+	free(flock->current);
+	free(flock->previous);
+	free(flock->sorted);
+	free(flock->sortedIndexes);
+	free(flock->cellStart);
+	free(flock->boidCells);
+	free(flock->neighbourLists);
+	memset(flock, 0, sizeof(Flock));
+}
+
+/*
+* This method initializes the fish from the species table at random positions
+* and velocities
+*/
+void initializeBoids()
+{
+	initializeFlock(&flock, speciesTable, sizeof(speciesTable) / sizeof(speciesTable[0]),
+		(GLfloat)bottomDiscRadius, (GLfloat)wallHeight);
+}
+
+// Returns the grid cell a point falls in, clamped to the grid
+GLint getFlockCell(Flock* flock, GLfloat position[3], GLint cell[3])
+{
+	for (GLint a = 0; a < 3; a++)
+	{
+		cell[a] = (GLint)floorf((position[a] - flock->gridOrigin[a]) / flock->cellSize);
+		cell[a] = cell[a] < 0 ? 0 : cell[a] >= flock->gridSize[a] ? flock->gridSize[a] - 1 : cell[a];
+	}
+
+	return (cell[2] * flock->gridSize[1] + cell[1]) * flock->gridSize[0] + cell[0];
+}
+
+/*
+* Buckets the previous flock into the uniform grid with a counting sort. The
+* boids get copied in cell order too, so a neighbour search reads through
+* memory in order instead of jumping all over the flock.
+*/
+void buildFlockGrid(Flock* flock)
+{
+	GLint cellCount = flock->gridSize[0] * flock->gridSize[1] * flock->gridSize[2];
+	memset(flock->cellStart, 0, sizeof(GLint) * (cellCount + 1));
+
+	for (GLint i = 0; i < flock->count; i++)
+	{
+		GLint cell[3];
+		flock->boidCells[i] = getFlockCell(flock, flock->previous[i].position, cell);
+		flock->cellStart[flock->boidCells[i] + 1]++;
+	}
+
+	for (GLint c = 0; c < cellCount; c++)
+	{
+		flock->cellStart[c + 1] += flock->cellStart[c];
+	}
+
+	// cellStart is used as the write position of each cell and ends up one
+	// cell ahead, so it gets shifted back afterwards
+	for (GLint i = 0; i < flock->count; i++)
+	{
+		GLint slot = flock->cellStart[flock->boidCells[i]]++;
+		flock->sorted[slot] = flock->previous[i];
+		flock->sortedIndexes[slot] = i;
+	}
+	for (GLint c = cellCount; c > 0; c--)
+	{
+		flock->cellStart[c] = flock->cellStart[c - 1];
+	}
+	flock->cellStart[0] = 0;
+	flock->isGridBuilt = GL_TRUE;
+}
+
+/*
+* Checks one other boid in a neighbour search. One of the same species within
+* sight goes into the sorted list of the NUMBER_NEIGHBOURS nearest so far, a
+* predator within the flee distance adds to the push away from it, and for a
+* predator the nearest prey so far is kept.
+*/
+void checkNeighbour(Flock* flock, Boid* boid, Species* species, Boid* other, GLint otherIndex, GLint* neighbours,
+	GLfloat* neighbourDistances, GLint* neighbourCount, GLfloat flee[3], GLint* nearestPrey, GLfloat* preyDistance)
+{
+	GLfloat dx = other->position[0] - boid->position[0];
+	GLfloat dy = other->position[1] - boid->position[1];
+	GLfloat dz = other->position[2] - boid->position[2];
+	GLfloat distanceSquared = dx * dx + dy * dy + dz * dz;
+
+	if (other->species == boid->species)
+	{
+		if (distanceSquared >= species->sightDistance * species->sightDistance)
+		{
+			return;
+		}
+
+		// Insert it into the sorted list of the nearest ones so far
+		GLint slot = *neighbourCount < NUMBER_NEIGHBOURS ? (*neighbourCount)++ : NUMBER_NEIGHBOURS;
+		while (slot > 0 && neighbourDistances[slot - 1] > distanceSquared)
+		{
+			if (slot < NUMBER_NEIGHBOURS)
+			{
+				neighbourDistances[slot] = neighbourDistances[slot - 1];
+				neighbours[slot] = neighbours[slot - 1];
+			}
+			slot--;
+		}
+		if (slot < NUMBER_NEIGHBOURS)
+		{
+			neighbourDistances[slot] = distanceSquared;
+			neighbours[slot] = otherIndex;
+		}
+	}
+	else if (flock->species[other->species].isPredator && !species->isPredator)
+	{
+		if (distanceSquared < species->fleeDistance * species->fleeDistance && distanceSquared > 0)
+		{
+			// Flee harder from closer predators
+			flee[0] -= dx / distanceSquared;
+			flee[1] -= dy / distanceSquared;
+			flee[2] -= dz / distanceSquared;
+		}
+	}
+	else if (species->isPredator && !flock->species[other->species].isPredator)
+	{
+		if (distanceSquared < *preyDistance)
+		{
+			*preyDistance = distanceSquared;
+			*nearestPrey = otherIndex;
+		}
+	}
+}
+
+/*
+* Goes through the boids in the 27 cells around a boid. It keeps the
+* NUMBER_NEIGHBOURS nearest of its own species within sight for the flocking
+* rules, adds up a push away from any predator within the flee distance, and
+* for a predator finds the nearest prey. Returns how many neighbours it kept.
+*/
+GLint findNeighbours(Flock* flock, GLint index, GLint* neighbours, GLfloat flee[3], GLint* nearestPrey)
+{
+	Boid* boid = &flock->previous[index];
+	Species* species = &flock->species[boid->species];
+	GLfloat neighbourDistances[NUMBER_NEIGHBOURS];
+	GLint neighbourCount = 0;
+	GLfloat preyDistance = species->sightDistance * species->sightDistance;
+
+	flee[0] = flee[1] = flee[2] = 0;
+	*nearestPrey = -1;
+
+	GLint cell[3];
+	getFlockCell(flock, boid->position, cell);
+
+	for (GLint z = cell[2] - 1; z <= cell[2] + 1; z++)
+	{
+		if (z < 0 || z >= flock->gridSize[2]) continue;
+		for (GLint y = cell[1] - 1; y <= cell[1] + 1; y++)
+		{
+			if (y < 0 || y >= flock->gridSize[1]) continue;
+
+			// The three cells along x are next to each other, so take them as one run
+			GLint row = (z * flock->gridSize[1] + y) * flock->gridSize[0];
+			GLint first = flock->cellStart[row + (cell[0] > 0 ? cell[0] - 1 : 0)];
+			GLint last = flock->cellStart[row + (cell[0] + 1 < flock->gridSize[0] ? cell[0] + 2 : cell[0] + 1)];
+			flock->neighbourChecks += last - first;
+
+			for (GLint j = first; j < last; j++)
+			{
+				Boid* other = &flock->sorted[j];
+				GLint otherIndex = flock->sortedIndexes[j];
+				if (otherIndex == index)
+				{
+					continue;
+				}
+
+				checkNeighbour(flock, boid, species, other, otherIndex, neighbours, neighbourDistances, &neighbourCount,
+					flee, nearestPrey, &preyDistance);
+			}
+		}
+	}
+
+	return neighbourCount;
+}
+
+/*
+* Adds a boid to one of the nearest first groups of a neighbour list. A boid
+* that doesn't fit, or gets pushed out by a nearer one, shrinks the radius the
+* group can vouch for down to its distance.
+*/
+void addListCandidate(GLint* candidates, GLfloat* distances, GLint* count, GLint capacity, GLfloat* radiusSquared,
+	GLint index, GLfloat distanceSquared)
+{
+	if (distanceSquared >= *radiusSquared)
+	{
+		return;
+	}
+
+	GLint slot = *count;
+	if (slot == capacity)
+	{
+		if (distanceSquared >= distances[capacity - 1])
+		{
+			*radiusSquared = distanceSquared;
+			return;
+		}
+		*radiusSquared = distances[capacity - 1];
+		slot--;
+	}
+	else
+	{
+		(*count)++;
+	}
+
+	while (slot > 0 && distances[slot - 1] > distanceSquared)
+	{
+		distances[slot] = distances[slot - 1];
+		candidates[slot] = candidates[slot - 1];
+		slot--;
+	}
+	distances[slot] = distanceSquared;
+	candidates[slot] = index;
+}
+
+// Puts a group of candidates back in boid order, it's only ever a few of them
+void sortCandidates(GLint* candidates, GLint count)
+{
+	for (GLint i = 1; i < count; i++)
+	{
+		GLint candidate = candidates[i];
+		GLint j = i;
+		while (j > 0 && candidates[j - 1] > candidate)
+		{
+			candidates[j] = candidates[j - 1];
+			j--;
+		}
+		candidates[j] = candidate;
+	}
+}
+
+/*
+* Rebuilds a boid's neighbour list from the grid, which gets built first if
+* nothing has needed it yet this tick. It keeps the nearest of its own species
+* and the nearest predators or prey out to a cell, the furthest the 27 cells
+* can vouch for. The groups are then put in boid order so the list ranks its
+* boids in the same order however long ago it was built.
+*/
+void buildNeighbourList(Flock* flock, GLint index)
+{
+	if (!flock->isGridBuilt)
+	{
+		buildFlockGrid(flock);
+	}
+
+	Boid* boid = &flock->previous[index];
+	GLboolean isPredator = flock->species[boid->species].isPredator;
+	NeighbourList* list = &flock->neighbourLists[index];
+	GLint* others = &list->candidates[NEIGHBOUR_SAME_CANDIDATES];
+	GLfloat sameDistances[NEIGHBOUR_SAME_CANDIDATES];
+	GLfloat otherDistances[NEIGHBOUR_OTHER_CANDIDATES];
+	GLfloat sameRadiusSquared = flock->cellSize * flock->cellSize;
+	GLfloat otherRadiusSquared = sameRadiusSquared;
+	list->sameCount = 0;
+	list->otherCount = 0;
+
+	GLint cell[3];
+	getFlockCell(flock, boid->position, cell);
+
+	for (GLint z = cell[2] - 1; z <= cell[2] + 1; z++)
+	{
+		if (z < 0 || z >= flock->gridSize[2]) continue;
+		for (GLint y = cell[1] - 1; y <= cell[1] + 1; y++)
+		{
+			if (y < 0 || y >= flock->gridSize[1]) continue;
+
+			GLint row = (z * flock->gridSize[1] + y) * flock->gridSize[0];
+			GLint first = flock->cellStart[row + (cell[0] > 0 ? cell[0] - 1 : 0)];
+			GLint last = flock->cellStart[row + (cell[0] + 1 < flock->gridSize[0] ? cell[0] + 2 : cell[0] + 1)];
+			flock->neighbourChecks += last - first;
+
+			for (GLint j = first; j < last; j++)
+			{
+				Boid* other = &flock->sorted[j];
+				GLint otherIndex = flock->sortedIndexes[j];
+				if (otherIndex == index)
+				{
+					continue;
+				}
+
+				GLfloat dx = other->position[0] - boid->position[0];
+				GLfloat dy = other->position[1] - boid->position[1];
+				GLfloat dz = other->position[2] - boid->position[2];
+				GLfloat distanceSquared = dx * dx + dy * dy + dz * dz;
+
+				if (other->species == boid->species)
+				{
+					addListCandidate(list->candidates, sameDistances, &list->sameCount, NEIGHBOUR_SAME_CANDIDATES,
+						&sameRadiusSquared, otherIndex, distanceSquared);
+				}
+				else if (flock->species[other->species].isPredator != isPredator)
+				{
+					addListCandidate(others, otherDistances, &list->otherCount, NEIGHBOUR_OTHER_CANDIDATES,
+						&otherRadiusSquared, otherIndex, distanceSquared);
+				}
+			}
+		}
+	}
+
+	sortCandidates(list->candidates, list->sameCount);
+	sortCandidates(others, list->otherCount);
+	list->sameRadius = sqrtf(sameRadiusSquared);
+	list->otherRadius = sqrtf(otherRadiusSquared);
+	list->sameDrift = 0;
+	list->otherDrift = 0;
+	list->tick = flock->tick;
+	list->origin[0] = boid->position[0];
+	list->origin[1] = boid->position[1];
+	list->origin[2] = boid->position[2];
+	flock->neighbourRebuilds++;
+}
+
+/*
+* Does what findNeighbours does with just the boids in a neighbour list. A boid
+* left out of the list was at least the list's radius away when it was built.
+* Since then it can only have got closer by how far this boid moved plus the
+* fastest speed each tick, or by the list's drift, whichever is less. So as
+* long as that is still further than the furthest boid the search needs, which
+* is the last of the nearest or the sight distance for its own species, and
+* the flee distance or the nearest prey for the others, nothing left out could
+* have changed the answer. Otherwise isValid is false.
+*/
+GLint rankNeighbourList(Flock* flock, GLint index, GLint* neighbours, GLfloat flee[3], GLint* nearestPrey, GLboolean* isValid)
+{
+	Boid* boid = &flock->previous[index];
+	Species* species = &flock->species[boid->species];
+	NeighbourList* list = &flock->neighbourLists[index];
+	GLfloat neighbourDistances[NUMBER_NEIGHBOURS];
+	GLint neighbourCount = 0;
+	GLfloat preyDistance = species->sightDistance * species->sightDistance;
+
+	flee[0] = flee[1] = flee[2] = 0;
+	*nearestPrey = -1;
+
+	for (GLint c = 0; c < list->sameCount; c++)
+	{
+		GLint otherIndex = list->candidates[c];
+		checkNeighbour(flock, boid, species, &flock->previous[otherIndex], otherIndex, neighbours, neighbourDistances,
+			&neighbourCount, flee, nearestPrey, &preyDistance);
+	}
+	for (GLint c = 0; c < list->otherCount; c++)
+	{
+		GLint otherIndex = list->candidates[NEIGHBOUR_SAME_CANDIDATES + c];
+		checkNeighbour(flock, boid, species, &flock->previous[otherIndex], otherIndex, neighbours, neighbourDistances,
+			&neighbourCount, flee, nearestPrey, &preyDistance);
+	}
+	flock->neighbourChecks += list->sameCount + list->otherCount;
+
+	GLfloat sameReach = neighbourCount == NUMBER_NEIGHBOURS ? sqrtf(neighbourDistances[NUMBER_NEIGHBOURS - 1]) : species->sightDistance;
+	GLfloat otherReach = 0;
+	if (species->isPredator)
+	{
+		otherReach = sqrtf(preyDistance);
+	}
+	else if (flock->hasPredators)
+	{
+		otherReach = species->fleeDistance;
+	}
+
+	GLfloat drift = getDistance(boid->position, list->origin) + (flock->tick - list->tick) * flock->fastestSpeed;
+	GLfloat sameDrift = list->sameDrift < drift ? list->sameDrift : drift;
+	GLfloat otherDrift = list->otherDrift < drift ? list->otherDrift : drift;
+	*isValid = sameReach + sameDrift < list->sameRadius && otherReach + otherDrift < list->otherRadius;
+	return neighbourCount;
+}
+
+/*
+* Finds a boid's neighbours from its neighbour list, rebuilding the list first
+* if it could be missing someone. A school packed so tight that even a new
+* list can't reach far enough gets searched on the grid the old way.
+*/
+GLint findListedNeighbours(Flock* flock, GLint index, GLint* neighbours, GLfloat flee[3], GLint* nearestPrey)
+{
+	GLboolean isValid = GL_FALSE;
+	GLint neighbourCount = 0;
+	if (flock->neighbourLists[index].sameCount >= 0)
+	{
+		neighbourCount = rankNeighbourList(flock, index, neighbours, flee, nearestPrey, &isValid);
+	}
+
+	if (!isValid)
+	{
+		buildNeighbourList(flock, index);
+		neighbourCount = rankNeighbourList(flock, index, neighbours, flee, nearestPrey, &isValid);
+	}
+
+	if (!isValid)
+	{
+		neighbourCount = findNeighbours(flock, index, neighbours, flee, nearestPrey);
+	}
+	return neighbourCount;
+}
+
+/*
+* Method that steers the boids away from the wall It steers them away based
+* on how far from the origin they are, or if they are close to hittin the 
+* floor or ceiling.
+*/
+void avoidCylinderWalls(Flock* flock, Species* species, GLfloat position[3], GLfloat velocity[3])
+{
+	GLfloat x = position[0];
+	GLfloat y = position[1];
+	GLfloat z = position[2];
+
+	// Distance to the center of the cylinder
+	GLfloat distanceToOrigin = sqrtf(x * x + y * y);
+
+	// If we are outside of the range of the cylinder
+	if (distanceToOrigin > flock->radius - distanceThreshold)
+	{
+		// So we aren't dividing by zero
+		if (distanceToOrigin != 0)
+		{
+			velocity[0] -= (x / (distanceToOrigin * (flock->radius - distanceToOrigin))) * species->wallAvoidanceFactor;
+			velocity[1] -= (y / (distanceToOrigin * (flock->radius - distanceToOrigin))) * species->wallAvoidanceFactor;
+		}
+	}
+
+	// Top wall hit
+	if (z > flock->height - distanceThreshold)
+	{
+		velocity[2] += ((1.0f / (z - flock->height)) * species->wallAvoidanceFactor);
+	}
+	// Bottom wall hit
+	else if (z < distanceThreshold)
+	{
+		velocity[2] += ((1.0f / z) * species->wallAvoidanceFactor);
+	}
+}
+
+/*
+* Method that steers the boids away from the coral and the submarine. The coral
+* comes from the baked obstacle field and the submarine from its capsule. The
+* push gets stronger the closer the boid is, up to the full factor when it
+* touches.
+*/
+void avoidObstacles(GLfloat position[3], GLfloat velocity[3])
+{
+	GLfloat direction[3];
+
+	GLfloat distance = sampleObstacleField(position, direction);
+	for (GLint pass = 0; pass < 2; pass++)
+	{
+		if (distance < obstacleThreshold)
+		{
+			GLfloat strength = distance <= 0 ? 1.0f : (obstacleThreshold - distance) / obstacleThreshold;
+			velocity[0] += direction[0] * strength * obstacleAvoidanceFactor;
+			velocity[1] += direction[1] * strength * obstacleAvoidanceFactor;
+			velocity[2] += direction[2] * strength * obstacleAvoidanceFactor;
+		}
+
+		distance = findSubmarineDistance(position, direction);
+	}
+}
+
+// Applies a boid factor to a certain array value (like alignment for example)
+void applyFactor(GLfloat * array, GLfloat factor)
+{
+	array[0] *= factor;
+	array[1] *= factor;
+	array[2] *= factor;
+}
+
+/*
+* Almost identical to the method used in Assignment 1, this method does the same
+* thing as A1 except in the 3rd dimension. The neighbours are all of the same
+* species, and the flee and chase pushes come from the other species.
+*/
+void handleBoidRules(Flock* flock, Species* species, GLint i, GLint* nearestNeighbours, GLint neighbourCount,
+	GLfloat flee[3], GLint nearestPrey, GLfloat velocity[3])
+{
+	Boid* boid = &flock->previous[i];
+	GLfloat alignment[3] = { 0, 0, 0 };
+	GLfloat cohesion[3] = { 0, 0, 0 };
+	GLfloat separation[3] = { 0, 0, 0 };
+
+	// Iterate through each nearest neighbour of a given boid
+	for (GLint j = 0; j < neighbourCount; j++)
+	{
+		Boid* neighbour = &flock->previous[nearestNeighbours[j]];
+
+		alignment[0] += neighbour->velocity[0];
+		alignment[1] += neighbour->velocity[1];
+		alignment[2] += neighbour->velocity[2];
+
+		cohesion[0] += neighbour->position[0];
+		cohesion[1] += neighbour->position[1];
+		cohesion[2] += neighbour->position[2];
+		
+		// Find the distance of the current boid compared to the current neighbour
+		GLfloat distance = getDistance(boid->position, neighbour->position);
+		if (distance < species->separationDistance)
+		{
+			// Get the vectors of the distance away from the current boid
+			GLfloat directionAway[3] =
+			{
+				boid->position[0] - neighbour->position[0],
+				boid->position[1] - neighbour->position[1],
+				boid->position[2] - neighbour->position[2]
+			};
+
+			normalizeVectorArray(directionAway);
+			
+			// Math for the boid separation
+			if (distance != 0)
+			{
+				applyFactor(directionAway, (1.0f / distance) * species->avoidanceFactor);
+			}
+
+			separation[0] += directionAway[0];
+			separation[1] += directionAway[1];
+			separation[2] += directionAway[2];
+		}
+	}
+
+	if (neighbourCount > 0)
+	{
+		// Take the average of the neighbours and remove the current boids alignment
+		alignment[0] = alignment[0] / neighbourCount - boid->velocity[0];
+		alignment[1] = alignment[1] / neighbourCount - boid->velocity[1];
+		alignment[2] = alignment[2] / neighbourCount - boid->velocity[2];
+
+		normalizeVectorArray(alignment);
+		applyFactor(alignment, species->alignmentFactor);
+
+		// Steer towards the average position of the neighbours
+		cohesion[0] = cohesion[0] / neighbourCount - boid->position[0];
+		cohesion[1] = cohesion[1] / neighbourCount - boid->position[1];
+		cohesion[2] = cohesion[2] / neighbourCount - boid->position[2];
+
+		normalizeVectorArray(cohesion);
+		applyFactor(cohesion, species->cohesionFactor);
+	}
+
+	// Run from predators, or for a predator go after the closest prey
+	normalizeVectorArray(flee);
+	applyFactor(flee, species->fleeFactor);
+
+	GLfloat chase[3] = { 0, 0, 0 };
+	if (nearestPrey >= 0)
+	{
+		chase[0] = flock->previous[nearestPrey].position[0] - boid->position[0];
+		chase[1] = flock->previous[nearestPrey].position[1] - boid->position[1];
+		chase[2] = flock->previous[nearestPrey].position[2] - boid->position[2];
+		normalizeVectorArray(chase);
+		applyFactor(chase, species->chaseFactor);
+	}
+
+	// Add the values to the velocity
+	for (GLint a = 0; a < 3; a++)
+	{
+		velocity[a] += alignment[a] + cohesion[a] + separation[a] + flee[a] + chase[a];
+	}
+}
+
+/*
+* Updates every boid of one species. All of them share the same parameters,
+* so the species is one batch that goes through the same steps with no
+* checks on what kind of fish each one is.
+*/
+void updateSpecies(Flock* flock, GLint s)
+{
+	Species* species = &flock->species[s];
+
+	for (GLint i = flock->speciesFirst[s]; i < flock->speciesFirst[s + 1]; i++)
+	{
+		Boid* boid = &flock->previous[i];
+		GLfloat velocity[3] = { boid->velocity[0], boid->velocity[1], boid->velocity[2] };
+
+		GLint nearestNeighbours[NUMBER_NEIGHBOURS];
+		GLfloat flee[3];
+		GLint nearestPrey;
+		GLint neighbourCount = flock->isUsingNeighbourLists ? findListedNeighbours(flock, i, nearestNeighbours, flee, &nearestPrey) :
+			findNeighbours(flock, i, nearestNeighbours, flee, &nearestPrey);
+
+		avoidCylinderWalls(flock, species, boid->position, velocity);
+		if (!flock->isInEmptyTank)
+		{
+			avoidObstacles(boid->position, velocity);
+		}
+		handleBoidRules(flock, species, i, nearestNeighbours, neighbourCount, flee, nearestPrey, velocity);
+
+		// Make sure the speed doesn't get too high
+		GLfloat speed = sqrtf(velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]);
+		if (speed > species->maxSpeed)
+		{
+			applyFactor(velocity, species->maxSpeed / speed);
+		}
+
+		Boid* next = &flock->current[i];
+		for (GLint a = 0; a < 3; a++)
+		{
+			next->velocity[a] = velocity[a];
+			next->position[a] = boid->position[a] + velocity[a];
+		}
+		next->species = s;
+	}
+}
+
+// How far a boid strayed from its species' average step last tick, a hair more
+// for rounding since a list has to err on the side of lasting too little
+GLfloat getBoidDeviation(Flock* flock, GLint index, GLfloat step[3])
+{
+	GLfloat deviation[3];
+	for (GLint a = 0; a < 3; a++)
+	{
+		deviation[a] = flock->current[index].position[a] - flock->previous[index].position[a] - step[a];
+	}
+	return sqrtf(deviation[0] * deviation[0] + deviation[1] * deviation[1] + deviation[2] * deviation[2]) * 1.001f + 1e-4f;
+}
+
+/*
+* Works out how much closer anything left out of each neighbour list could
+* have got this tick. Two boids can only close in on each other by how far
+* each strayed from any step they both share, so each species' average step
+* is taken out and the gap is what's left of the boid's own step plus the
+* most any other boid of the species strayed, like Verlet's rule of the two
+* largest moves. A school swimming together barely strays from its average,
+* so its lists last a lot longer than they would if every boid outside them
+* had to be counted as coming straight at it. Predators and prey use the
+* other species' largest stray plus how far apart the two averages went.
+*/
+void addNeighbourListDrift(Flock* flock)
+{
+	for (GLint s = 0; s < flock->speciesCount; s++)
+	{
+		GLfloat* step = flock->speciesStep[s];
+		step[0] = step[1] = step[2] = 0;
+		GLint first = flock->speciesFirst[s];
+		GLint last = flock->speciesFirst[s + 1];
+		for (GLint i = first; i < last; i++)
+		{
+			for (GLint a = 0; a < 3; a++)
+			{
+				step[a] += flock->current[i].position[a] - flock->previous[i].position[a];
+			}
+		}
+		if (last > first)
+		{
+			applyFactor(step, 1.0f / (last - first));
+		}
+
+		flock->largestDeviation[s][0] = flock->largestDeviation[s][1] = 0;
+		flock->largestBoid[s] = -1;
+		for (GLint i = first; i < last; i++)
+		{
+			GLfloat deviation = getBoidDeviation(flock, i, step);
+			if (deviation > flock->largestDeviation[s][0])
+			{
+				flock->largestDeviation[s][1] = flock->largestDeviation[s][0];
+				flock->largestDeviation[s][0] = deviation;
+				flock->largestBoid[s] = i;
+			}
+			else if (deviation > flock->largestDeviation[s][1])
+			{
+				flock->largestDeviation[s][1] = deviation;
+			}
+		}
+	}
+
+	for (GLint s = 0; s < flock->speciesCount; s++)
+	{
+		// The most a predator could have closed on this species, or prey on a predator
+		GLfloat otherDeviation = 0;
+		for (GLint t = 0; t < flock->speciesCount; t++)
+		{
+			if (flock->species[t].isPredator == flock->species[s].isPredator || flock->species[t].count == 0)
+			{
+				continue;
+			}
+			GLfloat apart = getDistance(flock->speciesStep[t], flock->speciesStep[s]) * 1.001f + 1e-4f;
+			if (flock->largestDeviation[t][0] + apart > otherDeviation)
+			{
+				otherDeviation = flock->largestDeviation[t][0] + apart;
+			}
+		}
+
+		for (GLint i = flock->speciesFirst[s]; i < flock->speciesFirst[s + 1]; i++)
+		{
+			NeighbourList* list = &flock->neighbourLists[i];
+			if (list->sameCount < 0)
+			{
+				continue;
+			}
+
+			GLfloat own = getBoidDeviation(flock, i, flock->speciesStep[s]);
+			list->sameDrift += own + flock->largestDeviation[s][i == flock->largestBoid[s] ? 1 : 0];
+			list->otherDrift += own + otherDeviation;
+		}
+	}
+}
+
+/*
+* Moves the whole flock one tick. The grid is built from the previous flock,
+* each species is updated from it into the current flock, then the current
+* flock becomes the previous one for the next tick. With neighbour lists the
+* grid is left until a boid needs its list rebuilt.
+*/
+void updateFlock(Flock* flock)
+{
+	flock->neighbourChecks = 0;
+	flock->neighbourRebuilds = 0;
+	if (!flock->isUsingNeighbourLists)
+	{
+		buildFlockGrid(flock);
+	}
+
+	// A boid moves at most its max speed a tick, a hair more for rounding
+	flock->fastestSpeed = 0;
+	flock->hasPredators = GL_FALSE;
+	for (GLint s = 0; s < flock->speciesCount; s++)
+	{
+		if (flock->species[s].maxSpeed * 1.001f > flock->fastestSpeed)
+		{
+			flock->fastestSpeed = flock->species[s].maxSpeed * 1.001f;
+		}
+		if (flock->species[s].isPredator && flock->species[s].count > 0)
+		{
+			flock->hasPredators = GL_TRUE;
+		}
+	}
+
+	for (GLint s = 0; s < flock->speciesCount; s++)
+	{
+		updateSpecies(flock, s);
+	}
+
+	if (flock->isUsingNeighbourLists)
+	{
+		addNeighbourListDrift(flock);
+	}
+
+	memcpy(flock->previous, flock->current, sizeof(Boid) * flock->count);
+	flock->isGridBuilt = GL_FALSE;
+	flock->tick++;
+}
+
+/*
+* Command line benchmark for the flock update. The last species is a
+* predator and the others are schools of count boids each. The tank is made
+* big enough that the fish are about as crowded as a real school, and a number
+* of ticks are timed, first searching the grid for every boid and then with
+* the neighbour lists.
+*/
+GLint benchmarkFlock(GLint speciesCount, GLint count, GLint tickCount)
+{
+	if (speciesCount < 1) speciesCount = 1;
+	if (speciesCount > MAX_SPECIES) speciesCount = MAX_SPECIES;
+
+	Species benchSpecies[MAX_SPECIES];
+	for (GLint s = 0; s < speciesCount; s++)
+	{
+		benchSpecies[s] = speciesTable[s % 2];
+		benchSpecies[s].count = count;
+		benchSpecies[s].sightDistance = 40;
+		benchSpecies[s].fleeDistance = 40;
+	}
+	if (speciesCount > 1)
+	{
+		benchSpecies[speciesCount - 1] = speciesTable[2];
+		benchSpecies[speciesCount - 1].count = count;
+		benchSpecies[speciesCount - 1].sightDistance = 40;
+	}
+
+	// Around one fish for every 30 x 30 x 30 block of water
+	GLfloat height = (GLfloat)wallHeight;
+	GLfloat radius = sqrtf(speciesCount * count * 27000.0f / (PI * height)) + 100;
+
+	// The same flock goes once searching the grid every tick and once with the neighbour lists
+	GLboolean wasUsingNeighbourLists = isUsingNeighbourLists;
+	for (GLint pass = 0; pass < 2; pass++)
+	{
+		srand(1);
+		Flock benchFlock;
+		isUsingNeighbourLists = pass == 1;
+		initializeFlock(&benchFlock, benchSpecies, speciesCount, radius, height);
+
+		double checks = 0;
+		double rebuilds = 0;
+		double start = getTimeSeconds();
+		for (GLint tick = 0; tick < tickCount; tick++)
+		{
+			updateFlock(&benchFlock);
+			checks += benchFlock.neighbourChecks;
+			rebuilds += benchFlock.neighbourRebuilds;
+		}
+		double totalTime = getTimeSeconds() - start;
+
+		if (pass == 0)
+		{
+			printf("Flock of %d species x %d boids in a tank of radius %.0f, %d x %d x %d grid\n", speciesCount, count,
+				radius, benchFlock.gridSize[0], benchFlock.gridSize[1], benchFlock.gridSize[2]);
+		}
+		printf("%s: %.2f ms per tick, %.1f ns per boid, %.1f boids checked per boid", pass == 0 ? "Grid search" : "Neighbour lists",
+			totalTime / tickCount * 1000.0, totalTime / tickCount / benchFlock.count * 1000000000.0, checks / tickCount / benchFlock.count);
+		if (pass == 1)
+		{
+			printf(", %.1f%% of the lists rebuilt a tick", rebuilds / tickCount / benchFlock.count * 100.0);
+		}
+		printf("\n");
+
+		freeFlock(&benchFlock);
+	}
+	isUsingNeighbourLists = wasUsingNeighbourLists;
+	return 0;
+}
+
+/*
+* Measures how a flock is schooling, over the species that aren't predators.
+* The polarization is how lined up each species is, 1 when they all swim the
+* same way and near 0 when they go every which way. The nearest distance is
+* the average distance to the closest fish of the same species that can be
+* seen, and isolated is the fraction of fish that can't see any.
+*/
+void measureFlock(Flock* flock, GLfloat* polarization, GLfloat* nearestDistance, GLfloat* isolated)
+{
+	buildFlockGrid(flock);
+
+	GLfloat polarizationSum = 0;
+	GLfloat distanceSum = 0;
+	GLint schoolingCount = 0;
+	GLint seenCount = 0;
+
+	for (GLint s = 0; s < flock->speciesCount; s++)
+	{
+		if (flock->species[s].isPredator)
+		{
+			continue;
+		}
+
+		GLfloat heading[3] = { 0, 0, 0 };
+		for (GLint i = flock->speciesFirst[s]; i < flock->speciesFirst[s + 1]; i++)
+		{
+			GLfloat* velocity = flock->previous[i].velocity;
+			GLfloat speed = sqrtf(velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]);
+			if (speed > 0)
+			{
+				heading[0] += velocity[0] / speed;
+				heading[1] += velocity[1] / speed;
+				heading[2] += velocity[2] / speed;
+			}
+
+			GLint neighbours[NUMBER_NEIGHBOURS];
+			GLfloat flee[3];
+			GLint nearestPrey;
+			if (findNeighbours(flock, i, neighbours, flee, &nearestPrey) > 0)
+			{
+				distanceSum += getDistance(flock->previous[i].position, flock->previous[neighbours[0]].position);
+				seenCount++;
+			}
+		}
+
+		// The length of the summed headings is the species count times its polarization
+		polarizationSum += sqrtf(heading[0] * heading[0] + heading[1] * heading[1] + heading[2] * heading[2]);
+		schoolingCount += flock->speciesFirst[s + 1] - flock->speciesFirst[s];
+	}
+
+	*polarization = schoolingCount > 0 ? polarizationSum / schoolingCount : 0;
+	*nearestDistance = seenCount > 0 ? distanceSum / seenCount : 0;
+	*isolated = schoolingCount > 0 ? (GLfloat)(schoolingCount - seenCount) / schoolingCount : 0;
+}
+
+// Returns the value a sweep parameter takes in a configuration
+GLfloat getSweepValue(Sweep* sweep, GLint configuration, GLint p)
+{
+	// The configuration number counts through the values with the first parameter changing fastest
+	for (GLint q = 0; q < p; q++)
+	{
+		configuration /= sweep->parameters[q].valueCount;
+	}
+	return sweep->parameters[p].values[configuration % sweep->parameters[p].valueCount];
+}
+
+/*
+* Runs one configuration of a sweep without drawing anything. The schooling
+* species get the swept settings and the predators keep their own. The fish
+* swim in an empty tank, and the first half of the ticks lets them settle
+* before the flock gets measured every 10 ticks. Only the updates are timed.
+*/
+void runSweepConfiguration(Sweep* sweep, GLint configuration, SweepResult* result)
+{
+	Species species[MAX_SPECIES];
+	GLint speciesCount = sizeof(speciesTable) / sizeof(speciesTable[0]);
+	memcpy(species, speciesTable, sizeof(speciesTable));
+
+	GLint tickCount = 1000;
+	GLfloat radius = (GLfloat)bottomDiscRadius;
+	GLint seed = 1;
+
+	for (GLint p = 0; p < sweep->parameterCount; p++)
+	{
+		SweepParameter* parameter = &sweep->parameters[p];
+		GLfloat value = getSweepValue(sweep, configuration, p);
+
+		if (parameter->offset == SWEEP_TICKS) tickCount = (GLint)value;
+		else if (parameter->offset == SWEEP_RADIUS) radius = value;
+		else if (parameter->offset == SWEEP_SEED) seed = (GLint)value;
+		else
+		{
+			for (GLint s = 0; s < speciesCount; s++)
+			{
+				if (species[s].isPredator)
+				{
+					continue;
+				}
+				char* field = (char*)&species[s] + parameter->offset;
+				if (parameter->isInteger)
+				{
+					*(GLint*)field = (GLint)value;
+				}
+				else
+				{
+					*(GLfloat*)field = value;
+				}
+			}
+		}
+	}
+
+	// The starting positions come from rand, so only one worker can set up a flock at a time
+	Flock sweepFlock;
+	lockMutex(&sweep->mutex);
+	srand(seed);
+	initializeFlock(&sweepFlock, species, speciesCount, radius, (GLfloat)wallHeight);
+	unlockMutex(&sweep->mutex);
+	sweepFlock.isInEmptyTank = GL_TRUE;
+
+	memset(result, 0, sizeof(SweepResult));
+	result->boidCount = sweepFlock.count;
+	result->tickCount = tickCount;
+
+	GLint measureCount = 0;
+	for (GLint tick = 0; tick < tickCount; tick++)
+	{
+		double start = getTimeSeconds();
+		updateFlock(&sweepFlock);
+		result->updateTime += getTimeSeconds() - start;
+
+		if (tick >= tickCount / 2 && (tickCount - 1 - tick) % 10 == 0)
+		{
+			GLfloat polarization, nearestDistance, isolated;
+			measureFlock(&sweepFlock, &polarization, &nearestDistance, &isolated);
+			result->polarization += polarization;
+			result->nearestDistance += nearestDistance;
+			result->isolated += isolated;
+			measureCount++;
+		}
+	}
+
+	if (measureCount > 0)
+	{
+		result->polarization /= measureCount;
+		result->nearestDistance /= measureCount;
+		result->isolated /= measureCount;
+	}
+
+	freeFlock(&sweepFlock);
+}
+
+// Thread function for the sweep workers, running configurations until there are none left
+void runSweepWorker(void* data)
+{
+	Sweep* sweep = (Sweep*)data;
+
+	for (;;)
+	{
+		lockMutex(&sweep->mutex);
+		GLint configuration = sweep->next++;
+		if (configuration < sweep->configurationCount && (configuration + 1) % 100 == 0)
+		{
+			printf("Running configuration %d of %d\n", configuration + 1, sweep->configurationCount);
+		}
+		unlockMutex(&sweep->mutex);
+
+		if (configuration >= sweep->configurationCount)
+		{
+			return;
+		}
+		runSweepConfiguration(sweep, configuration, &sweep->results[configuration]);
+	}
+}
+
+/*
+* Reads a sweep grid file. Each line is a setting and the values to try for
+* it, and every combination of them gets run. # starts a comment. The
+* settings are count, speed, maxSpeed, sight, separation, wall, avoidance,
+* alignment and cohesion for the schooling species, and ticks, radius and
+* seed for the whole run. Returns 0 if the file can't be used.
+*/
+GLint readSweepGrid(char* path, Sweep* sweep)
+{
+	struct
+	{
+		char* name;
+		GLint offset;
+		GLboolean isInteger;
+	} settings[] =
+	{
+		{ "count", offsetof(Species, count), GL_TRUE },
+		{ "speed", offsetof(Species, speed), GL_FALSE },
+		{ "maxSpeed", offsetof(Species, maxSpeed), GL_FALSE },
+		{ "sight", offsetof(Species, sightDistance), GL_FALSE },
+		{ "separation", offsetof(Species, separationDistance), GL_FALSE },
+		{ "wall", offsetof(Species, wallAvoidanceFactor), GL_FALSE },
+		{ "avoidance", offsetof(Species, avoidanceFactor), GL_FALSE },
+		{ "alignment", offsetof(Species, alignmentFactor), GL_FALSE },
+		{ "cohesion", offsetof(Species, cohesionFactor), GL_FALSE },
+		{ "ticks", SWEEP_TICKS, GL_TRUE },
+		{ "radius", SWEEP_RADIUS, GL_FALSE },
+		{ "seed", SWEEP_SEED, GL_TRUE }
+	};
+
+	FILE* file = fopen(path, "r");
+	if (!file)
+	{
+		printf("Could not open the sweep grid %s\n", path);
+		return 0;
+	}
+
+	memset(sweep, 0, sizeof(Sweep));
+	sweep->configurationCount = 1;
+
+	char line[1024];
+	GLint lineNumber = 0;
+	while (fgets(line, sizeof(line), file))
+	{
+		lineNumber++;
+		char* comment = strchr(line, '#');
+		if (comment)
+		{
+			*comment = '\0';
+		}
+
+		// The name runs up to the first space
+		char* cursor = line;
+		while (*cursor == ' ' || *cursor == '\t') cursor++;
+		char* name = cursor;
+		while (*cursor && *cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '\n') cursor++;
+		if (cursor == name)
+		{
+			continue;
+		}
+		if (*cursor)
+		{
+			*cursor++ = '\0';
+		}
+
+		GLint setting = -1;
+		for (GLint i = 0; i < (GLint)(sizeof(settings) / sizeof(settings[0])); i++)
+		{
+			if (strcmp(name, settings[i].name) == 0)
+			{
+				setting = i;
+			}
+		}
+		if (setting < 0 || sweep->parameterCount == MAX_SWEEP_PARAMETERS)
+		{
+			printf("%s line %d: %s isn't something that can be swept\n", path, lineNumber, name);
+			fclose(file);
+			return 0;
+		}
+
+		SweepParameter* parameter = &sweep->parameters[sweep->parameterCount++];
+		snprintf(parameter->name, sizeof(parameter->name), "%s", settings[setting].name);
+		parameter->offset = settings[setting].offset;
+		parameter->isInteger = settings[setting].isInteger;
+
+		for (;;)
+		{
+			char* end;
+			double value = strtod(cursor, &end);
+			if (end == cursor)
+			{
+				break;
+			}
+			if (parameter->valueCount < MAX_SWEEP_VALUES)
+			{
+				parameter->values[parameter->valueCount++] = (GLfloat)value;
+			}
+			cursor = end;
+		}
+
+		if (parameter->valueCount == 0)
+		{
+			printf("%s line %d: %s has no values\n", path, lineNumber, name);
+			fclose(file);
+			return 0;
+		}
+		if (sweep->configurationCount > 10000000 / parameter->valueCount)
+		{
+			printf("%s has too many combinations to sweep\n", path);
+			fclose(file);
+			return 0;
+		}
+		sweep->configurationCount *= parameter->valueCount;
+	}
+
+	fclose(file);
+	return 1;
+}
+
+/*
+* Command line tool that runs every combination in a sweep grid file, spread
+* over threadCount workers (0 for one per processor), and writes a line of
+* CSV for each one. The throughput is boid updates a second on one worker.
+*/
+GLint runSweep(char* gridPath, char* resultsPath, GLint threadCount)
+{
+	Sweep* sweep = (Sweep*)malloc(sizeof(Sweep));
+	if (!sweep)
+	{
+		printf("Error allocating memory for the sweep\n");
+		exit(1);
+	}
+	if (!readSweepGrid(gridPath, sweep))
+	{
+		free(sweep);
+		return 1;
+	}
+
+	FILE* file = fopen(resultsPath, "w");
+	if (!file)
+	{
+		printf("Could not write the sweep results to %s\n", resultsPath);
+		free(sweep);
+		return 1;
+	}
+
+	sweep->results = (SweepResult*)malloc(sizeof(SweepResult) * sweep->configurationCount);
+	if (threadCount <= 0)
+	{
+		threadCount = getProcessorCount();
+	}
+	if (threadCount > sweep->configurationCount)
+	{
+		threadCount = sweep->configurationCount;
+	}
+	Thread* threads = (Thread*)malloc(sizeof(Thread) * threadCount);
+	if (!sweep->results || !threads)
+	{
+		printf("Error allocating memory for the sweep\n");
+		exit(1);
+	}
+	initMutex(&sweep->mutex);
+
+	printf("Sweeping %d configurations of %d settings on %d threads\n", sweep->configurationCount,
+		sweep->parameterCount, threadCount);
+	double start = getTimeSeconds();
+
+	for (GLint t = 1; t < threadCount; t++)
+	{
+		startThread(&threads[t], runSweepWorker, sweep);
+	}
+	runSweepWorker(sweep);
+	for (GLint t = 1; t < threadCount; t++)
+	{
+		joinThread(threads[t]);
+	}
+
+	double totalTime = getTimeSeconds() - start;
+
+	// Written in configuration order once they're all done, so the file is the same however the threads went
+	// The ticks are always written after the boids, so they're left out of the swept ones
+	fprintf(file, "configuration");
+	for (GLint p = 0; p < sweep->parameterCount; p++)
+	{
+		if (sweep->parameters[p].offset != SWEEP_TICKS)
+		{
+			fprintf(file, ",%s", sweep->parameters[p].name);
+		}
+	}
+	fprintf(file, ",boids,ticks,update_ms_per_tick,boid_updates_per_second,polarization,nearest_distance,isolated\n");
+
+	for (GLint c = 0; c < sweep->configurationCount; c++)
+	{
+		SweepResult* result = &sweep->results[c];
+		fprintf(file, "%d", c);
+		for (GLint p = 0; p < sweep->parameterCount; p++)
+		{
+			if (sweep->parameters[p].offset != SWEEP_TICKS)
+			{
+				fprintf(file, ",%g", getSweepValue(sweep, c, p));
+			}
+		}
+		fprintf(file, ",%d,%d,%.4f,%.0f,%.4f,%.3f,%.4f\n", result->boidCount, result->tickCount,
+			result->tickCount > 0 ? result->updateTime * 1000.0 / result->tickCount : 0,
+			result->updateTime > 0 ? (double)result->boidCount * result->tickCount / result->updateTime : 0,
+			result->polarization, result->nearestDistance, result->isolated);
+	}
+	fclose(file);
+
+	printf("Swept %d configurations in %.2f s, %.1f ms each, results in %s\n", sweep->configurationCount,
+		totalTime, totalTime * 1000.0 / sweep->configurationCount, resultsPath);
+
+	free(threads);
+	free(sweep->results);
+	free(sweep);
+	return 0;
+}
+
+/*
+* Compresses a block in the LZ4 block format. Each sequence is a token byte
+* holding the literal length and the match length, the literals, then a two
+* byte offset back to where the match is copied from. Matches are found with
+* a small hash table of where each four byte run was last seen, which is fast
+* rather than thorough. Returns the compressed size, or 0 if it didn't fit in
+* the destination.
+*/
+GLint compressBlock(const unsigned char* source, GLint sourceSize, unsigned char* destination, GLint destinationCapacity)
+{
+	GLint hashTable[1 << LZ_HASH_BITS];
+	for (GLint i = 0; i < (1 << LZ_HASH_BITS); i++)
+	{
+		hashTable[i] = -1;
+	}
+
+	GLint in = 0;
+	GLint out = 0;
+	GLint literalStart = 0;
+
+	// The format wants the last bytes to always be literals
+	GLint matchLimit = sourceSize - LZ_LAST_LITERALS;
+
+	while (in + LZ_MIN_MATCH <= matchLimit)
+	{
+		unsigned int sequence;
+		memcpy(&sequence, source + in, 4);
+		GLint hash = (GLint)((sequence * 2654435761u) >> (32 - LZ_HASH_BITS));
+		GLint candidate = hashTable[hash];
+		hashTable[hash] = in;
+
+		if (candidate < 0 || in - candidate > 65535 || memcmp(source + candidate, source + in, 4) != 0)
+		{
+			in++;
+			continue;
+		}
+
+		GLint matchLength = LZ_MIN_MATCH;
+		while (in + matchLength < matchLimit && source[candidate + matchLength] == source[in + matchLength])
+		{
+			matchLength++;
+		}
+
+		// Token, the extra literal length bytes, literals, offset and the extra match length bytes
+		GLint literalLength = in - literalStart;
+		if (out + 1 + literalLength / 255 + 1 + literalLength + 2 + (matchLength - LZ_MIN_MATCH) / 255 + 1 > destinationCapacity)
+		{
+			return 0;
+		}
+
+		unsigned char* token = &destination[out++];
+		*token = (unsigned char)((literalLength >= 15 ? 15 : literalLength) << 4);
+		if (literalLength >= 15)
+		{
+			GLint remaining = literalLength - 15;
+			for (; remaining >= 255; remaining -= 255)
+			{
+				destination[out++] = 255;
+			}
+			destination[out++] = (unsigned char)remaining;
+		}
+		memcpy(destination + out, source + literalStart, literalLength);
+		out += literalLength;
+
+		GLint offset = in - candidate;
+		destination[out++] = (unsigned char)(offset & 0xFF);
+		destination[out++] = (unsigned char)(offset >> 8);
+
+		GLint extraMatch = matchLength - LZ_MIN_MATCH;
+		*token |= (unsigned char)(extraMatch >= 15 ? 15 : extraMatch);
+		if (extraMatch >= 15)
+		{
+			GLint remaining = extraMatch - 15;
+			for (; remaining >= 255; remaining -= 255)
+			{
+				destination[out++] = 255;
+			}
+			destination[out++] = (unsigned char)remaining;
+		}
+
+		in += matchLength;
+		literalStart = in;
+	}
+
+	// Whatever is left goes out as literals with no match after them
+	GLint literalLength = sourceSize - literalStart;
+	if (out + 1 + literalLength / 255 + 1 + literalLength > destinationCapacity)
+	{
+		return 0;
+	}
+	destination[out++] = (unsigned char)((literalLength >= 15 ? 15 : literalLength) << 4);
+	if (literalLength >= 15)
+	{
+		GLint remaining = literalLength - 15;
+		for (; remaining >= 255; remaining -= 255)
+		{
+			destination[out++] = 255;
+		}
+		destination[out++] = (unsigned char)remaining;
+	}
+	memcpy(destination + out, source + literalStart, literalLength);
+	out += literalLength;
+
+	return out;
+}
+
+/*
+* Decompresses a block from compressBlock. Every length is checked against both
+* buffers so a broken file can't write outside of them. Returns the size it
+* decompressed to, or -1 if the block is broken.
+*/
+GLint decompressBlock(const unsigned char* source, GLint sourceSize, unsigned char* destination, GLint destinationCapacity)
+{
+	GLint in = 0;
+	GLint out = 0;
+
+	while (in < sourceSize)
+	{
+		GLint token = source[in++];
+
+		GLint literalLength = token >> 4;
+		if (literalLength == 15)
+		{
+			GLint extra;
+			do
+			{
+				if (in >= sourceSize) return -1;
+				extra = source[in++];
+				literalLength += extra;
+			} while (extra == 255);
+		}
+
+		if (literalLength > sourceSize - in || literalLength > destinationCapacity - out)
+		{
+			return -1;
+		}
+		memcpy(destination + out, source + in, literalLength);
+		in += literalLength;
+		out += literalLength;
+
+		// The last sequence has no match
+		if (in == sourceSize)
+		{
+			break;
+		}
+
+		if (in + 2 > sourceSize)
+		{
+			return -1;
+		}
+		GLint offset = source[in] | (source[in + 1] << 8);
+		in += 2;
+
+		GLint matchLength = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15)
+		{
+			GLint extra;
+			do
+			{
+				if (in >= sourceSize) return -1;
+				extra = source[in++];
+				matchLength += extra;
+			} while (extra == 255);
+		}
+
+		if (offset == 0 || offset > out || matchLength > destinationCapacity - out)
+		{
+			return -1;
+		}
+
+		// Byte by byte, since the match can overlap what it is writing
+		for (GLint i = 0; i < matchLength; i++, out++)
+		{
+			destination[out] = destination[out - offset];
+		}
+	}
+
+	return out;
+}
+
+/*
+* Copies the simulation into a snapshot header and an uncompressed payload.
+* The payload is the coral positions then the previous and current flocks, so
+* the flock arrays go in with one copy each.
+*/
+void captureSnapshot(SnapshotHeader* header, unsigned char** payload, GLint* payloadCapacity)
+{
+	memset(header, 0, sizeof(SnapshotHeader));
+	header->magic = SNAPSHOT_MAGIC;
+	header->version = SNAPSHOT_VERSION;
+	header->tick = simulationTick;
+	header->submarine[0] = submarineX;
+	header->submarine[1] = submarineY;
+	header->submarine[2] = submarineZ;
+	header->waveTimeValue = waveTimeValue;
+	header->speciesCount = flock.speciesCount;
+	memcpy(header->speciesFirst, flock.speciesFirst, sizeof(header->speciesFirst));
+	header->coralCount = coralInstanceCount;
+
+	GLint coralBytes = (GLint)(sizeof(GLfloat) * 3 * coralInstanceCount);
+	GLint flockBytes = (GLint)(sizeof(Boid) * flock.count);
+	header->rawSize = coralBytes + 2 * flockBytes;
+	reserveArray((void**)payload, payloadCapacity, header->rawSize, 1);
+
+	for (GLint i = 0; i < coralInstanceCount; i++)
+	{
+		memcpy(*payload + sizeof(GLfloat) * 3 * i, coralInstances[i].position, sizeof(GLfloat) * 3);
+	}
+	memcpy(*payload + coralBytes, flock.previous, flockBytes);
+	memcpy(*payload + coralBytes + flockBytes, flock.current, flockBytes);
+}
+
+/*
+* Writes a captured snapshot to a file, compressing the payload first if
+* isCompressed is set (and compressing actually made it smaller). It is
+* written to a temporary file that then replaces the old one, so a crash
+* halfway through never leaves a broken snapshot behind. Returns 0 on success.
+*/
+GLint writeSnapshot(char* path, SnapshotHeader* header, unsigned char* payload, GLboolean isCompressed,
+	unsigned char** compressed, GLint* compressedCapacity)
+{
+	unsigned char* data = payload;
+	header->flags = 0;
+	header->payloadSize = header->rawSize;
+
+	if (isCompressed && header->rawSize > 0)
+	{
+		reserveArray((void**)compressed, compressedCapacity, header->rawSize, 1);
+		GLint size = compressBlock(payload, header->rawSize, *compressed, header->rawSize);
+		if (size > 0)
+		{
+			header->flags |= SNAPSHOT_COMPRESSED;
+			header->payloadSize = size;
+			data = *compressed;
+		}
+	}
+
+	char temporaryPath[512];
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path);
+
+	FILE* file = fopen(temporaryPath, "wb");
+	if (!file)
+	{
+		printf("Could not open %s for the snapshot\n", temporaryPath);
+		return 1;
+	}
+
+	GLboolean isWritten = fwrite(header, sizeof(SnapshotHeader), 1, file) == 1 &&
+		(header->payloadSize == 0 || fwrite(data, header->payloadSize, 1, file) == 1);
+	isWritten = fclose(file) == 0 && isWritten;
+	if (!isWritten)
+	{
+		printf("Could not write the snapshot to %s\n", temporaryPath);
+		remove(temporaryPath);
+		return 1;
+	}
+
+#ifdef _WIN32
+	if (!MoveFileExA(temporaryPath, path, MOVEFILE_REPLACE_EXISTING))
+#else
+	if (rename(temporaryPath, path) != 0)
+#endif
+	{
+		printf("Could not replace the snapshot %s\n", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Saves the simulation right away, from the thread that calls it
+GLint saveSnapshot(char* path)
+{
+	SnapshotHeader header;
+	unsigned char* payload = NULL;
+	unsigned char* compressed = NULL;
+	GLint payloadCapacity = 0, compressedCapacity = 0;
+
+	captureSnapshot(&header, &payload, &payloadCapacity);
+	GLint result = writeSnapshot(path, &header, payload, isSnapshotCompressed, &compressed, &compressedCapacity);
+	if (result == 0)
+	{
+		printf("Saved tick %d to %s (%d bytes, %d before compression)\n", header.tick, path,
+			header.payloadSize, header.rawSize);
+	}
+
+	free(payload);
+	free(compressed);
+	return result;
+}
+
+/*
+* Maps a whole file into memory read only. Returns NULL if it couldn't be
+* opened or is empty.
+*/
+const unsigned char* mapFile(char* path, MappedFile* mapped)
+{
+	memset(mapped, 0, sizeof(MappedFile));
+
+#ifdef _WIN32
+	mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mapped->file == INVALID_HANDLE_VALUE)
+	{
+		return NULL;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mapped->file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(mapped->file);
+		return NULL;
+	}
+	mapped->size = (size_t)size.QuadPart;
+
+	mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapped->mapping)
+	{
+		CloseHandle(mapped->file);
+		return NULL;
+	}
+
+	mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!mapped->data)
+	{
+		CloseHandle(mapped->mapping);
+		CloseHandle(mapped->file);
+		return NULL;
+	}
+#else
+	GLint descriptor = open(path, O_RDONLY);
+	if (descriptor < 0)
+	{
+		return NULL;
+	}
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0 || status.st_size == 0)
+	{
+		close(descriptor);
+		return NULL;
+	}
+	mapped->size = (size_t)status.st_size;
+
+	mapped->data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+	if (mapped->data == MAP_FAILED)
+	{
+		mapped->data = NULL;
+		return NULL;
+	}
+#endif
+
+	return (const unsigned char*)mapped->data;
+}
+
+void unmapFile(MappedFile* mapped)
+{
+	if (!mapped->data)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(mapped->data);
+	CloseHandle(mapped->mapping);
+	CloseHandle(mapped->file);
+#else
+	munmap(mapped->data, mapped->size);
+#endif
+	mapped->data = NULL;
+}
+
+/*
+* Maps a file into memory for reading and writing, shared with any other
+* process that maps it. If size is more than 0 the file is made that big,
+* otherwise the whole file is mapped. Returns NULL if it couldn't be mapped.
+*/
+unsigned char* mapSharedFile(char* path, size_t size, MappedFile* mapped)
+{
+	memset(mapped, 0, sizeof(MappedFile));
+
+#ifdef _WIN32
+	mapped->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		size > 0 ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (mapped->file == INVALID_HANDLE_VALUE)
+	{
+		return NULL;
+	}
+
+	if (size == 0)
+	{
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(mapped->file, &fileSize) || fileSize.QuadPart == 0)
+		{
+			CloseHandle(mapped->file);
+			return NULL;
+		}
+		size = (size_t)fileSize.QuadPart;
+	}
+	mapped->size = size;
+
+	// Making the mapping bigger than the file grows the file
+	mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READWRITE, 0, (DWORD)size, NULL);
+	if (!mapped->mapping)
+	{
+		CloseHandle(mapped->file);
+		return NULL;
+	}
+
+	mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (!mapped->data)
+	{
+		CloseHandle(mapped->mapping);
+		CloseHandle(mapped->file);
+		return NULL;
+	}
+#else
+	GLint descriptor = open(path, size > 0 ? O_RDWR | O_CREAT : O_RDWR, 0644);
+	if (descriptor < 0)
+	{
+		return NULL;
+	}
+
+	struct stat status;
+	if (size > 0 ? ftruncate(descriptor, (off_t)size) != 0 : fstat(descriptor, &status) != 0 || status.st_size == 0)
+	{
+		close(descriptor);
+		return NULL;
+	}
+	mapped->size = size > 0 ? size : (size_t)status.st_size;
+
+	mapped->data = mmap(NULL, mapped->size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if (mapped->data == MAP_FAILED)
+	{
+		mapped->data = NULL;
+		return NULL;
+	}
+#endif
+
+	return (unsigned char*)mapped->data;
+}
+
+// A random number from 0 to 1 for a point on the terrain noise lattice, always the same for the same point
+GLfloat hashTerrainPoint(GLint x, GLint y)
+{
+	unsigned int h = (unsigned int)x * 374761393u + (unsigned int)y * 668265263u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	return (GLfloat)((h ^ (h >> 16)) & 0xffff) / 65535.0f;
+}
+
+/*
+* Smooth noise made of a few octaves of value noise, each one half the size
+* and half as strong as the one before. Returns about 0 to 1.
+*/
+GLfloat getTerrainNoise(GLfloat x, GLfloat y)
+{
+	GLfloat total = 0;
+	GLfloat strength = 0.5f;
+	GLfloat wavelength = 2048.0f;
+
+	for (GLint octave = 0; octave < 6; octave++)
+	{
+		GLfloat u = x / wavelength;
+		GLfloat v = y / wavelength;
+		GLint i = (GLint)floorf(u);
+		GLint j = (GLint)floorf(v);
+		u -= i;
+		v -= j;
+
+		// Smoothstep so the slopes don't have creases along the lattice
+		u = u * u * (3 - 2 * u);
+		v = v * v * (3 - 2 * v);
+
+		GLfloat bottom = hashTerrainPoint(i + octave * 1000, j) * (1 - u) + hashTerrainPoint(i + 1 + octave * 1000, j) * u;
+		GLfloat top = hashTerrainPoint(i + octave * 1000, j + 1) * (1 - u) + hashTerrainPoint(i + 1 + octave * 1000, j + 1) * u;
+		total += (bottom * (1 - v) + top * v) * strength;
+
+		strength *= 0.5f;
+		wavelength *= 0.5f;
+	}
+
+	return total;
+}
+
+/*
+* Writes a made up terrain file with tiles by tiles tiles, centred on the
+* origin. The sea floor is flat around the reef and turns into hills and
+* trenches further out, so the coral still sits on it.
+*/
+GLint makeTerrain(char* path, GLint tiles, GLint tileSamples)
+{
+	TerrainHeader header;
+	header.magic = TERRAIN_MAGIC;
+	header.version = TERRAIN_VERSION;
+	header.tileSamples = tileSamples;
+	header.tiles[0] = tiles;
+	header.tiles[1] = tiles;
+	header.spacing = 8.0f;
+	header.heightScale = 0.05f;
+	header.origin[0] = -tiles * (tileSamples - 1) * header.spacing / 2.0f;
+	header.origin[1] = header.origin[0];
+
+	FILE* file = fopen(path, "wb");
+	GLshort* samples = (GLshort*)malloc(sizeof(GLshort) * tileSamples * tileSamples);
+	if (!file || !samples)
+	{
+		printf("Couldn't write the terrain to %s\n", path);
+		return 1;
+	}
+	fwrite(&header, sizeof(TerrainHeader), 1, file);
+
+	for (GLint ty = 0; ty < tiles; ty++)
+	{
+		for (GLint tx = 0; tx < tiles; tx++)
+		{
+			for (GLint j = 0; j < tileSamples; j++)
+			{
+				for (GLint i = 0; i < tileSamples; i++)
+				{
+					GLfloat x = header.origin[0] + (tx * (tileSamples - 1) + i) * header.spacing;
+					GLfloat y = header.origin[1] + (ty * (tileSamples - 1) + j) * header.spacing;
+
+					GLfloat height = (getTerrainNoise(x, y) - 0.6f) * 600.0f;
+
+					// Fade into the flat floor of the reef
+					GLfloat fade = (sqrtf(x * x + y * y) - bottomDiscRadius) / bottomDiscRadius;
+					if (fade < 0) fade = 0;
+					if (fade > 1) fade = 1;
+					height *= fade * fade * (3 - 2 * fade);
+
+					samples[j * tileSamples + i] = (GLshort)floorf(height / header.heightScale + 0.5f);
+				}
+			}
+			fwrite(samples, sizeof(GLshort), tileSamples * tileSamples, file);
+		}
+	}
+
+	GLboolean isWritten = ferror(file) == 0;
+	fclose(file);
+	free(samples);
+
+	if (!isWritten)
+	{
+		printf("Couldn't write the terrain to %s\n", path);
+		return 1;
+	}
+	printf("Wrote a terrain of %d by %d tiles, %.0f units across, to %s\n", tiles, tiles,
+		tiles * (tileSamples - 1) * header.spacing, path);
+	return 0;
+}
+
+/*
+* Fills in the mesh of a terrain tile from the mapped file. This runs on a
+* worker thread, and the first time a tile is touched is where the file gets
+* paged in, so none of that lands on the frame. The normals look at the
+* samples across the tile edges so neighbouring tiles shade the same.
+*/
+void meshTerrainTile(TerrainTile* tile)
+{
+	GLint samples = terrainHeader->tileSamples;
+	GLfloat spacing = terrainHeader->spacing;
+	GLint first[2] = { tile->tile[0] * (samples - 1), tile->tile[1] * (samples - 1) };
+
+	boundsEmpty(&tile->bounds);
+	for (GLint j = 0; j < samples; j++)
+	{
+		for (GLint i = 0; i < samples; i++)
+		{
+			GLint x = first[0] + i;
+			GLint y = first[1] + j;
+			GLint v = j * samples + i;
+
+			GLfloat* vertex = &tile->mesh.vertices[v * 3];
+			vertex[0] = terrainHeader->origin[0] + x * spacing;
+			vertex[1] = terrainHeader->origin[1] + y * spacing;
+			vertex[2] = getTerrainSample(x, y);
+
+			Vertex3 normal = { { getTerrainSample(x - 1, y) - getTerrainSample(x + 1, y),
+				getTerrainSample(x, y - 1) - getTerrainSample(x, y + 1), 2.0f * spacing } };
+			normalizeVector(&normal);
+			memcpy(&tile->mesh.normals[v * 3], normal.position, sizeof(GLfloat) * 3);
+
+			// The sand is stretched the same as it is over the disc
+			tile->mesh.texCoords[v * 2] = vertex[0] / (2.0f * bottomDiscRadius) + 0.5f;
+			tile->mesh.texCoords[v * 2 + 1] = vertex[1] / (2.0f * bottomDiscRadius) + 0.5f;
+
+			boundsGrowPoint(&tile->bounds, vertex);
+		}
+	}
+
+	// Each corner of the occluder grid takes the lowest height of the cells it touches
+	GLint cellSamples[TERRAIN_OCCLUDER_CELLS + 1];
+	for (GLint c = 0; c <= TERRAIN_OCCLUDER_CELLS; c++)
+	{
+		cellSamples[c] = c * (samples - 1) / TERRAIN_OCCLUDER_CELLS;
+	}
+	for (GLint cj = 0; cj <= TERRAIN_OCCLUDER_CELLS; cj++)
+	{
+		for (GLint ci = 0; ci <= TERRAIN_OCCLUDER_CELLS; ci++)
+		{
+			GLfloat lowest = 1e30f;
+			for (GLint j = cellSamples[cj > 0 ? cj - 1 : 0]; j <= cellSamples[cj < TERRAIN_OCCLUDER_CELLS ? cj + 1 : cj]; j++)
+			{
+				for (GLint i = cellSamples[ci > 0 ? ci - 1 : 0]; i <= cellSamples[ci < TERRAIN_OCCLUDER_CELLS ? ci + 1 : ci]; i++)
+				{
+					GLfloat height = tile->mesh.vertices[(j * samples + i) * 3 + 2];
+					lowest = height < lowest ? height : lowest;
+				}
+			}
+
+			GLfloat* corner = tile->occluder[cj * (TERRAIN_OCCLUDER_CELLS + 1) + ci];
+			corner[0] = terrainHeader->origin[0] + (first[0] + cellSamples[ci]) * spacing;
+			corner[1] = terrainHeader->origin[1] + (first[1] + cellSamples[cj]) * spacing;
+			corner[2] = lowest;
+		}
+	}
+}
+
+// Worker thread that meshes terrain tiles as they are asked for
+void runTerrainWorker(void* data)
+{
+	(void)data;
+
+	lockMutex(&terrainMutex);
+	while (!isTerrainStopping)
+	{
+		if (terrainQueueCount == 0)
+		{
+			waitCondition(&terrainCondition, &terrainMutex);
+			continue;
+		}
+
+		GLint slot = terrainQueue[terrainQueueStart];
+		terrainQueueStart = (terrainQueueStart + 1) % terrainBudget;
+		terrainQueueCount--;
+		unlockMutex(&terrainMutex);
+
+		double start = getTimeSeconds();
+		meshTerrainTile(&terrainTiles[slot]);
+		double meshTime = getTimeSeconds() - start;
+		atomicStore(&terrainTiles[slot].state, TERRAIN_TILE_MESHED);
+
+		lockMutex(&terrainMutex);
+		terrainMeshTime += meshTime;
+		terrainMeshCount++;
+	}
+	unlockMutex(&terrainMutex);
+}
+
+// Stops the terrain workers and lets go of the tiles and the file
+void unloadTerrain()
+{
+	if (!terrainHeader)
+	{
+		return;
+	}
+
+	lockMutex(&terrainMutex);
+	isTerrainStopping = GL_TRUE;
+	broadcastCondition(&terrainCondition);
+	unlockMutex(&terrainMutex);
+
+	for (GLint t = 0; t < terrainWorkerCount; t++)
+	{
+		joinThread(terrainWorkers[t]);
+	}
+	terrainWorkerCount = 0;
+
+	for (GLint s = 0; s < terrainBudget; s++)
+	{
+		freeStaticMesh(&terrainTiles[s].mesh);
+	}
+	free(terrainTiles);
+	free(terrainQueue);
+	terrainTiles = NULL;
+	terrainQueue = NULL;
+
+	unmapFile(&terrainFile);
+	terrainHeader = NULL;
+	terrainSamples = NULL;
+}
+
+/*
+* Maps a terrain file in and sets up the tile slots and the workers. Every slot
+* gets its mesh arrays up front and keeps them, since every tile is the same
+* size, so loading tiles never allocates. The triangles are the same for every
+* tile too, so they only get built once.
+*/
+void loadTerrain(char* path)
+{
+	const unsigned char* data = mapFile(path, &terrainFile);
+	TerrainHeader* header = (TerrainHeader*)data;
+	if (!data || terrainFile.size < sizeof(TerrainHeader) || header->magic != TERRAIN_MAGIC
+		|| header->version != TERRAIN_VERSION || header->tileSamples < 2 || header->tiles[0] < 1 || header->tiles[1] < 1
+		|| terrainFile.size < sizeof(TerrainHeader) + sizeof(GLshort) * (size_t)header->tiles[0] * header->tiles[1]
+			* header->tileSamples * header->tileSamples)
+	{
+		printf("Couldn't load the terrain from %s, using the flat floor\n", path);
+		unmapFile(&terrainFile);
+		return;
+	}
+
+	terrainHeader = header;
+	terrainSamples = (const GLshort*)(data + sizeof(TerrainHeader));
+
+	GLint samples = header->tileSamples;
+	if (terrainBudget < 1)
+	{
+		terrainBudget = 1;
+	}
+	terrainTiles = (TerrainTile*)calloc(terrainBudget, sizeof(TerrainTile));
+	terrainQueue = (GLint*)malloc(sizeof(GLint) * terrainBudget);
+	if (!terrainTiles || !terrainQueue)
+	{
+		printf("Error allocating memory for the terrain tiles\n");
+		exit(1);
+	}
+
+	for (GLint s = 0; s < terrainBudget; s++)
+	{
+		StaticMesh* mesh = &terrainTiles[s].mesh;
+		allocateStaticMesh(mesh, samples * samples, (samples - 1) * (samples - 1) * 6, GL_TRUE);
+
+		GLint written = 0;
+		for (GLint j = 0; j < samples - 1; j++)
+		{
+			for (GLint i = 0; i < samples - 1; i++)
+			{
+				addGridQuad(mesh, &written, j, i, samples - 1);
+			}
+		}
+		buildStaticMeshEdges(mesh);
+	}
+
+	initMutex(&terrainMutex);
+	initCondition(&terrainCondition);
+	isTerrainStopping = GL_FALSE;
+
+	// Leave a core for the simulation and one for drawing
+	terrainWorkerCount = getProcessorCount() - 2;
+	if (terrainWorkerCount < 1) terrainWorkerCount = 1;
+	if (terrainWorkerCount > MAX_TERRAIN_WORKERS) terrainWorkerCount = MAX_TERRAIN_WORKERS;
+	for (GLint t = 0; t < terrainWorkerCount; t++)
+	{
+		startThread(&terrainWorkers[t], runTerrainWorker, NULL);
+	}
+	atexit(unloadTerrain);
+
+	GLfloat tileSize = (samples - 1) * header->spacing;
+	printf("Loaded a terrain of %d by %d tiles, %.0f by %.0f units, keeping %d tiles (%.1f MB) with %d workers\n",
+		header->tiles[0], header->tiles[1], header->tiles[0] * tileSize, header->tiles[1] * tileSize, terrainBudget,
+		terrainBudget * (sizeof(GLfloat) * 8 * samples * samples + sizeof(GLuint) * 6 * (samples - 1) * (samples - 1)
+			+ sizeof(GLuint) * 2 * terrainTiles[0].mesh.edgeCount)
+			/ (1024.0 * 1024.0), terrainWorkerCount);
+}
+
+// How far a point is from the closest part of a terrain tile, across the floor
+GLfloat getTerrainTileDistance(GLint tileX, GLint tileY, GLfloat x, GLfloat y)
+{
+	GLfloat tileSize = (terrainHeader->tileSamples - 1) * terrainHeader->spacing;
+	GLfloat minimum[2] = { terrainHeader->origin[0] + tileX * tileSize, terrainHeader->origin[1] + tileY * tileSize };
+	GLfloat point[2] = { x, y };
+	GLfloat distance = 0;
+
+	for (GLint a = 0; a < 2; a++)
+	{
+		GLfloat outside = 0;
+		if (point[a] < minimum[a]) outside = minimum[a] - point[a];
+		if (point[a] > minimum[a] + tileSize) outside = point[a] - minimum[a] - tileSize;
+		distance += outside * outside;
+	}
+
+	return sqrtf(distance);
+}
+
+/*
+* Makes sure a tile is loaded or on its way. If it isn't in a slot yet it takes
+* an empty one, or else the one used longest ago that isn't needed this frame.
+* A slot that is still being meshed can't be taken. Returns GL_FALSE if every
+* slot is busy, which only happens with a budget too small for the view.
+*/
+GLboolean requestTerrainTile(GLint tileX, GLint tileY)
+{
+	TerrainTile* empty = NULL;
+	TerrainTile* oldest = NULL;
+	for (GLint s = 0; s < terrainBudget; s++)
+	{
+		TerrainTile* tile = &terrainTiles[s];
+		GLint state = atomicLoad(&tile->state);
+
+		if (state == TERRAIN_TILE_EMPTY)
+		{
+			empty = empty ? empty : tile;
+		}
+		else if (tile->tile[0] == tileX && tile->tile[1] == tileY)
+		{
+			tile->lastUsed = terrainFrame;
+			return GL_TRUE;
+		}
+		else if (state != TERRAIN_TILE_LOADING && tile->lastUsed < terrainFrame
+			&& (!oldest || tile->lastUsed < oldest->lastUsed))
+		{
+			oldest = tile;
+		}
+	}
+
+	TerrainTile* victim = empty ? empty : oldest;
+	if (!victim)
+	{
+		return GL_FALSE;
+	}
+
+	if (victim == oldest)
+	{
+		terrainEvictions++;
+	}
+	victim->tile[0] = tileX;
+	victim->tile[1] = tileY;
+	victim->lastUsed = terrainFrame;
+	atomicStore(&victim->state, TERRAIN_TILE_LOADING);
+	terrainLoads++;
+
+	lockMutex(&terrainMutex);
+	terrainQueue[(terrainQueueStart + terrainQueueCount) % terrainBudget] = (GLint)(victim - terrainTiles);
+	terrainQueueCount++;
+	signalCondition(&terrainCondition);
+	unlockMutex(&terrainMutex);
+	return GL_TRUE;
+}
+
+/*
+* Keeps the tiles around a point loaded. Tiles are asked for in rings going
+* out from the one under the point, so the closest ones get slots first, and
+* one tile past what can be seen so they are ready before they come into view.
+* The only work on this thread is compiling finished meshes into display
+* lists, and only a few a frame so crossing a tile edge never hitches.
+*/
+void updateTerrain(GLfloat x, GLfloat y)
+{
+	terrainFrame++;
+
+	GLfloat tileSize = (terrainHeader->tileSamples - 1) * terrainHeader->spacing;
+	GLfloat reach = terrainViewDistance + tileSize;
+	GLint rings = (GLint)ceilf(reach / tileSize);
+	GLint centre[2] = { (GLint)floorf((x - terrainHeader->origin[0]) / tileSize),
+		(GLint)floorf((y - terrainHeader->origin[1]) / tileSize) };
+
+	for (GLint ring = 0; ring <= rings; ring++)
+	{
+		for (GLint ty = centre[1] - ring; ty <= centre[1] + ring; ty++)
+		{
+			// Only the edge of the ring, the inside was done already
+			GLint step = (ty == centre[1] - ring || ty == centre[1] + ring) ? 1 : 2 * ring;
+			for (GLint tx = centre[0] - ring; tx <= centre[0] + ring; tx += step)
+			{
+				if (tx < 0 || ty < 0 || tx >= terrainHeader->tiles[0] || ty >= terrainHeader->tiles[1]
+					|| getTerrainTileDistance(tx, ty, x, y) > reach)
+				{
+					continue;
+				}
+				requestTerrainTile(tx, ty);
+			}
+		}
+	}
+
+	terrainUploads = 0;
+	for (GLint s = 0; s < terrainBudget && terrainUploads < terrainUploadsPerFrame; s++)
+	{
+		TerrainTile* tile = &terrainTiles[s];
+		if (atomicLoad(&tile->state) != TERRAIN_TILE_MESHED)
+		{
+			continue;
+		}
+
+		double start = getTimeSeconds();
+		uploadStaticMesh(&tile->mesh);
+
+		double uploadTime = getTimeSeconds() - start;
+		terrainUploadTime += uploadTime;
+		terrainUploadCount++;
+		if (uploadTime > terrainWorstUploadTime)
+		{
+			terrainWorstUploadTime = uploadTime;
+		}
+
+		atomicStore(&tile->state, TERRAIN_TILE_RESIDENT);
+		terrainUploads++;
+	}
+}
+
+// Render queue callback that draws a terrain tile out of its display list, or
+// its edges straight from the mesh in wireframe
+void drawTerrainTile(void* data, GLint param)
+{
+	(void)param;
+
+	TerrainTile* tile = (TerrainTile*)data;
+
+	glColor3f(1.0f, 1.0f, 1.0f);
+	drawStaticMesh(&tile->mesh, isDrawingEdges);
+}
+
+/*
+* Queues the terrain tiles that are loaded, close enough to see and inside the
+* view frustum, with the sand texture. A tile that isn't loaded yet is just
+* missing, the fog hides it when it is far enough out. The queued tiles get
+* marked so only they go in the occlusion buffer.
+*/
+void drawTerrain()
+{
+	updateTerrain(frameState->submarine[0], frameState->submarine[1]);
+
+	GLfloat planes[6][4];
+	extractFrustumPlanes(projectionMatrix, viewMatrix, planes);
+
+	GLfloat model[16];
+	matrixIdentity(model);
+
+	for (GLint s = 0; s < terrainBudget; s++)
+	{
+		TerrainTile* tile = &terrainTiles[s];
+		if (atomicLoad(&tile->state) != TERRAIN_TILE_RESIDENT
+			|| getTerrainTileDistance(tile->tile[0], tile->tile[1], frameState->submarine[0], frameState->submarine[1]) > terrainViewDistance
+			|| !isBoundsInFrustum(&tile->bounds, planes))
+		{
+			continue;
+		}
+
+		submitRenderItem(GL_FALSE, MATERIAL_NONE, sandTexture, model, drawTerrainTile, tile, 0);
+		tile->drawnFrame = terrainFrame;
+	}
+}
+
+// Prints how the terrain streaming is keeping up
+void printTerrainStats()
+{
+	if (!terrainHeader)
+	{
+		return;
+	}
+
+	GLint counts[4] = { 0, 0, 0, 0 };
+	for (GLint s = 0; s < terrainBudget; s++)
+	{
+		counts[atomicLoad(&terrainTiles[s].state)]++;
+	}
+
+	lockMutex(&terrainMutex);
+	double meshTime = terrainMeshTime;
+	GLint meshCount = terrainMeshCount;
+	unlockMutex(&terrainMutex);
+
+	printf("Terrain: %d of %d tiles resident, %d loading, %d meshed, %d loaded and %d evicted in all\n",
+		counts[TERRAIN_TILE_RESIDENT], terrainBudget, counts[TERRAIN_TILE_LOADING], counts[TERRAIN_TILE_MESHED],
+		terrainLoads, terrainEvictions);
+	if (meshCount > 0 && terrainUploadCount > 0)
+	{
+		printf("Terrain tiles: %.2f ms meshing on the workers and %.2f ms uploading on average, %.2f ms worst upload\n",
+			meshTime / meshCount * 1000.0, terrainUploadTime / terrainUploadCount * 1000.0, terrainWorstUploadTime * 1000.0);
+	}
+}
+
+/*
+* Restores the simulation from a snapshot. The file is mapped instead of read,
+* so an uncompressed snapshot goes straight from the mapping into the flock
+* arrays. The snapshot has to come from the same species table, since the
+* flock is stored sorted by species. Coral that was placed somewhere else gets
+* moved, which means baking the obstacle field again. Returns 0 on success.
+*/
+GLint loadSnapshot(char* path)
+{
+	MappedFile mapped;
+	const unsigned char* data = mapFile(path, &mapped);
+	if (!data)
+	{
+		printf("Could not open the snapshot %s\n", path);
+		return 1;
+	}
+
+	SnapshotHeader header;
+	if (mapped.size < sizeof(SnapshotHeader))
+	{
+		printf("%s is too small to be a snapshot\n", path);
+		unmapFile(&mapped);
+		return 1;
+	}
+	memcpy(&header, data, sizeof(SnapshotHeader));
+
+	GLint coralBytes = (GLint)(sizeof(GLfloat) * 3 * header.coralCount);
+	GLint flockBytes = (GLint)(sizeof(Boid) * flock.count);
+
+	if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION)
+	{
+		printf("%s is not a version %d snapshot\n", path, SNAPSHOT_VERSION);
+		unmapFile(&mapped);
+		return 1;
+	}
+	if (header.speciesCount != flock.speciesCount ||
+		memcmp(header.speciesFirst, flock.speciesFirst, sizeof(header.speciesFirst)) != 0 ||
+		header.coralCount != coralInstanceCount || header.rawSize != coralBytes + 2 * flockBytes ||
+		header.payloadSize < 0 || (size_t)header.payloadSize > mapped.size - sizeof(SnapshotHeader))
+	{
+		printf("%s doesn't match this scene's coral and species\n", path);
+		unmapFile(&mapped);
+		return 1;
+	}
+
+	const unsigned char* payload = data + sizeof(SnapshotHeader);
+	unsigned char* decompressed = NULL;
+	if (header.flags & SNAPSHOT_COMPRESSED)
+	{
+		decompressed = (unsigned char*)malloc(header.rawSize > 0 ? header.rawSize : 1);
+		if (!decompressed)
+		{
+			printf("Error allocating memory for the snapshot\n");
+			exit(1);
+		}
+		if (decompressBlock(payload, header.payloadSize, decompressed, header.rawSize) != header.rawSize)
+		{
+			printf("%s is corrupt\n", path);
+			free(decompressed);
+			unmapFile(&mapped);
+			return 1;
+		}
+		payload = decompressed;
+	}
+
+	// The 'l' key restores on the simulation thread, so the frame being drawn
+	// has to let go of the coral before any of them move. The hierarchy gets
+	// refit before letting go so drawCoral never has to
+	GLboolean hasCoralMoved = GL_FALSE;
+	for (GLint i = 0; i < coralInstanceCount; i++)
+	{
+		GLfloat position[3];
+		memcpy(position, payload + sizeof(GLfloat) * 3 * i, sizeof(position));
+		if (memcmp(position, coralInstances[i].position, sizeof(position)) != 0)
+		{
+			if (!hasCoralMoved)
+			{
+				lockMutex(&sceneMutex);
+			}
+			moveCoralInstance(i, position);
+			hasCoralMoved = GL_TRUE;
+		}
+	}
+	if (hasCoralMoved)
+	{
+		updateSceneBvh();
+		unlockMutex(&sceneMutex);
+	}
+	memcpy(flock.previous, payload + coralBytes, flockBytes);
+	memcpy(flock.current, payload + coralBytes + flockBytes, flockBytes);
+	resetNeighbourLists(&flock);
+
+	simulationTick = header.tick;
+	submarineX = header.submarine[0];
+	submarineY = header.submarine[1];
+	submarineZ = header.submarine[2];
+	waveTimeValue = header.waveTimeValue;
+
+	free(decompressed);
+	unmapFile(&mapped);
+
+	if (hasCoralMoved)
+	{
+		bakeObstacleField();
+	}
+
+	printf("Restored tick %d from %s\n", header.tick, path);
+	return 0;
+}
+
+/*
+* The checkpoint thread. It sleeps until the simulation hands it a captured
+* snapshot, then compresses and writes it while the simulation carries on.
+*/
+void runCheckpointThread(void* data)
+{
+	(void)data;
+
+	unsigned char* compressed = NULL;
+	GLint compressedCapacity = 0;
+
+	lockMutex(&checkpointMutex);
+	for (;;)
+	{
+		while (!isCheckpointPending)
+		{
+			waitCondition(&checkpointCondition, &checkpointMutex);
+		}
+		unlockMutex(&checkpointMutex);
+
+		// The snapshot can't change while it is pending, so no lock is needed to write it
+		double start = getTimeSeconds();
+		if (writeSnapshot(checkpointPath, &checkpointHeader, checkpointPayload, isSnapshotCompressed,
+			&compressed, &compressedCapacity) == 0)
+		{
+			printf("Checkpointed tick %d to %s in %.1f ms\n", checkpointHeader.tick, checkpointPath,
+				(getTimeSeconds() - start) * 1000.0);
+		}
+
+		lockMutex(&checkpointMutex);
+		isCheckpointPending = GL_FALSE;
+	}
+}
+
+/*
+* Called every tick. Every checkpointInterval ticks it copies the simulation
+* for the checkpoint thread, unless that thread is still busy with the last
+* one, in which case this checkpoint is skipped rather than waited for.
+*/
+void updateCheckpoint()
+{
+	if (checkpointInterval <= 0 || simulationTick % checkpointInterval != 0)
+	{
+		return;
+	}
+
+	if (!isCheckpointThreadRunning)
+	{
+		initMutex(&checkpointMutex);
+		initCondition(&checkpointCondition);
+		startThread(&checkpointThread, runCheckpointThread, NULL);
+		isCheckpointThreadRunning = GL_TRUE;
+	}
+
+	lockMutex(&checkpointMutex);
+	if (isCheckpointPending)
+	{
+		checkpointsSkipped++;
+	}
+	else
+	{
+		captureSnapshot(&checkpointHeader, &checkpointPayload, &checkpointPayloadCapacity);
+		isCheckpointPending = GL_TRUE;
+		signalCondition(&checkpointCondition);
+	}
+	unlockMutex(&checkpointMutex);
+}
+
+/*
+* Command line benchmark for snapshots. It saves and restores a flock of the
+* given size, raw and compressed, and checks the restored flock matches.
+*/
+GLint benchmarkSnapshot(GLint count)
+{
+	Species benchSpecies[3];
+	for (GLint s = 0; s < 3; s++)
+	{
+		benchSpecies[s] = speciesTable[s];
+		benchSpecies[s].count = count / 3;
+	}
+
+	srand(1);
+	initializeFlock(&flock, benchSpecies, 3, (GLfloat)bottomDiscRadius, (GLfloat)wallHeight);
+
+	Boid* expected = (Boid*)malloc(sizeof(Boid) * flock.count);
+	if (!expected)
+	{
+		printf("Error allocating memory for the benchmark\n");
+		return 1;
+	}
+	memcpy(expected, flock.current, sizeof(Boid) * flock.count);
+
+	for (GLint compressed = 0; compressed < 2; compressed++)
+	{
+		isSnapshotCompressed = (GLboolean)compressed;
+
+		double start = getTimeSeconds();
+		saveSnapshot("bench.snap");
+		double saveTime = getTimeSeconds() - start;
+
+		memset(flock.current, 0, sizeof(Boid) * flock.count);
+		start = getTimeSeconds();
+		loadSnapshot("bench.snap");
+		double loadTime = getTimeSeconds() - start;
+
+		printf("%s: saved in %.2f ms, restored in %.2f ms, %s\n", compressed ? "Compressed" : "Raw",
+			saveTime * 1000.0, loadTime * 1000.0,
+			memcmp(expected, flock.current, sizeof(Boid) * flock.count) == 0 ? "matches" : "DOES NOT MATCH");
+	}
+
+	remove("bench.snap");
+	free(expected);
+	freeFlock(&flock);
+	return 0;
+}
+
+/*
+* Draws the pyramid that makes up one fish, with a normal set for each
+* triangle. The render queue calls it with the fish's matrix loaded.
+*/
+void drawBoidGeometry(void* data, GLint param)
+{
+	(void)param;
+	GLfloat boidSize = ((Species*)data)->size;
+
+	// The 5 vertices that make up the boid
+	Vertex3 v1 = { 0.0f, 0.0f, boidSize * 1.75f };
+	Vertex3 v2 = { -boidSize, boidSize, -boidSize };
+	Vertex3 v3 = { boidSize, boidSize, -boidSize };
+	Vertex3 v4 = { boidSize, -boidSize, -boidSize };
+	Vertex3 v5 = { -boidSize, -boidSize, -boidSize };
+
+	// The wireframe is the 4 edges up to the nose, the base and its diagonal,
+	// each lit as if it faced out from the middle
+	if (isDrawingEdges)
+	{
+		Vertex3* corners[5] = { &v1, &v2, &v3, &v4, &v5 };
+		const GLint edges[9][2] = { { 0, 1 }, { 0, 2 }, { 0, 3 }, { 0, 4 }, { 1, 2 }, { 2, 3 }, { 3, 4 }, { 4, 1 }, { 1, 3 } };
+
+		glBegin(GL_LINES);
+		for (GLint e = 0; e < 9; e++)
+		{
+			for (GLint k = 0; k < 2; k++)
+			{
+				Vertex3 normal = *corners[edges[e][k]];
+				normalizeVector(&normal);
+				glNormal3fv(normal.position);
+				glVertex3fv(corners[edges[e][k]]->position);
+			}
+		}
+		glEnd();
+		renderStats.lines += 9;
+		return;
+	}
+
+	glBegin(GL_TRIANGLES);
+
+	// First triangle
+	Vertex3 normal;
+	normal = calculateNormal(v1, v2, v3);
+	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
+	glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
+	glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
+	glVertex3f(v3.position[0], v3.position[1], v3.position[2]);
+
+	// Second triangle
+	normal = calculateNormal(v1, v3, v4);
+	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
+	glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
+	glVertex3f(v3.position[0], v3.position[1], v3.position[2]);
+	glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
+
+	// Third triangle
+	normal = calculateNormal(v1, v4, v5);
+	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
+	glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
+	glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
+	glVertex3f(v5.position[0], v5.position[1], v5.position[2]);
+
+	// Fourth triangle
+	normal = calculateNormal(v1, v5, v2);
+	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
+	glVertex3f(v1.position[0], v1.position[1], v1.position[2]);
+	glVertex3f(v5.position[0], v5.position[1], v5.position[2]);
+	glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
+
+	// First base triangle
+	normal = calculateNormal(v2, v3, v4);
+	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
+	glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
+	glVertex3f(v3.position[0], v3.position[1], v3.position[2]);
+	glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
+
+	// Second base triangle
+	normal = calculateNormal(v4, v5, v2);
+	glNormal3f(normal.position[0], normal.position[1], normal.position[2]);
+	glVertex3f(v4.position[0], v4.position[1], v4.position[2]);
+	glVertex3f(v5.position[0], v5.position[1], v5.position[2]);
+	glVertex3f(v2.position[0], v2.position[1], v2.position[2]);
+
+	glEnd();
+	renderStats.triangles += 6;
+}
+
+/*
+* This method queues a boid to be drawn. It points the boids in the direction
+* they are moving and sets the material of their species.
+*/
+void drawBoids(Boid boid, Species* species)
+{
+	// Normalize the velocity vectors for the angle calculations
+	GLfloat magnitude = sqrt(boid.velocity[0] * boid.velocity[0] + 
+		boid.velocity[1] * boid.velocity[1] +
+		boid.velocity[2] * boid.velocity[2]);
+
+	GLfloat velocity[3] = 
+	{
+		boid.velocity[0] / magnitude,
+		boid.velocity[1] / magnitude,
+		boid.velocity[2] / magnitude 
+	};
+
+	// For rotation
+	GLfloat angleZ = atan2f(velocity[0], velocity[2]);
+	GLfloat pitch = -asinf(velocity[1]);
+
+	GLfloat model[16];
+	matrixIdentity(model);
+
+	matrixTranslate(model, boid.position[0], boid.position[1], boid.position[2]);
+
+	matrixRotate(model, angleZ * (180.0f / PI), 0.0f, 1.0f, 0.0f); 
+	matrixRotate(model, pitch * (180.0f / PI), 1.0f, 0.0f, 0.0f);
+
+	submitRenderItem(GL_TRUE, species->material, 0, model, drawBoidGeometry, species, 0);
+}
+
+/*
+* Looks up the GL functions past 1.1. Instancing came in with GL 3.1 and 3.3,
+* so those two also get looked up by their older ARB names, and so do the
+* buffer object ones from 1.5. The program binary functions are the same under
+* both names.
+*/
+void loadGlFunctions()
+{
+	const char* glFunctionNames[][2] =
+	{
+		{ "glCreateShader", NULL },
+		{ "glShaderSource", NULL },
+		{ "glCompileShader", NULL },
+		{ "glGetShaderiv", NULL },
+		{ "glGetShaderInfoLog", NULL },
+		{ "glDeleteShader", NULL },
+		{ "glCreateProgram", NULL },
+		{ "glAttachShader", NULL },
+		{ "glBindAttribLocation", NULL },
+		{ "glLinkProgram", NULL },
+		{ "glGetProgramiv", NULL },
+		{ "glGetProgramInfoLog", NULL },
+		{ "glDeleteProgram", NULL },
+		{ "glUseProgram", NULL },
+		{ "glGetUniformLocation", NULL },
+		{ "glUniform1f", NULL },
+		{ "glUniform1i", NULL },
+		{ "glUniform2f", NULL },
+		{ "glActiveTexture", "glActiveTextureARB" },
+		{ "glVertexAttribPointer", NULL },
+		{ "glEnableVertexAttribArray", NULL },
+		{ "glDisableVertexAttribArray", NULL },
+		{ "glVertexAttribDivisor", "glVertexAttribDivisorARB" },
+		{ "glDrawElementsInstanced", "glDrawElementsInstancedARB" },
+		{ "glProgramParameteri", NULL },
+		{ "glGetProgramBinary", NULL },
+		{ "glProgramBinary", NULL },
+		{ "glGenBuffers", "glGenBuffersARB" },
+		{ "glDeleteBuffers", "glDeleteBuffersARB" },
+		{ "glBindBuffer", "glBindBufferARB" },
+		{ "glBufferData", "glBufferDataARB" },
+		{ "glBufferSubData", "glBufferSubDataARB" }
+	};
+
+	// The struct is nothing but function pointers in the same order as the names
+	void (**functions)(void) = (void (**)(void))&gl;
+	GLint functionCount = sizeof(glFunctionNames) / sizeof(glFunctionNames[0]);
+	for (GLint i = 0; i < functionCount; i++)
+	{
+		functions[i] = (void (*)(void))glutGetProcAddress(glFunctionNames[i][0]);
+		if (!functions[i] && glFunctionNames[i][1])
+		{
+			functions[i] = (void (*)(void))glutGetProcAddress(glFunctionNames[i][1]);
+		}
+	}
+}
+
+/*
+* Compiles and links a shader program. The header goes in front of both
+* sources, for the #version and any #defines. The fragment shader can be NULL
+* to keep the fixed function fragment stage, fog and all. The attributes are
+* bound to the given indexes before linking. Returns 0 and prints the log if
+* anything failed or the driver doesn't have shaders.
+*/
+GLuint buildShaderProgram(const char* header, const char* vertexSource, const char* fragmentSource,
+	const char** attributes, GLint* attributeIndexes, GLint attributeCount)
+{
+	if (!gl.createShader || !gl.createProgram || !gl.linkProgram || !gl.useProgram)
+	{
+		return 0;
+	}
+
+	const char* sources[2] = { vertexSource, fragmentSource };
+	GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	char log[1024];
+	GLint status;
+
+	GLuint program = gl.createProgram();
+	for (GLint s = 0; s < 2; s++)
+	{
+		if (!sources[s])
+		{
+			continue;
+		}
+
+		const char* strings[2] = { header, sources[s] };
+		GLuint shader = gl.createShader(types[s]);
+		gl.shaderSource(shader, 2, strings, NULL);
+		gl.compileShader(shader);
+		gl.getShaderiv(shader, GL_COMPILE_STATUS, &status);
+		if (!status)
+		{
+			gl.getShaderInfoLog(shader, sizeof(log), NULL, log);
+			printf("Couldn't compile a %s shader:\n%s\n", s == 0 ? "vertex" : "fragment", log);
+			gl.deleteShader(shader);
+			gl.deleteProgram(program);
+			return 0;
+		}
+
+		gl.attachShader(program, shader);
+
+		// It stays around as long as the program does
+		gl.deleteShader(shader);
+	}
+
+	for (GLint a = 0; a < attributeCount; a++)
+	{
+		gl.bindAttribLocation(program, attributeIndexes[a], attributes[a]);
+	}
+
+	// Ask to be able to save the linked program, for the shader cache
+	if (gl.programParameteri && gl.getProgramBinary)
+	{
+		gl.programParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
+	gl.linkProgram(program);
+	gl.getProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status)
+	{
+		gl.getProgramInfoLog(program, sizeof(log), NULL, log);
+		printf("Couldn't link a shader program:\n%s\n", log);
+		gl.deleteProgram(program);
+		return 0;
+	}
+
+	return program;
+}
+
+/*
+* Builds the fish body, a tube along z from the tail at -0.5 to the nose at
+* 0.5 with segments rings of sides quads. It's taller than it is wide and
+* fattest a third of the way back from the nose. The rings repeat their first
+* vertex so the grid quads can wrap.
+*/
+void buildFishMesh(StaticMesh* mesh, GLint segments, GLint sides)
+{
+	allocateStaticMesh(mesh, (segments + 1) * (sides + 1), segments * sides * 6, GL_FALSE);
+
+	for (GLint j = 0; j <= segments; j++)
+	{
+		GLfloat along = (GLfloat)j / segments;
+		GLfloat bulge = sinf(PI * powf(along, 1.5f));
+
+		// How quickly the radius changes along the body, to tilt the normals
+		GLfloat slope = 0;
+		if (along > 0)
+		{
+			slope = cosf(PI * powf(along, 1.5f)) * PI * 1.5f * sqrtf(along);
+		}
+
+		for (GLint i = 0; i <= sides; i++)
+		{
+			GLfloat angle = 2.0f * PI * i / sides;
+			GLint v = j * (sides + 1) + i;
+
+			mesh->vertices[v * 3] = cosf(angle) * bulge * 0.08f;
+			mesh->vertices[v * 3 + 1] = sinf(angle) * bulge * 0.16f;
+			mesh->vertices[v * 3 + 2] = along - 0.5f;
+
+			Vertex3 normal = { { cosf(angle) / 0.08f, sinf(angle) / 0.16f, -slope * 0.08f } };
+			normalizeVector(&normal);
+			memcpy(&mesh->normals[v * 3], normal.position, sizeof(GLfloat) * 3);
+		}
+	}
+
+	GLint written = 0;
+	for (GLint j = 0; j < segments; j++)
+	{
+		for (GLint i = 0; i < sides; i++)
+		{
+			addGridQuad(mesh, &written, j, i, sides);
+		}
+	}
+}
+
+/*
+* Makes the texture of the fish impostors, the side view of the fish mesh,
+* lighter along the back. The texture runs from the tail at s = 0 to the nose
+* at s = 1, and everything around the fish is see through so it can be alpha
+* tested away.
+*/
+GLuint buildFishImpostorTexture()
+{
+	GLint width = 64;
+	GLint height = 32;
+	GLubyte* pixels = (GLubyte*)malloc(width * height * 2);
+	if (!pixels)
+	{
+		printf("Error allocating memory for the fish impostor texture\n");
+		exit(1);
+	}
+
+	for (GLint y = 0; y < height; y++)
+	{
+		for (GLint x = 0; x < width; x++)
+		{
+			GLfloat s = (x + 0.5f) / width;
+			GLfloat t = (y + 0.5f) / height * 2.0f - 1.0f;
+
+			// The same bulge as the mesh, filling the height of the texture at its fattest
+			GLfloat bulge = sinf(PI * powf(s, 1.5f));
+
+			pixels[(y * width + x) * 2] = (GLubyte)(190 + 50 * t);
+			pixels[(y * width + x) * 2 + 1] = fabsf(t) < bulge ? 255 : 0;
+		}
+	}
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	gluBuild2DMipmaps(GL_TEXTURE_2D, GL_LUMINANCE_ALPHA, width, height, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, pixels);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	free(pixels);
+	return texture;
+}
+
+/*
+* The scene shaders, built once for every permutation of the SHADER_ bits by
+* defining LIT, TEXTURED, FOG and INSTANCED in front of them. The fragment
+* shader works out the cluster from the pixel's tile and depth, and loops over
+* that cluster's lights from the index texture. Lit things get the fixed
+* function sun and material on top, and unlit textured things like the sand
+* just get the small lights added to the texture. The instanced version bends
+* and places every vertex of a fish, so the CPU only fills in one instance per
+* fish however detailed the fish mesh is. The fish faces along its velocity
+* with its back up, and the sway grows towards the tail. With culling off
+* every light gets looped over, for the benchmark to compare against.
+*/
+const char* sceneVertexShader =
+	"varying vec3 eyePosition;\n"
+	"varying vec3 eyeNormal;\n"
+	"#ifdef INSTANCED\n"
+	"attribute vec4 instancePosition;\n"
+	"attribute vec4 instanceVelocity;\n"
+	"uniform float squiggles;\n"
+	"uniform float squiggleDepth;\n"
+	"#endif\n"
+	"void main()\n"
+	"{\n"
+	"#ifdef INSTANCED\n"
+	"	float speed = length(instanceVelocity.xyz);\n"
+	"	vec3 forward = speed > 0.0 ? instanceVelocity.xyz / speed : vec3(1.0, 0.0, 0.0);\n"
+	"	vec3 side = cross(vec3(0.0, 0.0, 1.0), forward);\n"
+	"	side = dot(side, side) > 0.0001 ? normalize(side) : vec3(0.0, 1.0, 0.0);\n"
+	"	vec3 up = cross(forward, side);\n"
+	"\n"
+	"	float tail = clamp(0.5 - gl_Vertex.z, 0.0, 1.0);\n"
+	"	float waveNumber = squiggles * 6.2831853;\n"
+	"	float wave = gl_Vertex.z * waveNumber + instanceVelocity.w;\n"
+	"	float depth = squiggleDepth * tail * tail;\n"
+	"	vec3 position = vec3(gl_Vertex.x + sin(wave) * depth, gl_Vertex.yz);\n"
+	"\n"
+	"	// Shearing x along z tilts the normal by the slope of the sway\n"
+	"	float slope = cos(wave) * depth * waveNumber - sin(wave) * squiggleDepth * 2.0 * tail;\n"
+	"	vec3 normal = vec3(gl_Normal.x, gl_Normal.y, gl_Normal.z - slope * gl_Normal.x);\n"
+	"\n"
+	"	vec3 world = instancePosition.xyz + (side * position.x + up * position.y + forward * position.z) * instancePosition.w;\n"
+	"	vec4 eye = gl_ModelViewMatrix * vec4(world, 1.0);\n"
+	"	eyeNormal = gl_NormalMatrix * (side * normal.x + up * normal.y + forward * normal.z);\n"
+	"#else\n"
+	"	vec4 eye = gl_ModelViewMatrix * gl_Vertex;\n"
+	"	eyeNormal = gl_NormalMatrix * gl_Normal;\n"
+	"#endif\n"
+	"	eyePosition = eye.xyz;\n"
+	"	gl_FrontColor = gl_Color;\n"
+	"#ifdef TEXTURED\n"
+	"	gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+	"#endif\n"
+	"	gl_Position = gl_ProjectionMatrix * eye;\n"
+	"}\n";
+
+const char* sceneFragmentShader =
+	"varying vec3 eyePosition;\n"
+	"varying vec3 eyeNormal;\n"
+	"#ifdef TEXTURED\n"
+	"uniform sampler2D surfaceTexture;\n"
+	"#endif\n"
+	"#ifdef FOG\n"
+	"uniform float fogDensity;\n"
+	"#endif\n"
+	"#if defined(LIT) || defined(TEXTURED)\n"
+	"#define SMALL_LIGHTS\n"
+	"uniform sampler2D rangeTexture;\n"
+	"uniform sampler2D indexTexture;\n"
+	"uniform sampler2D lightTexture;\n"
+	"uniform vec2 tileScale;\n"
+	"uniform vec2 sliceScale;\n"
+	"uniform float indexRows;\n"
+	"uniform float isCulling;\n"
+	"uniform float lightCount;\n"
+	"const vec3 clusterCounts = vec3(16.0, 9.0, 24.0);\n"
+	"const float indexWidth = 1024.0;\n"
+	"const float maxLights = 1024.0;\n"
+	"#endif\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 surface = gl_Color;\n"
+	"#ifdef TEXTURED\n"
+	"	surface *= texture2D(surfaceTexture, gl_TexCoord[0].st);\n"
+	"#endif\n"
+	"	vec3 color = surface.rgb;\n"
+	"	float alpha = surface.a;\n"
+	"\n"
+	"#ifdef SMALL_LIGHTS\n"
+	"	vec3 normal = normalize(eyeNormal);\n"
+	"	vec3 view = normalize(-eyePosition);\n"
+	"	vec3 albedo = surface.rgb;\n"
+	"	vec3 shine = vec3(0.0);\n"
+	"#endif\n"
+	"#ifdef LIT\n"
+	"	vec3 sun = normalize(gl_LightSource[0].position.xyz);\n"
+	"	float sunDiffuse = max(dot(normal, sun), 0.0);\n"
+	"	float sunSpecular = sunDiffuse > 0.0 ? pow(max(dot(normal, normalize(sun + view)), 0.0), gl_FrontMaterial.shininess) : 0.0;\n"
+	"	color = (gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient\n"
+	"		+ gl_FrontLightProduct[0].diffuse * sunDiffuse + gl_FrontLightProduct[0].specular * sunSpecular).rgb;\n"
+	"	albedo = gl_FrontMaterial.diffuse.rgb;\n"
+	"	shine = gl_FrontMaterial.specular.rgb;\n"
+	"	alpha = gl_FrontMaterial.diffuse.a;\n"
+	"#endif\n"
+	"\n"
+	"#ifdef SMALL_LIGHTS\n"
+	"	float first = 0.0;\n"
+	"	float count = lightCount;\n"
+	"	if (isCulling > 0.5)\n"
+	"	{\n"
+	"		vec2 tile = min(floor(gl_FragCoord.xy * tileScale), clusterCounts.xy - 1.0);\n"
+	"		float slice = clamp(floor(log(-eyePosition.z) * sliceScale.x + sliceScale.y), 0.0, clusterCounts.z - 1.0);\n"
+	"		vec4 range = texture2D(rangeTexture, (vec2(tile.y * clusterCounts.x + tile.x, slice) + 0.5) / vec2(clusterCounts.x * clusterCounts.y, clusterCounts.z));\n"
+	"		first = range.r;\n"
+	"		count = range.a;\n"
+	"	}\n"
+	"\n"
+	"	for (float i = 0.0; i < maxLights; i += 1.0)\n"
+	"	{\n"
+	"		if (i >= count)\n"
+	"		{\n"
+	"			break;\n"
+	"		}\n"
+	"		float light = first + i;\n"
+	"		if (isCulling > 0.5)\n"
+	"		{\n"
+	"			vec2 cell = vec2(mod(light, indexWidth), floor(light / indexWidth));\n"
+	"			light = texture2D(indexTexture, (cell + 0.5) / vec2(indexWidth, indexRows)).r;\n"
+	"		}\n"
+	"		vec4 positionRadius = texture2D(lightTexture, vec2(0.5 / 3.0, (light + 0.5) / maxLights));\n"
+	"		vec4 lightColor = texture2D(lightTexture, vec2(1.5 / 3.0, (light + 0.5) / maxLights));\n"
+	"		vec3 toLight = positionRadius.xyz - eyePosition;\n"
+	"		float distance = length(toLight);\n"
+	"		if (distance >= positionRadius.w)\n"
+	"		{\n"
+	"			continue;\n"
+	"		}\n"
+	"		toLight /= distance;\n"
+	"		float fade = 1.0 - distance * distance / (positionRadius.w * positionRadius.w);\n"
+	"		fade *= fade;\n"
+	"		if (lightColor.a > -1.0)\n"
+	"		{\n"
+	"			vec3 direction = texture2D(lightTexture, vec2(2.5 / 3.0, (light + 0.5) / maxLights)).xyz;\n"
+	"			fade *= smoothstep(lightColor.a, mix(lightColor.a, 1.0, 0.25), dot(-toLight, direction));\n"
+	"		}\n"
+	"		float diffuse = max(dot(normal, toLight), 0.0);\n"
+	"		float specular = diffuse > 0.0 ? pow(max(dot(normal, normalize(toLight + view)), 0.0), max(gl_FrontMaterial.shininess, 1.0)) : 0.0;\n"
+	"		color += lightColor.rgb * fade * (albedo * diffuse + shine * specular);\n"
+	"	}\n"
+	"#endif\n"
+	"\n"
+	"#ifdef FOG\n"
+	"	float fog = clamp(exp(-fogDensity * abs(eyePosition.z)), 0.0, 1.0);\n"
+	"	color = mix(gl_Fog.color.rgb, color, fog);\n"
+	"#endif\n"
+	"	gl_FragColor = vec4(color, alpha);\n"
+	"}\n";
+
+#define SHADER_CACHE_VERSION 1
+
+// Hashes the driver and the shader sources, since a saved program is only good for both
+unsigned int getShaderCacheKey()
+{
+	const char* strings[5] =
+	{
+		(const char*)glGetString(GL_VENDOR),
+		(const char*)glGetString(GL_RENDERER),
+		(const char*)glGetString(GL_VERSION),
+		sceneVertexShader,
+		sceneFragmentShader
+	};
+
+	unsigned int hash = 2166136261u;
+	for (GLint i = 0; i < 5; i++)
+	{
+		if (strings[i])
+		{
+			hash = hashBytes(hash, strings[i], strlen(strings[i]) + 1);
+		}
+	}
+	return hash;
+}
+
+/*
+* Reads the program binaries saved by the last launch into binaries, by their
+* permutation. The cache is only used if it was saved for the same driver and
+* shader sources, otherwise it returns false and everything gets compiled.
+*/
+GLboolean loadShaderCache(unsigned int key, void* binaries[SHADER_PERMUTATIONS], GLint lengths[SHADER_PERMUTATIONS],
+	GLenum formats[SHADER_PERMUTATIONS])
+{
+	FILE* file = fopen(shaderCachePath, "rb");
+	if (!file)
+	{
+		return GL_FALSE;
+	}
+
+	char magic[4];
+	GLint version, count;
+	unsigned int cachedKey;
+
+	if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "SSHD", 4) != 0 ||
+		fread(&version, sizeof(GLint), 1, file) != 1 || version != SHADER_CACHE_VERSION ||
+		fread(&cachedKey, sizeof(unsigned int), 1, file) != 1 || cachedKey != key ||
+		fread(&count, sizeof(GLint), 1, file) != 1 || count < 0 || count > SHADER_PERMUTATIONS)
+	{
+		fclose(file);
+		return GL_FALSE;
+	}
+
+	for (GLint i = 0; i < count; i++)
+	{
+		GLint features, length;
+		GLenum format;
+		if (fread(&features, sizeof(GLint), 1, file) != 1 || fread(&format, sizeof(GLenum), 1, file) != 1 ||
+			fread(&length, sizeof(GLint), 1, file) != 1 || features < 0 || features >= SHADER_PERMUTATIONS ||
+			length < 0 || binaries[features])
+		{
+			break;
+		}
+
+		// A program the driver wouldn't give back is saved with no binary
+		if (length == 0)
+		{
+			continue;
+		}
+
+		binaries[features] = malloc(length);
+		if (!binaries[features])
+		{
+			printf("Error allocating memory for the shader cache\n");
+			exit(1);
+		}
+		if (fread(binaries[features], 1, length, file) != (size_t)length)
+		{
+			free(binaries[features]);
+			binaries[features] = NULL;
+			break;
+		}
+		lengths[features] = length;
+		formats[features] = format;
+	}
+
+	fclose(file);
+	return GL_TRUE;
+}
+
+// Writes every scene program's binary so the next launch can skip compiling them
+void saveShaderCache(unsigned int key)
+{
+	FILE* file = fopen(shaderCachePath, "wb");
+	if (!file)
+	{
+		printf("Could not write the shader cache %s\n", shaderCachePath);
+		return;
+	}
+
+	GLint version = SHADER_CACHE_VERSION;
+	fwrite("SSHD", 1, 4, file);
+	fwrite(&version, sizeof(GLint), 1, file);
+	fwrite(&key, sizeof(unsigned int), 1, file);
+	fwrite(&shaderProgramCount, sizeof(GLint), 1, file);
+
+	for (GLint features = 0; features < SHADER_PERMUTATIONS; features++)
+	{
+		GLuint program = scenePrograms[features].program;
+		if (!program)
+		{
+			continue;
+		}
+
+		GLint length = 0;
+		GLenum format = 0;
+		gl.getProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		void* binary = malloc(length > 0 ? length : 1);
+		if (!binary)
+		{
+			printf("Error allocating memory for the shader cache\n");
+			exit(1);
+		}
+
+		GLsizei written = 0;
+		if (length > 0)
+		{
+			gl.getProgramBinary(program, length, &written, &format, binary);
+		}
+
+		fwrite(&features, sizeof(GLint), 1, file);
+		fwrite(&format, sizeof(GLenum), 1, file);
+		fwrite(&written, sizeof(GLint), 1, file);
+		fwrite(binary, 1, written, file);
+		free(binary);
+	}
+
+	fclose(file);
+}
+
+/*
+* Builds every scene shader permutation that gets drawn with, once there is a
+* window. Each one comes from the shader cache when the driver takes the saved
+* binary, and is compiled otherwise. The instanced ones are only for the fish,
+* which are always lit and never textured. Without shaders nothing gets built
+* and the render queue sticks to the fixed function pipeline.
+*/
+void initScenePrograms()
+{
+	if (!gl.createShader || !gl.activeTexture || !gl.uniform1i || !gl.uniform2f)
+	{
+		printf("No shaders, so the scene is drawn with the fixed function lighting and fog\n");
+		return;
+	}
+
+	double start = getTimeSeconds();
+	GLint formatCount = 0;
+	if (isCachingShaders && gl.getProgramBinary && gl.programBinary)
+	{
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+	}
+
+	unsigned int key = getShaderCacheKey();
+	void* binaries[SHADER_PERMUTATIONS] = { NULL };
+	GLint lengths[SHADER_PERMUTATIONS];
+	GLenum formats[SHADER_PERMUTATIONS];
+	if (formatCount > 0)
+	{
+		loadShaderCache(key, binaries, lengths, formats);
+	}
+
+	const char* attributes[2] = { "instancePosition", "instanceVelocity" };
+	GLint attributeIndexes[2] = { FISH_POSITION_ATTRIBUTE, FISH_VELOCITY_ATTRIBUTE };
+	GLboolean isInstancing = gl.vertexAttribDivisor && gl.drawElementsInstanced;
+	shaderProgramCount = 0;
+	shaderCachedCount = 0;
+
+	for (GLint features = 0; features < SHADER_PERMUTATIONS; features++)
+	{
+		SceneProgram* scene = &scenePrograms[features];
+		scene->program = 0;
+		if ((features & SHADER_INSTANCED) && (!isInstancing || !(features & SHADER_LIT) || (features & SHADER_TEXTURED)))
+		{
+			continue;
+		}
+
+		if (binaries[features])
+		{
+			GLint status;
+			scene->program = gl.createProgram();
+			gl.programBinary(scene->program, formats[features], binaries[features], lengths[features]);
+			gl.getProgramiv(scene->program, GL_LINK_STATUS, &status);
+			if (status)
+			{
+				shaderCachedCount++;
+			}
+			else
+			{
+				gl.deleteProgram(scene->program);
+				scene->program = 0;
+			}
+		}
+
+		if (!scene->program)
+		{
+			char header[128];
+			snprintf(header, sizeof(header), "#version 120\n%s%s%s%s",
+				(features & SHADER_LIT) ? "#define LIT\n" : "",
+				(features & SHADER_TEXTURED) ? "#define TEXTURED\n" : "",
+				(features & SHADER_FOG) ? "#define FOG\n" : "",
+				(features & SHADER_INSTANCED) ? "#define INSTANCED\n" : "");
+			scene->program = buildShaderProgram(header, sceneVertexShader, sceneFragmentShader, attributes, attributeIndexes, 2);
+		}
+
+		if (!scene->program)
+		{
+			continue;
+		}
+		shaderProgramCount++;
+
+		// Uniforms aren't part of a saved binary, so the texture units get set either way
+		gl.useProgram(scene->program);
+		gl.uniform1i(gl.getUniformLocation(scene->program, "surfaceTexture"), 0);
+		gl.uniform1i(gl.getUniformLocation(scene->program, "rangeTexture"), 1);
+		gl.uniform1i(gl.getUniformLocation(scene->program, "indexTexture"), 2);
+		gl.uniform1i(gl.getUniformLocation(scene->program, "lightTexture"), 3);
+		gl.useProgram(0);
+
+		scene->fogDensityLocation = gl.getUniformLocation(scene->program, "fogDensity");
+		scene->tileScaleLocation = gl.getUniformLocation(scene->program, "tileScale");
+		scene->sliceScaleLocation = gl.getUniformLocation(scene->program, "sliceScale");
+		scene->indexRowsLocation = gl.getUniformLocation(scene->program, "indexRows");
+		scene->isCullingLocation = gl.getUniformLocation(scene->program, "isCulling");
+		scene->lightCountLocation = gl.getUniformLocation(scene->program, "lightCount");
+		scene->squigglesLocation = gl.getUniformLocation(scene->program, "squiggles");
+		scene->squiggleDepthLocation = gl.getUniformLocation(scene->program, "squiggleDepth");
+	}
+
+	for (GLint features = 0; features < SHADER_PERMUTATIONS; features++)
+	{
+		free(binaries[features]);
+	}
+
+	// The render queue needs every plain permutation, so one broken one means
+	// none of them get used. Without the instanced ones the fish just go rigid
+	GLboolean isComplete = GL_TRUE;
+	for (GLint features = 0; features < SHADER_INSTANCED; features++)
+	{
+		isComplete = isComplete && scenePrograms[features].program;
+	}
+
+	if (!isComplete)
+	{
+		for (GLint features = 0; features < SHADER_PERMUTATIONS; features++)
+		{
+			if (scenePrograms[features].program)
+			{
+				gl.deleteProgram(scenePrograms[features].program);
+				scenePrograms[features].program = 0;
+			}
+		}
+		printf("The scene shaders didn't build, so the scene is drawn with the fixed function lighting and fog\n");
+		return;
+	}
+
+	hasScenePrograms = GL_TRUE;
+	if (formatCount > 0 && shaderCachedCount < shaderProgramCount)
+	{
+		saveShaderCache(key);
+	}
+
+	shaderBuildTime = getTimeSeconds() - start;
+	printf("Built %d scene shader permutations in %.1f ms, %d of them from %s\n", shaderProgramCount,
+		shaderBuildTime * 1000.0, shaderCachedCount, formatCount > 0 ? shaderCachePath : "no cache");
+}
+
+// Prints how the scene shaders got built this launch
+void printShaderStats()
+{
+	if (!hasScenePrograms)
+	{
+		printf("Shaders: none, the fixed function pipeline\n");
+		return;
+	}
+	printf("Shaders: %d scene permutations, %d loaded from %s, built in %.1f ms\n", shaderProgramCount, shaderCachedCount,
+		isCachingShaders ? shaderCachePath : "no cache", shaderBuildTime * 1000.0);
+}
+
+/*
+* Sets up the animated fish once there is a window. They need the instanced
+* scene shaders, and without them the fish stay the rigid pyramids. The far
+* away impostors work either way.
+*/
+void initFishRendering()
+{
+	buildFishMesh(&fishMesh, FISH_SEGMENTS, FISH_SIDES);
+	buildFishMesh(&fishSimpleMesh, FISH_SIMPLE_SEGMENTS, FISH_SIMPLE_SIDES);
+	buildStaticMeshEdges(&fishMesh);
+	buildStaticMeshEdges(&fishSimpleMesh);
+	fishImpostorTexture = buildFishImpostorTexture();
+
+	if (isDrawingRigidFish)
+	{
+		return;
+	}
+
+	if (!scenePrograms[SHADER_LIT | SHADER_INSTANCED].program)
+	{
+		printf("No shaders or instancing, so the fish are drawn as rigid pyramids\n");
+		isDrawingRigidFish = GL_TRUE;
+	}
+}
+
+/*
+* Keeps a fish's stroke going from the distance it swam since the last time,
+* so a fish that speeds up beats its tail faster instead of jumping to another
+* point in the stroke. Fish drawn without their tail still get moved along, so
+* they don't jump when they come close again.
+*/
+void advanceFishPhase(Boid* boid, GLfloat* phase, GLint ticks)
+{
+	GLfloat speed = sqrtf(boid->velocity[0] * boid->velocity[0] + boid->velocity[1] * boid->velocity[1]
+		+ boid->velocity[2] * boid->velocity[2]);
+
+	*phase += speed * ticks / fishStrokeLength * 2.0f * PI;
+	if (*phase > 2.0f * PI)
+	{
+		*phase = fmodf(*phase, 2.0f * PI);
+	}
+}
+
+// Fills in the instance of a fish, moving its stroke along
+void fillFishInstance(FishInstance* instance, Boid* boid, Species* species, GLfloat* phase, GLint ticks)
+{
+	advanceFishPhase(boid, phase, ticks);
+
+	instance->position[0] = boid->position[0];
+	instance->position[1] = boid->position[1];
+	instance->position[2] = boid->position[2];
+
+	// The pyramids were 2.75 sizes long
+	instance->position[3] = species->size * 2.75f;
+
+	instance->velocity[0] = boid->velocity[0];
+	instance->velocity[1] = boid->velocity[1];
+	instance->velocity[2] = boid->velocity[2];
+	instance->velocity[3] = *phase;
+}
+
+// Render queue callback that draws a batch of fish instances with the instanced scene shader
+void drawFishInstances(void* data, GLint param)
+{
+	(void)param;
+
+	FishBatch* batch = (FishBatch*)data;
+	FishInstance* first = &fishInstances[batch->first];
+
+	// The render queue has the plain lit shader bound, so put it back after
+	GLint previousProgram;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &previousProgram);
+	SceneProgram* scene = &scenePrograms[SHADER_LIT | SHADER_INSTANCED | (isDrawingFog ? SHADER_FOG : 0)];
+	gl.useProgram(scene->program);
+	gl.uniform1f(scene->squigglesLocation, numberOfFishSquiggles);
+	gl.uniform1f(scene->squiggleDepthLocation, fishSquiggleDepth);
+
+	// The fish mesh comes from its buffer objects but the instances are read from memory
+	const GLvoid* elements = bindStaticMesh(batch->mesh, isDrawingEdges);
+	if (gl.bindBuffer)
+	{
+		gl.bindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	gl.enableVertexAttribArray(FISH_POSITION_ATTRIBUTE);
+	gl.enableVertexAttribArray(FISH_VELOCITY_ATTRIBUTE);
+	gl.vertexAttribPointer(FISH_POSITION_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, sizeof(FishInstance), first->position);
+	gl.vertexAttribPointer(FISH_VELOCITY_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, sizeof(FishInstance), first->velocity);
+	gl.vertexAttribDivisor(FISH_POSITION_ATTRIBUTE, 1);
+	gl.vertexAttribDivisor(FISH_VELOCITY_ATTRIBUTE, 1);
+
+	if (isDrawingEdges)
+	{
+		gl.drawElementsInstanced(GL_LINES, batch->mesh->edgeCount * 2, GL_UNSIGNED_INT, elements, batch->count);
+		renderStats.lines += batch->mesh->edgeCount * batch->count;
+	}
+	else
+	{
+		gl.drawElementsInstanced(GL_TRIANGLES, batch->mesh->indexCount, GL_UNSIGNED_INT, elements, batch->count);
+		renderStats.triangles += batch->mesh->indexCount / 3 * batch->count;
+	}
+
+	gl.vertexAttribDivisor(FISH_POSITION_ATTRIBUTE, 0);
+	gl.vertexAttribDivisor(FISH_VELOCITY_ATTRIBUTE, 0);
+	gl.disableVertexAttribArray(FISH_POSITION_ATTRIBUTE);
+	gl.disableVertexAttribArray(FISH_VELOCITY_ATTRIBUTE);
+	unbindStaticMesh();
+	gl.useProgram(previousProgram);
+}
+
+/*
+* Picks how a fish gets drawn from how far it is and how long it looks on
+* screen. The fog in drawFog fades things by exp(-density * depth), so past
+* ln(255) / density a fish is under one step of the colour and can be skipped,
+* and past ln(4) / density it's mostly fog and a flat impostor looks the same.
+*/
+GLint getFishLod(Boid* boid, Species* species, GLfloat planes[6][4])
+{
+	GLfloat length = species->size * 2.75f;
+	GLfloat depth = -(viewMatrix[2] * boid->position[0] + viewMatrix[6] * boid->position[1]
+		+ viewMatrix[10] * boid->position[2] + viewMatrix[14]);
+
+	if (isDrawingFog && depth > logf(255.0f) / fogDensity)
+	{
+		return FISH_LOD_HIDDEN;
+	}
+	if (!isSphereInFrustum(boid->position, length * 0.5f, planes))
+	{
+		return FISH_LOD_OFF_SCREEN;
+	}
+	if (depth <= length)
+	{
+		return FISH_LOD_NEAR;
+	}
+
+	GLfloat pixels = length * projectionMatrix[5] * windowHeight * 0.5f / depth;
+	if (pixels < fishImpostorPixels || (isDrawingFog && depth > logf(4.0f) / fogDensity))
+	{
+		return FISH_LOD_IMPOSTOR;
+	}
+	return pixels < fishNearPixels ? FISH_LOD_SIMPLE : FISH_LOD_NEAR;
+}
+
+/*
+* Adds the quad of a far away fish to the impostors. It faces the camera and
+* is stretched along the way the fish swims across the screen, so a fish
+* swimming straight at the camera gets a short quad. The colour is roughly
+* what the lit material looks like from the side.
+*/
+void addFishImpostor(Boid* boid, Species* species)
+{
+	reserveArray((void**)&fishImpostorVertices, &fishImpostorCapacity, fishImpostorCount + 4, sizeof(FishImpostorVertex));
+
+	GLfloat right[3] = { viewMatrix[0], viewMatrix[4], viewMatrix[8] };
+	GLfloat up[3] = { viewMatrix[1], viewMatrix[5], viewMatrix[9] };
+	GLfloat* velocity = boid->velocity;
+	GLfloat across = velocity[0] * right[0] + velocity[1] * right[1] + velocity[2] * right[2];
+	GLfloat upwards = velocity[0] * up[0] + velocity[1] * up[1] + velocity[2] * up[2];
+	GLfloat onScreen = sqrtf(across * across + upwards * upwards);
+	GLfloat speed = sqrtf(velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]);
+
+	// A fish that isn't going anywhere on screen still needs a direction
+	if (onScreen < 1e-6f)
+	{
+		across = 1;
+		upwards = 0;
+		onScreen = 1;
+	}
+
+	// Keep the back of the fish towards the top of the screen
+	GLfloat flip = across < 0 ? -1.0f : 1.0f;
+
+	GLfloat length = species->size * 2.75f;
+	GLfloat halfLength = 0.5f * length * fmaxf(speed > 0 ? onScreen / speed : 1, 0.35f);
+	GLfloat halfHeight = 0.5f * length * 0.32f;
+
+	GLfloat forward[3];
+	GLfloat side[3];
+	for (GLint i = 0; i < 3; i++)
+	{
+		forward[i] = (across * right[i] + upwards * up[i]) / onScreen * halfLength;
+		side[i] = (-upwards * right[i] + across * up[i]) * flip / onScreen * halfHeight;
+	}
+
+	Material* material = &materials[species->material];
+	GLubyte color[4];
+	for (GLint i = 0; i < 3; i++)
+	{
+		GLfloat tint = i == 2 ? 0.8f : 1.0f;
+		GLfloat value = material->emission[i] + material->ambient[i] * 0.25f + material->diffuse[i] * tint * 0.6f;
+		color[i] = (GLubyte)(fminf(value, 1.0f) * 255);
+	}
+	color[3] = 255;
+
+	const GLfloat corners[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+	for (GLint c = 0; c < 4; c++)
+	{
+		FishImpostorVertex* vertex = &fishImpostorVertices[fishImpostorCount++];
+		for (GLint i = 0; i < 3; i++)
+		{
+			vertex->position[i] = boid->position[i] + forward[i] * (corners[c][0] * 2 - 1) + side[i] * (corners[c][1] * 2 - 1);
+		}
+		vertex->texCoord[0] = corners[c][0];
+		vertex->texCoord[1] = corners[c][1];
+		memcpy(vertex->color, color, sizeof(color));
+	}
+}
+
+// Render queue callback that draws every impostor of this frame at once
+void drawFishImpostors(void* data, GLint param)
+{
+	(void)data;
+	(void)param;
+
+	// The outlines run along the see through border of the texture, so they skip the alpha test
+	if (!isDrawingEdges)
+	{
+		glEnable(GL_ALPHA_TEST);
+		glAlphaFunc(GL_GREATER, 0.5f);
+	}
+
+	// Facing the camera, for the small lights
+	glNormal3f(viewMatrix[2], viewMatrix[6], viewMatrix[10]);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(FishImpostorVertex), fishImpostorVertices[0].position);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(FishImpostorVertex), fishImpostorVertices[0].texCoord);
+	glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(FishImpostorVertex), fishImpostorVertices[0].color);
+
+	if (isDrawingEdges)
+	{
+		// The outlines of the quads are the same for every frame, so they only
+		// get added to when there are more impostors than ever before
+		GLint quads = fishImpostorCount / 4;
+		reserveArray((void**)&fishImpostorEdges, &fishImpostorEdgeCapacity, quads * 8, sizeof(GLuint));
+		for (; fishImpostorEdgeQuads < quads; fishImpostorEdgeQuads++)
+		{
+			for (GLint k = 0; k < 4; k++)
+			{
+				fishImpostorEdges[fishImpostorEdgeQuads * 8 + k * 2] = fishImpostorEdgeQuads * 4 + k;
+				fishImpostorEdges[fishImpostorEdgeQuads * 8 + k * 2 + 1] = fishImpostorEdgeQuads * 4 + (k + 1) % 4;
+			}
+		}
+		glDrawElements(GL_LINES, quads * 8, GL_UNSIGNED_INT, fishImpostorEdges);
+		renderStats.lines += quads * 4;
+	}
+	else
+	{
+		glDrawArrays(GL_QUADS, 0, fishImpostorCount);
+		renderStats.triangles += fishImpostorCount / 2;
+	}
+
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	glDisable(GL_ALPHA_TEST);
+}
+
+/*
+* Queues a set of fish. With the fish shader every species is a batch of
+* instances for the whole mesh and one for the simple mesh, sorted into place
+* by species and mesh, otherwise every close fish is queued on its own as a
+* pyramid. With the LOD on, the far fish all go into one draw of impostors.
+*/
+void queueFish(Boid* boids, GLint count, GLint tick)
+{
+	GLfloat planes[6][4];
+	extractFrustumPlanes(projectionMatrix, viewMatrix, planes);
+
+	reserveArray((void**)&fishLods, &fishLodCapacity, count, sizeof(GLubyte));
+	memset(fishLodCounts, 0, sizeof(fishLodCounts));
+	fishImpostorCount = 0;
+	for (GLint i = 0; i < count; i++)
+	{
+		fishLods[i] = isFishLod ? (GLubyte)getFishLod(&boids[i], &flock.species[boids[i].species], planes) : FISH_LOD_NEAR;
+		fishLodCounts[fishLods[i]]++;
+	}
+
+	if (isDrawingRigidFish)
+	{
+		for (GLint i = 0; i < count; i++)
+		{
+			if (fishLods[i] == FISH_LOD_NEAR || fishLods[i] == FISH_LOD_SIMPLE)
+			{
+				drawBoids(boids[i], &flock.species[boids[i].species]);
+			}
+		}
+	}
+	else
+	{
+		reserveArray((void**)&fishInstances, &fishInstanceCapacity, count, sizeof(FishInstance));
+		reserveArray((void**)&fishPhases, &fishPhaseCapacity, count, sizeof(GLfloat));
+
+		// New fish start at different points in their stroke, spread out by the golden angle
+		for (; fishPhaseCount < count; fishPhaseCount++)
+		{
+			fishPhases[fishPhaseCount] = fmodf(fishPhaseCount * 2.3999632f, 2.0f * PI);
+		}
+
+		// Restoring a snapshot can send the tick backwards
+		GLint ticks = tick - fishPhaseTick;
+		if (ticks < 0 || ticks > (GLint)tickRate)
+		{
+			ticks = 1;
+		}
+		fishPhaseTick = tick;
+
+		// Batch s * 2 has the whole mesh of species s and s * 2 + 1 the simple one
+		for (GLint s = 0; s < flock.speciesCount; s++)
+		{
+			for (GLint lod = 0; lod < 2; lod++)
+			{
+				fishBatches[s * 2 + lod].species = &flock.species[s];
+				fishBatches[s * 2 + lod].mesh = lod ? &fishSimpleMesh : &fishMesh;
+				fishBatches[s * 2 + lod].count = 0;
+			}
+		}
+		for (GLint i = 0; i < count; i++)
+		{
+			if (fishLods[i] <= FISH_LOD_SIMPLE)
+			{
+				fishBatches[boids[i].species * 2 + fishLods[i]].count++;
+			}
+		}
+		for (GLint b = 0, first = 0; b < flock.speciesCount * 2; b++)
+		{
+			fishBatches[b].first = first;
+			first += fishBatches[b].count;
+			fishBatches[b].count = 0;
+		}
+
+		for (GLint i = 0; i < count; i++)
+		{
+			Boid* boid = &boids[i];
+			if (fishLods[i] <= FISH_LOD_SIMPLE)
+			{
+				FishBatch* batch = &fishBatches[boid->species * 2 + fishLods[i]];
+				fillFishInstance(&fishInstances[batch->first + batch->count++], boid, batch->species, &fishPhases[i], ticks);
+			}
+			else
+			{
+				advanceFishPhase(boid, &fishPhases[i], ticks);
+			}
+		}
+
+		GLfloat model[16];
+		matrixIdentity(model);
+		for (GLint b = 0; b < flock.speciesCount * 2; b++)
+		{
+			if (fishBatches[b].count > 0)
+			{
+				submitRenderItem(GL_TRUE, fishBatches[b].species->material, 0, model, drawFishInstances, &fishBatches[b], 0);
+			}
+		}
+	}
+
+	for (GLint i = 0; i < count; i++)
+	{
+		if (fishLods[i] == FISH_LOD_IMPOSTOR)
+		{
+			addFishImpostor(&boids[i], &flock.species[boids[i].species]);
+		}
+	}
+	if (fishImpostorCount > 0)
+	{
+		GLfloat model[16];
+		matrixIdentity(model);
+		submitRenderItem(GL_FALSE, MATERIAL_NONE, fishImpostorTexture, model, drawFishImpostors, NULL, 0);
+	}
+}
+
+// Queues the fish of this frame
+void drawFish()
+{
+	queueFish(frameState->boids, frameState->boidCount, frameState->tick);
+}
+
+// Prints how the fish were drawn last frame
+void printFishStats()
+{
+	if (!isFishLod)
+	{
+		printf("Fish LOD: off\n");
+		return;
+	}
+
+	printf("Fish LOD: %d whole, %d simple, %d impostors, %d hidden by fog, %d off screen\n",
+		fishLodCounts[FISH_LOD_NEAR], fishLodCounts[FISH_LOD_SIMPLE], fishLodCounts[FISH_LOD_IMPOSTOR],
+		fishLodCounts[FISH_LOD_HIDDEN], fishLodCounts[FISH_LOD_OFF_SCREEN]);
+}
+
+// Makes one of the float textures the cluster shader reads, with nothing filtered
+GLuint createClusterTexture(GLint unit, GLenum internalFormat, GLenum format, GLint width, GLint height)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	gl.activeTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, NULL);
+	gl.activeTexture(GL_TEXTURE0);
+	return texture;
+}
+
+/*
+* Sets up the clustered lighting once there is a window. Units 1 to 3 hold the
+* cluster ranges, the light indexes and the lights, so unit 0 is left for the
+* sand. Without the scene shaders the scene stays on the fixed function sun.
+*/
+void initClusterLighting()
+{
+	if (!isClusteredLighting)
+	{
+		return;
+	}
+
+	if (!hasScenePrograms)
+	{
+		printf("No shaders, so the scene is only lit by the sun\n");
+		isClusteredLighting = GL_FALSE;
+		return;
+	}
+
+	clusterRangeTexture = createClusterTexture(1, GL_LUMINANCE_ALPHA32F_ARB, GL_LUMINANCE_ALPHA, CLUSTER_TILES, CLUSTER_SLICES);
+	clusterLightTexture = createClusterTexture(3, GL_RGBA32F, GL_RGBA, 3, MAX_CLUSTER_LIGHTS);
+}
+
+// Adds a light given in world space, unless it's off screen or there's no room left
+void addClusterLight(GLfloat planes[6][4], GLfloat position[3], GLfloat radius, GLfloat color[3],
+	GLfloat spotCosine, GLfloat direction[3])
+{
+	if (clusterLightCount >= clusterLightLimit || clusterLightCount >= MAX_CLUSTER_LIGHTS)
+	{
+		return;
+	}
+	for (GLint p = 0; p < 6; p++)
+	{
+		if (planes[p][0] * position[0] + planes[p][1] * position[1] + planes[p][2] * position[2] + planes[p][3] < -radius)
+		{
+			return;
+		}
+	}
+
+	ClusterLight* light = &clusterLights[clusterLightCount++];
+	for (GLint row = 0; row < 3; row++)
+	{
+		light->position[row] = viewMatrix[row] * position[0] + viewMatrix[4 + row] * position[1] +
+			viewMatrix[8 + row] * position[2] + viewMatrix[12 + row];
+		light->direction[row] = 0;
+		if (direction)
+		{
+			light->direction[row] = viewMatrix[row] * direction[0] + viewMatrix[4 + row] * direction[1] +
+				viewMatrix[8 + row] * direction[2];
+		}
+		light->color[row] = color[row];
+	}
+	light->radius = radius;
+	light->spotCosine = spotCosine;
+	light->padding = 0;
+}
+
+/*
+* Collects this frame's lights. The submarine's two headlights go first, then
+* a glow on each coral and then one on each fish that isn't a predator, as long
+* as there's room. The glows pulse slowly, each one at its own pace.
+*/
+void gatherClusterLights()
+{
+	GLfloat planes[6][4];
+	extractFrustumPlanes(projectionMatrix, viewMatrix, planes);
+	clusterLightCount = 0;
+	GLfloat time = frameState->tick / tickRate;
+
+	// The benchmark has its own lights spread over the sand instead
+	if (benchmarkLightCount > 0)
+	{
+		for (GLint i = 0; i < benchmarkLightCount; i++)
+		{
+			ClusterLight* light = &benchmarkLights[i];
+			addClusterLight(planes, light->position, light->radius, light->color, light->spotCosine, NULL);
+		}
+		return;
+	}
+
+	GLfloat forward[3] = { submarineForward[0], submarineForward[1], -0.2f };
+	normalizeVectorArray(forward);
+	for (GLint side = -1; side <= 1; side += 2)
+	{
+		GLfloat position[3] =
+		{
+			frameState->submarine[0] + submarineForward[0] * submarineNoseDistance - submarineForward[1] * side * 6.0f,
+			frameState->submarine[1] + submarineForward[1] * submarineNoseDistance + submarineForward[0] * side * 6.0f,
+			frameState->submarine[2] - 4.0f
+		};
+		GLfloat color[3] = { 1.0f, 0.95f, 0.8f };
+		addClusterLight(planes, position, 450.0f, color, cosf(20.0f * (PI / 180.0f)), forward);
+	}
+
+	GLfloat coralColors[4][3] = { { 0.1f, 0.9f, 0.8f }, { 0.3f, 1.0f, 0.3f }, { 0.9f, 0.2f, 0.9f }, { 0.4f, 0.4f, 1.0f } };
+	for (GLint i = 0; i < coralInstanceCount; i++)
+	{
+		CoralInstance* instance = &coralInstances[i];
+		GLfloat position[3] = { instance->position[0], instance->position[1], instance->position[2] + instance->scale * 0.3f };
+		GLfloat pulse = 0.6f + 0.4f * sinf(time * (0.5f + 0.1f * (i % 7)) + i * 2.4f);
+		GLfloat color[3];
+		for (GLint a = 0; a < 3; a++)
+		{
+			color[a] = coralColors[instance->mesh % 4][a] * pulse;
+		}
+		addClusterLight(planes, position, 40.0f + instance->scale * 0.4f, color, -2.0f, NULL);
+	}
+
+	for (GLint i = 0; i < frameState->boidCount; i++)
+	{
+		Boid* boid = &frameState->boids[i];
+		Species* species = &flock.species[boid->species];
+		if (species->isPredator)
+		{
+			continue;
+		}
+
+		GLfloat pulse = 0.5f + 0.5f * sinf(time * 2.0f + i * 2.4f);
+		GLfloat color[3];
+		for (GLint a = 0; a < 3; a++)
+		{
+			color[a] = materials[species->material].diffuse[a] * pulse;
+		}
+		addClusterLight(planes, boid->position, species->size * 4.0f, color, -2.0f, NULL);
+	}
+}
+
+// How far in front of the camera a slice of the clusters starts. They get deeper further away
+GLfloat getClusterSliceDepth(GLint slice)
+{
+	return CLUSTER_NEAR * powf(CLUSTER_FAR / CLUSTER_NEAR, (GLfloat)slice / CLUSTER_SLICES);
+}
+
+/*
+* Bins the lights into the clusters of one slice. A light's sphere is boxed
+* between its depths inside the slice, and the box is projected to find the
+* tiles it could touch. Then each tile lists the lights whose tiles cover it,
+* in light order so the result doesn't depend on the threads.
+*/
+void binClusterSlice(GLint s)
+{
+	ClusterSlice* slice = &clusterSlices[s];
+	GLfloat sliceNear = getClusterSliceDepth(s);
+	GLfloat sliceFar = getClusterSliceDepth(s + 1);
+	GLfloat tiles[2] = { CLUSTER_TILES_X, CLUSTER_TILES_Y };
+	GLfloat projection[2] = { projectionMatrix[0], projectionMatrix[5] };
+
+	slice->candidateCount = 0;
+	for (GLint l = 0; l < clusterLightCount; l++)
+	{
+		ClusterLight* light = &clusterLights[l];
+		GLfloat depth = -light->position[2];
+		GLfloat nearest = depth - light->radius > sliceNear ? depth - light->radius : sliceNear;
+		GLfloat farthest = depth + light->radius < sliceFar ? depth + light->radius : sliceFar;
+		if (nearest > farthest)
+		{
+			continue;
+		}
+
+		GLint* rect = slice->rects[slice->candidateCount];
+		GLboolean isOnScreen = GL_TRUE;
+		for (GLint a = 0; a < 2; a++)
+		{
+			GLfloat low = light->position[a] - light->radius;
+			GLfloat high = light->position[a] + light->radius;
+			GLfloat minimum = (low / nearest < low / farthest ? low / nearest : low / farthest) * projection[a];
+			GLfloat maximum = (high / nearest > high / farthest ? high / nearest : high / farthest) * projection[a];
+			if (maximum < -1 || minimum > 1)
+			{
+				isOnScreen = GL_FALSE;
+				break;
+			}
+			rect[a * 2] = (GLint)floorf((minimum + 1) * 0.5f * tiles[a]);
+			rect[a * 2 + 1] = (GLint)floorf((maximum + 1) * 0.5f * tiles[a]);
+			if (rect[a * 2] < 0) rect[a * 2] = 0;
+			if (rect[a * 2 + 1] >= (GLint)tiles[a]) rect[a * 2 + 1] = (GLint)tiles[a] - 1;
+		}
+		if (isOnScreen)
+		{
+			slice->candidates[slice->candidateCount++] = l;
+		}
+	}
+
+	slice->indexCount = 0;
+	for (GLint y = 0; y < CLUSTER_TILES_Y; y++)
+	{
+		for (GLint x = 0; x < CLUSTER_TILES_X; x++)
+		{
+			GLint start = slice->indexCount;
+			for (GLint c = 0; c < slice->candidateCount; c++)
+			{
+				GLint* rect = slice->rects[c];
+				if (x >= rect[0] && x <= rect[1] && y >= rect[2] && y <= rect[3])
+				{
+					reserveArray((void**)&slice->indexes, &slice->indexCapacity, slice->indexCount + 1, sizeof(GLint));
+					slice->indexes[slice->indexCount++] = slice->candidates[c];
+				}
+			}
+			slice->counts[y * CLUSTER_TILES_X + x] = slice->indexCount - start;
+		}
+	}
+}
+
+// Bins every slice a thread is given, spread out so each one gets near and far slices
+void binClusterSlices(GLint first)
+{
+	for (GLint s = first; s < CLUSTER_SLICES; s += clusterWorkerCount + 1)
+	{
+		binClusterSlice(s);
+	}
+}
+
+// Thread function for the binning workers, which wait for each frame and bin their slices
+void runClusterWorker(void* data)
+{
+	GLint worker = (GLint)(size_t)data;
+	GLint frame = 0;
+
+	lockMutex(&clusterMutex);
+	for (;;)
+	{
+		while (clusterFrame == frame && !isClusterStopping)
+		{
+			waitCondition(&clusterStartCondition, &clusterMutex);
+		}
+		if (isClusterStopping)
+		{
+			break;
+		}
+		frame = clusterFrame;
+		unlockMutex(&clusterMutex);
+
+		binClusterSlices(worker + 1);
+
+		lockMutex(&clusterMutex);
+		clusterWorkersDone++;
+		signalCondition(&clusterDoneCondition);
+	}
+	unlockMutex(&clusterMutex);
+}
+
+// Stops the binning workers and lets go of the cluster textures and indexes
+void freeClusterLighting()
+{
+	if (clusterWorkerCount > 0)
+	{
+		lockMutex(&clusterMutex);
+		isClusterStopping = GL_TRUE;
+		broadcastCondition(&clusterStartCondition);
+		unlockMutex(&clusterMutex);
+
+		for (GLint t = 0; t < clusterWorkerCount; t++)
+		{
+			joinThread(clusterWorkers[t]);
+		}
+		clusterWorkerCount = 0;
+	}
+
+	GLuint textures[3] = { clusterRangeTexture, clusterIndexTexture, clusterLightTexture };
+	glDeleteTextures(3, textures);
+	clusterRangeTexture = 0;
+	clusterIndexTexture = 0;
+	clusterLightTexture = 0;
+	clusterIndexRows = 0;
+
+	for (GLint s = 0; s < CLUSTER_SLICES; s++)
+	{
+		free(clusterSlices[s].indexes);
+		clusterSlices[s].indexes = NULL;
+		clusterSlices[s].indexCapacity = 0;
+		clusterSlices[s].indexCount = 0;
+	}
+	free(clusterIndexData);
+	clusterIndexData = NULL;
+	clusterIndexCapacity = 0;
+}
+
+/*
+* Gathers and bins this frame's lights and sends them to the cluster shader.
+* The slices are binned on the workers and this thread together, then joined
+* into one list of indexes with each cluster's first index and count.
+*/
+void updateClusterLighting()
+{
+	if (!isClusteredLighting)
+	{
+		return;
+	}
+
+	if (clusterWorkerCount < 0)
+	{
+		clusterWorkerCount = (clusterThreads > 0 ? clusterThreads : getProcessorCount()) - 1;
+		if (clusterWorkerCount > CLUSTER_SLICES - 1)
+		{
+			clusterWorkerCount = CLUSTER_SLICES - 1;
+		}
+		initMutex(&clusterMutex);
+		initCondition(&clusterStartCondition);
+		initCondition(&clusterDoneCondition);
+		for (GLint t = 0; t < clusterWorkerCount; t++)
+		{
+			startThread(&clusterWorkers[t], runClusterWorker, (void*)(size_t)t);
+		}
+		atexit(freeClusterLighting);
+	}
+
+	double start = getTimeSeconds();
+	gatherClusterLights();
+
+	lockMutex(&clusterMutex);
+	clusterFrame++;
+	clusterWorkersDone = 0;
+	broadcastCondition(&clusterStartCondition);
+	unlockMutex(&clusterMutex);
+
+	binClusterSlices(0);
+
+	lockMutex(&clusterMutex);
+	while (clusterWorkersDone < clusterWorkerCount)
+	{
+		waitCondition(&clusterDoneCondition, &clusterMutex);
+	}
+	unlockMutex(&clusterMutex);
+
+	clusterIndexCount = 0;
+	clusterMostLights = 0;
+	for (GLint s = 0; s < CLUSTER_SLICES; s++)
+	{
+		ClusterSlice* slice = &clusterSlices[s];
+		reserveArray((void**)&clusterIndexData, &clusterIndexCapacity, clusterIndexCount + slice->indexCount, sizeof(GLfloat));
+		for (GLint i = 0; i < slice->indexCount; i++)
+		{
+			clusterIndexData[clusterIndexCount + i] = (GLfloat)slice->indexes[i];
+		}
+
+		GLint offset = clusterIndexCount;
+		for (GLint c = 0; c < CLUSTER_TILES; c++)
+		{
+			clusterRanges[(s * CLUSTER_TILES + c) * 2] = (GLfloat)offset;
+			clusterRanges[(s * CLUSTER_TILES + c) * 2 + 1] = (GLfloat)slice->counts[c];
+			offset += slice->counts[c];
+			if (slice->counts[c] > clusterMostLights)
+			{
+				clusterMostLights = slice->counts[c];
+			}
+		}
+		clusterIndexCount += slice->indexCount;
+	}
+	clusterBinTime = getTimeSeconds() - start;
+
+	// The index texture only grows, a whole row at a time
+	GLint rows = (clusterIndexCount + CLUSTER_INDEX_WIDTH - 1) / CLUSTER_INDEX_WIDTH;
+	rows = rows > 0 ? rows : 1;
+	reserveArray((void**)&clusterIndexData, &clusterIndexCapacity, rows * CLUSTER_INDEX_WIDTH, sizeof(GLfloat));
+	if (rows > clusterIndexRows)
+	{
+		if (clusterIndexTexture)
+		{
+			glDeleteTextures(1, &clusterIndexTexture);
+		}
+		clusterIndexTexture = createClusterTexture(2, GL_LUMINANCE32F_ARB, GL_LUMINANCE, CLUSTER_INDEX_WIDTH, rows);
+		clusterIndexRows = rows;
+	}
+
+	gl.activeTexture(GL_TEXTURE0 + 1);
+	glBindTexture(GL_TEXTURE_2D, clusterRangeTexture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_TILES, CLUSTER_SLICES, GL_LUMINANCE_ALPHA, GL_FLOAT, clusterRanges);
+	gl.activeTexture(GL_TEXTURE0 + 2);
+	glBindTexture(GL_TEXTURE_2D, clusterIndexTexture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_INDEX_WIDTH, rows, GL_LUMINANCE, GL_FLOAT, clusterIndexData);
+	gl.activeTexture(GL_TEXTURE0 + 3);
+	glBindTexture(GL_TEXTURE_2D, clusterLightTexture);
+	if (clusterLightCount > 0)
+	{
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 3, clusterLightCount, GL_RGBA, GL_FLOAT, clusterLights);
+	}
+	gl.activeTexture(GL_TEXTURE0);
+}
+
+/*
+* Hands this frame's uniforms to every scene shader permutation. Without
+* clustered lighting the light count stays 0, so the light loop never runs.
+*/
+void updateScenePrograms()
+{
+	if (!hasScenePrograms)
+	{
+		return;
+	}
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	GLfloat sliceScale = CLUSTER_SLICES / logf(CLUSTER_FAR / CLUSTER_NEAR);
+	GLfloat lightCount = isClusteredLighting ? (GLfloat)clusterLightCount : 0.0f;
+	GLfloat isCulling = isClusteredLighting && isCullingClusterLights ? 1.0f : 0.0f;
+
+	for (GLint features = 0; features < SHADER_PERMUTATIONS; features++)
+	{
+		SceneProgram* scene = &scenePrograms[features];
+		if (!scene->program)
+		{
+			continue;
+		}
+
+		// Locations the permutation compiled out are -1, which GL skips
+		gl.useProgram(scene->program);
+		gl.uniform1f(scene->fogDensityLocation, fogDensity);
+		gl.uniform2f(scene->tileScaleLocation, (GLfloat)CLUSTER_TILES_X / viewport[2], (GLfloat)CLUSTER_TILES_Y / viewport[3]);
+		gl.uniform2f(scene->sliceScaleLocation, sliceScale, -logf(CLUSTER_NEAR) * sliceScale);
+		gl.uniform1f(scene->indexRowsLocation, (GLfloat)clusterIndexRows);
+		gl.uniform1f(scene->isCullingLocation, isCulling);
+		gl.uniform1f(scene->lightCountLocation, lightCount);
+	}
+	gl.useProgram(0);
+}
+
+// Prints how many lights there were last frame and how they binned
+void printClusterStats()
+{
+	if (!isClusteredLighting)
+	{
+		printf("Lighting: the sun only, no clustered lighting\n");
+		return;
+	}
+	printf("Lighting: %d lights in %d x %d x %d clusters, %d indexes, at most %d in one cluster, binned in %.3f ms on %d threads\n",
+		clusterLightCount, CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES, clusterIndexCount, clusterMostLights,
+		clusterBinTime * 1000.0, clusterWorkerCount + 1);
+}
+
+/*
+* Method that is used to handle the mouse movement across the screen to rotate 
+* the camera. It uses global prevX and prevY variables so that it can keep 
+* track of the mouse position. It sets the horizontal mouse angle (the azimuth)
+* based on the sensitivity and the difference, and also sets the vertical based 
+* on the same properties. It keeps the vertical within bounds, and makes sure
+* the horizontal doesn't get some large (or negatively large) number.
+*/
+void lookWithMouse(GLint x, GLint y)
+{
+	GLint xDiff = x - prevX;
+	GLint yDiff = y - prevY;
+
+	horizontalMouseAngle += xDiff * sensitivity;
+	verticalMouseAngle += yDiff * sensitivity;
+
+	// Reset angles to avoid ridiculoualy large (or negatively large) horizontal values
+	if (horizontalMouseAngle > 360.0f) horizontalMouseAngle -= 360.0f;
+	else if (horizontalMouseAngle < 0.0f) horizontalMouseAngle += 360.0f;
+
+	// Make sure that the vertical does not go above or below the top or the bottonm of the submarine
+	if (verticalMouseAngle > 89.0f) verticalMouseAngle = 89.0f;
+	else if (verticalMouseAngle < -89.0f) verticalMouseAngle = -89.0f;
+
+	prevX = x;
+	prevY = y;
+}
+
+/*
+* This method calculates where the camera should be based on a sphere on where
+* the submarine lies, sets the new camera based on this, and makes sure the 
+* camera is looking at the position of the submarine. It first calculates the
+* horizontal and vertical radians of the mouse angles, and then it calculates
+* the new postion of the camera based on this web resource:
+* https://mathinsight.org/spherical_coordinates, retrieved from relationship
+* (1)l except I added the submarine position to properly offset the camera
+*/
+void moveCamera()
+{
+	GLfloat radianHorizontal = frameState->cameraAngles[0] * (PI / 180.0f);
+	GLfloat radianVertical = frameState->cameraAngles[1] * (PI / 180.0f);
+	GLfloat* submarinePosition = frameState->submarine;
+
+	GLfloat newCamX = submarinePosition[0] + cameraDistance * cosf(radianHorizontal) * cosf(radianVertical);
+	GLfloat newCamY = submarinePosition[1] + cameraDistance * sinf(radianHorizontal) * cosf(radianVertical);
+	GLfloat newCamZ = submarinePosition[2] + cameraDistance * sinf(radianVertical);
+
+	//printf("Camera: ( %.2f, %.2f, %.2f ); Submarine: ( %.2f, %.2f, %.2f )\n", newCamX, newCamY, newCamZ, submarineX, submarineY, submarineZ);
+
+	// Keep track of where the camera is for the level of detail selection
+	cameraPosition[0] = newCamX;
+	cameraPosition[1] = newCamY;
+	cameraPosition[2] = newCamZ;
+
+	gluLookAt(newCamX, newCamY, newCamZ, submarinePosition[0], submarinePosition[1], submarinePosition[2], 0, 0, 1);
+}
+
+// Copies the simulation into a render state
+void captureRenderState(RenderState* state)
+{
+	state->tick = simulationTick;
+	state->submarine[0] = submarineX;
+	state->submarine[1] = submarineY;
+	state->submarine[2] = submarineZ;
+	state->waveTimeValue = waveTimeValue;
+	state->cameraAngles[0] = horizontalMouseAngle;
+	state->cameraAngles[1] = verticalMouseAngle;
+
+	reserveArray((void**)&state->boids, &state->boidCapacity, flock.count, sizeof(Boid));
+	memcpy(state->boids, flock.current, sizeof(Boid) * flock.count);
+	state->boidCount = flock.count;
+}
+
+/*
+* Publishes the simulation as the latest finished state. The one being written
+* is swapped with the waiting one, so the writer never touches the state the
+* window thread is drawing and neither side ever waits on the other.
+*/
+void publishRenderState()
+{
+	captureRenderState(&renderStates[renderStateWriting]);
+	GLint previous = atomicExchange(&renderStateLatest, renderStateWriting | RENDER_STATE_FRESH);
+	renderStateWriting = previous & ~RENDER_STATE_FRESH;
+}
+
+/*
+* Returns the newest state to draw. If a newer one has been published since
+* the last frame it is swapped in, otherwise the same one is drawn again.
+*/
+RenderState* acquireRenderState()
+{
+	if (atomicLoad(&renderStateLatest) & RENDER_STATE_FRESH)
+	{
+		GLint latest = atomicExchange(&renderStateLatest, renderStateReading);
+		renderStateReading = latest & ~RENDER_STATE_FRESH;
+	}
+
+	return &renderStates[renderStateReading];
+}
+
+// Fills all three render states from the simulation as it is now
+void resetRenderStates()
+{
+	for (GLint i = 0; i < 3; i++)
+	{
+		captureRenderState(&renderStates[i]);
+	}
+}
+
+// Function to handle the key down presses that only change how things are
+// drawn. These stay on the thread with the window
+void applyRenderKey(unsigned char key)
+{
+	// Toggle the state variables
+	if ((key == 'f' || key == 'F') && !isHeadless)
+	{
+		isFullscreen = !isFullscreen;
+		if (isFullscreen)
+		{
+			glutFullScreen();
+		}
+		else
+		{
+			glutReshapeWindow(windowWidth, windowHeight);
+			glutPositionWindow(windowPositionX, windowPositionY);
+		}
+	}
+	if (key == 'u' || key == 'U')
+	{
+		isDrawingWireFrame = !isDrawingWireFrame;
+		requestRedisplay();
+	}
+	if (key == 'b' || key == 'B')
+	{
+		isDrawingFog = !isDrawingFog;
+		requestRedisplay();
+	}
+	if (key == 'i' || key == 'I')
+	{
+		printRenderStats();
+		printShaderStats();
+		printClusterStats();
+		printOcclusionStats();
+		printFishStats();
+		printTerrainStats();
+		printAssetMemory();
+	}
+	if (key == '[')
+	{
+		scaleStaticTessellation(0.5f);
+		requestRedisplay();
+	}
+	if (key == ']')
+	{
+		scaleStaticTessellation(2.0f);
+		requestRedisplay();
+	}
+
+	// A replay ends where the recording did instead
+	if ((key == 'q' || key == 'Q') && !isReplaying)
+	{
+		exit(1);
+	}
+}
+
+// Function to handle standard key down presses for the simulation. We handle
+// the state varaibles in this function
+void applyKeyDown(unsigned char key)
+{
+	keyStates[key] = GL_TRUE;
+
+	if (key == 'k' || key == 'K')
+	{
+		saveSnapshot(snapshotPath);
+	}
+	if (key == 'l' || key == 'L')
+	{
+		loadSnapshot(snapshotPath);
+	}
+}
+
+// Does the part of an input event that changes how things are drawn
+void applyRenderInput(InputEvent* event)
+{
+	if (event->type == INPUT_KEY_DOWN)
+	{
+		applyRenderKey((unsigned char)event->key);
+	}
+}
+
+// Does the part of an input event that changes the simulation
+void applySimulationInput(InputEvent* event)
+{
+	switch (event->type)
+	{
+	case INPUT_KEY_DOWN:
+		applyKeyDown((unsigned char)event->key);
+		break;
+	case INPUT_KEY_UP:
+		keyStates[(unsigned char)event->key] = GL_FALSE;
+		break;
+	case INPUT_SPECIAL_DOWN:
+		specialKeyStates[(unsigned char)event->key] = GL_TRUE;
+		break;
+	case INPUT_SPECIAL_UP:
+		specialKeyStates[(unsigned char)event->key] = GL_FALSE;
+		break;
+	case INPUT_MOUSE_MOVE:
+		lookWithMouse(event->x, event->y);
+		break;
+	}
+}
+
+/*
+* Makes an input event do what it does. Everything that reacts to input goes
+* through here or the two functions above, both live and in a replay, so a
+* replay can't miss anything.
+*/
+void applyInputEvent(InputEvent* event)
+{
+	applyRenderInput(event);
+	applySimulationInput(event);
+}
+
+/*
+* Applies an input event to the simulation on whichever thread runs it. It
+* gets stamped with the tick it actually comes before, and written to the
+* journal if one is being recorded.
+*/
+void recordInputEvent(InputEvent* event)
+{
+	event->tick = simulationTick;
+	if (journalFile)
+	{
+		fwrite(event, sizeof(InputEvent), 1, journalFile);
+	}
+
+	applySimulationInput(event);
+}
+
+/*
+* Takes input from the window. The drawing part happens right away, and the
+* simulation part goes to the simulation thread through the input queue, or
+* straight in when there is no simulation thread. Live input is ignored
+* during a replay so it can't change what is being measured.
+*/
+void submitInputEvent(GLint type, GLint key, GLint x, GLint y)
+{
+	if (isReplaying)
+	{
+		return;
+	}
+
+	InputEvent event = { 0, type, key, x, y, (GLfloat)(getTimeSeconds() - journalStartTime) };
+	applyRenderInput(&event);
+
+	if (isSimulationThreadRunning)
+	{
+		if (!pushInputEvent(&event))
+		{
+			printf("The input queue is full, an input was dropped\n");
+		}
+	}
+	else
+	{
+		recordInputEvent(&event);
+	}
+}
+
+void handleKeyboardDown(unsigned char key, GLint x, GLint y)
+{
+	submitInputEvent(INPUT_KEY_DOWN, key, x, y);
+}
+
+// Function to handle the release of standard keys
+void handleKeyboardUp(unsigned char key, GLint x, GLint y)
+{
+	submitInputEvent(INPUT_KEY_UP, key, x, y);
+}
+
+// Function to handle special key down presses
+void handleSpecialKeyboardDown(unsigned char key, GLint x, GLint y)
+{
+	submitInputEvent(INPUT_SPECIAL_DOWN, key, x, y);
+}
+
+// Function to handle the release of special keys
+void handleSpecialKeyboardUp(unsigned char key, GLint x, GLint y)
+{
+	submitInputEvent(INPUT_SPECIAL_UP, key, x, y);
+}
+
+void moveMouse(GLint x, GLint y)
+{
+	submitInputEvent(INPUT_MOUSE_MOVE, 0, x, y);
+}
+
+// Function that's used to move the submarine if any of the keys are pressed.
+// The step goes through moveSubmarine so it can't pass through anything
+void handleMovement()
+{
+	GLfloat dx = 0, dy = 0, dz = 0;
+
+	// Handle lateral movement
+	if (keyStates['w'] || keyStates['W'])
+	{
+		dy += submarineSpeed;
+	}
+	if (keyStates['a'] || keyStates['A'])
+	{
+		dx -= submarineSpeed;
+	}
+	if (keyStates['s'] || keyStates['S'])
+	{
+		dy -= submarineSpeed;
+	}
+	if (keyStates['d'] || keyStates['D'])
+	{
+		dx += submarineSpeed;
+	}
+
+	// Handle vertical movement
+	if (specialKeyStates[GLUT_KEY_UP])
+	{
+		dz += submarineSpeed;
+	}
+	if (specialKeyStates[GLUT_KEY_DOWN])
+	{
+		dz -= submarineSpeed;
+	}
+
+	moveSubmarine(dx, dy, dz);
+}
+
+/*
+* Opens the telemetry file and starts the ring over. Any reader that already
+* has it open sees the ring start over too.
+*/
+void openTelemetry(char* path)
+{
+	size_t size = sizeof(TelemetryHeader) + sizeof(TelemetrySample) * TELEMETRY_CAPACITY;
+	unsigned char* data = mapSharedFile(path, size, &telemetryFile);
+	if (!data)
+	{
+		printf("Failed to open telemetry file %s\n", path);
+		return;
+	}
+
+	telemetry = (TelemetryHeader*)data;
+	telemetrySamples = (TelemetrySample*)(data + sizeof(TelemetryHeader));
+	telemetry->version = TELEMETRY_VERSION;
+	telemetry->sampleSize = sizeof(TelemetrySample);
+	telemetry->capacity = TELEMETRY_CAPACITY;
+	atomicStore(&telemetry->head, 0);
+	atomicStore(&telemetry->tail, 0);
+	atomicStore(&telemetry->dropped, 0);
+	atomicStore((AtomicInt*)&telemetry->magic, TELEMETRY_MAGIC);
+	printf("Writing telemetry to %s\n", path);
+}
+
+/*
+* Adds a sample for the tick that just ran. If the reader hasn't kept up and
+* the ring is full, the sample is dropped and counted instead, so this never
+* waits on anything.
+*/
+void publishTelemetry()
+{
+	if (!telemetry)
+	{
+		return;
+	}
+
+	GLint tail = atomicLoad(&telemetry->tail);
+	GLint next = (tail + 1) % TELEMETRY_CAPACITY;
+	if (next == atomicLoad(&telemetry->head))
+	{
+		atomicStore(&telemetry->dropped, atomicLoad(&telemetry->dropped) + 1);
+		return;
+	}
+
+	TelemetrySample* sample = &telemetrySamples[tail];
+	sample->tick = simulationTick;
+	sample->tickTime = (GLfloat)(lastTickTime * 1000.0);
+	sample->frameTime = atomicLoad(&lastFrameMicroseconds) / 1000.0f;
+	sample->neighbourChecks = flock.neighbourChecks;
+	sample->neighbourRebuilds = flock.neighbourRebuilds;
+	sample->triangles = atomicLoad(&lastFrameTriangles);
+
+	// The centre of the flock, how far the boids are spread from it and how fast they go
+	GLfloat sum[3] = { 0, 0, 0 };
+	GLfloat speedSum = 0;
+	for (GLint i = 0; i < flock.count; i++)
+	{
+		GLfloat* velocity = flock.current[i].velocity;
+		for (GLint a = 0; a < 3; a++)
+		{
+			sum[a] += flock.current[i].position[a];
+		}
+		speedSum += sqrtf(velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]);
+	}
+
+	GLint count = flock.count > 0 ? flock.count : 1;
+	GLfloat spreadSum = 0;
+	for (GLint a = 0; a < 3; a++)
+	{
+		sample->centroid[a] = sum[a] / count;
+	}
+	for (GLint i = 0; i < flock.count; i++)
+	{
+		GLfloat* position = flock.current[i].position;
+		GLfloat dx = position[0] - sample->centroid[0];
+		GLfloat dy = position[1] - sample->centroid[1];
+		GLfloat dz = position[2] - sample->centroid[2];
+		spreadSum += dx * dx + dy * dy + dz * dz;
+	}
+	sample->dispersion = sqrtf(spreadSum / count);
+	sample->meanSpeed = speedSum / count;
+
+	atomicStore(&telemetry->tail, next);
+}
+
+/*
+* Moves the simulation forward one fixed tick. The submarine, the fish and the
+* wave all move the same amount each tick however fast frames are drawn,
+* which is what lets a journal be replayed exactly.
+*/
+void simulationStep()
+{
+	handleMovement();
+
+	updateFlock(&flock);
+	simulationTick++;
+	updateCheckpoint();
+
+	waveTimeValue += waveVelocity;
+	if (waveTimeValue > 100000) waveTimeValue = 0;
+}
+
+// Runs a tick, timing it and publishing its telemetry
+void runTimedTick()
+{
+	double start = getTimeSeconds();
+	simulationStep();
+	lastTickTime = getTimeSeconds() - start;
+	publishTelemetry();
+}
+
+/*
+* The simulation thread. It applies whatever input has come in, then runs the
+* next tick once it is due and publishes it. If it falls well behind it skips
+* ahead rather than racing to catch up.
+*/
+void runSimulationThread(void* data)
+{
+	(void)data;
+
+	double nextTick = getTimeSeconds();
+
+	while (atomicLoad(&isSimulationRunning))
+	{
+		InputEvent event;
+		while (popInputEvent(&event))
+		{
+			recordInputEvent(&event);
+		}
+
+		double now = getTimeSeconds();
+		if (now < nextTick)
+		{
+			sleepSeconds(nextTick - now);
+			continue;
+		}
+
+		runTimedTick();
+		publishRenderState();
+
+		nextTick += 1.0 / tickRate;
+		if (getTimeSeconds() - nextTick > maxTicksPerIdle / tickRate)
+		{
+			nextTick = getTimeSeconds();
+		}
+	}
+}
+
+// Stops the simulation thread, waiting for it to finish its tick
+void stopSimulationThread()
+{
+	if (!isSimulationThreadRunning)
+	{
+		return;
+	}
+
+	atomicStore(&isSimulationRunning, 0);
+	joinThread(simulationThread);
+	isSimulationThreadRunning = GL_FALSE;
+}
+
+// Moves the simulation onto its own thread
+void startSimulationThread()
+{
+	atomicStore(&isSimulationRunning, 1);
+	isSimulationThreadRunning = GL_TRUE;
+	startThread(&simulationThread, runSimulationThread, NULL);
+	atexit(stopSimulationThread);
+}
+
+// Writes the end of the journal when the program exits
+void stopRecording()
+{
+	if (!journalFile)
+	{
+		return;
+	}
+
+	// The simulation thread writes to the journal too
+	stopSimulationThread();
+
+	InputEvent event = { simulationTick, INPUT_END, 0, 0, 0, (GLfloat)(getTimeSeconds() - journalStartTime) };
+	fwrite(&event, sizeof(InputEvent), 1, journalFile);
+	fclose(journalFile);
+	journalFile = NULL;
+	printf("Recorded %d ticks to %s\n", simulationTick - journalFirstTick, journalPath);
+}
+
+/*
+* Starts recording input to a journal. The simulation is saved next to it as
+* a snapshot first, so a replay starts from exactly the same fish, coral and
+* submarine. The camera is kept in the journal's header.
+*/
+void startRecording(char* path)
+{
+	char statePath[512];
+	snprintf(statePath, sizeof(statePath), "%s.snap", path);
+	if (saveSnapshot(statePath) != 0)
+	{
+		return;
+	}
+
+	journalFile = fopen(path, "wb");
+	if (!journalFile)
+	{
+		printf("Could not open the journal %s\n", path);
+		return;
+	}
+
+	JournalHeader header = { JOURNAL_MAGIC, JOURNAL_VERSION, tickRate, { horizontalMouseAngle, verticalMouseAngle },
+		{ prevX, prevY } };
+	fwrite(&header, sizeof(JournalHeader), 1, journalFile);
+
+	journalPath = path;
+	journalStartTime = getTimeSeconds();
+	journalFirstTick = simulationTick;
+	atexit(stopRecording);
+}
+
+/*
+* Loads a journal and the snapshot saved with it, ready to be replayed. The
+* ticks in the journal are made relative to the start of the recording.
+* Returns 0 on success.
+*/
+GLint loadJournal(char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+	{
+		printf("Could not open the journal %s\n", path);
+		return 1;
+	}
+
+	JournalHeader header;
+	if (fread(&header, sizeof(JournalHeader), 1, file) != 1 || header.magic != JOURNAL_MAGIC ||
+		header.version != JOURNAL_VERSION)
+	{
+		printf("%s is not a version %d journal\n", path, JOURNAL_VERSION);
+		fclose(file);
+		return 1;
+	}
+
+	replayEventCount = 0;
+	InputEvent event;
+	while (fread(&event, sizeof(InputEvent), 1, file) == 1)
+	{
+		reserveArray((void**)&replayEvents, &replayEventCapacity, replayEventCount + 1, sizeof(InputEvent));
+		replayEvents[replayEventCount++] = event;
+	}
+	fclose(file);
+
+	if (replayEventCount == 0 || replayEvents[replayEventCount - 1].type != INPUT_END)
+	{
+		printf("%s was cut off before the recording finished\n", path);
+		return 1;
+	}
+
+	char statePath[512];
+	snprintf(statePath, sizeof(statePath), "%s.snap", path);
+	if (loadSnapshot(statePath) != 0)
+	{
+		return 1;
+	}
+
+	// The snapshot puts the simulation back at the tick the recording started on
+	replayFirstTick = simulationTick;
+	replayEndTick = replayEvents[replayEventCount - 1].tick;
+	replayNextEvent = 0;
+	tickRate = header.tickRate;
+	horizontalMouseAngle = header.cameraAngles[0];
+	verticalMouseAngle = header.cameraAngles[1];
+	prevX = header.mouse[0];
+	prevY = header.mouse[1];
+	isReplaying = GL_TRUE;
+
+	printf("Replaying %d ticks and %d input events from %s\n", replayEndTick - replayFirstTick,
+		replayEventCount - 1, path);
+	return 0;
+}
+
+// Adds up the flock and submarine into one number, to check two replays ended the same
+unsigned int getStateChecksum()
+{
+	unsigned int hash = hashBytes(2166136261u, flock.current, sizeof(Boid) * flock.count);
+	GLfloat submarine[3] = { submarineX, submarineY, submarineZ };
+	return hashBytes(hash, submarine, sizeof(submarine));
+}
+
+/*
+* Runs one tick of a replay. The events recorded before this tick are applied,
+* then the tick is timed. Returns GL_FALSE once the recording has run out.
+*/
+GLboolean replayTick()
+{
+	if (simulationTick >= replayEndTick)
+	{
+		return GL_FALSE;
+	}
+
+	while (replayNextEvent < replayEventCount && replayEvents[replayNextEvent].tick <= simulationTick &&
+		replayEvents[replayNextEvent].type != INPUT_END)
+	{
+		applyInputEvent(&replayEvents[replayNextEvent++]);
+	}
+
+	runTimedTick();
+
+	if (!isHeadless)
+	{
+		publishRenderState();
+	}
+	return GL_TRUE;
+}
+
+// Adds a row to the timings file for the tick that just ran
+void writeTiming(double frameTime)
+{
+	if (timingsFile)
+	{
+		fprintf(timingsFile, "%d,%.4f,%.4f\n", simulationTick - replayFirstTick, lastTickTime * 1000.0, frameTime * 1000.0);
+	}
+}
+
+// Opens the timings file and writes the column names
+void openTimings(char* path)
+{
+	timingsFile = fopen(path, "w");
+	if (!timingsFile)
+	{
+		printf("Could not open %s for the timings\n", path);
+		return;
+	}
+	fprintf(timingsFile, "tick,simulation_ms,frame_ms\n");
+}
+
+// Prints how the replay ended and closes the timings
+void finishReplay()
+{
+	printf("Replay finished at tick %d, state checksum %08x\n", simulationTick - replayFirstTick, getStateChecksum());
+	if (timingsFile)
+	{
+		fclose(timingsFile);
+		timingsFile = NULL;
+	}
+}
+
+// Reads one column of a timings file. Returns how many rows it read
+GLint readTimings(char* path, GLint column, double** values)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+	{
+		printf("Could not open the timings %s\n", path);
+		return -1;
+	}
+
+	char line[256];
+	GLint count = 0;
+	GLint capacity = 0;
+	*values = NULL;
+
+	// Skip the column names
+	fgets(line, sizeof(line), file);
+	while (fgets(line, sizeof(line), file))
+	{
+		GLint tick;
+		double simulation, frame;
+		if (sscanf_s(line, "%d,%lf,%lf", &tick, &simulation, &frame) != 3)
+		{
+			continue;
+		}
+		reserveArray((void**)values, &capacity, count + 1, sizeof(double));
+		(*values)[count++] = column == 0 ? simulation : frame;
+	}
+
+	fclose(file);
+	return count;
+}
+
+int compareDoubles(const void* a, const void* b)
+{
+	double difference = *(const double*)a - *(const double*)b;
+	return difference < 0 ? -1 : difference > 0 ? 1 : 0;
+}
+
+// Prints the mean, median and 95th percentile of a column, returning the mean
+double printTimingStats(char* label, double* values, GLint count)
+{
+	double* sorted = (double*)malloc(sizeof(double) * (count > 0 ? count : 1));
+	if (!sorted)
+	{
+		printf("Error allocating memory for the timings\n");
+		exit(1);
+	}
+	memcpy(sorted, values, sizeof(double) * count);
+	qsort(sorted, count, sizeof(double), compareDoubles);
+
+	double mean = 0;
+	for (GLint i = 0; i < count; i++)
+	{
+		mean += sorted[i];
+	}
+	mean /= count > 0 ? count : 1;
+
+	printf("  %-10s mean %8.4f ms  median %8.4f ms  95%% %8.4f ms\n", label, mean,
+		count > 0 ? sorted[count / 2] : 0, count > 0 ? sorted[count * 95 / 100] : 0);
+	free(sorted);
+	return mean;
+}
+
+/*
+* Compares the timings of two replays of the same journal, tick by tick. Both
+* ran the same inputs, so any tick that got a lot slower is a real slowdown
+* and not a different camera path. Returns 1 if the second one is more than
+* 10% slower on average, so it can fail a script.
+*/
+GLint compareTimings(char* basePath, char* newPath)
+{
+	char* columns[2] = { "simulation", "frame" };
+	GLint isSlower = 0;
+
+	for (GLint column = 0; column < 2; column++)
+	{
+		double* base;
+		double* changed;
+		GLint baseCount = readTimings(basePath, column, &base);
+		GLint changedCount = readTimings(newPath, column, &changed);
+		if (baseCount < 0 || changedCount < 0)
+		{
+			return 1;
+		}
+		if (baseCount != changedCount)
+		{
+			printf("The timings have %d and %d ticks, so they aren't from the same journal\n", baseCount, changedCount);
+			free(base);
+			free(changed);
+			return 1;
+		}
+
+		printf("%s time over %d ticks\n", columns[column], baseCount);
+		double baseMean = printTimingStats(basePath, base, baseCount);
+		double changedMean = printTimingStats(newPath, changed, changedCount);
+
+		GLint slowerTicks = 0;
+		for (GLint i = 0; i < baseCount; i++)
+		{
+			if (changed[i] > base[i] * 1.2 && changed[i] - base[i] > 0.01)
+			{
+				slowerTicks++;
+			}
+		}
+
+		double change = baseMean > 0 ? (changedMean - baseMean) / baseMean * 100.0 : 0;
+		printf("  change %+.1f%%, %d ticks more than 20%% slower\n", change, slowerTicks);
+		if (change > 10.0)
+		{
+			isSlower = 1;
+		}
+
+		free(base);
+		free(changed);
+	}
+
+	printf(isSlower ? "Slower than the base timings\n" : "No slowdown\n");
+	return isSlower;
+}
+
+/*
+* Command line tool that follows the telemetry of a running simulation and
+* prints each sample. It takes over as the reader, skipping whatever was
+* already waiting, and prints how many samples were dropped when that changes.
+*/
+GLint readTelemetry(char* path)
+{
+	MappedFile mapped;
+	unsigned char* data = mapSharedFile(path, 0, &mapped);
+	if (!data || mapped.size < sizeof(TelemetryHeader))
+	{
+		printf("Failed to open telemetry file %s\n", path);
+		return 1;
+	}
+
+	TelemetryHeader* header = (TelemetryHeader*)data;
+	TelemetrySample* samples = (TelemetrySample*)(data + sizeof(TelemetryHeader));
+	if (header->magic != TELEMETRY_MAGIC || header->version != TELEMETRY_VERSION ||
+		header->sampleSize != sizeof(TelemetrySample) ||
+		mapped.size < sizeof(TelemetryHeader) + sizeof(TelemetrySample) * header->capacity)
+	{
+		printf("%s is not a telemetry file this version can read\n", path);
+		unmapFile(&mapped);
+		return 1;
+	}
+
+	printf("tick,tick_ms,frame_ms,centroid_x,centroid_y,centroid_z,dispersion,mean_speed,neighbour_checks,neighbour_rebuilds,triangles\n");
+	atomicStore(&header->head, atomicLoad(&header->tail));
+	GLint lastDropped = atomicLoad(&header->dropped);
+
+	while (1)
+	{
+		GLint head = atomicLoad(&header->head);
+		GLint tail = atomicLoad(&header->tail);
+
+		// The simulation started the ring over
+		if (head >= header->capacity || tail >= header->capacity)
+		{
+			head = tail;
+		}
+
+		while (head != tail)
+		{
+			TelemetrySample* sample = &samples[head];
+			printf("%d,%.3f,%.3f,%.2f,%.2f,%.2f,%.2f,%.3f,%d,%d,%d\n", sample->tick, sample->tickTime, sample->frameTime,
+				sample->centroid[0], sample->centroid[1], sample->centroid[2], sample->dispersion,
+				sample->meanSpeed, sample->neighbourChecks, sample->neighbourRebuilds, sample->triangles);
+			head = (head + 1) % header->capacity;
+		}
+		atomicStore(&header->head, head);
+
+		GLint dropped = atomicLoad(&header->dropped);
+		if (dropped != lastDropped)
+		{
+			printf("# %d samples dropped\n", dropped < lastDropped ? dropped : dropped - lastDropped);
+			lastDropped = dropped;
+		}
+
+		fflush(stdout);
+		sleepSeconds(0.1);
+	}
+}
+
+/*
+* Runs however many fixed ticks have come due since the last time, up to a
+* limit so a long stall doesn't freeze everything catching up. This is only
+* used when there is no simulation thread.
+*/
+void runDueTicks()
+{
+	double now = getTimeSeconds();
+	if (lastIdleTime == 0)
+	{
+		lastIdleTime = now;
+	}
+	tickAccumulator += now - lastIdleTime;
+	lastIdleTime = now;
+
+	GLint ticks = 0;
+	while (tickAccumulator >= 1.0 / tickRate && ticks < maxTicksPerIdle)
+	{
+		runTimedTick();
+		tickAccumulator -= 1.0 / tickRate;
+		ticks++;
+	}
+	if (ticks == maxTicksPerIdle)
+	{
+		tickAccumulator = 0;
+	}
+	if (ticks > 0)
+	{
+		publishRenderState();
+	}
+}
+
+// Returns the earliest time the next frame can start
+double getFrameDeadline()
+{
+	if (targetFps <= 0)
+	{
+		return 0;
+	}
+
+	return lastFrameStart + 1.0 / targetFps - (isVsyncOn ? vsyncMargin : 0);
+}
+
+/*
+* Idle function to handle idle changes. A frame is only asked for once there
+* is a new tick to show or a redraw was requested, and not before the frame
+* cap allows it. Otherwise it sleeps, in short slices when waiting on the
+* simulation so input is still picked up quickly. In a replay it runs exactly
+* one tick per frame as fast as it can, since the replay is being timed.
+*/
+void idleScene(void)
+{
+	if (isReplaying)
+	{
+		if (!replayTick())
+		{
+			finishReplay();
+			exit(0);
+		}
+		glutPostRedisplay();
+		return;
+	}
+
+	if (!isSimulationThreadRunning)
+	{
+		runDueTicks();
+	}
+
+	GLboolean hasNewFrame = isRedisplayPending || (atomicLoad(&renderStateLatest) & RENDER_STATE_FRESH);
+	double now = getTimeSeconds();
+	double deadline = getFrameDeadline();
+	if (hasNewFrame && now >= deadline)
+	{
+		isRedisplayPending = GL_FALSE;
+		glutPostRedisplay();
+		return;
+	}
+
+	double wake = hasNewFrame ? deadline : now + maxIdleSleep;
+	if (!isSimulationThreadRunning && !hasNewFrame)
+	{
+		// The next tick might come due before that
+		double nextTick = lastIdleTime + 1.0 / tickRate - tickAccumulator;
+		wake = nextTick < wake ? nextTick : wake;
+	}
+	sleepUntil(wake);
+	idleSleepTime += getTimeSeconds() - now;
+}
+
+// Display function that sets what the camera is looking at, draws the vectors,
+// the scene, etc.
+void display(void)
+{
+	double frameStart = getTimeSeconds();
+	lastFrameStart = frameStart;
+	framesDrawn++;
+
+	// Draw the newest tick the simulation has finished
+	frameState = acquireRenderState();
+
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	glLoadIdentity();
+
+	moveCamera();
+
+	// Keep the camera matrix so the render queue can place everything relative to it,
+	// and the projection for frustum culling
+	glGetFloatv(GL_MODELVIEW_MATRIX, viewMatrix);
+	glGetFloatv(GL_PROJECTION_MATRIX, projectionMatrix);
+
+	// Make sure the light comes from the top
+	GLfloat lightPosition[] = { 0.0f, 0.0f, 1.0f, 0.0f };
+	glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+
+	drawFog();
+
+	// The glowing coral and the coral themselves are read from here to drawCoral,
+	// so a snapshot restore can't move them in the middle
+	lockMutex(&sceneMutex);
+
+	// Bin the small lights into the clusters of this view
+	updateClusterLighting();
+	updateScenePrograms();
+
+	drawSubmarine();
+
+	// A terrain stretches past the walls, so it replaces the floor and the walls
+	if (terrainHeader)
+	{
+		drawTerrain();
+	}
+	else
+	{
+		drawBottomDisc();
+		drawCylinderWall();
+	}
+
+	drawCoral();
+	unlockMutex(&sceneMutex);
+
+	drawWave();
+
+	drawFish();
+
+	drawUnitVectors();
+
+	// Everything above was only queued, so draw it all sorted by state
+	flushRenderQueue();
+
+	glutSwapBuffers();
+
+	// A replay keeps how long each frame took next to its tick
+	if (isReplaying)
+	{
+		glFinish();
+		writeTiming(getTimeSeconds() - frameStart);
+	}
+	lastFrameTime = getTimeSeconds() - frameStart;
+	atomicStore(&lastFrameMicroseconds, (GLint)(lastFrameTime * 1000000.0));
+	atomicStore(&lastFrameTriangles, renderStats.triangles);
+}
+
+/*
+* Function that handles window reshaping by calling gluPerspective when the 
+* window is resized.
+*/
+void windowReshape(GLint width, GLint height)
+{
+	viewportHeight = height;
+
+	glViewport(0, 0, width, height);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	gluPerspective(fieldOfView, (float)width / (float)height, 1.0f, 2000.0f);
+	glMatrixMode(GL_MODELVIEW);
+}
+
+void initializeGL(void)
+{
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_LIGHTING);
+	glEnable(GL_LIGHT0);
+	glEnable(GL_NORMALIZE);
+	glClearColor(0, 0, 0, 1.0);
+
+	// Global ambient light
+	GLfloat globalAmbient[] = { 0.25f, 0.25f, 0.25f, 1.0f };
+	glLightModelfv(GL_LIGHT_MODEL_AMBIENT, globalAmbient);
+
+	// Set up the sunlight
+	GLfloat lightPosition[] = { 0.0f, 0.0f, 1.0f, 0.0f };
+	GLfloat lightDiffuse[] = { 1.0f, 1.0f, 0.8f, 1.0f };  
+	GLfloat lightSpecular[] = { 1.0f, 1.0f, 0.8f, 1.0f }; 
+
+	glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+	glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
+	glLightfv(GL_LIGHT0, GL_SPECULAR, lightSpecular);
+
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	gluPerspective(fieldOfView, (float)windowWidth / (float)windowHeight, 1.0f, 2000.0f);
+	glMatrixMode(GL_MODELVIEW);
+
+	loadGlFunctions();
+	initScenePrograms();
+	initFishRendering();
+	initClusterLighting();
+}
+
+// Helper method to clean up the main method and leave the initialization of 
+// the submarine in its own method
+void initSub()
+{
+	initObject(&submarine, "sub_norm_flat.obj");
+
+	FILE* file = fopen("sub_norm_flat.obj", "r");
+	if (!file)
+	{
+		printf("No file found\n");
+		return 1;
+	}
+
+	allocateAndPopulateHelper(file, &submarine);
+	buildObjectLods(&submarine, file, "sub_norm_flat.obj");
+	buildObjectEdges(&submarine);
+	fclose(file);
+
+	setupSubmarineCollision();
+	packObjectArena(&submarine);
+
+	printf("Success allocating for submarine, %.1f KB in one block\n", submarine.arena.size / 1024.0);
+}
+
+// A random number from 0 up to 1 that's the same every run for the same state, and safe to use on any thread
+GLfloat nextReefRandom(unsigned int* state)
+{
+	// xorshift32
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return (*state >> 8) * (1.0f / 16777216.0f);
+}
+
+// Starts a random number state from the reef seed and a number, mixing them so nearby numbers don't give nearby states
+unsigned int seedReefRandom(GLint number)
+{
+	unsigned int h = (unsigned int)reefSeed * 2654435761u ^ (unsigned int)number * 2246822519u;
+	h = (h ^ (h >> 15)) * 2246822519u;
+	h ^= h >> 13;
+	return h ? h : 1;
+}
+
+/*
+* Puts a coral centre in the grid if it's inside its region and the disc, and
+* no other centre is closer than the spacing. Anything closer has to be in
+* the 5 x 5 cells around it, less the corners which are always a spacing
+* away. Its own cell is looked at first since once the region fills up most
+* darts land on a taken cell. Returns GL_FALSE if it didn't fit.
+*/
+GLboolean tryReefSample(ReefRegionJob* job, GLfloat x, GLfloat y)
+{
+	ReefGrid* grid = job->grid;
+	GLfloat regionX = -grid->radius + job->region[0] * grid->regionSize;
+	GLfloat regionY = -grid->radius + job->region[1] * grid->regionSize;
+	if (x < regionX || y < regionY || x >= regionX + grid->regionSize || y >= regionY + grid->regionSize
+		|| x * x + y * y > grid->radius * grid->radius)
+	{
+		return GL_FALSE;
+	}
+
+	GLint cellX = (GLint)((x + grid->radius) / grid->cellSize);
+	GLint cellY = (GLint)((y + grid->radius) / grid->cellSize);
+	if (cellX >= grid->gridSize || cellY >= grid->gridSize)
+	{
+		return GL_FALSE;
+	}
+	GLfloat* cell = grid->cells[cellY * grid->gridSize + cellX];
+	if (cell[0] < 1e29f)
+	{
+		return GL_FALSE;
+	}
+
+	GLint firstX = cellX > 2 ? cellX - 2 : 0;
+	GLint firstY = cellY > 2 ? cellY - 2 : 0;
+	GLint lastX = cellX + 2 < grid->gridSize ? cellX + 2 : grid->gridSize - 1;
+	GLint lastY = cellY + 2 < grid->gridSize ? cellY + 2 : grid->gridSize - 1;
+	for (GLint j = firstY; j <= lastY; j++)
+	{
+		for (GLint i = firstX; i <= lastX; i++)
+		{
+			if ((i - cellX) * (i - cellX) + (j - cellY) * (j - cellY) == 8)
+			{
+				continue;
+			}
+
+			GLfloat* other = grid->cells[j * grid->gridSize + i];
+			GLfloat dx = other[0] - x;
+			GLfloat dy = other[1] - y;
+			if (dx * dx + dy * dy < grid->spacing * grid->spacing)
+			{
+				return GL_FALSE;
+			}
+		}
+	}
+
+	cell[0] = x;
+	cell[1] = y;
+	return GL_TRUE;
+}
+
+/*
+* Fills one region with Bridson's Poisson disk sampling. Each centre on the
+* active list throws darts in the ring one to two spacings around it, and
+* comes off the list once none of them fit. Almost all the darts miss once the
+* region fills up, so after a quarter of the centres have come off the list
+* each one only gets 12 darts instead of 30. When the list runs dry a few
+* more darts go anywhere in the region in case some of it wasn't reached.
+*/
+void fillReefRegion(ReefRegionJob* job)
+{
+	ReefGrid* grid = job->grid;
+	GLint regionCells = (GLint)(grid->regionSize / grid->cellSize) + 2;
+	GLfloat (*active)[2] = (GLfloat(*)[2])malloc(sizeof(GLfloat) * 2 * regionCells * regionCells);
+	if (!active)
+	{
+		printf("Error allocating memory for the reef sampler\n");
+		exit(1);
+	}
+
+	GLfloat regionX = -grid->radius + job->region[0] * grid->regionSize;
+	GLfloat regionY = -grid->radius + job->region[1] * grid->regionSize;
+	GLint activeCount = 0;
+	GLint placedCount = 0;
+	GLint retiredCount = 0;
+
+	for (GLint restart = 0; restart < 30; restart++)
+	{
+		GLfloat x = regionX + nextReefRandom(&job->random) * grid->regionSize;
+		GLfloat y = regionY + nextReefRandom(&job->random) * grid->regionSize;
+		if (!tryReefSample(job, x, y))
+		{
+			continue;
+		}
+		active[0][0] = x;
+		active[0][1] = y;
+		activeCount = 1;
+		placedCount++;
+
+		while (activeCount > 0)
+		{
+			GLint a = (GLint)(nextReefRandom(&job->random) * activeCount);
+			GLboolean isPlaced = GL_FALSE;
+			GLint dartCount = retiredCount * 4 > placedCount ? 12 : 30;
+
+			for (GLint dart = 0; dart < dartCount && !isPlaced; dart++)
+			{
+				GLfloat angle = nextReefRandom(&job->random) * 2.0f * PI;
+				GLfloat distance = grid->spacing * (1.0f + nextReefRandom(&job->random));
+				x = active[a][0] + cosf(angle) * distance;
+				y = active[a][1] + sinf(angle) * distance;
+
+				if (tryReefSample(job, x, y))
+				{
+					active[activeCount][0] = x;
+					active[activeCount][1] = y;
+					activeCount++;
+					placedCount++;
+					isPlaced = GL_TRUE;
+				}
+			}
+
+			if (!isPlaced)
+			{
+				retiredCount++;
+				activeCount--;
+				active[a][0] = active[activeCount][0];
+				active[a][1] = active[activeCount][1];
+			}
+		}
+	}
+
+	free(active);
+}
+
+// Thread function that fills a range of the regions in a phase
+void fillReefRegions(void* data)
+{
+	ReefPhaseJob* job = (ReefPhaseJob*)data;
+	for (GLint r = job->first; r < job->last; r++)
+	{
+		fillReefRegion(&job->regions[r]);
+	}
+}
+
+/*
+* Places up to count coral inside the floor disc with no two centres closer
+* than the spacing, or a spacing picked to fit count if it's 0. The regions
+* are done in four phases like the squares of a checkerboard two squares
+* wide, so the regions filled at the same time are a whole region apart and
+* never look at the same cells. Each region seeds its random numbers from the
+* reef seed and where it is, so the reef comes out the same on any number of
+* threads. If more centres fit than were asked for, a random count of them
+* are kept. The instances each get a random mesh, heading and size, and coral
+* get scaled down when they are packed closer than reefFullSizeSpacing.
+* Returns how many were placed.
+*/
+GLint placeReef(CoralInstance* instances, GLint count, GLfloat spacing, GLint threadCount)
+{
+	double start = getTimeSeconds();
+
+	GLfloat discRadius = (GLfloat)bottomDiscRadius;
+	GLboolean isSpacingPicked = spacing <= 0;
+	if (isSpacingPicked)
+	{
+		// The sampler below packs about one centre per 1.7 spacings squared, a
+		// bit looser is picked so one pass is nearly always enough
+		spacing = sqrtf(PI * discRadius * discRadius / (count * 1.8f));
+	}
+	if (spacing > discRadius)
+	{
+		spacing = discRadius;
+	}
+
+	if (threadCount <= 0)
+	{
+		threadCount = getProcessorCount();
+	}
+
+	ReefGrid grid;
+	GLint found = 0;
+	GLfloat* centres = NULL;
+	for (GLint attempt = 0; attempt < 8; attempt++)
+	{
+		grid.spacing = spacing;
+		grid.radius = discRadius - spacing / 2.0f;
+		grid.cellSize = spacing / sqrtf(2.0f);
+		grid.gridSize = (GLint)ceilf(2.0f * grid.radius / grid.cellSize);
+		grid.regionCount = (GLint)(2.0f * grid.radius / (3.0f * spacing));
+		if (grid.regionCount < 1) grid.regionCount = 1;
+		if (grid.regionCount > 16) grid.regionCount = 16;
+		grid.regionSize = 2.0f * grid.radius / grid.regionCount;
+		grid.cells = (GLfloat(*)[2])malloc(sizeof(GLfloat) * 2 * grid.gridSize * grid.gridSize);
+
+		ReefRegionJob* regions = (ReefRegionJob*)malloc(sizeof(ReefRegionJob) * grid.regionCount * grid.regionCount);
+		Thread* threads = (Thread*)malloc(sizeof(Thread) * threadCount);
+		ReefPhaseJob* jobs = (ReefPhaseJob*)malloc(sizeof(ReefPhaseJob) * threadCount);
+		if (!grid.cells || !regions || !threads || !jobs)
+		{
+			printf("Error allocating memory for the reef sampler\n");
+			exit(1);
+		}
+		for (GLint c = 0; c < grid.gridSize * grid.gridSize; c++)
+		{
+			grid.cells[c][0] = 1e30f;
+			grid.cells[c][1] = 1e30f;
+		}
+
+		for (GLint phase = 0; phase < 4; phase++)
+		{
+			GLint regionCount = 0;
+			for (GLint ry = phase / 2; ry < grid.regionCount; ry += 2)
+			{
+				for (GLint rx = phase % 2; rx < grid.regionCount; rx += 2)
+				{
+					regions[regionCount].grid = &grid;
+					regions[regionCount].region[0] = rx;
+					regions[regionCount].region[1] = ry;
+					regions[regionCount].random = seedReefRandom(ry * grid.regionCount + rx);
+					regionCount++;
+				}
+			}
+
+			GLint phaseThreads = threadCount < regionCount ? threadCount : regionCount;
+			for (GLint t = 0; t < phaseThreads; t++)
+			{
+				jobs[t].regions = regions;
+				jobs[t].first = regionCount * t / phaseThreads;
+				jobs[t].last = regionCount * (t + 1) / phaseThreads;
+			}
+			for (GLint t = 1; t < phaseThreads; t++)
+			{
+				startThread(&threads[t], fillReefRegions, &jobs[t]);
+			}
+			fillReefRegions(&jobs[0]);
+			for (GLint t = 1; t < phaseThreads; t++)
+			{
+				joinThread(threads[t]);
+			}
+		}
+		free(regions);
+		free(threads);
+		free(jobs);
+
+		// Going through the grid in order keeps the reef the same whichever thread finished first
+		free(centres);
+		centres = (GLfloat*)malloc(sizeof(GLfloat) * 2 * grid.gridSize * grid.gridSize);
+		if (!centres)
+		{
+			printf("Error allocating memory for the reef sampler\n");
+			exit(1);
+		}
+		found = 0;
+		for (GLint c = 0; c < grid.gridSize * grid.gridSize; c++)
+		{
+			if (grid.cells[c][0] < 1e29f)
+			{
+				centres[found * 2] = grid.cells[c][0];
+				centres[found * 2 + 1] = grid.cells[c][1];
+				found++;
+			}
+		}
+		free(grid.cells);
+
+		// A picked spacing that came up short gets tightened by how short it was and tried again
+		if (found >= count || !isSpacingPicked)
+		{
+			break;
+		}
+		spacing *= 0.97f * sqrtf((GLfloat)found / count);
+	}
+
+	// Keep a random count of the centres by shuffling them to the front
+	unsigned int random = seedReefRandom(-1);
+	GLint placed = found < count ? found : count;
+	for (GLint i = 0; i < placed; i++)
+	{
+		GLint other = i + (GLint)(nextReefRandom(&random) * (found - i));
+		GLfloat x = centres[other * 2];
+		GLfloat y = centres[other * 2 + 1];
+		centres[other * 2] = centres[i * 2];
+		centres[other * 2 + 1] = centres[i * 2 + 1];
+
+		CoralInstance* instance = &instances[i];
+		instance->mesh = (GLint)(nextReefRandom(&random) * 14) % 14;
+		instance->position[0] = x;
+		instance->position[1] = y;
+		instance->position[2] = 0;
+		instance->heading = nextReefRandom(&random) * 2.0f * PI;
+		instance->scale = coralScale * (0.75f + 0.5f * nextReefRandom(&random));
+		if (spacing < reefFullSizeSpacing)
+		{
+			instance->scale *= spacing / reefFullSizeSpacing;
+		}
+		instance->lodLevel = 0;
+	}
+	free(centres);
+
+	printf("Placed %d coral %.1f apart on %d threads in %.2f ms\n", placed, spacing, threadCount,
+		(getTimeSeconds() - start) * 1000.0);
+	if (placed < count)
+	{
+		printf("Only %d of the %d coral fit that far apart\n", placed, count);
+	}
+	return placed;
+}
+
+// Sorts coral instances along x, for checking the spacing of the reef
+int compareCoralInstancesX(const void* a, const void* b)
+{
+	GLfloat x = ((CoralInstance*)a)->position[0];
+	GLfloat y = ((CoralInstance*)b)->position[0];
+	return (x > y) - (x < y);
+}
+
+/*
+* Places count coral on one thread and then on every processor, checking both
+* come out the same, every centre is inside the disc and how close the two
+* closest centres are.
+*/
+GLint benchmarkReef(GLint count)
+{
+	CoralInstance* single = (CoralInstance*)malloc(sizeof(CoralInstance) * count);
+	CoralInstance* parallel = (CoralInstance*)malloc(sizeof(CoralInstance) * count);
+	if (!single || !parallel)
+	{
+		printf("Error allocating memory for the reef benchmark\n");
+		exit(1);
+	}
+
+	GLint placed = placeReef(single, count, coralSpacing, 1);
+	placeReef(parallel, count, coralSpacing, 0);
+	printf("One thread and every processor %s\n",
+		memcmp(single, parallel, sizeof(CoralInstance) * placed) == 0 ? "match" : "DO NOT MATCH");
+
+	GLint outside = 0;
+	for (GLint i = 0; i < placed; i++)
+	{
+		GLfloat* p = single[i].position;
+		if (p[0] * p[0] + p[1] * p[1] > bottomDiscRadius * bottomDiscRadius)
+		{
+			outside++;
+		}
+	}
+
+	// Sweep along x, only pairs closer in x than the closest so far can be any closer
+	qsort(single, placed, sizeof(CoralInstance), compareCoralInstancesX);
+	GLfloat closest = 1e30f;
+	for (GLint i = 0; i < placed; i++)
+	{
+		for (GLint j = i + 1; j < placed && single[j].position[0] - single[i].position[0] < closest; j++)
+		{
+			GLfloat distance = getDistance(single[i].position, single[j].position);
+			if (distance < closest)
+			{
+				closest = distance;
+			}
+		}
+	}
+	printf("%d coral placed, %d outside the disc, the closest two are %.2f apart\n", placed, outside, closest);
+
+	free(single);
+	free(parallel);
+	return 0;
+}
+
+void initCoral()
+{
+	char* coralFilePaths[14] = { "coral/coral_1.obj", "coral/coral_2.obj", "coral/coral_3.obj" ,
+	"coral/coral_4.obj", "coral/coral_5.obj", "coral/coral_6.obj", "coral/coral_7.obj", 
+	"coral/coral_8.obj", "coral/coral_9.obj", "coral/coral_10.obj", "coral/coral_11.obj", 
+	"coral/coral_12.obj", "coral/coral_13.obj", "coral/coral_14.obj" };
+	for (GLint i = 0; i < 14; i++)
+	{
+		initObject(&coral[i], coralFilePaths[i]);
+
+		FILE* file = fopen(coralFilePaths[i], "r");
+		if (!file)
+		{
+			printf("No coral file found for index: %d\n", i);
+			return 1;
+		}
+
+		allocateAndPopulateHelper(file, &coral[i]);
+		buildObjectLods(&coral[i], file, coralFilePaths[i]);
+		buildObjectEdges(&coral[i]);
+		buildObjectTriangleBvh(&coral[i]);
+		fclose(file);
+		packObjectArena(&coral[i]);
+		
+		printf("Success allocating for coral at %d, %.1f KB in one block\n", i, coral[i].arena.size / 1024.0);
+	}
+
+	// Spread the instances over the floor with the reef generator
+	coralInstanceCount = coralInstanceTarget > 0 ? coralInstanceTarget : 14;
+	coralInstances = (CoralInstance*)malloc(sizeof(CoralInstance) * coralInstanceCount);
+	if (!coralInstances)
+	{
+		printf("Error allocating memory for the coral instances\n");
+		exit(1);
+	}
+	coralInstanceCount = placeReef(coralInstances, coralInstanceCount, coralSpacing, 0);
+}
+
+// Quantizes the submarine and coral meshes
+void quantizeSceneMeshes()
+{
+	quantizeObjectMeshes(&submarine);
+	for (GLint i = 0; i < 14; i++)
+	{
+		quantizeObjectMeshes(&coral[i]);
+	}
+}
+
+// Method to initialize data and textures
+// Loads and sets up everything the simulation needs, none of which needs a window
+void initSimulation()
+{
+	initMutex(&sceneMutex);
+	initSub();
+	initCoral();
+	if (isQuantizingMeshes)
+	{
+		quantizeSceneMeshes();
+	}
+	printMeshMemory();
+	initializeBoids();
+	buildStaticGeometry();
+	buildSceneBvh();
+	bakeObstacleField();
+}
+
+/*
+* Turns vsync on or off if the driver has a way to, since GLUT doesn't. Returns
+* GL_TRUE if the swap interval was set.
+*/
+GLboolean setSwapInterval(GLint interval)
+{
+#ifdef _WIN32
+	typedef BOOL(WINAPI* SwapIntervalFunction)(int);
+	SwapIntervalFunction swapInterval = (SwapIntervalFunction)glutGetProcAddress("wglSwapIntervalEXT");
+	return swapInterval && swapInterval(interval);
+#else
+	// The MESA one takes an unsigned interval but the SGI one takes an int, so
+	// each gets its own type. Going through void (*)(void) keeps the casts quiet
+	typedef int (*MesaSwapIntervalFunction)(unsigned int);
+	typedef int (*SgiSwapIntervalFunction)(int);
+	MesaSwapIntervalFunction mesaSwapInterval = (MesaSwapIntervalFunction)(void (*)(void))glutGetProcAddress("glXSwapIntervalMESA");
+	if (mesaSwapInterval)
+	{
+		return mesaSwapInterval((unsigned int)interval) == 0;
+	}
+
+	SgiSwapIntervalFunction sgiSwapInterval = (SgiSwapIntervalFunction)(void (*)(void))glutGetProcAddress("glXSwapIntervalSGI");
+	return sgiSwapInterval && sgiSwapInterval(interval) == 0;
+#endif
+}
+
+// Sets up vsync and starts counting for the pacing numbers
+void initFramePacing()
+{
+	isVsyncOn = setSwapInterval(isVsyncWanted ? 1 : 0) && isVsyncWanted;
+	pacingStartTime = getTimeSeconds();
+	pacingStartCpu = getProcessCpuSeconds();
+}
+
+void init()
+{
+	initSimulation();
+	initClipmap();
+
+	sandTexture = readPPM("spongebob-sand.ppm");
+	printf("Initialized sand texture with ID: %u\n", sandTexture);
+}
+
+/*
+* Replays a journal with no window as fast as it will go. Only the simulation
+* is set up, since nothing gets drawn.
+*/
+GLint runHeadlessReplay(char* path, char* timingsPath)
+{
+	isHeadless = GL_TRUE;
+	initSimulation();
+	if (loadJournal(path) != 0)
+	{
+		return 1;
+	}
+	if (timingsPath)
+	{
+		openTimings(timingsPath);
+	}
+
+	double start = getTimeSeconds();
+	while (replayTick())
+	{
+		writeTiming(0);
+	}
+	double totalTime = getTimeSeconds() - start;
+
+	printf("Replayed in %.2f ms, %.3f ms per tick\n", totalTime * 1000.0,
+		totalTime * 1000.0 / (replayEndTick - replayFirstTick > 0 ? replayEndTick - replayFirstTick : 1));
+	finishReplay();
+	return 0;
+}
+
+// Frees everything an object holds
+void freeObject(Object* object)
+{
+	freeQuantizedMeshes(object);
+	freeLodMeshes(object);
+	freeObjectPiece(object, object->triangleBvh.nodes);
+	freeObjectPiece(object, object->triangleBvh.primitives);
+	freeObjectPiece(object, object->triangleBounds);
+	freeObjectPiece(object, object->edges);
+	freeObjectPiece(object, object->edgeNormals);
+	freeArena(&object->arena);
+	memset(object, 0, sizeof(Object));
+}
+
+// Method to free the memory of all of the objects we allocated memory for
+void freeObjects()
+{
+	freeObject(&submarine);
+	for (GLint i = 0; i < 14; i++)
+	{
+		freeObject(&coral[i]);
+	}
+	free(coralInstances);
+	coralInstances = NULL;
+	coralInstanceCount = 0;
+
+	freeStaticMesh(&floorMesh);
+	freeStaticMesh(&wallMesh);
+	freeStaticMesh(&originMarkerMesh);
+	freeFlock(&flock);
+}
+
+/*
+* Command line benchmark for submarine collision. It loads the submarine and
+* the coral, then drives the submarine at random through the scene for a
+* number of ticks. After each tick it checks that no collision sphere ended up
+* inside a coral mesh, the wall, the floor or above the surface.
+*/
+GLint benchmarkCollision(GLint tickCount)
+{
+	initSub();
+	initCoral();
+	buildSceneBvh();
+
+	srand(1);
+	submarineX = 0;
+	submarineY = 0;
+	submarineZ = 100;
+
+	double totalTime = 0, worstTime = 0;
+	GLint touchingTicks = 0;
+	GLfloat worstPenetration = 0;
+	GLfloat heading[3] = { 1, 0, 0 };
+
+	for (GLint tick = 0; tick < tickCount; tick++)
+	{
+		// Turn now and then so the submarine wanders around the whole scene
+		if (tick % 60 == 0)
+		{
+			heading[0] = generateRandomFloat(-1, 1);
+			heading[1] = generateRandomFloat(-1, 1);
+			heading[2] = generateRandomFloat(-0.5f, 0.5f);
+			normalizeVectorArray(heading);
+		}
+
+		GLfloat before[3] = { submarineX + heading[0] * submarineSpeed, submarineY + heading[1] * submarineSpeed,
+			submarineZ + heading[2] * submarineSpeed };
+		moveSubmarine(heading[0] * submarineSpeed, heading[1] * submarineSpeed, heading[2] * submarineSpeed);
+		totalTime += collisionTime;
+		if (collisionTime > worstTime)
+		{
+			worstTime = collisionTime;
+		}
+		if (fabsf(before[0] - submarineX) + fabsf(before[1] - submarineY) + fabsf(before[2] - submarineZ) > 0.0001f)
+		{
+			touchingTicks++;
+		}
+
+		// Check what is left over with the same tests the collision uses
+		GLfloat position[3] = { submarineX, submarineY, submarineZ };
+		for (GLint s = 0; s < SUBMARINE_COLLISION_SPHERES; s++)
+		{
+			GLfloat centre[3] = { position[0] + submarineCollisionOffsets[s][0],
+				position[1] + submarineCollisionOffsets[s][1], position[2] + submarineCollisionOffsets[s][2] };
+			for (GLint c = 0; c < coralInstanceCount; c++)
+			{
+				GLfloat direction[3];
+				GLfloat depth = findMeshPenetration(&coral[coralInstances[c].mesh], coralInstances[c].scale,
+					coralInstances[c].heading, coralInstances[c].position, centre, submarineCollisionRadius, direction);
+				if (depth > worstPenetration)
+				{
+					worstPenetration = depth;
+				}
+			}
+
+			GLfloat outside = sqrtf(centre[0] * centre[0] + centre[1] * centre[1]) + submarineCollisionRadius - bottomDiscRadius;
+			GLfloat below = submarineCollisionRadius - centre[2];
+			GLfloat above = centre[2] + submarineCollisionRadius - getWaveHeight(centre[0], centre[1]);
+			if (outside > worstPenetration) worstPenetration = outside;
+			if (below > worstPenetration) worstPenetration = below;
+			if (above > worstPenetration) worstPenetration = above;
+		}
+	}
+
+	printf("Collision over %d ticks: %.1f us on average, %.1f us at worst\n", tickCount,
+		totalTime / tickCount * 1000000.0, worstTime * 1000000.0);
+	printf("Pushed back on %d ticks, deepest penetration left after a tick: %.3f\n", touchingTicks, worstPenetration);
+	return 0;
+}
+
+/*
+* Command line benchmark for drawing the meshes as floats and quantized. This
+* one needs a window. It places count coral, draws a number of frames with the
+* float meshes, then quantizes them and draws the same frames again, printing
+* the mesh memory and the average frame time of each.
+*/
+GLint benchmarkMeshes(int* argc, char** argv, GLint count, GLint frameCount)
+{
+	coralInstanceTarget = count;
+	isQuantizingMeshes = GL_FALSE;
+	targetFps = 0;
+
+	glutInit(argc, argv);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+	glutInitWindowSize(windowWidth, windowHeight);
+	glutInitWindowPosition(windowPositionX, windowPositionY);
+	glutCreateWindow("Submarine Simulator");
+	glutDisplayFunc(display);
+	glutReshapeFunc(windowReshape);
+
+	init();
+	initializeGL();
+	setSwapInterval(0);
+	resetRenderStates();
+
+	for (GLint pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			quantizeSceneMeshes();
+		}
+		printMeshMemory();
+
+		// Let the window show up and the driver warm up before timing
+		for (GLint i = 0; i < 10; i++)
+		{
+			glutMainLoopEvent();
+			display();
+		}
+
+		glFinish();
+		double start = getTimeSeconds();
+		for (GLint i = 0; i < frameCount; i++)
+		{
+			glutMainLoopEvent();
+			display();
+		}
+		glFinish();
+		double totalTime = getTimeSeconds() - start;
+
+		printf("%s meshes: %.3f ms per frame over %d frames, %d triangles a frame\n", pass == 0 ? "Float" : "Quantized",
+			totalTime * 1000.0 / frameCount, frameCount, renderStats.triangles);
+	}
+
+	freeObjects();
+	return 0;
+}
+
+/*
+* The fish shader done on the CPU, for the benchmark to compare against. Writes
+* the bent and placed vertices and normals of one fish.
+*/
+void bendFishOnCpu(FishInstance* instance, GLfloat* vertices, GLfloat* normals)
+{
+	GLfloat* velocity = instance->velocity;
+	GLfloat speed = sqrtf(velocity[0] * velocity[0] + velocity[1] * velocity[1] + velocity[2] * velocity[2]);
+	GLfloat forward[3] = { 1, 0, 0 };
+	if (speed > 0)
+	{
+		forward[0] = velocity[0] / speed;
+		forward[1] = velocity[1] / speed;
+		forward[2] = velocity[2] / speed;
+	}
+
+	GLfloat side[3] = { -forward[1], forward[0], 0 };
+	GLfloat sideLength = sqrtf(side[0] * side[0] + side[1] * side[1]);
+	if (sideLength > 0.01f)
+	{
+		side[0] /= sideLength;
+		side[1] /= sideLength;
+	}
+	else
+	{
+		side[0] = 0;
+		side[1] = 1;
+	}
+	GLfloat up[3] =
+	{
+		forward[1] * side[2] - forward[2] * side[1],
+		forward[2] * side[0] - forward[0] * side[2],
+		forward[0] * side[1] - forward[1] * side[0]
+	};
+
+	GLfloat waveNumber = numberOfFishSquiggles * 2.0f * PI;
+	for (GLint v = 0; v < fishMesh.vertexCount; v++)
+	{
+		GLfloat* vertex = &fishMesh.vertices[v * 3];
+		GLfloat* normal = &fishMesh.normals[v * 3];
+
+		GLfloat tail = 0.5f - vertex[2];
+		tail = tail < 0 ? 0 : (tail > 1 ? 1 : tail);
+		GLfloat wave = vertex[2] * waveNumber + velocity[3];
+		GLfloat depth = fishSquiggleDepth * tail * tail;
+		GLfloat position[3] = { vertex[0] + sinf(wave) * depth, vertex[1], vertex[2] };
+
+		GLfloat slope = cosf(wave) * depth * waveNumber - sinf(wave) * fishSquiggleDepth * 2.0f * tail;
+		GLfloat bent[3] = { normal[0], normal[1], normal[2] - slope * normal[0] };
+
+		for (GLint a = 0; a < 3; a++)
+		{
+			vertices[v * 3 + a] = instance->position[a]
+				+ (side[a] * position[0] + up[a] * position[1] + forward[a] * position[2]) * instance->position[3];
+			normals[v * 3 + a] = side[a] * bent[0] + up[a] * bent[1] + forward[a] * bent[2];
+		}
+	}
+}
+
+/*
+* Times drawing count swimming fish, first bending every vertex on the CPU and
+* drawing the fish one at a time, then with one instanced draw through the
+* fish shader. The CPU time is only the time spent filling in the fish each
+* frame, the frame time includes waiting on the GPU.
+*/
+GLint benchmarkFish(int* argc, char** argv, GLint count, GLint frameCount)
+{
+	glutInit(argc, argv);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+	glutInitWindowSize(windowWidth, windowHeight);
+	glutInitWindowPosition(windowPositionX, windowPositionY);
+	glutCreateWindow("Submarine Simulator");
+	glutReshapeFunc(windowReshape);
+
+	initializeGL();
+	setSwapInterval(0);
+
+	Species* species = &speciesTable[0];
+	Boid* boids = (Boid*)malloc(sizeof(Boid) * count);
+	GLfloat* phases = (GLfloat*)malloc(sizeof(GLfloat) * count);
+	GLfloat* vertices = (GLfloat*)malloc(sizeof(GLfloat) * 3 * fishMesh.vertexCount * count);
+	GLfloat* normals = (GLfloat*)malloc(sizeof(GLfloat) * 3 * fishMesh.vertexCount * count);
+	reserveArray((void**)&fishInstances, &fishInstanceCapacity, count, sizeof(FishInstance));
+	if (!boids || !phases || !vertices || !normals)
+	{
+		printf("Error allocating memory for the fish benchmark\n");
+		exit(1);
+	}
+
+	srand(1);
+	for (GLint i = 0; i < count; i++)
+	{
+		for (GLint a = 0; a < 3; a++)
+		{
+			boids[i].position[a] = generateRandomFloat(-300.0f, 300.0f);
+			boids[i].velocity[a] = generateRandomFloat(-1.0f, 1.0f);
+		}
+		phases[i] = fmodf(i * 2.3999632f, 2.0f * PI);
+	}
+
+	GLint passCount = isDrawingRigidFish ? 1 : 2;
+	if (isDrawingRigidFish)
+	{
+		printf("No fish shader, so only the CPU bending gets timed\n");
+	}
+
+	for (GLint pass = 0; pass < passCount; pass++)
+	{
+		double cpuTime = 0;
+		double start = 0;
+
+		// Let the window show up and the driver warm up before timing
+		for (GLint frame = -10; frame < frameCount; frame++)
+		{
+			if (frame == 0)
+			{
+				glFinish();
+				start = getTimeSeconds();
+				cpuTime = 0;
+			}
+			glutMainLoopEvent();
+
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glLoadIdentity();
+			gluLookAt(0, -900, 400, 0, 0, 0, 0, 0, 1);
+			GLfloat lightPosition[] = { 0.0f, 0.0f, 1.0f, 0.0f };
+			glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+			applyMaterial(&materials[species->material]);
+
+			double cpuStart = getTimeSeconds();
+			for (GLint i = 0; i < count; i++)
+			{
+				fillFishInstance(&fishInstances[i], &boids[i], species, &phases[i], 1);
+			}
+			if (pass == 0)
+			{
+				for (GLint i = 0; i < count; i++)
+				{
+					bendFishOnCpu(&fishInstances[i], &vertices[i * fishMesh.vertexCount * 3], &normals[i * fishMesh.vertexCount * 3]);
+				}
+			}
+			cpuTime += getTimeSeconds() - cpuStart;
+
+			if (pass == 0)
+			{
+				glEnableClientState(GL_VERTEX_ARRAY);
+				glEnableClientState(GL_NORMAL_ARRAY);
+				for (GLint i = 0; i < count; i++)
+				{
+					glVertexPointer(3, GL_FLOAT, 0, &vertices[i * fishMesh.vertexCount * 3]);
+					glNormalPointer(GL_FLOAT, 0, &normals[i * fishMesh.vertexCount * 3]);
+					glDrawElements(GL_TRIANGLES, fishMesh.indexCount, GL_UNSIGNED_INT, fishMesh.indices);
+				}
+				glDisableClientState(GL_NORMAL_ARRAY);
+				glDisableClientState(GL_VERTEX_ARRAY);
+			}
+			else
+			{
+				FishBatch batch = { species, &fishMesh, 0, count };
+				drawFishInstances(&batch, 0);
+			}
+
+			glutSwapBuffers();
+		}
+		glFinish();
+		double totalTime = getTimeSeconds() - start;
+
+		printf("%s: %.3f ms per frame, %.3f ms of it filling in the fish, for %d fish of %d triangles over %d frames\n",
+			pass == 0 ? "CPU bending" : "Instanced shader", totalTime * 1000.0 / frameCount, cpuTime * 1000.0 / frameCount,
+			count, fishMesh.indexCount / 3, frameCount);
+	}
+
+	free(boids);
+	free(phases);
+	free(vertices);
+	free(normals);
+	return 0;
+}
+
+/*
+* Command line benchmark for the clustered lighting. It opens a window on the
+* usual scene, swaps its lights for lights spread over the sand and times the
+* frames with the clusters culling the lights and then with every pixel
+* looping over all of them, going from 1 light up to 1024.
+*/
+GLint benchmarkClusterLights(int* argc, char** argv, GLint frameCount)
+{
+	targetFps = 0;
+
+	glutInit(argc, argv);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+	glutInitWindowSize(windowWidth, windowHeight);
+	glutInitWindowPosition(windowPositionX, windowPositionY);
+	glutCreateWindow("Submarine Simulator");
+	glutDisplayFunc(display);
+	glutReshapeFunc(windowReshape);
+
+	init();
+	initializeGL();
+	setSwapInterval(0);
+	resetRenderStates();
+
+	if (!isClusteredLighting)
+	{
+		printf("No clustered lighting to benchmark\n");
+		return 1;
+	}
+
+	benchmarkLights = (ClusterLight*)malloc(sizeof(ClusterLight) * MAX_CLUSTER_LIGHTS);
+	if (!benchmarkLights)
+	{
+		printf("Error allocating memory for the benchmark lights\n");
+		exit(1);
+	}
+
+	srand(1);
+	for (GLint i = 0; i < MAX_CLUSTER_LIGHTS; i++)
+	{
+		ClusterLight* light = &benchmarkLights[i];
+		GLfloat angle = generateRandomFloat(0, 2 * PI);
+		GLfloat distance = (GLfloat)bottomDiscRadius * sqrtf(generateRandomFloat(0, 1));
+		light->position[0] = distance * cosf(angle);
+		light->position[1] = distance * sinf(angle);
+		light->position[2] = generateRandomFloat(5, 45);
+		light->radius = 60;
+		for (GLint a = 0; a < 3; a++)
+		{
+			light->color[a] = generateRandomFloat(0.2f, 1);
+		}
+		light->spotCosine = -2;
+	}
+	clusterLightLimit = MAX_CLUSTER_LIGHTS;
+
+	printf("Lights  clustered ms  every light ms  binning ms  most in a cluster\n");
+	for (GLint count = 1; count <= MAX_CLUSTER_LIGHTS; count *= 4)
+	{
+		benchmarkLightCount = count;
+		double frameTimes[2];
+		double binTime = 0;
+
+		for (GLint pass = 0; pass < 2; pass++)
+		{
+			isCullingClusterLights = pass == 0;
+
+			// Let the driver warm up before timing
+			for (GLint i = 0; i < 5; i++)
+			{
+				glutMainLoopEvent();
+				display();
+			}
+
+			glFinish();
+			double start = getTimeSeconds();
+			for (GLint i = 0; i < frameCount; i++)
+			{
+				glutMainLoopEvent();
+				display();
+				binTime += pass == 0 ? clusterBinTime : 0;
+			}
+			glFinish();
+			frameTimes[pass] = (getTimeSeconds() - start) / frameCount;
+		}
+
+		printf("%6d %13.3f %15.3f %11.3f %18d\n", clusterLightCount, frameTimes[0] * 1000.0, frameTimes[1] * 1000.0,
+			binTime / frameCount * 1000.0, clusterMostLights);
+	}
+
+	free(benchmarkLights);
+	freeObjects();
+	return 0;
+}
+
+/*
+* Times drawing a reef of count coral from low down, looking across it so most
+* coral is behind other coral, with the occlusion buffer and then without it.
+*/
+GLint benchmarkOcclusion(int* argc, char** argv, GLint count, GLint frameCount)
+{
+	coralInstanceTarget = count;
+	targetFps = 0;
+
+	glutInit(argc, argv);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+	glutInitWindowSize(windowWidth, windowHeight);
+	glutInitWindowPosition(windowPositionX, windowPositionY);
+	glutCreateWindow("Submarine Simulator");
+	glutDisplayFunc(display);
+	glutReshapeFunc(windowReshape);
+
+	init();
+	initializeGL();
+	setSwapInterval(0);
+
+	// Sit near the floor at the edge of the reef and look across the middle
+	submarineX = 0;
+	submarineY = -bottomDiscRadius * 0.8f;
+	submarineZ = 20;
+	horizontalMouseAngle = 270.0f;
+	verticalMouseAngle = 5.0f;
+	cameraDistance = 60.0f;
+	resetRenderStates();
+
+	for (GLint pass = 0; pass < 2; pass++)
+	{
+		isOcclusionCulling = pass == 0;
+
+		// Let the window show up and the driver warm up before timing
+		for (GLint i = 0; i < 10; i++)
+		{
+			glutMainLoopEvent();
+			display();
+		}
+
+		glFinish();
+		double drawTime = 0;
+		double start = getTimeSeconds();
+		for (GLint i = 0; i < frameCount; i++)
+		{
+			glutMainLoopEvent();
+			display();
+			drawTime += occlusionDrawTime;
+		}
+		glFinish();
+		double totalTime = getTimeSeconds() - start;
+
+		if (pass == 0)
+		{
+			printf("Occlusion culling: %.3f ms per frame, %d of %d coral hidden, %.3f ms drawing %d occluders of %d triangles on %d threads\n",
+				totalTime * 1000.0 / frameCount, occludedCount, occlusionTestCount, drawTime * 1000.0 / frameCount,
+				occluderCount, occlusionTriangleCount, occlusionWorkerCount + 1);
+		}
+		else
+		{
+			printf("Frustum culling only: %.3f ms per frame\n", totalTime * 1000.0 / frameCount);
+		}
+		printf("  %d triangles a frame\n", renderStats.triangles);
+	}
+
+	freeObjects();
+	return 0;
+}
+
+/*
+* Times drawing a tank full of count fish from just outside the wall, first
+* with the fish LOD and then with every fish drawn whole. The fish sit still
+* in the flock's starting spots, split between the species like the table.
+*/
+GLint benchmarkFishLod(int* argc, char** argv, GLint count, GLint frameCount)
+{
+	GLint speciesCount = sizeof(speciesTable) / sizeof(speciesTable[0]);
+	Species benchSpecies[MAX_SPECIES];
+	GLint tableTotal = 0;
+	for (GLint s = 0; s < speciesCount; s++)
+	{
+		benchSpecies[s] = speciesTable[s];
+		tableTotal += speciesTable[s].count;
+	}
+	for (GLint s = 0, left = count; s < speciesCount; s++)
+	{
+		benchSpecies[s].count = s == speciesCount - 1 ? left : count * speciesTable[s].count / tableTotal;
+		left -= benchSpecies[s].count;
+	}
+
+	glutInit(argc, argv);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+	glutInitWindowSize(windowWidth, windowHeight);
+	glutInitWindowPosition(windowPositionX, windowPositionY);
+	glutCreateWindow("Submarine Simulator");
+	glutReshapeFunc(windowReshape);
+
+	initializeGL();
+	setSwapInterval(0);
+	initializeFlock(&flock, benchSpecies, speciesCount, (GLfloat)bottomDiscRadius, (GLfloat)wallHeight);
+
+	for (GLint pass = 0; pass < 2; pass++)
+	{
+		isFishLod = pass == 0;
+		double start = 0;
+
+		// Let the window show up and the driver warm up before timing
+		for (GLint frame = -10; frame < frameCount; frame++)
+		{
+			if (frame == 0)
+			{
+				glFinish();
+				start = getTimeSeconds();
+			}
+			glutMainLoopEvent();
+
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glLoadIdentity();
+			gluLookAt(0, -bottomDiscRadius - 50.0f, wallHeight * 0.5f, 0, 0, wallHeight * 0.5f, 0, 0, 1);
+			glGetFloatv(GL_MODELVIEW_MATRIX, viewMatrix);
+			glGetFloatv(GL_PROJECTION_MATRIX, projectionMatrix);
+			GLfloat lightPosition[] = { 0.0f, 0.0f, 1.0f, 0.0f };
+			glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+			drawFog();
+			updateScenePrograms();
+
+			queueFish(flock.current, flock.count, frame);
+			flushRenderQueue();
+
+			glutSwapBuffers();
+		}
+		glFinish();
+		double totalTime = getTimeSeconds() - start;
+
+		printf("%s: %.3f ms per frame, %d triangles, for %d fish over %d frames\n",
+			pass == 0 ? "Fish LOD" : "Whole fish", totalTime * 1000.0 / frameCount, renderStats.triangles, count, frameCount);
+		if (pass == 0)
+		{
+			printf("  ");
+			printFishStats();
+		}
+	}
+
+	return 0;
+}
+
+/*
+* Times drawing a reef of count coral filled, then in wireframe from the edge
+* lists and then in wireframe with glPolygonMode, from the same spot as the
+* occlusion benchmark.
+*/
+GLint benchmarkWireFrame(int* argc, char** argv, GLint count, GLint frameCount)
+{
+	coralInstanceTarget = count;
+	targetFps = 0;
+
+	glutInit(argc, argv);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+	glutInitWindowSize(windowWidth, windowHeight);
+	glutInitWindowPosition(windowPositionX, windowPositionY);
+	glutCreateWindow("Submarine Simulator");
+	glutDisplayFunc(display);
+	glutReshapeFunc(windowReshape);
+
+	init();
+	initializeGL();
+	setSwapInterval(0);
+
+	submarineX = 0;
+	submarineY = -bottomDiscRadius * 0.8f;
+	submarineZ = 20;
+	horizontalMouseAngle = 270.0f;
+	verticalMouseAngle = 5.0f;
+	cameraDistance = 60.0f;
+	resetRenderStates();
+
+	const char* passNames[3] = { "Filled", "Wireframe from edge lists", "Wireframe with glPolygonMode" };
+	for (GLint pass = 0; pass < 3; pass++)
+	{
+		isDrawingWireFrame = pass > 0;
+		isUsingEdgeLists = pass == 1;
+
+		// Let the window show up and the driver warm up before timing
+		for (GLint i = 0; i < 10; i++)
+		{
+			glutMainLoopEvent();
+			display();
+		}
+
+		glFinish();
+		double start = getTimeSeconds();
+		for (GLint i = 0; i < frameCount; i++)
+		{
+			glutMainLoopEvent();
+			display();
+		}
+		glFinish();
+		double totalTime = getTimeSeconds() - start;
+
+		printf("%s: %.3f ms per frame, %d triangles and %d lines a frame\n",
+			passNames[pass], totalTime * 1000.0 / frameCount, renderStats.triangles, renderStats.lines);
+	}
+
+	freeObjects();
+	return 0;
+}
+
+void printDump()
+{
+	printf("\n\n");
+	printf("Scene Controls\n");
+	printf("-----------------\n");
+	printf("Up Arrow   : Raise Submarine\n");
+	printf("Down Arrow : Lower Submarine\n");
+	printf("w,a,s,d    : Lateral Movement of Submarine\n");
 	printf("u          : Toggle Wireframe Drawing\n");
 	printf("b          : Toggle Fog\n");
+	printf("i          : Print Render Queue Counters, Shaders, Lighting, Occlusion, Fish LOD, Collision, Tick and Frame Times, Frame Rate, CPU Use, Ocean Levels, Terrain Streaming and Asset Memory\n");
+	printf("[, ]       : Lower or Raise Floor and Wall Tessellation\n");
+	printf("k          : Save a Snapshot\n");
+	printf("l          : Restore the Snapshot\n");
 	printf("f          : Fullscreen\n");
 	printf("q          : Quit\n");
+	printf("\nBenchmarks\n");
+	printf("-----------------\n");
+	printf("--bench-bvh [count]  : Scene hierarchy queries\n");
+	printf("--bench-collision [ticks] : Submarine collision against the scene\n");
+	printf("--bench-boids [species] [count] : Flock update\n");
+	printf("--bench-snapshot [count] : Snapshot save and restore\n");
+	printf("--bench-meshes [count] [frames] : Float and quantized mesh drawing, in a window\n");
+	printf("--bench-fish [count] [frames] : Swimming fish bent on the CPU and in the shader, in a window\n");
+	printf("--bench-reef [count] : Reef generation on one thread and on all of them\n");
+	printf("--bench-lights [frames] : Clustered lighting from 1 to 1024 lights, in a window (default 20)\n");
+	printf("--bench-occlusion [count] [frames] : A reef of count coral seen from low down, with and without occlusion culling, in a window (default 2000 100)\n");
+	printf("--bench-fish-lod [count] [frames] : A tank of count fish drawn with and without the fish LOD, in a window (default 100000 50)\n");
+	printf("--bench-wireframe [count] [frames] : A reef of count coral filled, in wireframe from the edge lists and with glPolygonMode, in a window (default 2000 100)\n");
+	printf("\nOptions\n");
+	printf("-----------------\n");
+	printf("--restore file       : Start from a snapshot\n");
+	printf("--checkpoint ticks   : Checkpoint to %s every so many ticks\n", checkpointPath);
+	printf("--uncompressed       : Write snapshots without compression\n");
+	printf("--record file        : Record input to a journal\n");
+	printf("--replay file        : Replay a journal, one tick per frame\n");
+	printf("--headless           : With --replay, replay without a window\n");
+	printf("--timings file       : With --replay, write the time of every tick and frame\n");
+	printf("--compare-timings base new : Compare the timings of two replays\n");
+	printf("--single-thread      : Run the simulation on the same thread as the window\n");
+	printf("--fps count          : Most frames to draw a second, 0 for no limit (default 60)\n");
+	printf("--no-vsync           : Don't wait for the vertical blank when swapping\n");
+	printf("--coral count        : Place count coral over the floor\n");
+	printf("--coral-spacing dist : Closest two coral can be, 0 to fit the count\n");
+	printf("--reef-seed seed     : Seed of the reef layout\n");
+	printf("--quantize-meshes    : Draw the submarine and coral from quantized meshes\n");
+	printf("--no-clustered-lighting : Only light the scene with the fixed function sun\n");
+	printf("--no-occlusion-culling : Draw every coral in the view, even the ones hidden behind other coral\n");
+	printf("--occlusion-threads count : Threads to draw the occlusion buffer on, 0 for one per processor (default 0)\n");
+	printf("--shader-cache file  : Where to save the linked scene shaders (default shaders.cache)\n");
+	printf("--no-shader-cache    : Compile the scene shaders every launch\n");
+	printf("--lights count       : Most small lights to shade with each frame (default 256)\n");
+	printf("--cluster-threads count : Threads to bin the lights into clusters on, 0 for one per processor (default 0)\n");
+	printf("--rigid-fish         : Draw the fish as rigid pyramids instead of swimming\n");
+	printf("--no-fish-lod        : Draw every fish whole, however far away it is\n");
+	printf("--polygon-mode-wireframe : Draw the wireframe with glPolygonMode instead of the edge lists\n");
+	printf("--neighbour-lists    : Keep a neighbour list for every fish instead of searching the grid every tick\n");
+	printf("--neighbour-skin dist : How much further the neighbour lists look (default 8)\n");
+	printf("--ocean size         : Size of the ocean surface around the camera\n");
+	printf("--terrain file       : Stream the sea floor from a terrain file instead of the sand disc\n");
+	printf("--terrain-budget tiles : Most terrain tiles to keep loaded (default 96)\n");
+	printf("--make-terrain file [tiles] [samples] : Write a made up terrain file\n");
+	printf("--telemetry file     : Publish the metrics of every tick to a shared memory file\n");
+	printf("--read-telemetry file : Follow the metrics published to a telemetry file\n");
+	printf("--sweep grid [results] [threads] : Run every flock setting in a grid file, writing a CSV\n");
 	printf("\nNote: This is run on Windows 64-bit\n\n");
 }
 
 // The main method that ties everything together
 int main(int argc, char** argv)
 {
+	// Benchmarks run without opening a window
+	if (argc > 1 && strcmp(argv[1], "--bench-bvh") == 0)
+	{
+		return benchmarkBvh(argc > 2 ? atoi(argv[2]) : 10000);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-collision") == 0)
+	{
+		return benchmarkCollision(argc > 2 ? atoi(argv[2]) : 10000);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-boids") == 0)
+	{
+		return benchmarkFlock(argc > 2 ? atoi(argv[2]) : 5, argc > 3 ? atoi(argv[3]) : 20000, 100);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-snapshot") == 0)
+	{
+		return benchmarkSnapshot(argc > 2 ? atoi(argv[2]) : 300000);
+	}
+
+	if (argc > 3 && strcmp(argv[1], "--compare-timings") == 0)
+	{
+		return compareTimings(argv[2], argv[3]);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--bench-meshes") == 0)
+	{
+		return benchmarkMeshes(&argc, argv, argc > 2 ? atoi(argv[2]) : 2000, argc > 3 ? atoi(argv[3]) : 200);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-fish") == 0)
+	{
+		return benchmarkFish(&argc, argv, argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 200);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-lights") == 0)
+	{
+		return benchmarkClusterLights(&argc, argv, argc > 2 ? atoi(argv[2]) : 20);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-occlusion") == 0)
+	{
+		return benchmarkOcclusion(&argc, argv, argc > 2 ? atoi(argv[2]) : 2000, argc > 3 ? atoi(argv[3]) : 100);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-fish-lod") == 0)
+	{
+		return benchmarkFishLod(&argc, argv, argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 50);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-wireframe") == 0)
+	{
+		return benchmarkWireFrame(&argc, argv, argc > 2 ? atoi(argv[2]) : 2000, argc > 3 ? atoi(argv[3]) : 100);
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-reef") == 0)
+	{
+		return benchmarkReef(argc > 2 ? atoi(argv[2]) : 50000);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "--read-telemetry") == 0)
+	{
+		return readTelemetry(argv[2]);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "--sweep") == 0)
+	{
+		return runSweep(argv[2], argc > 3 ? argv[3] : "sweep.csv", argc > 4 ? atoi(argv[4]) : 0);
+	}
+
+	if (argc > 2 && strcmp(argv[1], "--make-terrain") == 0)
+	{
+		return makeTerrain(argv[2], argc > 3 ? atoi(argv[3]) : 64, argc > 4 ? atoi(argv[4]) : 65);
+	}
+
+	char* restorePath = NULL;
+	char* recordPath = NULL;
+	char* replayPath = NULL;
+	char* timingsPath = NULL;
+	GLboolean isReplayHeadless = GL_FALSE;
+	for (GLint i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc)
+		{
+			restorePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+		{
+			checkpointInterval = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--uncompressed") == 0)
+		{
+			isSnapshotCompressed = GL_FALSE;
+		}
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+		{
+			recordPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+		{
+			replayPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--timings") == 0 && i + 1 < argc)
+		{
+			timingsPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--headless") == 0)
+		{
+			isReplayHeadless = GL_TRUE;
+		}
+		else if (strcmp(argv[i], "--single-thread") == 0)
+		{
+			isSimulationThreaded = GL_FALSE;
+		}
+		else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+		{
+			targetFps = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--no-vsync") == 0)
+		{
+			isVsyncWanted = GL_FALSE;
+		}
+		else if (strcmp(argv[i], "--coral") == 0 && i + 1 < argc)
+		{
+			coralInstanceTarget = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--coral-spacing") == 0 && i + 1 < argc)
+		{
+			coralSpacing = (GLfloat)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--reef-seed") == 0 && i + 1 < argc)
+		{
+			reefSeed = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--quantize-meshes") == 0)
+		{
+			isQuantizingMeshes = GL_TRUE;
+		}
+		else if (strcmp(argv[i], "--no-clustered-lighting") == 0)
+		{
+			isClusteredLighting = GL_FALSE;
+		}
+		else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+		{
+			clusterLightLimit = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--cluster-threads") == 0 && i + 1 < argc)
+		{
+			clusterThreads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--no-occlusion-culling") == 0)
+		{
+			isOcclusionCulling = GL_FALSE;
+		}
+		else if (strcmp(argv[i], "--occlusion-threads") == 0 && i + 1 < argc)
+		{
+			occlusionThreads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--shader-cache") == 0 && i + 1 < argc)
+		{
+			shaderCachePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--no-shader-cache") == 0)
+		{
+			isCachingShaders = GL_FALSE;
+		}
+		else if (strcmp(argv[i], "--rigid-fish") == 0)
+		{
+			isDrawingRigidFish = GL_TRUE;
+		}
+		else if (strcmp(argv[i], "--no-fish-lod") == 0)
+		{
+			isFishLod = GL_FALSE;
+		}
+		else if (strcmp(argv[i], "--polygon-mode-wireframe") == 0)
+		{
+			isUsingEdgeLists = GL_FALSE;
+		}
+		else if (strcmp(argv[i], "--neighbour-lists") == 0)
+		{
+			isUsingNeighbourLists = GL_TRUE;
+		}
+		else if (strcmp(argv[i], "--neighbour-skin") == 0 && i + 1 < argc)
+		{
+			neighbourSkin = (GLfloat)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--ocean") == 0 && i + 1 < argc)
+		{
+			oceanSize = (GLfloat)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--terrain") == 0 && i + 1 < argc)
+		{
+			terrainPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--terrain-budget") == 0 && i + 1 < argc)
+		{
+			terrainBudget = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc)
+		{
+			openTelemetry(argv[++i]);
+		}
+	}
+
+	if (terrainPath)
+	{
+		loadTerrain(terrainPath);
+	}
+
+	if (replayPath && isReplayHeadless)
+	{
+		return runHeadlessReplay(replayPath, timingsPath);
+	}
+
 	glutInit(&argc, argv);
 
 	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
@@ -1492,12 +13655,39 @@ int main(int argc, char** argv)
 	glutPassiveMotionFunc(moveMouse);
 
 	init();
+	if (restorePath)
+	{
+		loadSnapshot(restorePath);
+	}
+	if (replayPath)
+	{
+		if (loadJournal(replayPath) != 0)
+		{
+			return 1;
+		}
+		if (timingsPath)
+		{
+			openTimings(timingsPath);
+		}
+	}
+	else if (recordPath)
+	{
+		startRecording(recordPath);
+	}
+
+	// A replay stays on this thread so every frame lines up with its tick
+	resetRenderStates();
+	if (isSimulationThreaded && !replayPath)
+	{
+		startSimulationThread();
+	}
 
 	printDump();
 
 	glutIdleFunc(idleScene);
 
 	initializeGL();
+	initFramePacing();
 	glutMainLoop();
 
 	freeObjects();